@@ -16,6 +16,7 @@
 #include <estack/netbuf.h>
 #include <estack/netdev.h>
 #include <estack/ethernet.h>
+#include <estack/inet.h>
 
 #pragma pack(push, 1)
 struct DLL_EXPORT arp_header {
@@ -41,6 +42,36 @@ typedef enum {
 } arp_opcode_t;
 
 CDECL
+/*
+ * ARP headers are kept in network byte order. These accessors return the
+ * header fields in host byte order.
+ */
+
+static inline uint16_t arp_get_hwtype(struct arp_header *hdr)
+{
+	return ntohs(hdr->hwtype);
+}
+
+static inline uint16_t arp_get_protocol(struct arp_header *hdr)
+{
+	return ntohs(hdr->protocol);
+}
+
+static inline uint16_t arp_get_opcode(struct arp_header *hdr)
+{
+	return ntohs(hdr->opcode);
+}
+
+static inline uint32_t arp_ipv4_get_saddr(struct arp_ipv4_header *hdr)
+{
+	return ntohl(hdr->ip_src_addr);
+}
+
+static inline uint32_t arp_ipv4_get_daddr(struct arp_ipv4_header *hdr)
+{
+	return ntohl(hdr->ip_target_addr);
+}
+
 extern DLL_EXPORT void arp_input(struct netbuf *nb);
 extern DLL_EXPORT void arp_output(struct netdev *dev, struct netbuf *nb, uint8_t *addr);
 extern DLL_EXPORT struct netbuf *arp_alloc_nb_ipv4(uint16_t type, uint32_t ip, uint8_t *mac);
@@ -0,0 +1,69 @@
+/*
+ * E/STACK - Link aggregation
+ *
+ * Author: Michel Megens
+ * Date: 24/02/2018
+ * Email: dev@bietje.net
+ */
+
+/**
+ * @addtogroup netdev
+ * @{
+ */
+
+#ifndef __BOND_H__
+#define __BOND_H__
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <estack/estack.h>
+#include <estack/netdev.h>
+
+#ifndef CONFIG_BOND_MAX_MEMBERS
+#define CONFIG_BOND_MAX_MEMBERS 4 //!< Maximum number of devices in a single bond.
+#endif
+
+#ifndef CONFIG_BOND_MAX_ERRORS
+#define CONFIG_BOND_MAX_ERRORS 3 //!< Number of consecutive errors after which a member is disabled.
+#endif
+
+#define BOND_BUCKETS 64 //!< Number of flow hash buckets.
+
+/**
+ * @brief Bond member.
+ */
+struct DLL_EXPORT bond_member {
+	struct netdev *dev; //!< Member device.
+	rx_handle rx; //!< Original receive handler of \p dev.
+	bool active; //!< Indicates whether or not \p dev can be used for transmission.
+	int errors; //!< Number of consecutive transmit errors.
+	uint32_t tx_packets; //!< Number of packets transmitted through this member.
+};
+
+/**
+ * @brief Bond device.
+ *
+ * Received packets of all members are handed to a single logical device. Transmitted
+ * packets are spread over the members based on their flow hash. Flow hashes map
+ * onto a bucket table, so that only the flows of a failing member are moved.
+ */
+struct DLL_EXPORT netdev_bond {
+	struct netdev dev; //!< Logical device.
+	struct bond_member members[CONFIG_BOND_MAX_MEMBERS]; //!< Member devices.
+	int length; //!< Number of members.
+	uint8_t buckets[BOND_BUCKETS]; //!< Flow bucket to member map.
+};
+
+CDECL
+extern DLL_EXPORT struct netdev *bond_create(const char *name);
+extern DLL_EXPORT void bond_destroy(struct netdev *dev);
+extern DLL_EXPORT int bond_add_member(struct netdev *dev, struct netdev *member);
+extern DLL_EXPORT int bond_remove_member(struct netdev *dev, struct netdev *member);
+extern DLL_EXPORT int bond_set_member_active(struct netdev *dev, struct netdev *member, bool active);
+extern DLL_EXPORT uint32_t bond_get_member_tx(struct netdev *dev, struct netdev *member);
+CDECL_END
+
+#endif
+
+/** @} */
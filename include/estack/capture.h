@@ -0,0 +1,74 @@
+/*
+ * E/STACK - Packet capture
+ *
+ * Author: Michel Megens
+ * Date: 20/02/2018
+ * Email: dev@bietje.net
+ */
+
+/**
+ * @addtogroup netdev
+ * @{
+ */
+
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <estack/estack.h>
+#include <estack/netdev.h>
+#include <estack/netbuf.h>
+#include <estack/filter.h>
+
+#ifndef CONFIG_CAPTURE_SLOTS
+#define CONFIG_CAPTURE_SLOTS 256 //!< Number of slots in the capture ring. Must be a power of two.
+#endif
+
+#ifndef CONFIG_CAPTURE_FLUSH_TMO
+#define CONFIG_CAPTURE_FLUSH_TMO 100 //!< Interval (in ms) at which the capture ring is drained.
+#endif
+
+#define CAPTURE_HEADROOM 18 //!< Datalink header space added to the MTU for the default snap length.
+
+/**
+ * @brief Packet capture datastructure.
+ *
+ * Captured packets are copied into a single producer / single consumer ring.
+ * The producer is the backlog processor of the device, the consumer is a writer
+ * thread that drains the ring into a pcap file.
+ */
+struct DLL_EXPORT netdev_capture {
+	FILE *file; //!< Output file.
+	uint8_t *ring; //!< Ring buffer.
+	size_t slot_size; //!< Size of a single slot in \p ring.
+	uint32_t slots; //!< Number of slots in \p ring.
+	volatile uint32_t head; //!< Producer index.
+	volatile uint32_t tail; //!< Consumer index.
+
+	uint32_t snaplen; //!< Maximum number of bytes captured per packet.
+	uint32_t sample; //!< Capture one out of every \p sample packets.
+	uint32_t counter; //!< Sample counter.
+	struct netdev_filter *filter; //!< Optional capture filter.
+
+	uint32_t captured; //!< Number of packets captured.
+	uint32_t dropped; //!< Number of packets lost due to a full ring.
+
+	volatile bool running; //!< Writer thread state.
+	estack_thread_t writer; //!< Writer thread.
+};
+
+CDECL
+extern DLL_EXPORT int netdev_capture_start(struct netdev *dev, const char *path, uint32_t snaplen,
+	uint32_t sample, struct netdev_filter *filter);
+extern DLL_EXPORT void netdev_capture_stop(struct netdev *dev);
+extern DLL_EXPORT void capture_packet(struct netdev_capture *cap, struct netbuf *nb);
+extern DLL_EXPORT uint32_t netdev_capture_get_captured(struct netdev *dev);
+extern DLL_EXPORT uint32_t netdev_capture_get_dropped(struct netdev *dev);
+CDECL_END
+
+#endif
+
+/** @} */
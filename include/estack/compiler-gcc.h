@@ -17,8 +17,13 @@
 
 #define __maybe __attribute__((weak))
 
+#define __compiler_barrier() __asm__ __volatile__("" : : : "memory")
+#define __compiler_mb() __sync_synchronize()
+#define __compiler_atomic_inc(ptr) __sync_add_and_fetch(ptr, 1)
+#define __compiler_atomic_dec(ptr) __sync_sub_and_fetch(ptr, 1)
+
 #ifndef offsetof
-#define offsetof(TYPE, MEMBER) ((size_t) &((TYPE *)0)->MEMBER)
+#define offsetof(TYPE, MEMBER) __builtin_offsetof(TYPE, MEMBER)
 #endif
 
 #define __compiler_co(ptr, type, member) ({		\
@@ -17,6 +17,23 @@
 
 #define __maybe
 
+#include <intrin.h>
+#define __compiler_barrier() _ReadWriteBarrier()
+
+#if defined(_M_X64)
+#define __compiler_mb() __faststorefence()
+#elif defined(_M_ARM64)
+#define __compiler_mb() __dmb(_ARM64_BARRIER_ISH)
+#elif defined(_M_ARM)
+#define __compiler_mb() __dmb(_ARM_BARRIER_ISH)
+#else
+#define __compiler_mb() _mm_mfence()
+#endif
+
+/* Atomic counters are declared as volatile long */
+#define __compiler_atomic_inc(ptr) _InterlockedIncrement((volatile long*)(ptr))
+#define __compiler_atomic_dec(ptr) _InterlockedDecrement((volatile long*)(ptr))
+
 #pragma warning(disable : 4251)
 #pragma warning (disable : 4820)
 #pragma warning (disable : 4100)
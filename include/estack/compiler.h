@@ -20,6 +20,25 @@
 
 #define container_of(ptr, type, entry) __compiler_co(ptr, type, entry)
 
+#define barrier() __compiler_barrier()
+#define smp_mb() __compiler_mb()
+#define smp_rmb() __compiler_mb()
+#define smp_wmb() __compiler_mb()
+
+#define atomic_inc(x) __compiler_atomic_inc(x)
+#define atomic_dec(x) __compiler_atomic_dec(x)
+
+#define __build_assert_paste(a, b) a##b
+#define __build_assert_name(n) __build_assert_paste(__build_assert_, n)
+
+/*
+ * Compile time assertion. A false condition declares an array with a negative
+ * size, which is rejected by every supported compiler. The message only serves
+ * as documentation.
+ */
+#define build_assert(cond, msg) \
+	typedef char __build_assert_name(__COUNTER__)[(cond) ? 1 : -1]
+
 #ifndef __cplusplus
 typedef unsigned char bool;
 
@@ -20,6 +20,7 @@ typedef enum error_code {
 	ENOSOCK,
 	ETMO,
 	EISCONNECTED,
+	ETOOLARGE,
 } error_t;
 
 #define ETIMEOUT ETMO
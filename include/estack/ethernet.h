@@ -32,6 +32,7 @@ CDECL
 extern DLL_EXPORT void ethernet_input(struct netbuf *nb);
 extern DLL_EXPORT void ethernet_output(struct netbuf *nb, uint8_t *hw);
 extern DLL_EXPORT bool ethernet_addr_is_broadcast(const uint8_t *addr);
+extern DLL_EXPORT netdev_class_t ethernet_classify(struct netbuf *nb);
 
 static inline struct ethernet_header *ethernet_nb_to_hdr(struct netbuf *nb)
 {
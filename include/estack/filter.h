@@ -0,0 +1,91 @@
+/*
+ * E/STACK - Packet filter
+ *
+ * Author: Michel Megens
+ * Date: 17/02/2018
+ * Email: dev@bietje.net
+ */
+
+/**
+ * @addtogroup netdev
+ * @{
+ */
+
+#ifndef __FILTER_H__
+#define __FILTER_H__
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <estack/estack.h>
+#include <estack/netdev.h>
+#include <estack/netbuf.h>
+
+/**
+ * @brief Filter verdict.
+ */
+typedef enum {
+	FILTER_ACCEPT, //!< Pass the packet on to the protocol stack.
+	FILTER_DROP, //!< Drop the packet.
+	FILTER_REDIRECT, //!< Pass the packet to the handler of the matching rule.
+} filter_action_t;
+
+#define FILTER_MATCH_ETHERTYPE (1 << 0) //!< Match on struct filter_rule::ethertype.
+#define FILTER_MATCH_PROTOCOL  (1 << 1) //!< Match on struct filter_rule::protocol.
+#define FILTER_MATCH_SADDR     (1 << 2) //!< Match on the IPv4 source prefix.
+#define FILTER_MATCH_DADDR     (1 << 3) //!< Match on the IPv4 destination prefix.
+#define FILTER_MATCH_SPORT     (1 << 4) //!< Match on the source port range.
+#define FILTER_MATCH_DPORT     (1 << 5) //!< Match on the destination port range.
+
+/**
+ * @brief Filter rule.
+ *
+ * All addresses and ports are in host byte order. A rule matches a packet
+ * when all fields selected by \p match match.
+ */
+struct DLL_EXPORT filter_rule {
+	uint8_t match; //!< Fields to match on.
+	uint16_t ethertype; //!< Ethernet type.
+	uint8_t protocol; //!< IPv4 protocol number.
+	uint32_t saddr, //!< IPv4 source prefix.
+		smask; //!< IPv4 source mask.
+	uint32_t daddr, //!< IPv4 destination prefix.
+		dmask; //!< IPv4 destination mask.
+	uint16_t sport_min, //!< Lower bound of the source port range.
+		sport_max; //!< Upper bound of the source port range.
+	uint16_t dport_min, //!< Lower bound of the destination port range.
+		dport_max; //!< Upper bound of the destination port range.
+
+	filter_action_t action; //!< Verdict for matching packets.
+	rx_handle handler; //!< Redirect handler, used for FILTER_REDIRECT.
+	uint32_t hits; //!< Number of packets that matched this rule.
+};
+
+/**
+ * @brief Filter program.
+ *
+ * Rules are evaluated in order, the first matching rule determines the
+ * verdict. Packets that do not match any rule are subject to \p policy.
+ */
+struct DLL_EXPORT netdev_filter {
+	struct filter_rule *rules; //!< Rule table.
+	int length; //!< Number of rules in \p rules.
+	int size; //!< Allocated size of \p rules.
+	filter_action_t policy; //!< Default verdict.
+	uint32_t hits; //!< Number of packets subject to \p policy.
+};
+
+CDECL
+extern DLL_EXPORT struct netdev_filter *filter_alloc(filter_action_t policy);
+extern DLL_EXPORT void filter_free(struct netdev_filter *filter);
+extern DLL_EXPORT int filter_add_rule(struct netdev_filter *filter, const struct filter_rule *rule);
+extern DLL_EXPORT filter_action_t filter_run(struct netdev_filter *filter, struct netbuf *nb,
+	rx_handle *handler);
+
+extern DLL_EXPORT struct netdev_filter *netdev_attach_filter(struct netdev *dev, struct netdev_filter *filter);
+extern DLL_EXPORT uint32_t netdev_filter_get_hits(struct netdev *dev, int rule);
+CDECL_END
+
+#endif
+
+/** @} */
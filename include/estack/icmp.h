@@ -15,14 +15,12 @@
 #include <estack/estack.h>
 #include <estack/netbuf.h>
 
-#pragma pack(push, 1)
 struct icmp_header {
 	uint8_t type;
 	uint8_t code;
 	uint16_t csum;
 	uint32_t spec;
 };
-#pragma pack(pop)
 
 typedef enum {
 	ICMP_REPLY = 0,
@@ -30,8 +28,41 @@ typedef enum {
 	ICMP_SOURCEQUENCH,
 	ICMP_REDIRECT,
 	ICMP_ECHO = 8,
+	ICMP_TIME_EXCEEDED = 11,
+	ICMP_PARAMPROB,
 } icmp_type_t;
 
+#define ICMP_TYPE_MAX 18 //!< Highest ICMP message type.
+
+#ifndef CONFIG_ICMP_RATE
+#define CONFIG_ICMP_RATE 1000 //!< Number of rate limited ICMP messages that may be sent per second.
+#endif
+
+#ifndef CONFIG_ICMP_BURST
+#define CONFIG_ICMP_BURST 50 //!< Maximum number of rate limited ICMP messages sent in a burst.
+#endif
+
+#ifndef CONFIG_ICMP_DEST_RATE
+#define CONFIG_ICMP_DEST_RATE 10 //!< Number of rate limited ICMP messages per destination per second.
+#endif
+
+#ifndef CONFIG_ICMP_DEST_BURST
+#define CONFIG_ICMP_DEST_BURST 10 //!< Maximum number of rate limited ICMP messages sent to a destination in a burst.
+#endif
+
+#ifndef CONFIG_ICMP_DEST_HASH_SIZE
+#define CONFIG_ICMP_DEST_HASH_SIZE 64 //!< Number of destinations that are rate limited individually.
+#endif
+
+#ifndef CONFIG_ICMP_RATEMASK
+/**
+ * Message types that are subject to the global and per destination rate
+ * limits. Echo replies are only limited by their per type limit.
+ */
+#define CONFIG_ICMP_RATEMASK ((1UL << ICMP_UNREACH) | (1UL << ICMP_SOURCEQUENCH) | \
+	(1UL << ICMP_TIME_EXCEEDED) | (1UL << ICMP_PARAMPROB))
+#endif
+
 typedef enum {
 	ICMP_UNREACH_NET = 0,
 	ICMP_UNREACH_HOST,
@@ -43,11 +74,21 @@ typedef enum {
 	ICMP_UNREACH_HOSTUNKOWN,
 } icmp_code_t;
 
+typedef enum {
+	ICMP_TIMXCEED_INTRANS = 0,
+	ICMP_TIMXCEED_REASS,
+} icmp_timxceed_code_t;
+
 CDECL
 extern DLL_EXPORT void icmp_input(struct netbuf *nb);
 extern DLL_EXPORT void icmp_output(uint8_t type, uint32_t dst, struct netbuf *nb);
 extern DLL_EXPORT void icmp_reply(struct netbuf *nb, uint8_t type, uint8_t code, uint32_t spec, uint32_t dest);
 extern DLL_EXPORT void icmp_response(struct netbuf *nb, uint8_t type, uint8_t code, uint32_t spec);
+extern DLL_EXPORT bool icmp_ratelimit(uint8_t type, uint32_t dst);
+extern DLL_EXPORT int icmp_ratelimit_set(uint8_t type, int rate, int burst);
+extern DLL_EXPORT uint32_t icmp_get_suppressed(uint8_t type);
+extern DLL_EXPORT void icmp_init(void);
+extern DLL_EXPORT void icmp_destroy(void);
 CDECL_END
 
 #endif
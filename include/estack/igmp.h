@@ -0,0 +1,56 @@
+/*
+ * E/STACK - IGMP header
+ *
+ * Author: Michel Megens
+ * Date: 24/02/2018
+ * Email: dev@bietje.net
+ */
+
+#ifndef __IGMP_H__
+#define __IGMP_H__
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <estack/estack.h>
+#include <estack/netbuf.h>
+#include <estack/netdev.h>
+#include <estack/list.h>
+
+#define IGMP_ALL_HOSTS   0xE0000001 //!< All systems on this subnet (224.0.0.1).
+#define IGMP_ALL_ROUTERS 0xE0000002 //!< All routers on this subnet (224.0.0.2).
+
+struct igmp_header {
+	uint8_t type;
+	uint8_t max_resp;
+	uint16_t csum;
+	uint32_t group;
+};
+
+typedef enum {
+	IGMP_QUERY = 0x11,
+	IGMP_V1_REPORT = 0x12,
+	IGMP_V2_REPORT = 0x16,
+	IGMP_LEAVE = 0x17,
+} igmp_type_t;
+
+/**
+ * @brief Multicast group joined on an interface.
+ */
+struct igmp_group {
+	struct list_head entry; //!< Entry in the group list of the interface.
+	uint32_t addr; //!< Group address.
+	int users; //!< Number of memberships of the group.
+};
+
+CDECL
+extern DLL_EXPORT void igmp_input(struct netbuf *nb);
+extern DLL_EXPORT int igmp_join(struct netdev *dev, uint32_t group);
+extern DLL_EXPORT int igmp_leave(struct netdev *dev, uint32_t group);
+extern DLL_EXPORT bool igmp_is_member(struct netdev *dev, uint32_t group);
+extern DLL_EXPORT void igmp_flush(struct netdev *dev);
+extern DLL_EXPORT void igmp_init(void);
+extern DLL_EXPORT void igmp_destroy(void);
+CDECL_END
+
+#endif
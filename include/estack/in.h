@@ -32,8 +32,22 @@ struct sockaddr_in {
 	uint8_t __pad[SOCK_SIZE - sizeof(short) -
 					sizeof(short) - sizeof(struct in_addr)];
 };
+
+#define IPPROTO_IP 0
+
+#define IP_ADD_MEMBERSHIP  35
+#define IP_DROP_MEMBERSHIP 36
+
+struct ip_mreq {
+	struct in_addr imr_multiaddr; //!< Group address.
+	struct in_addr imr_interface; //!< Local address of the interface.
+};
 #else
 #include <estack/inet.h>
 #endif
 
+#ifndef IP_DONTFRAG
+#define IP_DONTFRAG 28 //!< Set the don't fragment bit on outgoing datagrams.
+#endif
+
 #endif
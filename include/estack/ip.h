@@ -14,14 +14,40 @@
 
 #include <estack/estack.h>
 #include <estack/netbuf.h>
+#include <estack/inet.h>
 
 #define IPV4_ADDR_SIZE 4
 #define IPV6_ADDR_SIZE 16
 
 #define IP4_DONT_FRAGMENT_FLAG  1
 #define IP4_MORE_FRAGMENTS_FLAG 0
+#define IP4_DONT_FRAGMENT 0x4000 //!< Don't fragment bit of the offset field.
+#define IP4_MORE_FRAGMENTS 0x2000 //!< More fragments bit of the offset field.
+#define IP4_OFFSET_MASK 0x1FFF //!< Fragment offset bits of the offset field.
 
-#pragma pack(push, 1)
+#define IPV4_MIN_MTU 68 //!< Minimum MTU every IPv4 link has to support.
+
+#ifndef CONFIG_PMTU_AGE
+#define CONFIG_PMTU_AGE 600 //!< Life time of path MTU estimates, in seconds.
+#endif
+
+#ifndef CONFIG_PMTU_ENTRIES
+#define CONFIG_PMTU_ENTRIES 32 //!< Number of entries in the path MTU cache.
+#endif
+
+#ifndef CONFIG_IPFRAG_BUCKETS
+#define CONFIG_IPFRAG_BUCKETS 64 //!< Number of buckets of the reassembly hash table.
+#endif
+
+#ifndef CONFIG_IPFRAG_MEM_MAX
+#define CONFIG_IPFRAG_MEM_MAX (256 * 1024) //!< Maximum number of bytes held by incomplete datagrams.
+#endif
+
+/*
+ * All fields are naturally aligned, so the header isn't packed. Received
+ * frames are stored with CONFIG_NET_IP_ALIGN bytes of headroom, which places
+ * the header on a 4 byte boundary.
+ */
 struct ipv4_header {
 	uint8_t ihl_version;
 	uint8_t tos;
@@ -34,9 +60,9 @@ struct ipv4_header {
 	uint32_t saddr;
 	uint32_t daddr;
 };
-#pragma pack(pop)
 
-#define IS_MULTICAST(x) false
+#define IS_MULTICAST(x) (((x) & 0xF0000000) == 0xE0000000)
+#define IS_LOOPBACK(x) (((x) & 0xFF000000) == 0x7F000000)
 #define IPV4_TTL 0x40
 
 typedef enum {
@@ -52,8 +78,10 @@ extern DLL_EXPORT void ip_input(struct netbuf *nb);
 extern DLL_EXPORT void ipv4_input(struct netbuf *nb);
 extern DLL_EXPORT void ipv4_output(struct netbuf *nb, uint32_t dst);
 extern DLL_EXPORT void __ipv4_output(struct netbuf *nb, uint32_t dst);
+extern DLL_EXPORT bool ipv4_fits_pmtu(struct netdev *dev, uint32_t dst, size_t length);
 
 extern DLL_EXPORT uint16_t ip_checksum_partial(uint16_t start, const void *buf, int len);
+extern DLL_EXPORT uint16_t ip_checksum_partial_copy(uint16_t start, void *dst, const void *src, int len);
 extern uint16_t DLL_EXPORT ip_checksum(uint16_t start, const void *buf, int len);
 extern DLL_EXPORT uint16_t ipv4_inet_csum(const void *start, uint16_t length,
 											uint32_t saddr, uint32_t daddr, uint8_t proto);
@@ -61,9 +89,17 @@ extern DLL_EXPORT uint16_t ipv4_inet_csum(const void *start, uint16_t length,
 extern DLL_EXPORT void ipfrag4_add_packet(struct netbuf *nb);
 extern DLL_EXPORT void ipv4_input_postfrag(struct netbuf *nb);
 extern DLL_EXPORT void ipfrag4_tmo(void);
+extern DLL_EXPORT void ipfrag4_init(void);
+extern DLL_EXPORT void ipfrag4_destroy(void);
+extern DLL_EXPORT uint16_t ipv4_pmtu_lookup(struct netdev *dev, uint32_t daddr);
+extern DLL_EXPORT bool ipv4_pmtu_update(uint32_t daddr, uint16_t mtu);
+extern DLL_EXPORT uint16_t ipv4_pmtu_plateau(uint16_t length);
+extern DLL_EXPORT void ipv4_pmtu_init(void);
+extern DLL_EXPORT void ipv4_pmtu_destroy(void);
 extern DLL_EXPORT void ipfrag4_fragment(struct netbuf *nb, uint32_t dst);
-extern DLL_EXPORT void ip_htons(struct netbuf *nb);
 extern DLL_EXPORT uint32_t ipv4_pseudo_partial_csum(uint32_t saddr, uint32_t daddr, uint8_t proto, uint16_t length);
+extern DLL_EXPORT uint32_t ipv4_flow_hash(uint32_t saddr, uint32_t daddr, uint8_t proto,
+	uint16_t sport, uint16_t dport);
 
 static inline bool ip_is_ipv4(struct netbuf *nb)
 {
@@ -80,24 +116,53 @@ static inline bool ip_is_ipv4(struct netbuf *nb)
 	return version == 4;
 }
 
+/*
+ * IPv4 headers are kept in network byte order. These accessors return the
+ * header fields in host byte order.
+ */
+
 static inline uint32_t ipv4_get_saddr(struct ipv4_header *hdr)
 {
-	return hdr->saddr;
+	return ntohl(hdr->saddr);
 }
 
-static inline uint32_t ipv4_get_remote_address(struct netbuf *nb)
+static inline uint32_t ipv4_get_daddr(struct ipv4_header *hdr)
 {
-	return ipv4_get_saddr(nb->network.data);
+	return ntohl(hdr->daddr);
 }
 
-static inline uint32_t ipv4_get_daddr(struct ipv4_header *hdr)
+static inline uint16_t ipv4_get_length(struct ipv4_header *hdr)
+{
+	return ntohs(hdr->length);
+}
+
+static inline uint16_t ipv4_get_id(struct ipv4_header *hdr)
 {
-	return hdr->daddr;
+	return ntohs(hdr->id);
+}
+
+static inline uint8_t ipv4_get_hdrlen(struct ipv4_header *hdr)
+{
+#ifdef HAVE_BIG_ENDIAN
+	return (uint8_t)(((hdr->ihl_version >> 4) & 0xF) * sizeof(uint32_t));
+#else
+	return (uint8_t)((hdr->ihl_version & 0xF) * sizeof(uint32_t));
+#endif
+}
+
+/**
+ * @brief Get the source address of a received datagram.
+ * @param nb Packet buffer.
+ * @return The source address, in host byte order.
+ */
+static inline uint32_t ipv4_get_remote_address(struct netbuf *nb)
+{
+	return nb->meta.saddr;
 }
 
 static inline uint8_t ipv4_get_flags(struct ipv4_header *hdr)
 {
-	uint16_t offset = hdr->offset;
+	uint16_t offset = ntohs(hdr->offset);
 
 	offset &= 0xE000;
 	offset >>= 13;
@@ -106,11 +171,61 @@ static inline uint8_t ipv4_get_flags(struct ipv4_header *hdr)
 
 static inline uint16_t ipv4_get_offset(struct ipv4_header *hdr)
 {
-	uint16_t offset = hdr->offset;
+	uint16_t offset = ntohs(hdr->offset);
 
 	offset &= ~0xE000;
 	return offset * 8; /* Offset i stored as 8-byte blocks */
 }
+
+/**
+ * @brief Update a checksum for a modified 16-bit word.
+ * @param csum Checksum to update.
+ * @param old Old value of the word.
+ * @param value New value of the word.
+ * @return The updated checksum.
+ *
+ * Incremental update as described in RFC 1624, equation 3. All arguments are
+ * in the same byte order as the checksummed data.
+ */
+static inline uint16_t ip_checksum_replace(uint16_t csum, uint16_t old, uint16_t value)
+{
+	uint32_t sum;
+
+	sum = (uint16_t)~csum + (uint16_t)~old + (uint32_t)value;
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	return (uint16_t)~sum;
+}
+
+/**
+ * @brief Add two partial checksums.
+ * @param a First partial checksum.
+ * @param b Second partial checksum.
+ * @return The one's complement sum of \p a and \p b.
+ *
+ * The data that \p b was calculated over must start at an even offset of the
+ * data that \p a was calculated over.
+ */
+static inline uint16_t ip_checksum_add(uint16_t a, uint16_t b)
+{
+	uint32_t sum;
+
+	sum = (uint32_t)a + b;
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	return (uint16_t)sum;
+}
+
+/**
+ * @brief Subtract a partial checksum from another.
+ * @param a Partial checksum to subtract from.
+ * @param b Partial checksum to subtract.
+ * @return The one's complement difference of \p a and \p b.
+ * @see ip_checksum_add
+ */
+static inline uint16_t ip_checksum_sub(uint16_t a, uint16_t b)
+{
+	return ip_checksum_add(a, (uint16_t)~b);
+}
 CDECL_END
 
 #endif /* !__IP_H__ */
\ No newline at end of file
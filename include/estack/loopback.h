@@ -0,0 +1,35 @@
+/*
+ * E/STACK - Loopback device
+ *
+ * Author: Michel Megens
+ * Date: 24/02/2018
+ * Email: dev@bietje.net
+ */
+
+/**
+ * @addtogroup netdev
+ * @{
+ */
+
+#ifndef __LOOPBACK_H__
+#define __LOOPBACK_H__
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <estack/estack.h>
+#include <estack/netdev.h>
+#include <estack/netbuf.h>
+
+#define LOOPBACK_ADDR 0x7F000001 //!< Loopback address (127.0.0.1).
+#define LOOPBACK_MASK 0xFF000000 //!< Loopback network mask.
+
+CDECL
+extern DLL_EXPORT struct netdev *loopback_create(const char *name);
+extern DLL_EXPORT void loopback_destroy(struct netdev *dev);
+extern DLL_EXPORT int loopback_xmit(struct netbuf *nb);
+CDECL_END
+
+#endif
+
+/** @} */
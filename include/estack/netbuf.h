@@ -22,6 +22,14 @@ struct DLL_EXPORT nbdata {
 	size_t size;
 };
 
+#ifndef CONFIG_NET_IP_ALIGN
+/**
+ * Headroom in front of the datalink layer. With a 14 byte ethernet header, two
+ * bytes of headroom place the network header on a 4 byte boundary.
+ */
+#define CONFIG_NET_IP_ALIGN 2
+#endif
+
 #define NBUF_DATALINK_ALLOC    0
 #define NBUF_NETWORK_ALLOC     1
 #define NBUF_TRANSPORT_ALLOC   2
@@ -43,6 +51,11 @@ struct DLL_EXPORT nbdata {
 #define NBUF_TX_KEEP          15
 
 #define NBUF_BL_QUEUED        16
+#define NBUF_LOOPED           17
+#define NBUF_DONTFRAG         18
+#define NBUF_CSUM_PARTIAL     19 //!< `csum` holds the sum of the application data.
+#define NBUF_CSUM_PENDING     20 //!< The transport checksum is verified when the data is read.
+#define NBUF_CSUM_COMPLETE    21 //!< `csum` holds the sum of the current layer up to the end of the packet.
 
 typedef enum {
 	NBAF_DATALINK = 0,
@@ -56,6 +69,22 @@ typedef enum {
 #define NBAF_TRANSPORT_MASK (1 << NBUF_TRANSPORT_ALLOC)
 #define NBAF_APPLICTION_MASK (1 << NBUF_APPLICATION_ALLOC)
 
+/**
+ * @brief Header fields parsed on input, in host byte order.
+ *
+ * Protocol headers are kept in network byte order. Input handlers store the
+ * fields that are used further up the stack here, so that they are converted
+ * only once.
+ */
+struct netbuf_meta {
+	uint32_t saddr; //!< IPv4 source address.
+	uint32_t daddr; //!< IPv4 destination address.
+	uint16_t length; //!< IPv4 total length.
+	uint16_t offset; //!< IPv4 fragment flags and offset field.
+	uint16_t sport; //!< Transport layer source port.
+	uint16_t dport; //!< Transport layer destination port.
+};
+
 struct DLL_EXPORT netbuf {
 	struct list_head entry;
 	struct list_head bl_entry;
@@ -68,7 +97,13 @@ struct DLL_EXPORT netbuf {
 
 	struct netdev *dev;
 	uint16_t protocol;
+	uint8_t bl_class;
 	uint32_t flags;
+	uint32_t hash; //!< Flow hash, used to select the next hop of a multipath route.
+	struct netbuf *parent; //!< Buffer that owns the data this buffer refers to.
+	volatile long refcount; //!< Number of references to this buffer.
+	struct netbuf_meta meta; //!< Parsed header fields.
+	uint16_t csum; //!< Partial checksum, see \p NBUF_CSUM_PARTIAL, \p NBUF_CSUM_PENDING and \p NBUF_CSUM_COMPLETE.
 	uint32_t sequence_end;
 };
 
@@ -137,6 +172,13 @@ static inline int netbuf_arrived(struct netbuf *nb)
 	return netbuf_test_flag(nb, NBUF_ARRIVED);
 }
 
+/* Take a reference to a buffer, the reference is dropped by netbuf_free */
+static inline struct netbuf *netbuf_get(struct netbuf *nb)
+{
+	atomic_inc(&nb->refcount);
+	return nb;
+}
+
 extern DLL_EXPORT struct netbuf *netbuf_realloc(struct netbuf *nb, netbuf_type_t type, size_t size);
 extern DLL_EXPORT struct netbuf *netbuf_alloc(netbuf_type_t type, size_t size);
 extern DLL_EXPORT void netbuf_free(struct netbuf *nb);
@@ -148,6 +190,8 @@ extern DLL_EXPORT struct netbuf *netbuf_clone(struct netbuf *nb, uint32_t layers
 extern DLL_EXPORT void netbuf_cpy_data_offset(struct netbuf *nb, size_t ofs, const void *src,
 												size_t length, netbuf_type_t type);
 extern DLL_EXPORT void netbuf_free_partial(struct netbuf *nb, netbuf_type_t type);
+extern DLL_EXPORT void *netbuf_alloc_data(netbuf_type_t type, size_t size);
+extern DLL_EXPORT void netbuf_free_data(void *data, netbuf_type_t type);
 CDECL_END
 
 #endif //!__NETBUF_H__
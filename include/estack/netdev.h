@@ -30,14 +30,48 @@ struct DLL_EXPORT netdev_stats {
 	uint32_t tx_bytes,  //!< Number of transmitted bytes.
 		tx_packets; //!< Number of received packets.
 	uint32_t dropped; //!< Number of dropped packets.
+	uint32_t unresolved_dropped; //!< Number of packets dropped while waiting for address resolution.
+};
+
+/**
+ * @brief Backlog traffic class.
+ *
+ * Packets are classified when they are queued on the backlog. Lower
+ * values are served first, and are shed last when a device is over budget.
+ */
+typedef enum {
+	NETDEV_CLASS_CONTROL = 0, //!< Control plane traffic (ARP, TCP SYN / FIN / RST).
+	NETDEV_CLASS_LATENCY, //!< Latency sensitive traffic (pure ACKs, ICMP).
+	NETDEV_CLASS_BULK, //!< Everything else.
+} netdev_class_t;
+
+#define NETDEV_CLASSES 3 //!< Number of backlog traffic classes.
+
+#ifndef CONFIG_BACKLOG_SIZE
+#define CONFIG_BACKLOG_SIZE 512
+#endif
+
+#define NETDEV_FEATURE_CSUM (1 << 0) //!< Checksums don't have to be calculated or verified.
+
+/**
+ * @brief Backlog queue for a single traffic class.
+ */
+struct DLL_EXPORT netdev_backlog_queue {
+	struct list_head head; //!< Queue head.
+	int size; //!< Number of packets on the queue.
+	int rx_size; //!< Number of received packets on the queue.
+	int limit; //!< Maximum number of received packets admitted to the queue.
+	uint32_t shed; //!< Number of received packets shed from this queue.
 };
 
 /**
  * @brief Network device backlog.
  */
 struct DLL_EXPORT netdev_backlog {
-	struct list_head head; //!< Backlog head.
+	struct netdev_backlog_queue queues[NETDEV_CLASSES]; //!< Per class backlog queues.
 	int size; //!< Backlog size.
+	int rx_size; //!< Number of received packets on the backlog.
+	int limit; //!< Total number of received packets admitted to the backlog.
 };
 
 #define MAX_ADDR_LEN 8 //!< Maximum device hardware address length.
@@ -48,9 +82,28 @@ struct DLL_EXPORT netdev_backlog {
  */
 typedef enum {
 	NIF_TYPE_ETHER,
+	NIF_TYPE_LOOPBACK,
 } nif_type_t;
 
 #define NIF_MAX_ADDR_LENGTH MAX_LOCAL_ADDRESS_LENGTH
+
+struct netdev;
+
+/**
+ * @brief Cached IPv4 route lookup.
+ *
+ * Packets that are forwarded in a batch tend to share their destination. The
+ * entry is only valid for the route table revision it was looked up in.
+ */
+struct netif_route_cache {
+	uint32_t daddr; //!< Destination address.
+	uint32_t hash; //!< Flow hash, only compared for multipath routes.
+	uint32_t gateway; //!< Gateway address, 0 for a directly connected network.
+	uint32_t seq; //!< Route table revision.
+	bool multipath; //!< True if the route has more than one next hop.
+	struct netdev *dev; //!< Output device, \p NULL if the entry is empty.
+};
+
 /**
  * @brief Network interface datastructure.
  */
@@ -60,11 +113,17 @@ struct netif {
 	uint8_t remote_ip[NIF_MAX_ADDR_LENGTH]; //!< Remote for Point to Point.
 	uint8_t ip_mask[NIF_MAX_ADDR_LENGTH]; //!< Address mask.
 	uint16_t pkt_id; //!< Packet ID generator.
+	struct netif_route_cache route_cache; //!< Last route used to forward a datagram.
+	struct list_head mcast_groups; //!< Joined multicast groups.
+	uint64_t mcast_filter; //!< Hash filter of the joined multicast groups.
 };
 
 struct netbuf;
+struct netdev_filter;
+struct netdev_capture;
 typedef void(*rx_handle)(struct netbuf *nb);
 typedef void(*tx_handle)(struct netbuf *nb, uint8_t *target);
+typedef netdev_class_t(*classify_handle)(struct netbuf *nb);
 
 /**
  * @brief Wrapper datastructure for (external) protocol handlers.
@@ -95,6 +154,18 @@ struct DLL_EXPORT netdev {
 
 	rx_handle rx; //!< Receive handler.
 	tx_handle tx; //!< Transmit handler.
+	classify_handle classify; //!< Backlog classifier. Packets are treated as bulk if not set.
+	struct netdev_filter *filter; //!< Receive filter.
+	struct netdev_capture *capture; //!< Packet capture, \p NULL if capturing is disabled.
+	struct netdev *master; //!< Aggregating device, if this device is a bond member.
+	uint32_t features; //!< Device feature flags.
+	struct dst_cache_bucket *dst_table; //!< Destination cache hash table.
+	struct dst_cache_entry *dst_free; //!< Released destination cache entries.
+	struct dst_cache_entry **dst_heap; //!< Destination cache timers, ordered on expiry.
+	int dst_heap_length; //!< Number of scheduled destination cache entries.
+	int dst_heap_size; //!< Capacity of \p dst_heap.
+	int dst_tokens; //!< Number of resolution requests that may be sent.
+	time_t dst_token_stamp; //!< Last time \p dst_tokens was refilled.
 
 	int processing_weight; //!< Processing bucket size.
 	int rx_max; //!< Receive bucket size.
@@ -133,36 +204,89 @@ typedef enum {
 } dst_cache_state_t;
 
 typedef void(*resolve_handle)(struct netdev *dev, uint8_t *addr);
+struct dst_cache_entry;
+typedef void(*dst_walk_handle)(struct netdev *dev, struct dst_cache_entry *e, void *arg);
 
 #ifndef CONFIG_CACHE_AGE
 #define CONFIG_CACHE_AGE 60
 #endif
 
+#ifndef CONFIG_CACHE_REFRESH
+#define CONFIG_CACHE_REFRESH 5 //!< Seconds before expiry at which entries in use are refreshed.
+#endif
+
 #define DST_PERM_MASK 0x1
 
+#ifndef CONFIG_DST_PENDING_MAX
+#define CONFIG_DST_PENDING_MAX 8 //!< Maximum number of packets waiting for a single entry to resolve.
+#endif
+
+#ifndef CONFIG_DST_UNRESOLVED_MAX
+#define CONFIG_DST_UNRESOLVED_MAX 64 //!< Maximum number of unresolved entries on all devices.
+#endif
+
+#ifndef CONFIG_DST_RESOLVE_RATE
+#define CONFIG_DST_RESOLVE_RATE 64 //!< Number of resolution requests a device may send per second.
+#endif
+
+#ifndef CONFIG_DST_RESOLVE_BURST
+#define CONFIG_DST_RESOLVE_BURST 16 //!< Maximum number of resolution requests sent in a single batch.
+#endif
+
+#ifndef CONFIG_CACHE_LINE_SIZE
+#define CONFIG_CACHE_LINE_SIZE 64 //!< Size of a CPU cache line in bytes.
+#endif
+
+#ifndef CONFIG_DST_HASH_SIZE
+#define CONFIG_DST_HASH_SIZE 256 //!< Number of destination cache buckets. Must be a power of two.
+#endif
+
 /**
  * @brief Destination cache data structure.
+ *
+ * Addresses are stored inline. The fields used by a lookup are kept within
+ * the first CONFIG_CACHE_LINE_SIZE bytes of the entry, which is checked at
+ * build time. Entries come from the regular allocator and aren't aligned to a
+ * cache line, so a lookup touches at most two lines per entry.
  */
 struct DLL_EXPORT dst_cache_entry {
-	struct list_head entry; //!< List entry.
+	struct dst_cache_entry *next; //!< Next entry in the hash chain.
+	dst_cache_state_t state; //!< Cache state.
 	uint8_t flags;
-
-	uint8_t *saddr; //!< Source / network layer address.
 	uint8_t saddr_length; //!< Length of \p saddr.
-	uint8_t *hwaddr; //!< Hardware address that \p saddr is mapped to.
 	uint8_t hwaddr_length; //!< Length of \p hwaddr.
+	volatile uint8_t used; //!< Set when the entry has been used since it was last resolved.
+	uint8_t saddr[MAX_LOCAL_ADDRESS_LENGTH]; //!< Source / network layer address.
+	uint8_t hwaddr[MAX_ADDR_LEN]; //!< Hardware address that \p saddr is mapped to.
 
-	dst_cache_state_t state; //!< Cache state.
+	struct list_head entry; //!< List entry.
 	struct list_head packets; //!< Packets waiting for the cache to fully resolve.
+	int pending; //!< Number of packets in \p packets.
 	time_t timeout, //!< Resolve time out. The cache is dropped if \p timeout expires.
-		last_attempt; //!< Last time the cache was attempted to be resolved.
+		last_attempt, //!< Last time the cache was attempted to be resolved.
+		expiry; //!< Time at which the entry needs attention of the cache timers.
+	int heap_idx; //!< Index into the timer heap, negative if the entry isn't scheduled.
 	int retry; //!< Number of resolve attempts.
 	resolve_handle translate; //!< Handle to resolve an unfinished entry.
 };
 
+/**
+ * @brief Destination cache hash bucket.
+ *
+ * Buckets are protected by a sequence counter. Writers hold the device lock
+ * and make the counter odd while they modify the bucket or one of its entries,
+ * readers retry their lookup when the counter changed.
+ */
+struct DLL_EXPORT dst_cache_bucket {
+	volatile uint32_t seq; //!< Sequence counter.
+	struct dst_cache_entry *volatile head; //!< Hash chain head.
+};
+
 CDECL
 extern DLL_EXPORT struct list_head *netdev_get_devices(void);
+extern DLL_EXPORT struct netdev *netdev_find(const char *name);
 extern DLL_EXPORT void netdev_add_backlog(struct netdev *dev, struct netbuf *nb);
+extern DLL_EXPORT int netdev_xmit(struct netdev *dev, struct netbuf *nb);
 extern DLL_EXPORT void netdev_init(struct netdev *dev);
 extern DLL_EXPORT void netdev_destroy(struct netdev *dev);
 extern DLL_EXPORT int netdev_poll(struct netdev *dev);
@@ -172,13 +296,21 @@ extern DLL_EXPORT bool netdev_add_protocol(struct netdev *dev, uint16_t proto, r
 extern DLL_EXPORT bool netdev_remove_protocol(struct netdev *dev, uint16_t proto);
 extern DLL_EXPORT void netdev_add_destination(struct netdev *dev, const uint8_t *dst,
 	uint8_t daddrlen, const uint8_t *src, uint8_t saddrlen);
+extern DLL_EXPORT void netdev_learn_destination(struct netdev *dev, const uint8_t *dst,
+	uint8_t daddrlen, const uint8_t *src, uint8_t saddrlen, resolve_handle handle);
 extern DLL_EXPORT struct dst_cache_entry *netdev_find_destination(struct netdev *dev,
 	const uint8_t *src, uint8_t length);
 extern DLL_EXPORT bool netdev_remove_destination(struct netdev *dev, const uint8_t *src,
 	uint8_t length);
 extern DLL_EXPORT bool netdev_update_destination(struct netdev *dev, const uint8_t *dst,
 	uint8_t dlength, const uint8_t *src, uint8_t slength);
-extern DLL_EXPORT bool netdev_dstcache_add_packet(struct netdev *dev, struct dst_cache_entry *e, struct netbuf *nb);
+extern DLL_EXPORT bool netdev_resolve_destination(struct netdev *dev, const uint8_t *src, uint8_t length,
+	uint8_t *hwaddr);
+extern DLL_EXPORT bool netdev_dstcache_queue_packet(struct netdev *dev, const uint8_t *src, uint8_t length,
+	resolve_handle handle, struct netbuf *nb, uint8_t *hwaddr);
+extern DLL_EXPORT bool netdev_restore_destination(struct netdev *dev, const uint8_t *dst, uint8_t daddrlen,
+	const uint8_t *src, uint8_t saddrlen, time_t lifetime);
+extern DLL_EXPORT void netdev_foreach_destination(struct netdev *dev, dst_walk_handle handle, void *arg);
 extern DLL_EXPORT void ifconfig(struct netdev *dev, uint8_t *local, uint8_t *remote,
 	uint8_t *mask, uint8_t length, nif_type_t type);
 extern DLL_EXPORT uint16_t netif_get_id(struct netif *nif);
@@ -186,6 +318,8 @@ extern DLL_EXPORT void netdev_print_nif(struct netdev *dev);
 
 extern DLL_EXPORT void netdev_write_stats(struct netdev *dev, FILE *file);
 extern DLL_EXPORT uint32_t netdev_get_dropped(struct netdev *dev);
+extern DLL_EXPORT void netdev_count_dropped(struct netdev *dev);
+extern DLL_EXPORT uint32_t netdev_get_unresolved_dropped(struct netdev *dev);
 extern DLL_EXPORT uint32_t netdev_get_rx_bytes(struct netdev *dev);
 extern DLL_EXPORT uint32_t netdev_get_tx_bytes(struct netdev *dev);
 extern DLL_EXPORT uint32_t netdev_get_rx_packets(struct netdev *dev);
@@ -194,6 +328,7 @@ extern DLL_EXPORT void netdev_print(struct netdev *dev, FILE *file);
 extern DLL_EXPORT struct dst_cache_entry *netdev_add_destination_unresolved(struct netdev *dev,
 	const uint8_t *src, uint8_t length, resolve_handle handle);
 extern DLL_EXPORT void netdev_config_core_params(uint32_t retry_tmo, uint32_t resolv_tmo, int retries);
+extern DLL_EXPORT void netdev_config_cache(time_t age, time_t refresh);
 extern DLL_EXPORT void devcore_init(void);
 extern DLL_EXPORT void devcore_destroy(void);
 extern DLL_EXPORT void netdev_config_params(struct netdev *dev, int maxrx, int maxweight);
@@ -203,16 +338,18 @@ extern DLL_EXPORT void netdev_add_destination_perm(struct netdev *dev, const uin
 	const uint8_t *src, uint8_t saddrlen);
 extern DLL_EXPORT void netdev_wakeup_irq(void);
 extern DLL_EXPORT void netdev_remove_backlog_if(struct netdev *dev, struct netbuf *nb);
+extern DLL_EXPORT void netdev_config_backlog(struct netdev *dev, int limit, int control, int latency, int bulk);
+extern DLL_EXPORT uint32_t netdev_get_shed(struct netdev *dev, netdev_class_t cls);
 CDECL_END
 
 /**
- * @brief Iterate over the backlog of a device.
- * @param bl Backlog pointer.
+ * @brief Iterate over a single backlog queue of a device.
+ * @param q Backlog queue pointer.
  * @param e Entry pointer.
  * @param p Temporary variable.
  */
-#define backlog_for_each_safe(bl, e, p) \
-			list_for_each_safe(e, p, &((bl)->head))
+#define backlog_for_each_safe(q, e, p) \
+			list_for_each_safe(e, p, &((q)->head))
 #endif // !__NETDEV_H__
 
  /** @} */
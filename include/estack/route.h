@@ -24,13 +24,44 @@ struct iproute_head {
 	estack_mutex_t lock;
 };
 
+#ifndef CONFIG_ROUTE4_NEXTHOPS
+#define CONFIG_ROUTE4_NEXTHOPS 8 //!< Maximum number of next hops of a multipath route.
+#endif
+
+#define ROUTE4_BUCKETS 64 //!< Number of flow buckets of a multipath route.
+
+/**
+ * @brief Next hop of a multipath route.
+ */
+struct DLL_EXPORT route4_nexthop {
+	uint32_t gateway; //!< Gateway address, 0 for a directly connected network.
+	struct netdev *dev; //!< Output device.
+	uint8_t weight; //!< Relative weight of the next hop.
+};
+
+/**
+ * @brief Next hop group of a multipath route.
+ *
+ * Flows are hashed onto a fixed number of buckets, and each bucket maps to
+ * a next hop. Buckets are only moved when next hops come and go, so that
+ * flows keep using the same next hop.
+ */
+struct DLL_EXPORT route4_group {
+	struct route4_nexthop nexthops[CONFIG_ROUTE4_NEXTHOPS]; //!< Next hops.
+	uint8_t length; //!< Number of next hops.
+	uint8_t buckets[ROUTE4_BUCKETS]; //!< Flow bucket to next hop map.
+};
+
 struct iproute4_entry {
 	struct list_head entry;
 
 	uint32_t ip;
 	uint32_t mask;
-	uint32_t gateway;
-	struct netdev *dev;
+	uint32_t gateway; //!< Gateway of the first next hop.
+	struct netdev *dev; //!< Device of the first next hop.
+	uint8_t weight; //!< Weight of the first next hop.
+	struct route4_group *group; //!< Next hop group, only used if it holds more than one next hop.
+	uint32_t stamp; //!< Insertion order of the route.
 };
 
 struct iproute6_entry {
@@ -42,8 +73,24 @@ struct iproute6_entry {
 	struct netdev *dev;
 };
 
+typedef void(*route4_walk_handle)(struct iproute4_entry *e, struct route4_nexthop *nh, void *arg);
+
 CDECL
+extern DLL_EXPORT struct netdev *route4_lookup_cached(struct netif_route_cache *cache, uint32_t ip,
+	uint32_t hash, uint32_t *gw);
+extern DLL_EXPORT void route4_foreach(route4_walk_handle handle, void *arg);
 extern DLL_EXPORT bool route4_add(uint32_t addr, uint32_t mask, uint32_t gw, struct netdev *dev);
+extern DLL_EXPORT void route4_batch_begin(void);
+extern DLL_EXPORT bool route4_batch_add(uint32_t addr, uint32_t mask, uint32_t gw, struct netdev *dev);
+extern DLL_EXPORT bool route4_batch_delete(uint32_t ip, uint32_t mask, uint32_t gate, struct netdev *dev);
+extern DLL_EXPORT bool route4_batch_add_nexthop(uint32_t addr, uint32_t mask, uint32_t gw,
+	struct netdev *dev, uint8_t weight);
+extern DLL_EXPORT bool route4_add_nexthop(uint32_t addr, uint32_t mask, uint32_t gw,
+	struct netdev *dev, uint8_t weight);
+extern DLL_EXPORT struct netdev *route4_lookup_flow(uint32_t ip, uint32_t hash, uint32_t *gw);
+extern DLL_EXPORT struct netdev *route4_lookup_dev(uint32_t ip, uint32_t hash, struct netdev *dev,
+	uint32_t *gw);
+extern DLL_EXPORT void route4_batch_commit(void);
 extern DLL_EXPORT void route4_clear(void);
 extern DLL_EXPORT bool route4_delete(uint32_t ip, uint32_t mask, uint32_t gate, struct netdev *dev);
 extern DLL_EXPORT struct netdev *route4_lookup(uint32_t ip, uint32_t *gw);
@@ -0,0 +1,81 @@
+/*
+ * E/STACK - Warm start snapshots
+ *
+ * Author: Michel Megens
+ * Date: 24/02/2018
+ * Email: dev@bietje.net
+ */
+
+/**
+ * @addtogroup snapshot
+ * @{
+ */
+
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <estack/estack.h>
+#include <estack/netdev.h>
+
+#define SNAPSHOT_MAGIC 0x45535350 //!< Snapshot file magic ("ESSP").
+#define SNAPSHOT_VERSION 1 //!< Snapshot file format version.
+#define SNAPSHOT_NAME_LENGTH 16 //!< Maximum device name length, including the terminator.
+
+/**
+ * @brief Snapshot record type.
+ */
+typedef enum {
+	SNAPSHOT_DST = 1, //!< Destination cache entry.
+	SNAPSHOT_ROUTE4, //!< IPv4 route.
+} snapshot_type_t;
+
+#pragma pack(push, 1)
+/**
+ * @brief Snapshot file header.
+ */
+struct DLL_EXPORT snapshot_header {
+	uint32_t magic; //!< File magic, \p SNAPSHOT_MAGIC.
+	uint16_t version; //!< File format version.
+	uint16_t reserved;
+	uint32_t length; //!< Number of records following the header.
+	uint64_t stamp; //!< Time at which the snapshot was taken, in microseconds.
+};
+
+/**
+ * @brief Snapshot record.
+ */
+struct DLL_EXPORT snapshot_record {
+	uint8_t type; //!< Record type.
+	uint8_t saddr_length; //!< Length of the network layer address.
+	uint8_t hwaddr_length; //!< Length of the hardware address.
+	uint8_t weight; //!< Next hop weight of a route.
+	char name[SNAPSHOT_NAME_LENGTH]; //!< Name of the device the record belongs to.
+	uint64_t lifetime; //!< Remaining life time in microseconds, when the snapshot was taken.
+	union {
+		struct {
+			uint8_t saddr[MAX_LOCAL_ADDRESS_LENGTH]; //!< Network layer address.
+			uint8_t hwaddr[MAX_ADDR_LEN]; //!< Hardware address.
+		} dst;
+		struct {
+			uint32_t ip; //!< Route address.
+			uint32_t mask; //!< Route mask.
+			uint32_t gateway; //!< Gateway address.
+		} route4;
+	};
+};
+#pragma pack(pop)
+
+CDECL
+extern DLL_EXPORT int estack_snapshot_save(const char *path);
+extern DLL_EXPORT int estack_snapshot_load(const char *path);
+extern DLL_EXPORT void estack_snapshot_apply(struct netdev *dev);
+extern DLL_EXPORT void snapshot_init(void);
+extern DLL_EXPORT void snapshot_destroy(void);
+CDECL_END
+
+#endif
+
+/** @} */
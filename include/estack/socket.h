@@ -30,14 +30,28 @@ typedef unsigned short sa_family_t;
 #define SO_UDP    0x10
 #define SO_TCP    0x20
 #define SO_CONNECTED 0x40
+#define SO_DONTFRAG 0x80 //!< Set the don't fragment bit on outgoing datagrams.
+#define SO_REUSE 0x100 //!< Allow other sockets to bind to the same local address.
 
 struct sock_rcv_buffer {
 	struct list_head entry;
 	ip_addr_t addr;
 	uint16_t port;
+	struct netbuf *nb; //!< Buffer that holds \p data.
 	void *data;
 	size_t index;
 	size_t length;
+	bool csum_pending; //!< The checksum of \p data hasn't been verified yet.
+	uint16_t csum; //!< Partial checksum of the headers, if \p csum_pending is set.
+};
+
+/**
+ * @brief Multicast group membership of a socket.
+ */
+struct sock_mcast {
+	struct list_head entry;
+	uint32_t group; //!< Group address.
+	struct netdev *dev; //!< Interface the group is joined on.
 };
 
 struct DLL_EXPORT socket {
@@ -55,6 +69,7 @@ struct DLL_EXPORT socket {
 	estack_event_t read_event;
 	size_t readsize;
 	struct netdev *dev;
+	struct list_head mcast; //!< Multicast group memberships.
 
 	int(*rcv_event)(struct socket *sock, struct netbuf *nb);
 };
@@ -82,6 +97,9 @@ typedef enum {
 	SOCK_DGRAM,
 	SOCK_RAW,
 } socket_protocol_t;
+
+#define SOL_SOCKET 1
+#define SO_REUSEADDR 2
 #endif
 
 CDECL
@@ -92,6 +110,7 @@ extern DLL_EXPORT struct socket *socket_remove(int fd);
 extern DLL_EXPORT struct socket *socket_find(ip_addr_t *addr, uint16_t port);
 extern DLL_EXPORT struct socket *socket_get(int fd);
 extern DLL_EXPORT struct socket *socket_find_by_addr(const struct sockaddr *s, socklen_t length);
+extern DLL_EXPORT int socket_deliver_multicast(struct netbuf *nb, ip_addr_t *group, uint16_t port);
 extern DLL_EXPORT uint16_t eph_port_alloc(void);
 
 extern DLL_EXPORT int socket_trigger_receive(int fd, void *data, size_t length);
@@ -99,6 +118,7 @@ extern DLL_EXPORT int estack_socket(int domain, int type, int protocol);
 extern DLL_EXPORT int estack_close(int fd);
 extern DLL_EXPORT int estack_connect(int fd, const struct sockaddr *addr, socklen_t len);
 extern DLL_EXPORT int estack_bind(int fd, const struct sockaddr *addr, socklen_t length);
+extern DLL_EXPORT int estack_setsockopt(int fd, int level, int optname, const void *optval, socklen_t length);
 
 extern DLL_EXPORT ssize_t estack_send(int fd, const void *buffer, size_t length, int flags);
 extern DLL_EXPORT ssize_t estack_sendto(int fd, const void *msg, size_t length, int flags,
@@ -40,7 +40,7 @@
 #define TCP_ECE 0x40U
 #define TCP_CWR 0x80U
 
-#pragma pack(push, 1)
+/* Naturally aligned, the header follows a 4 byte aligned IPv4 header */
 struct tcp_hdr {
 	uint16_t sport;
 	uint16_t dport;
@@ -52,6 +52,7 @@ struct tcp_hdr {
 	uint16_t urg_ptr;
 };
 
+#pragma pack(push, 1)
 struct tcp_options {
 	uint16_t options;
 	uint16_t mss;
@@ -117,8 +118,9 @@ struct tcp_pcb {
 };
 
 #define TCP_MSS 536
-#define TCP_MAX_MSS 1460
+#define TCP_MAX_MSS (0xFFFF - 20 - TCP_HDR_LENGTH) //!< Largest MSS of an IPv4 segment.
 #define TCP_WINSIZE 3216
+#define TCP_WINDOW_SEGMENTS 2 //!< Minimum receive window, in segments of the announced MSS.
 #define TCP_MAX_WINDOW_SIZE 0xFFFF
 #define TCP_CLIENT_SEND_WINDOW 4096
 #define TCP_MAX_WINDOW_SHIFT 14
@@ -153,6 +155,21 @@ static inline void tcp_hdr_set_flags(struct tcp_hdr *hdr, uint16_t flags)
 	hdr->hlen_flags = (hdr->hlen_flags & htons((uint16_t)~TCP_FLAGS_MASK)) | htons(flags);
 }
 
+static inline uint32_t tcp_hdr_get_seq(struct tcp_hdr *hdr)
+{
+	return ntohl(hdr->seq_no);
+}
+
+static inline uint32_t tcp_hdr_get_ack(struct tcp_hdr *hdr)
+{
+	return ntohl(hdr->ack_no);
+}
+
+static inline uint16_t tcp_hdr_get_window(struct tcp_hdr *hdr)
+{
+	return ntohs(hdr->window);
+}
+
 static inline void *tcp_hdr_get_options(struct tcp_hdr *hdr)
 {
 	return (void*)(hdr + 1);
@@ -166,6 +183,8 @@ extern DLL_EXPORT int tcp_output(struct netbuf *nb, struct tcp_pcb *pcb, uint32_
 extern DLL_EXPORT void tcp_process(struct socket *pcb, struct netbuf *nb);
 extern DLL_EXPORT void tcp_input(struct netbuf *nb);
 extern DLL_EXPORT void tcp_close(struct socket *sock);
+extern DLL_EXPORT void tcp_pmtu_update(uint32_t saddr, uint16_t sport, uint32_t daddr,
+	uint16_t dport, uint16_t mtu);
 CDECL_END
 
 #endif
@@ -13,6 +13,7 @@
 
 CDECL
 extern DLL_EXPORT void translate_ipv4_to_mac(struct netdev *dev, uint8_t *src);
+extern DLL_EXPORT void translate_ipv4_multicast_to_mac(uint32_t group, uint8_t *hw);
 CDECL_END
 
 #endif
@@ -19,6 +19,7 @@
 #include <estack/arp.h>
 #include <estack/ip.h>
 #include <estack/prototype.h>
+#include <estack/tcp.h>
 
 void ethernet_input(struct netbuf *nb)
 {
@@ -29,6 +30,9 @@ void ethernet_input(struct netbuf *nb)
 	nb->network.size = nb->datalink.size - sizeof(struct ethernet_header);
 	nb->datalink.size = sizeof(struct ethernet_header);
 
+	if(netbuf_test_flag(nb, NBUF_CSUM_COMPLETE))
+		nb->csum = ip_checksum_sub(nb->csum, ip_checksum_partial(0, hdr, sizeof(*hdr)));
+
 	netdev_demux_handle(nb);
 	nb->protocol = ntohs(hdr->type);
 
@@ -54,3 +58,92 @@ void ethernet_input(struct netbuf *nb)
 		break;
 	}
 }
+
+static netdev_class_t ethernet_classify_tcp(struct tcp_hdr *tcp, size_t length)
+{
+	uint16_t flags;
+	size_t hlen;
+
+	flags = tcp_hdr_get_flags(tcp);
+	if(flags & (TCP_SYN | TCP_FIN | TCP_RST))
+		return NETDEV_CLASS_CONTROL;
+
+	hlen = tcp_hdr_get_hlen(tcp) * sizeof(uint32_t);
+	if((flags & TCP_ACK) && length <= hlen)
+		return NETDEV_CLASS_LATENCY;
+
+	return NETDEV_CLASS_BULK;
+}
+
+/**
+ * @brief Classify an ethernet frame for the device backlog.
+ * @param nb Packet buffer to classify.
+ * @return The backlog class of \p nb.
+ *
+ * Only the headers are inspected, so the classifier is cheap enough to run on
+ * every packet that is queued. Received frames are expected to be linear, while
+ * transmitted frames have their headers split over the datalink, network and
+ * transport layers of \p nb.
+ */
+netdev_class_t ethernet_classify(struct netbuf *nb)
+{
+	struct ethernet_header *hdr;
+	struct ipv4_header *ip;
+	struct tcp_hdr *tcp;
+	size_t length, hlen;
+
+	hdr = nb->datalink.data;
+	if(unlikely(!hdr || nb->datalink.size < sizeof(*hdr)))
+		return NETDEV_CLASS_BULK;
+
+	switch(ntohs(hdr->type)) {
+	case ETH_TYPE_ARP:
+		return NETDEV_CLASS_CONTROL;
+
+	case ETH_TYPE_IP:
+		break;
+
+	default:
+		return NETDEV_CLASS_BULK;
+	}
+
+	if(nb->network.data) {
+		ip = nb->network.data;
+		length = nb->network.size;
+	} else {
+		ip = (struct ipv4_header*)(hdr + 1);
+		length = nb->datalink.size - sizeof(*hdr);
+	}
+
+	if(length < sizeof(*ip) || (ntohs(ip->offset) & IP4_OFFSET_MASK))
+		return NETDEV_CLASS_BULK;
+
+	hlen = (ip->ihl_version & 0xF) * sizeof(uint32_t);
+	if(hlen < sizeof(*ip) || ntohs(ip->length) < hlen)
+		return NETDEV_CLASS_BULK;
+
+	switch(ip->protocol) {
+	case IP_PROTO_ICMP:
+		return NETDEV_CLASS_LATENCY;
+
+	case IP_PROTO_IGMP:
+		return NETDEV_CLASS_CONTROL;
+
+	case IP_PROTO_TCP:
+		if(nb->transport.data && nb->network.data) {
+			tcp = nb->transport.data;
+			if(nb->transport.size < sizeof(*tcp))
+				return NETDEV_CLASS_BULK;
+		} else {
+			if(length < hlen + sizeof(*tcp))
+				return NETDEV_CLASS_BULK;
+
+			tcp = (struct tcp_hdr*)((uint8_t*)ip + hlen);
+		}
+
+		return ethernet_classify_tcp(tcp, ntohs(ip->length) - hlen);
+
+	default:
+		return NETDEV_CLASS_BULK;
+	}
+}
@@ -59,8 +59,9 @@ uint32_t ipv4_atoi(char *addr)
 
 uint32_t ipv4_ptoi(const uint8_t *ary)
 {
-	uint32_t *num;
+	uint32_t num;
 
-	num = (void*)ary;
-	return *num;
+	/* The address isn't necessarily aligned */
+	memcpy(&num, ary, sizeof(num));
+	return num;
 }
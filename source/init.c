@@ -10,19 +10,38 @@
 #include <stdio.h>
 #include <estack.h>
 
+#include <estack/ip.h>
+#include <estack/igmp.h>
+#include <estack/icmp.h>
+#include <estack/snapshot.h>
+
 void estack_init(const FILE *logfile)
 {
 	log_init(logfile);
 	estack_timers_init();
 	route4_init();
+	ipfrag4_init();
+	ipv4_pmtu_init();
+	igmp_init();
+	icmp_init();
 	devcore_init();
 	socket_api_init();
+	snapshot_init();
+
+#ifdef CONFIG_SNAPSHOT_FILE
+	estack_snapshot_load(CONFIG_SNAPSHOT_FILE);
+#endif
 }
 
 void estack_destroy(void)
 {
+	snapshot_destroy();
 	socket_api_destroy();
 	devcore_destroy();
+	icmp_destroy();
+	igmp_destroy();
+	ipv4_pmtu_destroy();
+	ipfrag4_destroy();
 	route4_destroy();
 	estack_timers_destroy();
 }
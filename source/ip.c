@@ -8,6 +8,7 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 
 #include <estack/estack.h>
 #include <estack/prototype.h>
@@ -19,42 +20,254 @@
 
 #include "config.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_CSUM_AVX2
+#endif
+
 #define FOLD_U32(u) (((u) >> 16) + ((u) & 0x0000ffffUL))
 
-uint16_t ip_checksum_partial(uint16_t start, const void *buf, int len)
+#ifndef CONFIG_CSUM_SIMD_THRESHOLD
+#define CONFIG_CSUM_SIMD_THRESHOLD 256 //!< Minimum buffer length to use vector instructions for.
+#endif
+
+/*
+ * The one's complement sum does not depend on the byte order, as long as the
+ * words are loaded in the native byte order. Adding 64-bit words with an end
+ * around carry and folding the result down to 16 bits therefore yields the
+ * same sum as adding the 16-bit words one by one.
+ */
+static inline uint64_t csum_add64(uint64_t sum, uint64_t value)
 {
-	register uint32_t sum;
-	register uint8_t *buffer = (uint8_t *)buf;
+	sum += value;
+	return sum + (sum < value);
+}
 
-	if(!buf || !len)
-		return start;
+static inline uint64_t csum_load64(const uint8_t *buffer)
+{
+	uint64_t value;
 
-	sum = start;
-	while(len > 1) {
-#ifdef HAVE_BIG_ENDIAN
-		sum += ((uint8_t)*buffer << 8) | *(buffer + 1);
-#else
-		sum += ((uint8_t) *(buffer + 1) << 8) | *buffer;
-#endif
+	memcpy(&value, buffer, sizeof(value));
+	return value;
+}
 
-		buffer += 2;
-		len -= 2;
+static uint64_t csum_generic(uint64_t sum, const uint8_t *buffer, size_t len)
+{
+	uint64_t tail;
+
+	while(len >= 32) {
+		sum = csum_add64(sum, csum_load64(buffer));
+		sum = csum_add64(sum, csum_load64(buffer + 8));
+		sum = csum_add64(sum, csum_load64(buffer + 16));
+		sum = csum_add64(sum, csum_load64(buffer + 24));
+
+		buffer += 32;
+		len -= 32;
 	}
 
+	while(len >= 8) {
+		sum = csum_add64(sum, csum_load64(buffer));
+		buffer += 8;
+		len -= 8;
+	}
+
+	/* An odd trailing byte is padded with a zero byte */
 	if(len) {
-#ifdef HAVE_BIG_ENDIAN
-		sum += (uint16_t) *buffer << 8;
-#else
-		sum += *buffer;
+		tail = 0ULL;
+		memcpy(&tail, buffer, len);
+		sum = csum_add64(sum, tail);
+	}
+
+	return sum;
+}
+
+static uint64_t csum_generic_copy(uint64_t sum, uint8_t *dst, const uint8_t *src, size_t len)
+{
+	uint64_t value, tail;
+
+	while(len >= 8) {
+		value = csum_load64(src);
+		memcpy(dst, &value, sizeof(value));
+		sum = csum_add64(sum, value);
+
+		src += 8;
+		dst += 8;
+		len -= 8;
+	}
+
+	if(len) {
+		tail = 0ULL;
+		memcpy(&tail, src, len);
+		memcpy(dst, &tail, len);
+		sum = csum_add64(sum, tail);
+	}
+
+	return sum;
+}
+
+#ifdef HAVE_CSUM_AVX2
+/*
+ * Every 16-bit word is zero extended into a 32-bit lane. A lane receives two
+ * words per iteration, so the accumulator is flushed before it can overflow.
+ */
+#define CSUM_AVX2_BLOCKS 0x7FFF
+
+__attribute__((target("avx2")))
+static uint64_t csum_avx2(uint64_t sum, const uint8_t *buffer, size_t len)
+{
+	__m256i acc, value, zero;
+	uint32_t lanes[8];
+	size_t blocks;
+
+	zero = _mm256_setzero_si256();
+
+	while(len >= 32) {
+		blocks = len / 32;
+		if(blocks > CSUM_AVX2_BLOCKS)
+			blocks = CSUM_AVX2_BLOCKS;
+
+		len -= blocks * 32;
+		acc = zero;
+
+		for(; blocks; blocks--) {
+			value = _mm256_loadu_si256((const __m256i*)buffer);
+			acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(value, zero));
+			acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(value, zero));
+			buffer += 32;
+		}
+
+		_mm256_storeu_si256((__m256i*)lanes, acc);
+		for(int idx = 0; idx < 8; idx++)
+			sum = csum_add64(sum, lanes[idx]);
+	}
+
+	return csum_generic(sum, buffer, len);
+}
+
+__attribute__((target("avx2")))
+static uint64_t csum_avx2_copy(uint64_t sum, uint8_t *dst, const uint8_t *src, size_t len)
+{
+	__m256i acc, value, zero;
+	uint32_t lanes[8];
+	size_t blocks;
+
+	zero = _mm256_setzero_si256();
+
+	while(len >= 32) {
+		blocks = len / 32;
+		if(blocks > CSUM_AVX2_BLOCKS)
+			blocks = CSUM_AVX2_BLOCKS;
+
+		len -= blocks * 32;
+		acc = zero;
+
+		for(; blocks; blocks--) {
+			value = _mm256_loadu_si256((const __m256i*)src);
+			_mm256_storeu_si256((__m256i*)dst, value);
+			acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(value, zero));
+			acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(value, zero));
+			src += 32;
+			dst += 32;
+		}
+
+		_mm256_storeu_si256((__m256i*)lanes, acc);
+		for(int idx = 0; idx < 8; idx++)
+			sum = csum_add64(sum, lanes[idx]);
+	}
+
+	return csum_generic_copy(sum, dst, src, len);
+}
 #endif
+
+typedef uint64_t (*csum_func_t)(uint64_t sum, const uint8_t *buffer, size_t len);
+typedef uint64_t (*csum_copy_func_t)(uint64_t sum, uint8_t *dst, const uint8_t *src, size_t len);
+
+static csum_func_t csum_large;
+static csum_copy_func_t csum_copy_large;
+
+/* Selecting the implementation more than once is harmless */
+static void csum_select(void)
+{
+#ifdef HAVE_CSUM_AVX2
+	if(__builtin_cpu_supports("avx2")) {
+		csum_copy_large = csum_avx2_copy;
+		csum_large = csum_avx2;
+		return;
 	}
+#endif
+
+	csum_copy_large = csum_generic_copy;
+	csum_large = csum_generic;
+}
 
+static inline uint16_t csum_fold64(uint64_t sum)
+{
+	sum = (sum & 0xFFFFFFFFULL) + (sum >> 32);
+	sum = (sum & 0xFFFFFFFFULL) + (sum >> 32);
 	sum = FOLD_U32(sum);
 	sum = FOLD_U32(sum);
 
 	return (uint16_t)sum & 0xFFFF;
 }
 
+/**
+ * @brief Calculate the partial Internet checksum of a buffer.
+ * @param start Partial checksum to continue from.
+ * @param buf Buffer to checksum.
+ * @param len Length of \p buf.
+ * @return The one's complement sum of \p buf and \p start, in the byte order
+ *         of the checksummed data.
+ *
+ * The buffer is summed a 64-bit word at a time. Large buffers are summed
+ * using vector instructions, when the processor supports them.
+ */
+uint16_t ip_checksum_partial(uint16_t start, const void *buf, int len)
+{
+	csum_func_t func;
+
+	if(!buf || len <= 0)
+		return start;
+
+	func = csum_generic;
+	if(len >= CONFIG_CSUM_SIMD_THRESHOLD) {
+		if(unlikely(!csum_large))
+			csum_select();
+
+		func = csum_large;
+	}
+
+	return csum_fold64(func(start, buf, (size_t)len));
+}
+
+/**
+ * @brief Copy a buffer and calculate its partial Internet checksum.
+ * @param start Partial checksum to continue from.
+ * @param dst Destination buffer.
+ * @param src Source buffer.
+ * @param len Number of bytes to copy.
+ * @return The one's complement sum of \p src and \p start.
+ * @see ip_checksum_partial
+ *
+ * The data is summed while it is copied, so that it is only read once.
+ */
+uint16_t ip_checksum_partial_copy(uint16_t start, void *dst, const void *src, int len)
+{
+	csum_copy_func_t func;
+
+	if(!src || !dst || len <= 0)
+		return start;
+
+	func = csum_generic_copy;
+	if(len >= CONFIG_CSUM_SIMD_THRESHOLD) {
+		if(unlikely(!csum_copy_large))
+			csum_select();
+
+		func = csum_copy_large;
+	}
+
+	return csum_fold64(func(start, dst, src, (size_t)len));
+}
+
 #pragma pack(push, 1)
 struct pseudo_hdr {
 	uint32_t src;
@@ -122,16 +335,32 @@ void ip_input(struct netbuf *nb)
 	}
 }
 
-void ip_htons(struct netbuf *nb)
+/**
+ * @brief Calculate the flow hash of an IPv4 flow.
+ * @param saddr Source address.
+ * @param daddr Destination address.
+ * @param proto IP protocol.
+ * @param sport Source port.
+ * @param dport Destination port.
+ * @return The flow hash.
+ *
+ * Packets that belong to the same flow always hash to the same value. The byte order
+ * of the arguments does not matter, as long as it is used consistently.
+ */
+uint32_t ipv4_flow_hash(uint32_t saddr, uint32_t daddr, uint8_t proto, uint16_t sport, uint16_t dport)
 {
-	struct ipv4_header *hdr;
-
-	if(ip_is_ipv4(nb)) {
-		hdr = nb->network.data;
-		hdr->daddr = htonl(hdr->daddr);
-		hdr->saddr = htonl(hdr->saddr);
-		hdr->length = htons(hdr->length);
-		hdr->offset = htons(hdr->offset);
-		hdr->id = htons(hdr->id);
-	}
+	register uint32_t hash;
+
+	hash = saddr * 0x9E3779B1U;
+	hash ^= daddr + 0x7F4A7C15U + (hash << 6) + (hash >> 2);
+	hash ^= (((uint32_t)sport << 16) | dport) + 0x7F4A7C15U + (hash << 6) + (hash >> 2);
+	hash ^= proto + 0x7F4A7C15U + (hash << 6) + (hash >> 2);
+
+	hash ^= hash >> 16;
+	hash *= 0x85EBCA6BU;
+	hash ^= hash >> 13;
+	hash *= 0xC2B2AE35U;
+	hash ^= hash >> 16;
+
+	return hash;
 }
@@ -8,11 +8,13 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <estack/estack.h>
 #include <estack/netbuf.h>
 #include <estack/netdev.h>
 #include <estack/arp.h>
+#include <estack/translate.h>
 #include <estack/inet.h>
 #include <estack/log.h>
 
@@ -29,12 +31,12 @@ void arp_print_info(struct arp_header *hdr, struct arp_ipv4_header *ip4hdr)
 
 	print_dbg("ARP packet data:\n");
 
-	ipv4_ntoa(ip4hdr->ip_src_addr, buf, 16);
+	ipv4_ntoa(arp_ipv4_get_saddr(ip4hdr), buf, 16);
 	ethernet_mac_ntoa(ip4hdr->hw_src_addr, hwbuf, 18);
 	print_dbg("\tARP source IP: %s\n", buf);
 	print_dbg("\tARP source MAC: %s\n", hwbuf);
 
-	ipv4_ntoa(ip4hdr->ip_target_addr, buf, 16);
+	ipv4_ntoa(arp_ipv4_get_daddr(ip4hdr), buf, 16);
 	ethernet_mac_ntoa(ip4hdr->hw_target_addr, hwbuf, 18);
 	print_dbg("\tARP destination IP: %s\n", buf);
 	print_dbg("\tARP destination MAC: %s\n", hwbuf);
@@ -47,13 +49,55 @@ void arp_print_info(struct arp_header *hdr, struct arp_ipv4_header *ip4hdr)
 
 #define IP_ADDR_BYTE_LENGTH 4
 
-static void arp_handle_request_ipv4(struct netbuf *nb, struct arp_header *hdr)
+/*
+ * Answer a request in the frame it was received in. The request becomes the
+ * reply by moving the sender addresses to the target fields, after which the
+ * frame is queued for transmission on the device it was received on.
+ */
+static bool arp_reply_inplace_ipv4(struct netbuf *nb, struct arp_header *hdr)
+{
+	struct arp_ipv4_header *ip4hdr;
+	struct ethernet_header *eth;
+	struct netdev *dev;
+
+	dev = nb->dev;
+	eth = nb->datalink.data;
+
+	if(!netbuf_test_flag(nb, NBUF_WAS_RX) || !netbuf_test_flag(nb, NBUF_IS_LINEAR) ||
+		dev->nif.iftype != NIF_TYPE_ETHER || nb->datalink.size != sizeof(*eth) ||
+		(void*)(eth + 1) != (void*)hdr)
+		return false;
+
+	if(nb->network.size < sizeof(*hdr) + sizeof(*ip4hdr) || arp_get_hwtype(hdr) != ARP_TYPE_ETHERNET ||
+		hdr->hwsize != ETHERNET_MAC_LENGTH || hdr->protosize != IP_ADDR_BYTE_LENGTH)
+		return false;
+
+	ip4hdr = (void*)(hdr + 1);
+	hdr->opcode = htons(ARP_OP_REPLY);
+	memcpy(ip4hdr->hw_target_addr, ip4hdr->hw_src_addr, ETHERNET_MAC_LENGTH);
+	ip4hdr->ip_target_addr = ip4hdr->ip_src_addr;
+	memcpy(ip4hdr->hw_src_addr, dev->hwaddr, ETHERNET_MAC_LENGTH);
+	ip4hdr->ip_src_addr = htonl(ipv4_ptoi(dev->nif.local_ip));
+
+	memcpy(eth->dest_mac, ip4hdr->hw_target_addr, ETHERNET_MAC_LENGTH);
+	memcpy(eth->src_mac, dev->hwaddr, ETHERNET_MAC_LENGTH);
+
+	netbuf_set_flag(nb, NBUF_REUSE);
+	netdev_add_backlog(dev, nb);
+	netdev_wakeup();
+	return true;
+}
+
+static void arp_handle_request_ipv4(struct netbuf *nb, struct arp_header *hdr, uint32_t saddr)
 {
 	struct arp_ipv4_header *ip4hdr;
 	struct netbuf *nbr;
 
+	if(arp_reply_inplace_ipv4(nb, hdr))
+		return;
+
 	ip4hdr = (void*)(hdr + 1);
-	nbr = arp_alloc_nb_ipv4(ARP_OP_REPLY, ip4hdr->ip_src_addr, ip4hdr->hw_src_addr);
+	nbr = arp_alloc_nb_ipv4(ARP_OP_REPLY, saddr, ip4hdr->hw_src_addr);
 
 	assert(nbr);
 	arp_output(nb->dev, nbr, ip4hdr->hw_src_addr);
@@ -63,29 +107,28 @@ static void arp_input_ipv4(struct netbuf *nb, struct arp_header *hdr)
 {
 	struct arp_ipv4_header *ip4hdr;
 	struct netif *nif;
-	struct dst_cache_entry *dst;
+	uint32_t saddr;
 
 	ip4hdr = (void*)(hdr + 1);
-	ip4hdr->ip_src_addr = ntohl(ip4hdr->ip_src_addr);
-	ip4hdr->ip_target_addr = ntohl(ip4hdr->ip_target_addr);
+	saddr = arp_ipv4_get_saddr(ip4hdr);
 	nif = &nb->dev->nif;
 
 	/*
 	 * Discard packets that aren't ment for us
 	 */
-	if(ipv4_ptoi(nif->local_ip) != ip4hdr->ip_target_addr) {
+	if(ipv4_ptoi(nif->local_ip) != arp_ipv4_get_daddr(ip4hdr)) {
 		netbuf_set_flag(nb, NBUF_DROPPED);
 		return;
 	}
 
 	/* Discard packets with our own source address */
-	if(ipv4_ptoi(nif->local_ip) == ip4hdr->ip_src_addr) {
+	if(ipv4_ptoi(nif->local_ip) == saddr) {
 		netbuf_set_flag(nb, NBUF_DROPPED);
 		return;
 	}
 
 	/* Discard all packets that have have an ETHERNET broadcast address */
-	if(hdr->hwtype == ARP_TYPE_ETHERNET && ethernet_addr_is_broadcast(ip4hdr->hw_src_addr)) {
+	if(arp_get_hwtype(hdr) == ARP_TYPE_ETHERNET && ethernet_addr_is_broadcast(ip4hdr->hw_src_addr)) {
 		netbuf_set_flag(nb, NBUF_DROPPED);
 		return;
 	}
@@ -96,21 +139,17 @@ static void arp_input_ipv4(struct netbuf *nb, struct arp_header *hdr)
 	 * Normally only ARP-reply packets are stored in the ARP cache. However, we are also
 	 * storing ARP-request packet addresses. This might save us a second or so in the
 	 * future. The reasoning is that if somebody wants our hardware address, its probably
-	 * because they're going to want to talk to us. Proactive baby.
+	 * because they're going to want to talk to us. Proactive baby. Learned
+	 * entries are refreshed by ARP while they're in use.
 	 */
-	dst = netdev_find_destination(nb->dev, (uint8_t*)&ip4hdr->ip_src_addr, IP_ADDR_BYTE_LENGTH);
-	if(!dst)
-		netdev_add_destination(nb->dev, ip4hdr->hw_src_addr, ETHERNET_MAC_LENGTH,
-		(uint8_t*)&ip4hdr->ip_src_addr, IP_ADDR_BYTE_LENGTH);
-	else
-		netdev_update_destination(nb->dev, ip4hdr->hw_src_addr, ETHERNET_MAC_LENGTH,
-		(uint8_t*)&ip4hdr->ip_src_addr, IP_ADDR_BYTE_LENGTH);
-
-	if(hdr->opcode == ARP_OP_REQUEST) {
-		arp_handle_request_ipv4(nb, hdr);
-	}
+	netdev_learn_destination(nb->dev, ip4hdr->hw_src_addr, ETHERNET_MAC_LENGTH,
+		(uint8_t*)&saddr, IP_ADDR_BYTE_LENGTH, translate_ipv4_to_mac);
 
 	arp_print_info(hdr, ip4hdr);
+
+	if(arp_get_opcode(hdr) == ARP_OP_REQUEST) {
+		arp_handle_request_ipv4(nb, hdr, saddr);
+	}
 }
 
 void arp_input(struct netbuf *nb)
@@ -123,11 +162,8 @@ void arp_input(struct netbuf *nb)
 	}
 
 	hdr = nb->network.data;
-	hdr->hwtype = ntohs(hdr->hwtype);
-	hdr->protocol = ntohs(hdr->protocol);
-	hdr->opcode = ntohs(hdr->opcode);
 
-	switch(hdr->protocol) {
+	switch(arp_get_protocol(hdr)) {
 	case ARP_TYPE_IP:
 		arp_input_ipv4(nb, hdr);
 		break;
@@ -16,308 +16,485 @@
 #include <estack/list.h>
 #include <estack/inet.h>
 
-static struct list_head ip_frag_backlog = STATIC_INIT_LIST_HEAD(ip_frag_backlog);
-
 #define FRAG_TMO ((time_t)5 * 1e6)
+#define FRAG_TMO_INTERVAL 500
+#define FRAG_MAX_LENGTH (0xFFFF - sizeof(struct ipv4_header))
 
-struct fragment_bucket {
-	struct list_head lh;
+/*
+ * Fragments of a single datagram. Fragments are kept sorted on their offset and
+ * never overlap, so the datagram is complete once the last fragment has been
+ * received and the number of bytes received equals the datagram length.
+ */
+struct fragment_queue {
 	struct list_head entry;
+	struct list_head lru;
+	struct list_head fragments;
+
+	/* Identification, in network byte order */
+	uint32_t saddr;
+	uint32_t daddr;
+	uint16_t id;
+	uint8_t protocol;
+
 	bool last_recv;
-	int size;
-	time_t tstamp;
+	uint32_t length;
+	uint32_t received;
+	size_t mem;
+	time_t expiry;
+};
+
+/*
+ * Queues are looked up through a hash table. The LRU list is ordered on
+ * creation time, which makes it ordered on expiry time as well.
+ */
+struct fragment_table {
+	struct list_head buckets[CONFIG_IPFRAG_BUCKETS];
+	struct list_head lru;
+	size_t mem;
+	estack_mutex_t lock;
+	estack_timer_t timer;
 };
 
-static inline bool ipfrag_is_in_seq(struct netbuf *nb1, struct netbuf *nb2)
+static struct fragment_table ip_frag_table;
+
+static inline uint16_t ipfrag_start(struct netbuf *nb)
 {
-	struct ipv4_header *hdr1, *hdr2;
+	/* The offset is stored as 8 byte blocks */
+	return (uint16_t)((nb->meta.offset & IP4_OFFSET_MASK) * 8);
+}
+
+static inline uint32_t ipfrag_end(struct netbuf *nb)
+{
+	return ipfrag_start(nb) + (uint32_t)nb->transport.size;
+}
 
-	hdr1 = nb1->network.data;
-	hdr2  = nb2->network.data;
+static inline struct list_head *ipfrag_bucket(struct ipv4_header *hdr)
+{
+	uint32_t hash;
 
-	return hdr1->saddr == hdr2->saddr && hdr1->daddr == hdr2->daddr &&
-		hdr1->id == hdr2->id && hdr1->protocol == hdr2->protocol;
+	hash = ipv4_flow_hash(hdr->saddr, hdr->daddr, hdr->protocol, hdr->id, 0);
+	return &ip_frag_table.buckets[hash % CONFIG_IPFRAG_BUCKETS];
 }
 
-static inline bool ipfrag_is_last(struct netbuf *nb)
+static struct fragment_queue *ipfrag_find(struct list_head *bucket, struct ipv4_header *hdr)
 {
-	struct ipv4_header *hdr;
-	uint8_t flags;
+	struct list_head *entry;
+	struct fragment_queue *fq;
 
-	hdr = nb->network.data;
-	flags = ipv4_get_flags(hdr);
+	list_for_each(entry, bucket) {
+		fq = list_entry(entry, struct fragment_queue, entry);
+
+		if(fq->saddr == hdr->saddr && fq->daddr == hdr->daddr &&
+			fq->id == hdr->id && fq->protocol == hdr->protocol)
+			return fq;
+	}
+
+	return NULL;
+}
+
+static struct fragment_queue *ipfrag_create(struct list_head *bucket, struct ipv4_header *hdr)
+{
+	struct fragment_queue *fq;
+
+	fq = z_alloc(sizeof(*fq));
+	if(!fq)
+		return NULL;
+
+	fq->saddr = hdr->saddr;
+	fq->daddr = hdr->daddr;
+	fq->id = hdr->id;
+	fq->protocol = hdr->protocol;
+	fq->expiry = estack_utime() + FRAG_TMO;
+
+	list_head_init(&fq->fragments);
+	list_add(&fq->entry, bucket);
+	list_add_tail(&fq->lru, &ip_frag_table.lru);
+
+	return fq;
+}
+
+static void ipfrag_unlink(struct fragment_queue *fq)
+{
+	list_del(&fq->entry);
+	list_del(&fq->lru);
+	ip_frag_table.mem -= fq->mem;
+}
+
+static void ipfrag_destroy_queue(struct fragment_queue *fq)
+{
+	struct list_head *lh, *tmp;
+	struct netbuf *nb;
+
+	ipfrag_unlink(fq);
+
+	list_for_each_safe(lh, tmp, &fq->fragments) {
+		nb = list_entry(lh, struct netbuf, entry);
+		list_del(lh);
+		netbuf_free(nb);
+	}
+
+	free(fq);
+}
+
+/*
+ * Make room for \p size bytes by evicting the oldest queues, except for \p keep.
+ */
+static bool ipfrag_reserve(size_t size, struct fragment_queue *keep)
+{
+	struct list_head *lh, *tmp;
+	struct fragment_queue *fq;
+
+	list_for_each_safe(lh, tmp, &ip_frag_table.lru) {
+		if(ip_frag_table.mem + size <= CONFIG_IPFRAG_MEM_MAX)
+			break;
+
+		fq = list_entry(lh, struct fragment_queue, lru);
+		if(fq != keep)
+			ipfrag_destroy_queue(fq);
+	}
+
+	return ip_frag_table.mem + size <= CONFIG_IPFRAG_MEM_MAX;
+}
+
+/*
+ * Find the fragment after which \p nb has to be inserted. Fragments usually
+ * arrive in order, so the search starts at the tail.
+ */
+static struct list_head *ipfrag_position(struct fragment_queue *fq, struct netbuf *nb)
+{
+	struct list_head *entry, *next;
+	struct netbuf *enb;
+	uint16_t start;
+	uint32_t end;
 
-	return !flags;
+	start = ipfrag_start(nb);
+	end = ipfrag_end(nb);
+
+	list_for_each_prev(entry, &fq->fragments) {
+		enb = list_entry(entry, struct netbuf, entry);
+		if(ipfrag_start(enb) < start)
+			break;
+	}
+
+	/* We already have (part of) the fragment when it overlaps with its neighbours */
+	if(entry != &fq->fragments) {
+		enb = list_entry(entry, struct netbuf, entry);
+		if(ipfrag_end(enb) > start)
+			return NULL;
+	}
+
+	next = entry->next;
+	if(next != &fq->fragments) {
+		enb = list_entry(next, struct netbuf, entry);
+		if(ipfrag_start(enb) < end)
+			return NULL;
+	}
+
+	return entry;
 }
 
-static struct netbuf *ipfrag_defragment(struct fragment_bucket *fb)
+/*
+ * Take over the data of a received buffer without copying it. The receiving
+ * device only frees the buffer descriptor of \p nb.
+ */
+static struct netbuf *ipfrag_adopt(struct netbuf *nb)
+{
+	struct netbuf *frag;
+	const uint32_t mask = NBAF_DATALINK_MASK | NBAF_NETWORK_MASK |
+		NBAF_TRANSPORT_MASK | NBAF_APPLICTION_MASK;
+
+	frag = malloc(sizeof(*frag));
+	if(!frag)
+		return NULL;
+
+	memcpy(frag, nb, sizeof(*frag));
+	list_head_init(&frag->entry);
+	list_head_init(&frag->bl_entry);
+	nb->flags &= ~mask;
+
+	return frag;
+}
+
+/*
+ * Build the datagram from its fragments. Upper layers expect a contiguous
+ * transport layer, so the payload of each fragment is copied exactly once.
+ * Fragments start at a multiple of 8 bytes, so the sum of the datagram is the
+ * sum of the sums of its fragments. Fragments without a recorded sum are summed
+ * while they are copied.
+ */
+static struct netbuf *ipfrag_defragment(struct fragment_queue *fq)
 {
 	struct netbuf *nb, *enb;
 	struct list_head *lh, *tmp;
 	struct ipv4_header *hdr;
-	uint16_t offset, length;
-	const uint8_t *src;
-	uint8_t *dst;
+	uint8_t *data;
+	uint16_t csum;
+	const uint32_t mask = (1 << NBUF_UNICAST) | (1 << NBUF_MULTICAST) | (1 << NBUF_BCAST);
 
-	nb = list_first_entry(&fb->lh, struct netbuf, entry);
-	nb = netbuf_realloc(nb, NBAF_TRANSPORT, fb->size);
+	enb = list_first_entry(&fq->fragments, struct netbuf, entry);
+	nb = netbuf_alloc(NBAF_NETWORK, enb->network.size);
+	nb = netbuf_realloc(nb, NBAF_TRANSPORT, fq->length);
 	assert(nb);
 
-	list_for_each_safe(lh, tmp, &fb->lh) {
-		enb = list_entry(lh, struct netbuf, entry);
-
-		if(unlikely(enb == nb))
-			continue;
+	netbuf_cpy_data(nb, enb->network.data, enb->network.size, NBAF_NETWORK);
+	nb->dev = enb->dev;
+	nb->protocol = enb->protocol;
+	nb->hash = enb->hash;
+	nb->meta = enb->meta;
+	nb->flags |= enb->flags & mask;
 
-		hdr = enb->network.data;
-		offset = ipv4_get_offset(hdr);
+	csum = 0;
+	data = nb->transport.data;
 
-		hdr->offset = 0;
-		length = hdr->length - sizeof(*hdr);
-		src = enb->transport.data;
-		dst = (uint8_t*)nb->transport.data + offset;
+	list_for_each_safe(lh, tmp, &fq->fragments) {
+		enb = list_entry(lh, struct netbuf, entry);
 
-		memcpy(dst, src, length);
+		if(netbuf_test_flag(enb, NBUF_CSUM_COMPLETE)) {
+			memcpy(data + ipfrag_start(enb), enb->transport.data, enb->transport.size);
+			csum = ip_checksum_add(csum, enb->csum);
+		} else {
+			csum = ip_checksum_partial_copy(csum, data + ipfrag_start(enb),
+				enb->transport.data, (int)enb->transport.size);
+		}
 
 		list_del(lh);
 		netbuf_free(enb);
 	}
 
-	list_del(&fb->entry);
-	free(fb);
+	nb->meta.offset = 0;
+	nb->meta.length = (uint16_t)(nb->network.size + fq->length);
 
-	netbuf_set_flag(nb, NBUF_NOCSUM);
+	hdr = nb->network.data;
+	hdr->offset = 0;
+	hdr->length = htons(nb->meta.length);
+	free(fq);
 
+	nb->csum = csum;
+	netbuf_set_flag(nb, NBUF_CSUM_COMPLETE);
+	netbuf_set_flag(nb, NBUF_NOCSUM);
 	return nb;
 }
 
-static int ipfrag_try_add_packet(struct fragment_bucket *fb, struct netbuf *nb)
+void ipfrag4_add_packet(struct netbuf *nb)
 {
-	struct netbuf *enb, *pnb;
-	struct list_head *entry;
-	uint16_t start, end;
-	uint16_t start_e, end_e;
-	uint16_t length;
-	struct ipv4_header *hdr, *ehdr;
-	int size;
+	struct ipv4_header *hdr;
+	struct fragment_queue *fq;
+	struct netbuf *frag;
+	struct list_head *bucket, *pos;
+	uint32_t end;
+	size_t size;
+	bool last;
 
 	hdr = nb->network.data;
-	
-	start = ipv4_get_offset(hdr);
-	length = hdr->length - sizeof(*hdr);
-	end = start + length;
+	end = ipfrag_end(nb);
+	last = !(nb->meta.offset & IP4_MORE_FRAGMENTS);
 
-	if(!fb->last_recv)
-		fb->last_recv = ipfrag_is_last(nb);
+	/* All fragments, except for the last one, carry a multiple of 8 bytes */
+	if(!nb->transport.size || end > FRAG_MAX_LENGTH || (!last && (end & 7))) {
+		netbuf_set_flag(nb, NBUF_DROPPED);
+		return;
+	}
 
-	list_for_each(entry, &fb->lh) {
-		enb = list_entry(entry, struct netbuf, entry);
-		if(!ipfrag_is_in_seq(nb, enb))
-			return 0;
-		
-		
-		ehdr = enb->network.data;
-		start_e = ipv4_get_offset(ehdr);
-		length = ehdr->length - sizeof(*ehdr);
-		end_e = start_e + length;
-
-		if(start < start_e) {
-			list_add_tail(&nb->entry, entry);
-			break;
-		}
+	size = sizeof(*nb) + nb->meta.length;
+	bucket = ipfrag_bucket(hdr);
 
-		if(start == start_e || start < end_e) {
-			/* we already have the packet or there is overlap,
-			   drop the packet in both scenario's.
-			*/
-			netbuf_set_flag(nb, NBUF_DROPPED);
-			return -1;
-		}
+	estack_mutex_lock(&ip_frag_table.lock, 0);
+	fq = ipfrag_find(bucket, hdr);
 
-		if(list_is_last(entry, &fb->lh)) {
-			list_add_tail(&nb->entry, &fb->lh);
-			break;
-		}
+	pos = NULL;
+
+	if(fq) {
+		if(fq->last_recv && (end > fq->length || (last && end != fq->length)))
+			goto drop;
+
+		if(last && !list_empty(&fq->fragments) &&
+			ipfrag_end(list_entry(fq->fragments.prev, struct netbuf, entry)) > end)
+			goto drop;
+
+		pos = ipfrag_position(fq, nb);
+		if(!pos)
+			goto drop;
 	}
 
-	/* validate the buffer chain */
-	if(!fb->last_recv)
-		return 1;
+	if(!ipfrag_reserve(size, fq))
+		goto drop;
 
-	pnb = NULL;
-	size = 0;
-	list_for_each(entry, &fb->lh) {
-		enb = list_entry(entry, struct netbuf, entry);
-		ehdr = enb->network.data;
-		start_e = ipv4_get_offset(ehdr);
-		length = ehdr->length - sizeof(*ehdr);
-		end_e = start_e + length;		
-		size += length;
-
-		if(!pnb) {
-			if(start_e)
-				return 1;
-
-			start = start_e;
-			end = end_e;
-			pnb = enb;
-			continue;
-		}
+	if(!fq) {
+		fq = ipfrag_create(bucket, hdr);
+		if(!fq)
+			goto drop;
+
+		pos = &fq->fragments;
+	}
+
+	frag = ipfrag_adopt(nb);
+	if(!frag) {
+		if(list_empty(&fq->fragments))
+			ipfrag_destroy_queue(fq);
+		goto drop;
+	}
+
+	list_add(&frag->entry, pos);
+	netbuf_set_flag(nb, NBUF_ARRIVED);
 
-		if(end != start_e)
-			return 1;
-		
-		start = start_e;
-		end = end_e;
-		pnb = enb;
+	fq->mem += size;
+	fq->received += frag->transport.size;
+	ip_frag_table.mem += size;
+
+	if(last) {
+		fq->last_recv = true;
+		fq->length = end;
+	}
+
+	if(!fq->last_recv || fq->received != fq->length) {
+		estack_mutex_unlock(&ip_frag_table.lock);
+		return;
 	}
 
-	fb->size = size;
-	return 2;
+	ipfrag_unlink(fq);
+	estack_mutex_unlock(&ip_frag_table.lock);
+
+	nb = ipfrag_defragment(fq);
+	ipv4_input_postfrag(nb);
+
+	if(!netbuf_test_and_clear_flag(nb, NBUF_REUSE))
+		netbuf_free(nb);
+	return;
+
+drop:
+	estack_mutex_unlock(&ip_frag_table.lock);
+	netbuf_set_flag(nb, NBUF_DROPPED);
 }
 
-static bool ipfrag4_bucket_tmo(struct fragment_bucket *fb)
+/**
+ * @brief Drop incomplete datagrams that have timed out.
+ *
+ * This function is called periodically by the fragmentation timer.
+ */
+void ipfrag4_tmo(void)
 {
-	struct netbuf *nb;
+	struct fragment_queue *fq;
 	time_t now;
-	struct list_head *lh, *tmp;
 
 	now = estack_utime();
-	if(now < fb->tstamp)
-		return false;
+	estack_mutex_lock(&ip_frag_table.lock, 0);
 
-	list_for_each_safe(lh, tmp, &fb->lh) {
-		nb = list_entry(lh, struct netbuf, entry);
-		list_del(lh);
-		netbuf_free(nb);
+	while(!list_empty(&ip_frag_table.lru)) {
+		fq = list_first_entry(&ip_frag_table.lru, struct fragment_queue, lru);
+		if(fq->expiry > now)
+			break;
+
+		ipfrag_destroy_queue(fq);
 	}
 
-	return true;
+	estack_mutex_unlock(&ip_frag_table.lock);
 }
 
-void ipfrag4_add_packet(struct netbuf *nb)
+static void ipfrag4_timer(estack_timer_t *timer, void *arg)
 {
-	struct list_head *lh, *tmp;
-	struct fragment_bucket *fb;
-	int rc;
-	struct netbuf *copy, *old;
-
-	copy = netbuf_clone(nb, (1 << NBAF_NETWORK) | (1 << NBAF_TRANSPORT));
-	old = nb;
-	nb = copy;
-
-	list_for_each_safe(lh, tmp, &ip_frag_backlog) {
-		fb = list_entry(lh, struct fragment_bucket, entry);
-		rc = ipfrag_try_add_packet(fb, nb);
-
-		switch(rc) {
-		case -1:
-			netbuf_set_flag(old, NBUF_DROPPED);
-			fb->tstamp = estack_utime();
-			return;
-
-		case 1:
-			netbuf_set_flag(old, NBUF_ARRIVED);
-			fb->tstamp = estack_utime();
-			return;
-
-		case 2:
-			netbuf_set_flag(old, NBUF_ARRIVED);
-			nb = ipfrag_defragment(fb);
-			ipv4_input_postfrag(nb);
-
-			if(!netbuf_test_and_clear_flag(nb, NBUF_REUSE))
-				netbuf_free(nb);
-			return;
-
-		default:
-			if(ipfrag4_bucket_tmo(fb)) {
-				list_del(lh);
-				free(fb);
-			}
-			continue;
-		}
-	}
+	UNUSED(timer);
+	UNUSED(arg);
 
-	fb = z_alloc(sizeof(*fb));
-	fb->tstamp = estack_utime();
-	list_head_init(&fb->lh);
-	list_head_init(&fb->entry);
-	list_add(&nb->entry, &fb->lh);
-	list_add(&fb->entry, &ip_frag_backlog);
-	netbuf_set_flag(old, NBUF_ARRIVED);
+	ipfrag4_tmo();
 }
 
-void ipfrag4_tmo(void)
+void ipfrag4_init(void)
 {
-	struct list_head *lh, *tmp;
-	struct fragment_bucket *fb;
+	for(int idx = 0; idx < CONFIG_IPFRAG_BUCKETS; idx++)
+		list_head_init(&ip_frag_table.buckets[idx]);
 
-	list_for_each_safe(lh, tmp, &ip_frag_backlog) {
-		fb = list_entry(lh, struct fragment_bucket, entry);
-		if(ipfrag4_bucket_tmo(fb)) {
-			list_del(lh);
-			free(fb);
-		}
+	list_head_init(&ip_frag_table.lru);
+	ip_frag_table.mem = 0;
+	estack_mutex_create(&ip_frag_table.lock, 0);
+
+	estack_timer_create(&ip_frag_table.timer, "ipfrag", FRAG_TMO_INTERVAL, 0, NULL, ipfrag4_timer);
+	estack_timer_start(&ip_frag_table.timer);
+}
+
+void ipfrag4_destroy(void)
+{
+	struct fragment_queue *fq;
+
+	estack_timer_stop(&ip_frag_table.timer);
+	estack_mutex_lock(&ip_frag_table.lock, 0);
+
+	while(!list_empty(&ip_frag_table.lru)) {
+		fq = list_first_entry(&ip_frag_table.lru, struct fragment_queue, lru);
+		ipfrag_destroy_queue(fq);
 	}
+
+	estack_mutex_unlock(&ip_frag_table.lock);
+	estack_mutex_destroy(&ip_frag_table.lock);
 }
 
-#define IP_MORE_FRAGS 0x2000
 
+/*
+ * Let \p frag refer to bytes [\p offset, \p offset + \p size) of the payload of
+ * \p nb. The payload consists of the transport and application layers.
+ */
+static void ipfrag_slice(struct netbuf *frag, struct netbuf *nb, size_t offset, size_t size)
+{
+	size_t tsize, end;
+
+	tsize = nb->transport.size;
+	end = offset + size;
+
+	if(offset < tsize) {
+		frag->transport.data = (uint8_t*)nb->transport.data + offset;
+		frag->transport.size = (end < tsize ? end : tsize) - offset;
+		offset = tsize;
+	}
+
+	if(end > tsize) {
+		frag->application.data = (uint8_t*)nb->application.data + offset - tsize;
+		frag->application.size = end - offset;
+	}
+}
+
+/**
+ * @brief Fragment an IPv4 datagram.
+ * @param nb Datagram to fragment.
+ * @param dst Destination address.
+ *
+ * Fragments only carry their own IP header. The payload is shared with \p nb,
+ * which is kept alive until the last fragment has been transmitted.
+ */
 void ipfrag4_fragment(struct netbuf *nb, uint32_t dst)
 {
 	struct ipv4_header *hdr;
-	int num;
-	uint16_t length, size, ofs, flags;
 	struct netbuf *frag;
-	uint16_t id;
+	size_t length, datasize, size, offset;
+	uint16_t ofs, id;
 	struct netif *nif;
-	size_t datasize;
-	size_t cpyoffset;
 
-	length = nb->dev->mtu - sizeof(*hdr);
+	/* All fragments, except for the last one, carry a multiple of 8 bytes */
+	length = (ipv4_pmtu_lookup(nb->dev, dst) - sizeof(*hdr)) & ~7U;
 	datasize = nb->transport.size + nb->application.size;
-	num  = (datasize / length) + !!(datasize % length);
 	nif = &nb->dev->nif;
 	id = htons(netif_get_id(nif));
-	cpyoffset = 0;
 
-	for(int idx = 0, offset = 0; idx < num; idx++) {
-		if(idx + 1 < num) {
+	for(offset = 0; offset < datasize; offset += size) {
+		size = datasize - offset;
+		ofs = (uint16_t)(offset / 8);
+
+		if(size > length) {
 			size = length;
-			flags = IP_MORE_FRAGS;
-		} else {
-			size = datasize % length;
-			flags = 0;
+			ofs |= IP4_MORE_FRAGMENTS;
 		}
 
-		if(!idx) {
-			frag = netbuf_alloc(NBAF_TRANSPORT, size);
-			netbuf_cpy_data(frag, (uint8_t*)nb->transport.data, nb->transport.size, NBAF_TRANSPORT);
-			netbuf_cpy_data_offset(frag, nb->transport.size, nb->application.data,
-									size - nb->transport.size, NBAF_TRANSPORT);
-			cpyoffset += size - nb->transport.size;
-		} else {
-			frag = netbuf_alloc(NBAF_TRANSPORT, size);
-			netbuf_cpy_data(frag, (uint8_t*)nb->application.data + cpyoffset, size, NBAF_TRANSPORT);
-			cpyoffset += size;
-		}
-		
-		netbuf_realloc(frag, NBAF_NETWORK, sizeof(*hdr));
+		frag = netbuf_alloc(NBAF_NETWORK, sizeof(*hdr));
+		frag->parent = netbuf_get(nb);
+		ipfrag_slice(frag, nb, offset, size);
+
 		frag->protocol = nb->protocol;
-		frag->flags = nb->flags;
 		frag->dev = nb->dev;
+		frag->hash = nb->hash;
 		hdr = frag->network.data;
 
 		hdr->id = id;
-		/* Set flag and offset bits */
-		ofs = (uint16_t)offset / 8;
-		ofs |= flags;
-		ofs = htons(ofs);
-		hdr->offset = ofs;
+		hdr->offset = htons(ofs);
 		hdr->saddr = 0;
 		__ipv4_output(frag, dst);
-		offset += size;
 	}
 
 	netbuf_free(nb);
@@ -11,12 +11,200 @@
 #include <string.h>
 
 #include <estack/estack.h>
+#include <estack/error.h>
 #include <estack/log.h>
 #include <estack/netbuf.h>
 #include <estack/netdev.h>
 #include <estack/icmp.h>
 #include <estack/ip.h>
 #include <estack/inet.h>
+#include <estack/tcp.h>
+#include <estack/route.h>
+#include <estack/ethernet.h>
+
+#define ICMP_REPLY_TTL 0xFF
+
+struct icmp_bucket {
+	int rate; //!< Tokens added per second, zero if the bucket is unlimited.
+	int burst; //!< Maximum number of tokens.
+	int tokens; //!< Number of messages that may be sent.
+	time_t stamp; //!< Last time \p tokens was refilled.
+};
+
+struct icmp_dest_bucket {
+	uint32_t addr;
+	struct icmp_bucket bucket;
+};
+
+static struct icmp_ratelimiter {
+	estack_mutex_t lock;
+	struct icmp_bucket global;
+	struct icmp_bucket types[ICMP_TYPE_MAX + 1];
+	struct icmp_dest_bucket dests[CONFIG_ICMP_DEST_HASH_SIZE];
+	uint32_t suppressed[ICMP_TYPE_MAX + 1];
+} icmp_limiter;
+
+static void icmp_bucket_init(struct icmp_bucket *bucket, int rate, int burst, time_t now)
+{
+	bucket->rate = rate;
+	bucket->burst = burst;
+	bucket->tokens = burst;
+	bucket->stamp = now;
+}
+
+/*
+ * Refill a token bucket and check if it holds a token. Unlimited buckets
+ * always have a token available.
+ */
+static bool icmp_bucket_refill(struct icmp_bucket *bucket, time_t now)
+{
+	time_t interval, tokens;
+
+	if(!bucket->rate)
+		return true;
+
+	interval = 1000000 / bucket->rate;
+	tokens = (now - bucket->stamp) / interval;
+
+	if(tokens) {
+		bucket->stamp += tokens * interval;
+		tokens += bucket->tokens;
+		if(tokens >= bucket->burst) {
+			bucket->tokens = bucket->burst;
+			bucket->stamp = now;
+		} else {
+			bucket->tokens = (int)tokens;
+		}
+	}
+
+	return bucket->tokens > 0;
+}
+
+static inline void icmp_bucket_take(struct icmp_bucket *bucket)
+{
+	if(bucket->rate)
+		bucket->tokens--;
+}
+
+/*
+ * Destinations share a direct mapped table. A destination that takes over a
+ * slot starts with a full bucket, the global limit still applies to it.
+ */
+static struct icmp_bucket *icmp_dest_bucket(uint32_t dst, time_t now)
+{
+	struct icmp_dest_bucket *db;
+
+	db = &icmp_limiter.dests[ipv4_flow_hash(0, dst, 0, 0, 0) % CONFIG_ICMP_DEST_HASH_SIZE];
+	if(db->addr != dst) {
+		db->addr = dst;
+		icmp_bucket_init(&db->bucket, CONFIG_ICMP_DEST_RATE, CONFIG_ICMP_DEST_BURST, now);
+	}
+
+	return &db->bucket;
+}
+
+/**
+ * @brief Check if an ICMP message may be sent.
+ * @param type Message type.
+ * @param dst Destination address of the message.
+ * @return True if the message may be sent, false if it should be suppressed.
+ *
+ * Every message type has its own token bucket, which is unlimited unless it
+ * is configured using \p icmp_ratelimit_set. Message types in
+ * \p CONFIG_ICMP_RATEMASK are also limited per destination and globally. A
+ * token is only taken when all applicable buckets have one available.
+ */
+bool icmp_ratelimit(uint8_t type, uint32_t dst)
+{
+	struct icmp_bucket *typeb, *dstb;
+	time_t now;
+	bool masked, allow;
+
+	if(type > ICMP_TYPE_MAX)
+		return true;
+
+	masked = (CONFIG_ICMP_RATEMASK & (1UL << type)) != 0;
+	now = estack_utime();
+	estack_mutex_lock(&icmp_limiter.lock, 0);
+
+	typeb = &icmp_limiter.types[type];
+	allow = icmp_bucket_refill(typeb, now);
+	dstb = NULL;
+
+	if(allow && masked) {
+		dstb = icmp_dest_bucket(dst, now);
+		allow = icmp_bucket_refill(&icmp_limiter.global, now) && icmp_bucket_refill(dstb, now);
+	}
+
+	if(allow) {
+		icmp_bucket_take(typeb);
+		if(masked) {
+			icmp_bucket_take(&icmp_limiter.global);
+			icmp_bucket_take(dstb);
+		}
+	} else {
+		icmp_limiter.suppressed[type]++;
+	}
+
+	estack_mutex_unlock(&icmp_limiter.lock);
+	return allow;
+}
+
+/**
+ * @brief Configure the rate limit of an ICMP message type.
+ * @param type Message type.
+ * @param rate Number of messages that may be sent per second, zero to remove
+ *             the limit.
+ * @param burst Maximum number of messages that may be sent in a burst.
+ * @return An error code.
+ */
+int icmp_ratelimit_set(uint8_t type, int rate, int burst)
+{
+	if(type > ICMP_TYPE_MAX || rate < 0 || rate > 1000000 || (rate && burst <= 0))
+		return -EINVALID;
+
+	estack_mutex_lock(&icmp_limiter.lock, 0);
+	icmp_bucket_init(&icmp_limiter.types[type], rate, burst, estack_utime());
+	estack_mutex_unlock(&icmp_limiter.lock);
+
+	return -EOK;
+}
+
+/**
+ * @brief Get the number of suppressed ICMP messages.
+ * @param type Message type.
+ * @return The number of messages of \p type that weren't sent due to rate limiting.
+ */
+uint32_t icmp_get_suppressed(uint8_t type)
+{
+	uint32_t num;
+
+	if(type > ICMP_TYPE_MAX)
+		return 0;
+
+	estack_mutex_lock(&icmp_limiter.lock, 0);
+	num = icmp_limiter.suppressed[type];
+	estack_mutex_unlock(&icmp_limiter.lock);
+
+	return num;
+}
+
+void icmp_init(void)
+{
+	time_t now;
+
+	now = estack_utime();
+	memset(&icmp_limiter.types, 0, sizeof(icmp_limiter.types));
+	memset(&icmp_limiter.dests, 0, sizeof(icmp_limiter.dests));
+	memset(&icmp_limiter.suppressed, 0, sizeof(icmp_limiter.suppressed));
+	icmp_bucket_init(&icmp_limiter.global, CONFIG_ICMP_RATE, CONFIG_ICMP_BURST, now);
+	estack_mutex_create(&icmp_limiter.lock, 0);
+}
+
+void icmp_destroy(void)
+{
+	estack_mutex_destroy(&icmp_limiter.lock);
+}
 
 void icmp_output(uint8_t type, uint32_t dst, struct netbuf *nb)
 {
@@ -34,6 +222,61 @@ void icmp_output(uint8_t type, uint32_t dst, struct netbuf *nb)
 	ipv4_output(nb, dst);
 }
 
+/*
+ * Turn a received echo request into a reply without leaving the receive buffer.
+ * Only the addresses, TTL and type change, the checksums are updated
+ * incrementally and the frame is queued for transmission on the device it was
+ * received on. Requests that carry IP options, were reassembled or are not
+ * routed back over the receiving device take the regular output path.
+ */
+static bool icmp_reflect_inplace(struct netbuf *nb, struct icmp_header *icmp, uint8_t type)
+{
+	struct ethernet_header *eth;
+	struct ipv4_header *ip;
+	struct netdev *dev;
+	uint16_t old;
+	uint32_t addr;
+
+	dev = nb->dev;
+	ip = nb->network.data;
+	eth = nb->datalink.data;
+
+	if(!netbuf_test_flag(nb, NBUF_WAS_RX) || !netbuf_test_flag(nb, NBUF_IS_LINEAR) ||
+		!netbuf_test_flag(nb, NBUF_UNICAST) || netbuf_test_flag(nb, NBUF_LOOPED))
+		return false;
+
+	if(dev->nif.iftype != NIF_TYPE_ETHER || nb->network.size != sizeof(*ip) ||
+		nb->datalink.size != sizeof(*eth) || (void*)(eth + 1) != (void*)ip ||
+		(void*)(ip + 1) != (void*)icmp)
+		return false;
+
+	if(route4_lookup(nb->meta.saddr, NULL) != dev)
+		return false;
+
+	/* Swapping the addresses leaves the header checksum as it is */
+	addr = ip->saddr;
+	ip->saddr = ip->daddr;
+	ip->daddr = addr;
+
+	old = htons((uint16_t)((ip->ttl << 8) | ip->protocol));
+	ip->ttl = ICMP_REPLY_TTL;
+	ip->chksum = ip_checksum_replace(ip->chksum, old,
+		htons((uint16_t)((ip->ttl << 8) | ip->protocol)));
+
+	old = htons((uint16_t)((icmp->type << 8) | icmp->code));
+	icmp->type = type;
+	icmp->csum = ip_checksum_replace(icmp->csum, old,
+		htons((uint16_t)((icmp->type << 8) | icmp->code)));
+
+	memcpy(eth->dest_mac, eth->src_mac, ETHERNET_MAC_LENGTH);
+	memcpy(eth->src_mac, dev->hwaddr, ETHERNET_MAC_LENGTH);
+
+	netbuf_set_flag(nb, NBUF_REUSE);
+	netdev_add_backlog(dev, nb);
+	netdev_wakeup();
+	return true;
+}
+
 static void icmp_reflect(struct netbuf *nb, uint8_t type)
 {
 	struct ipv4_header *iphdr;
@@ -42,7 +285,7 @@ static void icmp_reflect(struct netbuf *nb, uint8_t type)
 
 	nif = &nb->dev->nif;
 	iphdr = nb->network.data;
-	dst = iphdr->saddr;
+	dst = ipv4_get_remote_address(nb);
 	iphdr->saddr = htonl(ipv4_ptoi(nif->local_ip));
 
 	print_dbg("\tICMP ECHOREPLY sent\n");
@@ -67,9 +310,15 @@ void icmp_response(struct netbuf *nb, uint8_t type, uint8_t code, uint32_t spec)
 	struct ipv4_header *ip;
 	uint32_t destination;
 
-	ip = nb->network.data;
-	destination = ip->saddr;
-	ip_htons(nb);
+	/* The quoted header is still in network byte order */
+	destination = ipv4_get_remote_address(nb);
+
+	/* Suppressed errors are rejected before any work is done */
+	if(!icmp_ratelimit(type, destination)) {
+		netbuf_clear_flag(nb, NBUF_REUSE);
+		netbuf_set_flag(nb, NBUF_DROPPED);
+		return;
+	}
 
 	nb = netbuf_realloc(nb, NBAF_APPLICTION, sizeof(*ip) + 8);
 	assert(nb);
@@ -79,6 +328,39 @@ void icmp_response(struct netbuf *nb, uint8_t type, uint8_t code, uint32_t spec)
 	icmp_reply(nb, type, code, spec, destination);
 }
 
+/*
+ * Process a fragmentation needed message (RFC 1191). The message quotes the
+ * IP header and the first 8 bytes of the datagram that was too big.
+ */
+static void icmp_needfrag(struct netbuf *nb, struct icmp_header *header)
+{
+	struct ipv4_header *ip;
+	uint16_t mtu, length, *ports;
+	uint8_t hdrlen;
+
+	ip = nb->application.data;
+	if(!ip || nb->application.size < sizeof(*ip))
+		return;
+
+	hdrlen = ipv4_get_hdrlen(ip);
+	length = ipv4_get_length(ip);
+	if(hdrlen < sizeof(*ip) || ipv4_get_saddr(ip) != ipv4_ptoi(nb->dev->nif.local_ip))
+		return;
+
+	/* Routers that predate RFC 1191 don't report the next hop MTU */
+	mtu = (uint16_t)(ntohl(header->spec) & 0xFFFF);
+	if(!mtu)
+		mtu = ipv4_pmtu_plateau(length);
+
+	if(mtu >= length || !ipv4_pmtu_update(ipv4_get_daddr(ip), mtu))
+		return;
+
+	if(ip->protocol == IP_PROTO_TCP && nb->application.size >= hdrlen + 2 * sizeof(*ports)) {
+		ports = (uint16_t*)((uint8_t*)ip + hdrlen);
+		tcp_pmtu_update(ip->saddr, ports[0], ip->daddr, ports[1], mtu);
+	}
+}
+
 void icmp_input(struct netbuf *nb)
 {
 	struct icmp_header *header;
@@ -90,17 +372,25 @@ void icmp_input(struct netbuf *nb)
 		return;
 	}
 
-	nb->application.size = nb->transport.size - sizeof(*header);
-	if(nb->application.size) {
-		nb->application.data = header + 1;
-		nb->transport.size = sizeof(*header);
+	if(!netbuf_test_flag(nb, NBUF_LOOPED)) {
+		nb->application.size = nb->transport.size - sizeof(*header);
+		if(nb->application.size) {
+			nb->application.data = header + 1;
+			nb->transport.size = sizeof(*header);
+		}
 	}
 
 	switch(header->type) {
 	case ICMP_ECHO:
 		print_dbg("\tICMP ECHOREQUEST received!\n");
-		netbuf_set_flag(nb, NBUF_REUSE);
 		netbuf_set_flag(nb, NBUF_ARRIVED);
+		if(!icmp_ratelimit(ICMP_REPLY, ipv4_get_remote_address(nb)))
+			break;
+
+		if(icmp_reflect_inplace(nb, header, ICMP_REPLY))
+			break;
+
+		netbuf_set_flag(nb, NBUF_REUSE);
 		icmp_reflect(nb, ICMP_REPLY);
 		break;
 
@@ -109,6 +399,13 @@ void icmp_input(struct netbuf *nb)
 		print_dbg("\tICMP REPLY received!\n");
 		break;
 
+	case ICMP_UNREACH:
+		if(header->code == ICMP_UNREACH_NEEDFRAG)
+			icmp_needfrag(nb, header);
+
+		netbuf_set_flag(nb, NBUF_ARRIVED);
+		break;
+
 	default:
 		netbuf_set_flag(nb, NBUF_DROPPED);
 		break;
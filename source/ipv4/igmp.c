@@ -0,0 +1,418 @@
+/*
+ * E/STACK - IGMP
+ *
+ * Author: Michel Megens
+ * Date: 24/02/2018
+ * Email: dev@bietje.net
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <estack/estack.h>
+#include <estack/error.h>
+#include <estack/log.h>
+#include <estack/netbuf.h>
+#include <estack/netdev.h>
+#include <estack/inet.h>
+#include <estack/ip.h>
+#include <estack/igmp.h>
+
+#define IGMP_WALK_MAX 1024
+
+/*
+ * Membership lookups don't take the lock. Writers hold the lock and make the
+ * sequence counter odd while they modify a group list or hash filter, lookups
+ * retry when the counter changed. This also keeps 64 bit filter reads from
+ * tearing. Groups that are left are kept on a free list until IGMP is
+ * destroyed, so a lookup racing with a writer never touches freed memory. The
+ * free list is linked through entry.next and ends in NULL, which also ends a
+ * lookup that followed a group onto it.
+ */
+static struct igmp_state {
+	estack_mutex_t lock;
+	volatile uint32_t seq;
+	struct igmp_group *free_groups;
+} igmp;
+
+static inline uint64_t igmp_filter_bit(uint32_t group)
+{
+	return 1ULL << (ipv4_flow_hash(0, group, 0, 0, 0) & 0x3F);
+}
+
+static inline void igmp_lock(void)
+{
+	estack_mutex_lock(&igmp.lock, 0);
+}
+
+static inline void igmp_unlock(void)
+{
+	estack_mutex_unlock(&igmp.lock);
+}
+
+static inline void igmp_write_begin(void)
+{
+	igmp.seq++;
+	smp_wmb();
+}
+
+static inline void igmp_write_end(void)
+{
+	smp_wmb();
+	igmp.seq++;
+}
+
+static inline uint32_t igmp_read_begin(void)
+{
+	uint32_t seq;
+
+	while((seq = igmp.seq) & 1)
+		barrier();
+
+	smp_rmb();
+	return seq;
+}
+
+static inline bool igmp_read_retry(uint32_t seq)
+{
+	smp_rmb();
+	return igmp.seq != seq;
+}
+
+/*
+ * Take a group from the free list, or allocate a new one.
+ * The IGMP lock must be held by the caller.
+ */
+static struct igmp_group *igmp_alloc_group(void)
+{
+	struct igmp_group *g;
+
+	g = igmp.free_groups;
+	if(!g)
+		return z_alloc(sizeof(*g));
+
+	igmp.free_groups = g->entry.next ? list_entry(g->entry.next, struct igmp_group, entry) : NULL;
+	return g;
+}
+
+/*
+ * Put a group that was removed from its list on the free list.
+ * The IGMP lock must be held by the caller.
+ */
+static void igmp_release_group(struct igmp_group *g)
+{
+	g->entry.prev = NULL;
+	g->entry.next = igmp.free_groups ? &igmp.free_groups->entry : NULL;
+	igmp.free_groups = g;
+}
+
+static struct igmp_group *igmp_find_group(struct netif *nif, uint32_t group)
+{
+	struct list_head *entry;
+	struct igmp_group *g;
+
+	list_for_each(entry, &nif->mcast_groups) {
+		g = list_entry(entry, struct igmp_group, entry);
+		if(g->addr == group)
+			return g;
+	}
+
+	return NULL;
+}
+
+static void igmp_output(struct netdev *dev, uint8_t type, uint32_t group, uint32_t dst)
+{
+	struct netbuf *nb;
+	struct igmp_header *hdr;
+
+	nb = netbuf_alloc(NBAF_TRANSPORT, sizeof(*hdr));
+	if(!nb)
+		return;
+
+	hdr = nb->transport.data;
+	hdr->type = type;
+	hdr->max_resp = 0;
+	hdr->csum = 0;
+	hdr->group = htonl(group);
+	hdr->csum = ip_checksum(0, hdr, sizeof(*hdr));
+
+	nb->protocol = IP_PROTO_IGMP;
+	netbuf_set_dev(nb, dev);
+	ipv4_output(nb, dst);
+}
+
+/**
+ * @brief Join a multicast group.
+ * @param dev Interface to join \p group on.
+ * @param group Group address.
+ * @return An error code.
+ *
+ * Memberships are counted, a report is only sent when the interface joins
+ * \p group for the first time.
+ */
+int igmp_join(struct netdev *dev, uint32_t group)
+{
+	struct netif *nif;
+	struct igmp_group *g;
+
+	assert(dev);
+
+	if(!IS_MULTICAST(group) || group == IGMP_ALL_HOSTS)
+		return -EINVALID;
+
+	nif = &dev->nif;
+	igmp_lock();
+
+	g = igmp_find_group(nif, group);
+	if(g) {
+		g->users++;
+		igmp_unlock();
+		return -EOK;
+	}
+
+	g = igmp_alloc_group();
+	if(!g) {
+		igmp_unlock();
+		return -ENOMEMORY;
+	}
+
+	g->addr = group;
+	g->users = 1;
+
+	igmp_write_begin();
+	list_add(&g->entry, &nif->mcast_groups);
+	nif->mcast_filter |= igmp_filter_bit(group);
+	igmp_write_end();
+	igmp_unlock();
+
+	igmp_output(dev, IGMP_V2_REPORT, group, group);
+	return -EOK;
+}
+
+/*
+ * Rebuild the hash filter of an interface.
+ * The caller must hold the lock and have opened a write section.
+ */
+static void igmp_update_filter(struct netif *nif)
+{
+	struct list_head *entry;
+	struct igmp_group *g;
+	uint64_t filter;
+
+	filter = 0ULL;
+	list_for_each(entry, &nif->mcast_groups) {
+		g = list_entry(entry, struct igmp_group, entry);
+		filter |= igmp_filter_bit(g->addr);
+	}
+
+	nif->mcast_filter = filter;
+}
+
+/**
+ * @brief Leave a multicast group.
+ * @param dev Interface to leave \p group on.
+ * @param group Group address.
+ * @return An error code.
+ *
+ * The routers are told that the group was left once the last membership of
+ * \p group on \p dev is dropped.
+ */
+int igmp_leave(struct netdev *dev, uint32_t group)
+{
+	struct netif *nif;
+	struct igmp_group *g;
+
+	assert(dev);
+
+	nif = &dev->nif;
+	igmp_lock();
+
+	g = igmp_find_group(nif, group);
+	if(!g) {
+		igmp_unlock();
+		return -EINVALID;
+	}
+
+	if(--g->users > 0) {
+		igmp_unlock();
+		return -EOK;
+	}
+
+	igmp_write_begin();
+	list_del(&g->entry);
+	igmp_update_filter(nif);
+	igmp_write_end();
+
+	igmp_release_group(g);
+	igmp_unlock();
+
+	igmp_output(dev, IGMP_LEAVE, group, IGMP_ALL_ROUTERS);
+	return -EOK;
+}
+
+/**
+ * @brief Check if an interface is a member of a multicast group.
+ * @param dev Interface to check.
+ * @param group Group address.
+ * @return True if datagrams sent to \p group should be accepted on \p dev.
+ *
+ * Most datagrams for groups that aren't joined are rejected on the hash filter
+ * of the interface. The lookup never takes the lock. The walk is bounded,
+ * since a racing writer may move groups to another list; the sequence check
+ * catches that.
+ */
+bool igmp_is_member(struct netdev *dev, uint32_t group)
+{
+	struct list_head *head, *entry;
+	struct igmp_group *g;
+	struct netif *nif;
+	uint64_t bit;
+	uint32_t seq;
+	bool member;
+	int steps;
+
+	if(group == IGMP_ALL_HOSTS)
+		return true;
+
+	nif = &dev->nif;
+	head = &nif->mcast_groups;
+	bit = igmp_filter_bit(group);
+
+	do {
+		seq = igmp_read_begin();
+		member = false;
+
+		if(likely(!(nif->mcast_filter & bit)))
+			continue;
+
+		entry = head->next;
+		for(steps = 0; entry && entry != head && steps < IGMP_WALK_MAX; steps++) {
+			g = list_entry(entry, struct igmp_group, entry);
+			if(g->addr == group) {
+				member = true;
+				break;
+			}
+
+			entry = entry->next;
+		}
+	} while(igmp_read_retry(seq));
+
+	return member;
+}
+
+/**
+ * @brief Drop all multicast group memberships of an interface.
+ * @param dev Interface to flush.
+ */
+void igmp_flush(struct netdev *dev)
+{
+	struct list_head *entry, *tmp;
+	struct igmp_group *g;
+	struct netif *nif;
+
+	nif = &dev->nif;
+	igmp_lock();
+	igmp_write_begin();
+
+	list_for_each_safe(entry, tmp, &nif->mcast_groups) {
+		g = list_entry(entry, struct igmp_group, entry);
+		list_del(entry);
+		igmp_release_group(g);
+	}
+
+	nif->mcast_filter = 0ULL;
+	igmp_write_end();
+	igmp_unlock();
+}
+
+/*
+ * Queries are answered right away, rather than after a random delay of up to
+ * the maximum response time. Reports of other hosts are therefore never used
+ * to suppress our own. The groups to report are collected under the lock,
+ * the reports are sent after releasing it.
+ */
+static void igmp_query(struct netdev *dev, uint32_t group)
+{
+	struct list_head *entry;
+	struct igmp_group *g;
+	struct netif *nif;
+	uint32_t *groups;
+	int num, idx;
+
+	nif = &dev->nif;
+	igmp_lock();
+
+	num = 0;
+	list_for_each(entry, &nif->mcast_groups) {
+		g = list_entry(entry, struct igmp_group, entry);
+		if(!group || g->addr == group)
+			num++;
+	}
+
+	groups = num ? malloc(num * sizeof(*groups)) : NULL;
+	if(!groups) {
+		igmp_unlock();
+		return;
+	}
+
+	idx = 0;
+	list_for_each(entry, &nif->mcast_groups) {
+		g = list_entry(entry, struct igmp_group, entry);
+		if(!group || g->addr == group)
+			groups[idx++] = g->addr;
+	}
+
+	igmp_unlock();
+
+	for(idx = 0; idx < num; idx++)
+		igmp_output(dev, IGMP_V2_REPORT, groups[idx], groups[idx]);
+
+	free(groups);
+}
+
+void igmp_input(struct netbuf *nb)
+{
+	struct igmp_header *hdr;
+
+	hdr = nb->transport.data;
+	if(!hdr || nb->transport.size < sizeof(*hdr) ||
+		ip_checksum(0, hdr, (int)nb->transport.size)) {
+		print_dbg("Dropping IGMP message with bogus length or checksum\n");
+		netbuf_set_flag(nb, NBUF_DROPPED);
+		return;
+	}
+
+	switch(hdr->type) {
+	case IGMP_QUERY:
+		igmp_query(nb->dev, ntohl(hdr->group));
+		break;
+
+	case IGMP_V1_REPORT:
+	case IGMP_V2_REPORT:
+	case IGMP_LEAVE:
+	default:
+		break;
+	}
+
+	netbuf_set_flag(nb, NBUF_ARRIVED);
+}
+
+void igmp_init(void)
+{
+	estack_mutex_create(&igmp.lock, 0);
+	igmp.seq = 0;
+	igmp.free_groups = NULL;
+}
+
+void igmp_destroy(void)
+{
+	struct igmp_group *g;
+
+	while((g = igmp.free_groups) != NULL) {
+		igmp.free_groups = g->entry.next ? list_entry(g->entry.next, struct igmp_group, entry) : NULL;
+		free(g);
+	}
+
+	estack_mutex_destroy(&igmp.lock);
+}
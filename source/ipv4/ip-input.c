@@ -19,10 +19,14 @@
 #include <estack/log.h>
 #include <estack/inet.h>
 #include <estack/icmp.h>
+#include <estack/igmp.h>
 #include <estack/route.h>
 #include <estack/udp.h>
 #include <estack/in.h>
 #include <estack/tcp.h>
+#include <estack/ethernet.h>
+#include <estack/neighbour.h>
+#include <estack/translate.h>
 
 static inline struct ipv4_header *ipv4_nbuf_to_iphdr(struct netbuf *nb)
 {
@@ -32,44 +36,156 @@ static inline struct ipv4_header *ipv4_nbuf_to_iphdr(struct netbuf *nb)
 	return nb->network.data;
 }
 
-static inline int ipv4_is_fragmented(struct ipv4_header *hdr)
+static inline int ipv4_is_fragmented(struct netbuf *nb)
 {
-	uint16_t offset;
-	uint8_t flags;
+	return (nb->meta.offset & (IP4_MORE_FRAGMENTS | IP4_OFFSET_MASK)) != 0;
+}
+
+/*
+ * Hash a datagram on its 5-tuple. Ports are left out for fragments, so
+ * that all fragments of a datagram take the same path.
+ */
+static uint32_t ipv4_forward_hash(struct netbuf *nb, struct ipv4_header *hdr)
+{
+	uint8_t *l4;
+	uint16_t sport, dport;
+
+	sport = dport = 0;
+	if(!ipv4_is_fragmented(nb) && nb->transport.size >= 2 * sizeof(uint16_t) &&
+		(hdr->protocol == IP_PROTO_TCP || hdr->protocol == IP_PROTO_UDP)) {
+		l4 = nb->transport.data;
+		sport = (uint16_t)((l4[0] << 8) | l4[1]);
+		dport = (uint16_t)((l4[2] << 8) | l4[3]);
+	}
 
-	flags = ipv4_get_flags(hdr);
-	offset = ipv4_get_offset(hdr);
+	return ipv4_flow_hash(nb->meta.saddr, nb->meta.daddr, hdr->protocol, sport, dport);
+}
+
+/*
+ * ICMP errors are not sent for non-initial fragments, link layer broadcasts
+ * and ICMP messages other than echo requests and replies (RFC 1812, 4.3.2.7).
+ */
+static bool ipv4_may_send_error(struct netbuf *nb, struct ipv4_header *hdr)
+{
+	struct icmp_header *icmp;
+
+	if((nb->meta.offset & IP4_OFFSET_MASK) || !netbuf_test_flag(nb, NBUF_UNICAST))
+		return false;
+
+	if(hdr->protocol != IP_PROTO_ICMP)
+		return true;
+
+	icmp = nb->transport.data;
+	return icmp && nb->transport.size >= sizeof(*icmp) &&
+		(icmp->type == ICMP_ECHO || icmp->type == ICMP_REPLY);
+}
+
+static void ipv4_forward_error(struct netbuf *nb, struct ipv4_header *hdr,
+	uint8_t type, uint8_t code, uint32_t spec)
+{
+	if(!ipv4_may_send_error(nb, hdr)) {
+		netbuf_set_flag(nb, NBUF_DROPPED);
+		return;
+	}
 
-	return (flags & (1UL << IP4_MORE_FRAGMENTS_FLAG)) != 0 || offset;
+	netbuf_set_flag(nb, NBUF_REUSE);
+	icmp_response(nb, type, code, spec);
 }
 
+/*
+ * Forward a datagram that isn't addressed to us. Only the TTL and header
+ * checksum change, after which the datagram is passed to the neighbour
+ * layer directly.
+ */
 static bool ipv4_forward(struct netbuf *nb, struct ipv4_header *hdr)
 {
 	struct netdev *dev;
+	uint32_t gw, nexthop;
+	uint16_t old, mtu;
 
-	dev = route4_lookup(hdr->daddr, 0);
-	if(nb->dev == dev)
+	nb->hash = ipv4_forward_hash(nb, hdr);
+	dev = route4_lookup_cached(&nb->dev->nif.route_cache, nb->meta.daddr, nb->hash, &gw);
+	if(!dev || nb->dev == dev)
 		return false;
 
-	netbuf_set_dev(nb, dev);
+	if(unlikely(hdr->ttl <= 1)) {
+		ipv4_forward_error(nb, hdr, ICMP_TIME_EXCEEDED, ICMP_TIMXCEED_INTRANS, 0);
+		return true;
+	}
+
+	mtu = dev->mtu;
+	if(unlikely(nb->meta.length > mtu)) {
+		/* Forwarded datagrams are not fragmented */
+		if(nb->meta.offset & IP4_DONT_FRAGMENT)
+			ipv4_forward_error(nb, hdr, ICMP_UNREACH, ICMP_UNREACH_NEEDFRAG, htonl(mtu));
+		else
+			netbuf_set_flag(nb, NBUF_DROPPED);
+
+		return true;
+	}
+
+	if(unlikely(dev->nif.iftype != NIF_TYPE_ETHER)) {
+		netbuf_set_flag(nb, NBUF_DROPPED);
+		return true;
+	}
+
+	nexthop = gw ? gw : nb->meta.daddr;
+	old = htons((uint16_t)((hdr->ttl << 8) | hdr->protocol));
+	hdr->ttl--;
+	hdr->chksum = ip_checksum_replace(hdr->chksum, old,
+		htons((uint16_t)((hdr->ttl << 8) | hdr->protocol)));
+
 	netbuf_set_flag(nb, NBUF_REUSE);
 	netbuf_set_flag(nb, NBUF_ARRIVED);
-	hdr->offset = htons(hdr->offset);
-	hdr->saddr = htonl(hdr->saddr);
-	__ipv4_output(nb, hdr->daddr);
+	nb->protocol = ETH_TYPE_IP;
+	neighbour_output(dev, nb, &nexthop, IPV4_ADDR_SIZE, translate_ipv4_to_mac);
 	return true;
 }
 
+/*
+ * Turn the sum of the network layer into the sum of the transport layer, by
+ * taking out the header and any padding added by the link layer.
+ */
+static void ipv4_csum_pull(struct netbuf *nb, struct ipv4_header *hdr, uint8_t hdrlen, size_t size)
+{
+	uint16_t csum, pad;
+
+	if(!netbuf_test_flag(nb, NBUF_CSUM_COMPLETE))
+		return;
+
+	if(unlikely(nb->meta.length > size)) {
+		netbuf_clear_flag(nb, NBUF_CSUM_COMPLETE);
+		return;
+	}
+
+	csum = ip_checksum_sub(nb->csum, ip_checksum_partial(0, hdr, hdrlen));
+
+	if(size > nb->meta.length) {
+		pad = ip_checksum_partial(0, (uint8_t*)hdr + nb->meta.length,
+			(int)(size - nb->meta.length));
+
+		/* Padding at an odd offset is summed with its bytes swapped */
+		if(nb->meta.length & 1)
+			pad = (uint16_t)((pad << 8) | (pad >> 8));
+
+		csum = ip_checksum_sub(csum, pad);
+	}
+
+	nb->csum = csum;
+}
+
 void ipv4_input(struct netbuf *nb)
 {
 	struct ipv4_header *hdr;
 	uint8_t hdrlen, version;
 	struct netif *nif;
 	uint32_t localmask;
-	uint32_t localip;
+	uint32_t localip, daddr;
 	uint16_t csum;
+	size_t size;
 
 	hdr = ipv4_nbuf_to_iphdr(nb);
+	size = nb->network.size;
 #ifdef HAVE_BIG_ENDIAN
 	hdrlen = (hdr->ihl_version >> 4) & 0xF;
 	version = hdr->version & 0xF;
@@ -84,8 +200,19 @@ void ipv4_input(struct netbuf *nb)
 		return;
 	}
 
+	hdrlen = hdrlen * sizeof(uint32_t);
+
+	if(hdrlen < sizeof(*hdr) || hdrlen > size) {
+		print_dbg("Dropping IPv4 packet with bogus header length (%u)!\n", hdrlen);
+		print_dbg("\tHeader size: %u\n", hdrlen);
+		print_dbg("\tsizeof(ipv4_header): %u :: Buffer size: %u\n", sizeof(*hdr), size);
+		netbuf_set_flag(nb, NBUF_DROPPED);
+		return;
+	}
+
+	/* The checksum covers the options as well */
 	if(!netbuf_test_and_clear_flag(nb, NBUF_NOCSUM)) {
-		csum = ip_checksum(0, nb->network.data, sizeof(*hdr));
+		csum = ip_checksum(0, nb->network.data, hdrlen);
 		if(csum) {
 			print_dbg("Dropping IPv4 packet with bogus checksum (is %x, should be %x)\n",
 						hdr->chksum, csum);
@@ -94,52 +221,52 @@ void ipv4_input(struct netbuf *nb)
 		}
 	}
 
-	hdrlen = hdrlen * sizeof(uint32_t);
 	nb->network.size = hdrlen;
 
-	if(hdrlen < sizeof(*hdr) || hdrlen > nb->network.size) {
-		print_dbg("Dropping IPv4 packet with bogus header length (%u)!\n", hdrlen);
-		print_dbg("\tHeader size: %u\n", hdrlen);
-		print_dbg("\tsizeof(ipv4_header): %u :: Buffer size: %u\n", sizeof(*hdr), nb->network.size);
-		netbuf_set_flag(nb, NBUF_DROPPED);
-		return;
-	}
-
-	hdr->offset = ntohs(hdr->offset);
-	hdr->length = ntohs(hdr->length);
-
-	hdr->saddr = ntohl(hdr->saddr);
-	hdr->daddr = ntohl(hdr->daddr);
+	/* The header is left in network byte order */
+	nb->meta.offset = ntohs(hdr->offset);
+	nb->meta.length = ipv4_get_length(hdr);
+	nb->meta.saddr = ipv4_get_saddr(hdr);
+	nb->meta.daddr = daddr = ipv4_get_daddr(hdr);
 	nif = &nb->dev->nif;
 
 	localip = ipv4_ptoi(nif->local_ip);
 	localmask = ipv4_ptoi(nif->ip_mask);
 	nb->protocol = hdr->protocol;
 
-	if(unlikely(hdr->daddr == INADDR_BCAST ||
-		(localip && localmask != INADDR_BCAST && (hdr->daddr | localmask) == INADDR_BCAST))) {
+	if(unlikely(daddr == INADDR_BCAST ||
+		(localip && localmask != INADDR_BCAST && (daddr | localmask) == INADDR_BCAST))) {
 		/* Datagram is a broadcast */
 		netbuf_set_flag(nb, NBUF_BCAST);
-	} else if(unlikely(IS_MULTICAST(hdr->daddr))) {
-		/* TODO: implement multicast */
-		print_dbg("Multicast not supported, dropping IP datagram.\n");
+	} else if(unlikely(IS_MULTICAST(daddr))) {
 		netbuf_set_flag(nb, NBUF_MULTICAST);
-		netbuf_set_flag(nb, NBUF_DROPPED);
-		return;
+
+		if(!igmp_is_member(nb->dev, daddr)) {
+			netbuf_set_flag(nb, NBUF_DROPPED);
+			return;
+		}
 	} else {
 		netbuf_set_flag(nb, NBUF_UNICAST);
 	}
 
-	nb->transport.size = hdr->length - hdrlen;
-	if(nb->transport.size < hdrlen) {
-		netbuf_set_flag(nb, NBUF_DROPPED);
-		return;
-	}
+	/* Looped back datagrams have their layers split already */
+	if(likely(!netbuf_test_flag(nb, NBUF_LOOPED))) {
+		/* The payload can be shorter than the header, e.g. IGMP messages */
+		if(nb->meta.length < hdrlen) {
+			netbuf_set_flag(nb, NBUF_DROPPED);
+			return;
+		}
+
+		nb->transport.size = nb->meta.length - hdrlen;
 
-	if(nb->transport.size)
-		nb->transport.data = ((uint8_t*)hdr) + hdrlen;
+		if(nb->transport.size)
+			nb->transport.data = ((uint8_t*)hdr) + hdrlen;
 
-	if(localip && (hdr->daddr == 0 || hdr->daddr != localip)) {
+		ipv4_csum_pull(nb, hdr, hdrlen, size);
+	}
+
+	if(localip && nif->iftype != NIF_TYPE_LOOPBACK && !netbuf_test_flag(nb, NBUF_MULTICAST) &&
+		(daddr == 0 || daddr != localip)) {
 		if(ipv4_forward(nb, hdr))
 			return;
 		print_dbg("Dropping IP packet that isn't ment for us..\n");
@@ -147,11 +274,9 @@ void ipv4_input(struct netbuf *nb)
 		return;
 	}
 
-	if(ipv4_is_fragmented(hdr)) {
+	if(ipv4_is_fragmented(nb)) {
 		ipfrag4_add_packet(nb);
 		return;
-	} else {
-		ipfrag4_tmo();
 	}
 
 	ipv4_input_postfrag(nb);
@@ -180,6 +305,9 @@ void ipv4_input_postfrag(struct netbuf *nb)
 		break;
 
 	case IP_PROTO_IGMP:
+		igmp_input(nb);
+		break;
+
 	default:
 		if(!demux) {
 			netbuf_set_flag(nb, NBUF_REUSE);
@@ -11,6 +11,7 @@
 #include <string.h>
 
 #include <estack/estack.h>
+#include <estack/error.h>
 #include <estack/netbuf.h>
 #include <estack/netdev.h>
 #include <estack/ip.h>
@@ -21,6 +22,7 @@
 #include <estack/translate.h>
 #include <estack/ethernet.h>
 #include <estack/in.h>
+#include <estack/loopback.h>
 
 #include <config.h>
 
@@ -38,6 +40,14 @@ static inline void ipoutput_free(struct netbuf *nb)
 	}
 }
 
+static inline bool ipv4_is_local(struct netdev *dev, uint32_t dst)
+{
+	if(IS_LOOPBACK(dst))
+		return true;
+
+	return dev && dst == ipv4_ptoi(dev->nif.local_ip);
+}
+
 void __ipv4_output(struct netbuf *nb, uint32_t dst)
 {
 	struct ipv4_header *header;
@@ -45,6 +55,8 @@ void __ipv4_output(struct netbuf *nb, uint32_t dst)
 	struct netdev *dev;
 	struct netif *nif;
 	uint32_t gw, saddr;
+	uint8_t hw[ETHERNET_MAC_LENGTH];
+	bool reuse;
 
 	header = nb->network.data;
 	proto = nb->protocol & 0xFF;
@@ -59,7 +71,7 @@ void __ipv4_output(struct netbuf *nb, uint32_t dst)
 	header->length = htons((uint16_t)(nb->network.size +
 		nb->transport.size + nb->application.size));
 	
-	if(proto == IP_PROTO_IGMP)
+	if(proto == IP_PROTO_IGMP || IS_MULTICAST(dst))
 		header->ttl = 1;
 	else
 		header->ttl = IP4_TTL_MAX;
@@ -67,20 +79,27 @@ void __ipv4_output(struct netbuf *nb, uint32_t dst)
 	header->protocol = proto;
 	header->daddr = htonl(dst);
 
-	if(dst == INADDR_BCAST || IS_MULTICAST(dst)) {
+	if(dst == INADDR_BCAST) {
 		/* broadcast */
 		ipoutput_free(nb);
 		return;
 	}
 
-	/* Unicast */
-	route4_lookup(dst, &gw);
+	/*
+	 * The caller picked the device, and may have used its address in a
+	 * checksum already. Take the gateway from a next hop on that device.
+	 * Multicast datagrams are sent on the interface set by the caller.
+	 */
 	dev = nb->dev;
 	if(!dev) {
 		ipoutput_free(nb);
 		return;
 	}
 
+	gw = 0;
+	if(!IS_MULTICAST(dst))
+		route4_lookup_dev(dst, nb->hash, dev, &gw);
+
 	nif = &dev->nif;
 	if(!header->id)
 		header->id = ntohs(netif_get_id(nif));
@@ -90,6 +109,17 @@ void __ipv4_output(struct netbuf *nb, uint32_t dst)
 		header->saddr = htonl(saddr);
 	}
 	header->chksum = 0;
+
+	if(unlikely(ipv4_is_local(dev, dst))) {
+		reuse = netbuf_test_flag(nb, NBUF_WAS_RX);
+		if(likely(loopback_xmit(nb) == -EOK)) {
+			if(reuse)
+				ipoutput_free(nb);
+
+			return;
+		}
+	}
+
 	header->chksum = ip_checksum(0, nb->network.data, nb->network.size);
 
 	if(gw)
@@ -98,6 +128,12 @@ void __ipv4_output(struct netbuf *nb, uint32_t dst)
 	switch(nif->iftype) {
 	case NIF_TYPE_ETHER:
 		nb->protocol = ETH_TYPE_IP;
+		if(unlikely(IS_MULTICAST(dst))) {
+			translate_ipv4_multicast_to_mac(dst, hw);
+			dev->tx(nb, hw);
+			break;
+		}
+
 		neighbour_output(dev, nb, &dst, IPV4_ADDR_SIZE, translate_ipv4_to_mac);
 		break;
 
@@ -107,6 +143,23 @@ void __ipv4_output(struct netbuf *nb, uint32_t dst)
 	}
 }
 
+/**
+ * @brief Check if a datagram can be sent without fragmenting it.
+ * @param dev Output device.
+ * @param dst Destination address.
+ * @param length Length of the datagram, without its IP header.
+ * @return True if \p length fits in the path MTU to \p dst.
+ *
+ * Datagrams to a local address are looped back, and always fit.
+ */
+bool ipv4_fits_pmtu(struct netdev *dev, uint32_t dst, size_t length)
+{
+	uint16_t mtu;
+
+	mtu = ipv4_pmtu_lookup(dev, dst);
+	return length <= mtu - sizeof(struct ipv4_header) || ipv4_is_local(dev, dst);
+}
+
 void ipv4_output(struct netbuf *nb, uint32_t dst)
 {
 	struct ipv4_header *header;
@@ -115,9 +168,16 @@ void ipv4_output(struct netbuf *nb, uint32_t dst)
 	memset(nb->network.data, 0, sizeof(*header));
 	header = nb->network.data;
 
-	/* printf("Should fragment? %u\n",
-			nb->transport.size + nb->application.size > nb->dev->mtu - sizeof(*header)); */
-	if(nb->transport.size + nb->application.size > nb->dev->mtu - sizeof(*header)) {
+	if(netbuf_test_flag(nb, NBUF_DONTFRAG))
+		header->offset = htons(IP4_DONT_FRAGMENT);
+
+	if(!ipv4_fits_pmtu(nb->dev, dst, nb->transport.size + nb->application.size)) {
+		if(netbuf_test_flag(nb, NBUF_DONTFRAG)) {
+			print_dbg("Dropping IPv4 datagram that exceeds the path MTU\n");
+			ipoutput_free(nb);
+			return;
+		}
+
 		ipfrag4_fragment(nb, dst);
 		return;
 	}
@@ -0,0 +1,194 @@
+/*
+ * E/STACK - IPv4 path MTU discovery
+ *
+ * Author: Michel Megens
+ * Date: 24/02/2018
+ * Email: dev@bietje.net
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <estack/estack.h>
+#include <estack/netdev.h>
+#include <estack/ip.h>
+
+#define PMTU_AGE ((time_t)CONFIG_PMTU_AGE * 1000000LL)
+
+struct pmtu_entry {
+	uint32_t daddr;
+	uint16_t mtu;
+	time_t expiry;
+};
+
+/*
+ * Direct mapped cache of path MTU estimates, indexed by destination
+ * address. Colliding destinations replace each other when an estimate is
+ * updated, lookups never modify the cache.
+ *
+ * Lookups don't take the lock. Writers hold the lock and make the sequence
+ * counter odd while they modify an entry, readers retry when the counter
+ * changed.
+ */
+struct pmtu_cache {
+	struct pmtu_entry entries[CONFIG_PMTU_ENTRIES];
+	volatile int length;
+	volatile uint32_t seq;
+	estack_mutex_t lock;
+};
+
+static struct pmtu_cache pmtu_cache;
+
+/* Plateau table of RFC 1191, section 7 */
+static const uint16_t pmtu_plateaus[] = {
+	32000, 17914, 8166, 4352, 2002, 1492, 1006, 508, 296, IPV4_MIN_MTU
+};
+
+static inline struct pmtu_entry *ipv4_pmtu_entry(uint32_t daddr)
+{
+	uint32_t hash;
+
+	hash = ipv4_flow_hash(0, daddr, 0, 0, 0);
+	return &pmtu_cache.entries[hash % CONFIG_PMTU_ENTRIES];
+}
+
+static inline void ipv4_pmtu_write_begin(void)
+{
+	pmtu_cache.seq++;
+	smp_wmb();
+}
+
+static inline void ipv4_pmtu_write_end(void)
+{
+	smp_wmb();
+	pmtu_cache.seq++;
+}
+
+static inline uint32_t ipv4_pmtu_read_begin(void)
+{
+	uint32_t seq;
+
+	while((seq = pmtu_cache.seq) & 1)
+		barrier();
+
+	smp_rmb();
+	return seq;
+}
+
+static inline bool ipv4_pmtu_read_retry(uint32_t seq)
+{
+	smp_rmb();
+	return pmtu_cache.seq != seq;
+}
+
+static inline bool ipv4_pmtu_valid(struct pmtu_entry *e, uint32_t daddr, time_t now)
+{
+	return e->mtu && e->daddr == daddr && e->expiry > now;
+}
+
+/**
+ * @brief Estimate the next hop MTU from the length of a datagram.
+ * @param length Total length of the datagram that was too big.
+ * @return The largest plateau below \p length.
+ *
+ * Used when a router doesn't report the next hop MTU in its
+ * fragmentation needed message.
+ */
+uint16_t ipv4_pmtu_plateau(uint16_t length)
+{
+	for(size_t idx = 0; idx < sizeof(pmtu_plateaus) / sizeof(pmtu_plateaus[0]); idx++) {
+		if(pmtu_plateaus[idx] < length)
+			return pmtu_plateaus[idx];
+	}
+
+	return IPV4_MIN_MTU;
+}
+
+/**
+ * @brief Get the path MTU to a destination.
+ * @param dev Output device.
+ * @param daddr Destination address.
+ * @return The path MTU to \p daddr.
+ *
+ * The path MTU never exceeds the MTU of \p dev. Estimates age out after
+ * CONFIG_PMTU_AGE seconds, after which a larger path MTU is tried again.
+ */
+uint16_t ipv4_pmtu_lookup(struct netdev *dev, uint32_t daddr)
+{
+	struct pmtu_entry *e;
+	uint16_t mtu, pmtu;
+	uint32_t seq;
+	time_t now;
+
+	mtu = dev ? (uint16_t)dev->mtu : 0;
+	if(likely(!pmtu_cache.length))
+		return mtu;
+
+	e = ipv4_pmtu_entry(daddr);
+	now = estack_utime();
+
+	do {
+		seq = ipv4_pmtu_read_begin();
+		pmtu = ipv4_pmtu_valid(e, daddr, now) ? e->mtu : 0;
+	} while(ipv4_pmtu_read_retry(seq));
+
+	if(pmtu && (!mtu || pmtu < mtu))
+		mtu = pmtu;
+
+	return mtu;
+}
+
+/**
+ * @brief Lower the path MTU to a destination.
+ * @param daddr Destination address.
+ * @param mtu New path MTU.
+ * @return True if the path MTU estimate was lowered.
+ *
+ * Estimates are only ever lowered. The estimate is restored to the MTU of the
+ * output device once it ages out.
+ */
+bool ipv4_pmtu_update(uint32_t daddr, uint16_t mtu)
+{
+	struct pmtu_entry *e;
+	time_t now;
+	bool valid;
+
+	if(mtu < IPV4_MIN_MTU)
+		mtu = IPV4_MIN_MTU;
+
+	e = ipv4_pmtu_entry(daddr);
+	now = estack_utime();
+	estack_mutex_lock(&pmtu_cache.lock, 0);
+
+	valid = ipv4_pmtu_valid(e, daddr, now);
+	if(valid && e->mtu <= mtu) {
+		estack_mutex_unlock(&pmtu_cache.lock);
+		return false;
+	}
+
+	if(!e->mtu)
+		pmtu_cache.length++;
+
+	ipv4_pmtu_write_begin();
+	e->daddr = daddr;
+	e->mtu = mtu;
+	e->expiry = now + PMTU_AGE;
+	ipv4_pmtu_write_end();
+
+	estack_mutex_unlock(&pmtu_cache.lock);
+	return true;
+}
+
+void ipv4_pmtu_init(void)
+{
+	memset(pmtu_cache.entries, 0, sizeof(pmtu_cache.entries));
+	pmtu_cache.length = 0;
+	pmtu_cache.seq = 0;
+	estack_mutex_create(&pmtu_cache.lock, 0);
+}
+
+void ipv4_pmtu_destroy(void)
+{
+	estack_mutex_destroy(&pmtu_cache.lock);
+}
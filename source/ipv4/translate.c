@@ -18,10 +18,30 @@
 
 void translate_ipv4_to_mac(struct netdev *dev, uint8_t *src)
 {
-	uint32_t *ip;
+	uint32_t ip;
 
 	assert(dev);
 	assert(src);
-	ip = (void*)src;
-	arp_ipv4_request(dev, *ip);
+	memcpy(&ip, src, sizeof(ip));
+	arp_ipv4_request(dev, ip);
+}
+
+/**
+ * @brief Map an IPv4 multicast group onto an ethernet multicast address.
+ * @param group Group address.
+ * @param hw Output buffer of \p ETHERNET_MAC_LENGTH bytes.
+ *
+ * The low 23 bits of \p group are placed in the 01:00:5e:00:00:00 block (RFC
+ * 1112, section 6.4), no address resolution is needed.
+ */
+void translate_ipv4_multicast_to_mac(uint32_t group, uint8_t *hw)
+{
+	assert(hw);
+
+	hw[0] = 0x01;
+	hw[1] = 0x00;
+	hw[2] = 0x5E;
+	hw[3] = (group >> 16) & 0x7F;
+	hw[4] = (group >> 8) & 0xFF;
+	hw[5] = group & 0xFF;
 }
@@ -14,10 +14,77 @@
 #include <estack/estack.h>
 #include <estack/list.h>
 #include <estack/netbuf.h>
+#include <estack/ethernet.h>
+#include <estack/ip.h>
+#include <estack/tcp.h>
+#include <estack/udp.h>
+#include <estack/icmp.h>
+#include <estack/igmp.h>
+
+/*
+ * The headroom aligns the network header behind the ethernet header. Headers
+ * that aren't packed must not be padded by the compiler.
+ */
+build_assert(sizeof(struct ethernet_header) == 14, "ethernet header size");
+build_assert(sizeof(struct ipv4_header) == 20, "IPv4 header size");
+build_assert(sizeof(struct tcp_hdr) == 20, "TCP header size");
+build_assert(sizeof(struct udp_header) == 8, "UDP header size");
+build_assert(sizeof(struct icmp_header) == 8, "ICMP header size");
+build_assert(sizeof(struct igmp_header) == 8, "IGMP header size");
+
+static inline size_t netbuf_headroom(netbuf_type_t type)
+{
+	return type == NBAF_DATALINK ? CONFIG_NET_IP_ALIGN : 0;
+}
+
+/**
+ * @brief Allocate the data of a buffer layer.
+ * @param type Layer type.
+ * @param size Size of the layer.
+ * @return The uninitialised layer data, or \p NULL if no memory is available.
+ *
+ * Datalink layers are allocated with \p CONFIG_NET_IP_ALIGN bytes of headroom,
+ * so that the network header of a received frame is naturally aligned. Data
+ * allocated by this function has to be released using netbuf_free_data.
+ */
+void *netbuf_alloc_data(netbuf_type_t type, size_t size)
+{
+	uint8_t *data;
+
+	data = malloc(size + netbuf_headroom(type));
+	if(!data)
+		return NULL;
+
+	return data + netbuf_headroom(type);
+}
+
+/**
+ * @brief Release the data of a buffer layer.
+ * @param data Data to release.
+ * @param type Layer type \p data was allocated for.
+ */
+void netbuf_free_data(void *data, netbuf_type_t type)
+{
+	if(!data)
+		return;
+
+	free((uint8_t*)data - netbuf_headroom(type));
+}
+
+/* Shrinking a layer of a received frame leaves a gap in front of the next layer */
+static inline struct netbuf *netbuf_shrink(struct netbuf *nb, struct nbdata *nbd, size_t size)
+{
+	if(nbd->size != size)
+		netbuf_clear_flag(nb, NBUF_IS_LINEAR);
+
+	nbd->size = size;
+	return nb;
+}
 
 struct netbuf *netbuf_realloc(struct netbuf *nb, netbuf_type_t type, size_t size)
 {
 	struct nbdata *nbd;
+	uint8_t *data;
 	bool prealloc;
 
 	assert(nb);
@@ -28,10 +95,8 @@ struct netbuf *netbuf_realloc(struct netbuf *nb, netbuf_type_t type, size_t size
 	switch(type) {
 	case NBAF_DATALINK:
 		nbd = &nb->datalink;
-		if(nbd->size >= size) {
-			nbd->size = size;
-			return nb;
-		}
+		if(nbd->size >= size)
+			return netbuf_shrink(nb, nbd, size);
 
 		if(netbuf_test_flag(nb, NBUF_DATALINK_ALLOC))
 			prealloc = true;
@@ -41,10 +106,8 @@ struct netbuf *netbuf_realloc(struct netbuf *nb, netbuf_type_t type, size_t size
 
 	case NBAF_NETWORK:
 		nbd = &nb->network;
-		if(nbd->size >= size) {
-			nbd->size = size;
-			return nb;
-		}
+		if(nbd->size >= size)
+			return netbuf_shrink(nb, nbd, size);
 
 		if(netbuf_test_flag(nb, NBUF_NETWORK_ALLOC))
 			prealloc = true;
@@ -53,10 +116,8 @@ struct netbuf *netbuf_realloc(struct netbuf *nb, netbuf_type_t type, size_t size
 
 	case NBAF_TRANSPORT:
 		nbd = &nb->transport;
-		if(nbd->size >= size) {
-			nbd->size = size;
-			return nb;
-		}
+		if(nbd->size >= size)
+			return netbuf_shrink(nb, nbd, size);
 
 		if(netbuf_test_flag(nb, NBUF_TRANSPORT_ALLOC))
 			prealloc = true;
@@ -66,10 +127,8 @@ struct netbuf *netbuf_realloc(struct netbuf *nb, netbuf_type_t type, size_t size
 
 	case NBAF_APPLICTION:
 		nbd = &nb->application;
-		if(nbd->size >= size) {
-			nbd->size = size;
-			return nb;
-		}
+		if(nbd->size >= size)
+			return netbuf_shrink(nb, nbd, size);
 
 		if(netbuf_test_flag(nb, NBUF_APPLICATION_ALLOC))
 			prealloc = true;
@@ -80,11 +139,17 @@ struct netbuf *netbuf_realloc(struct netbuf *nb, netbuf_type_t type, size_t size
 		return NULL;
 	}
 
-	if(prealloc)
-		nbd->data = realloc(nbd->data, size);
-	else
-		nbd->data = z_alloc(size);
+	if(prealloc) {
+		data = realloc((uint8_t*)nbd->data - netbuf_headroom(type), size + netbuf_headroom(type));
+		nbd->data = data ? data + netbuf_headroom(type) : NULL;
+	} else {
+		nbd->data = netbuf_alloc_data(type, size);
+		if(nbd->data)
+			memset(nbd->data, 0, size);
+	}
 
+	/* The layer no longer lives in the received frame */
+	netbuf_clear_flag(nb, NBUF_IS_LINEAR);
 	nbd->size = size;
 	return nb;
 }
@@ -98,6 +163,7 @@ struct netbuf *netbuf_alloc(netbuf_type_t type, size_t size)
 
 	list_head_init(&nb->bl_entry);
 	list_head_init(&nb->entry);
+	nb->refcount = 1;
 
 	if(netbuf_realloc(nb, type, size) == NULL) {
 		free(nb);
@@ -153,7 +219,7 @@ void netbuf_free_partial(struct netbuf *nb, netbuf_type_t type)
 	}
 
 	if(nbd->size && nbd->data) {
-		free(nbd->data);
+		netbuf_free_data(nbd->data, type);
 		nbd->size = 0;
 		netbuf_clear_flag(nb, flag);
 	}
@@ -161,21 +227,31 @@ void netbuf_free_partial(struct netbuf *nb, netbuf_type_t type)
 
 void netbuf_free(struct netbuf *nb)
 {
+	struct netbuf *parent;
+
 	assert(nb);
 
+	/* The data of this buffer can still be referred to by other buffers */
+	if(atomic_dec(&nb->refcount) > 0)
+		return;
+
 	if(netbuf_test_flag(nb, NBUF_DATALINK_ALLOC))
-		free(nb->datalink.data);
+		netbuf_free_data(nb->datalink.data, NBAF_DATALINK);
 
 	if(netbuf_test_flag(nb, NBUF_NETWORK_ALLOC))
-		free(nb->network.data);
+		netbuf_free_data(nb->network.data, NBAF_NETWORK);
 
 	if(netbuf_test_flag(nb, NBUF_TRANSPORT_ALLOC))
-		free(nb->transport.data);
+		netbuf_free_data(nb->transport.data, NBAF_TRANSPORT);
 
 	if(netbuf_test_flag(nb, NBUF_APPLICATION_ALLOC))
-		free(nb->application.data);
+		netbuf_free_data(nb->application.data, NBAF_APPLICTION);
 
+	parent = nb->parent;
 	free(nb);
+
+	if(parent)
+		netbuf_free(parent);
 }
 
 void netbuf_cpy_data(struct netbuf *nb, const void *src, size_t length, netbuf_type_t type)
@@ -252,6 +328,7 @@ struct netbuf *netbuf_clone(struct netbuf *nb, uint32_t layers)
 
 	list_head_init(&copy->bl_entry);
 	list_head_init(&copy->entry);
+	copy->refcount = 1;
 
 	for(int i = 1; i < (1 << NBAF_APPLICTION); i <<= 1) {
 		switch(i) {
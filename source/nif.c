@@ -17,6 +17,7 @@
 #include <estack/error.h>
 #include <estack/inet.h>
 #include <estack/log.h>
+#include <estack/snapshot.h>
 
 void ifconfig(struct netdev *dev, uint8_t *local, uint8_t *remote,
 	uint8_t *mask, uint8_t length, nif_type_t type)
@@ -31,6 +32,9 @@ void ifconfig(struct netdev *dev, uint8_t *local, uint8_t *remote,
 	memcpy(nif->ip_mask, mask, length);
 	nif->iftype = type;
 	nif->pkt_id = 1;
+	memset(&nif->route_cache, 0, sizeof(nif->route_cache));
+
+	estack_snapshot_apply(dev);
 }
 
 uint16_t netif_get_id(struct netif *nif)
@@ -51,7 +55,7 @@ void netdev_print_nif(struct netdev *dev)
 	assert(dev);
 	nif = &dev->nif;
 
-	if(nif->iftype == NIF_TYPE_ETHER) {
+	if(nif->iftype == NIF_TYPE_ETHER || nif->iftype == NIF_TYPE_LOOPBACK) {
 		print_dbg("Network interface: %s\n", dev->name);
 		ipv4_ntoa(ipv4_ptoi(nif->local_ip), buf, 16);
 		print_dbg("\tSource IP %s\n", buf);
@@ -0,0 +1,463 @@
+/*
+ * E/STACK - Link aggregation
+ *
+ * Author: Michel Megens
+ * Date: 24/02/2018
+ * Email: dev@bietje.net
+ *
+ * A bond is a virtual network device that aggregates several member devices
+ * into a single logical interface. The bond owns the network interface and the
+ * destination cache, members only move frames.
+ */
+
+/**
+ * @addtogroup netdev
+ * @{
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <estack/estack.h>
+#include <estack/netbuf.h>
+#include <estack/netdev.h>
+#include <estack/ethernet.h>
+#include <estack/ip.h>
+#include <estack/inet.h>
+#include <estack/error.h>
+#include <estack/bond.h>
+
+#define BOND_NO_MEMBER 0xFF
+
+static inline struct netdev_bond *bond_get(struct netdev *dev)
+{
+	return container_of(dev, struct netdev_bond, dev);
+}
+
+static inline void bond_lock(struct netdev *dev)
+{
+	estack_mutex_lock(&dev->mtx, 0);
+}
+
+static inline void bond_unlock(struct netdev *dev)
+{
+	estack_mutex_unlock(&dev->mtx);
+}
+
+/**
+ * @brief Calculate the flow hash of a linear ethernet frame.
+ * @param nb Frame to hash.
+ * @return The flow hash of \p nb.
+ *
+ * IPv4 frames are hashed on their addresses, protocol and ports. Ports are left
+ * out for fragments, so that all fragments of a datagram take the same link. Other
+ * frames are hashed on their destination hardware address.
+ */
+static uint32_t bond_flow_hash(struct netbuf *nb)
+{
+	struct ethernet_header *eth;
+	struct ipv4_header *ip;
+	uint8_t *l4;
+	size_t length, hlen;
+	uint16_t sport, dport;
+	uint32_t addr;
+
+	eth = nb->datalink.data;
+	if(unlikely(nb->size < sizeof(*eth)))
+		return 0;
+
+	length = nb->size - sizeof(*eth);
+	if(ntohs(eth->type) != ETH_TYPE_IP || length < sizeof(*ip)) {
+		memcpy(&addr, &eth->dest_mac[2], sizeof(addr));
+		return ipv4_flow_hash(addr, 0, 0, 0, 0);
+	}
+
+	ip = (struct ipv4_header*)(eth + 1);
+	hlen = (ip->ihl_version & 0xF) * sizeof(uint32_t);
+	sport = dport = 0;
+
+	if(!(ntohs(ip->offset) & (IP4_MORE_FRAGMENTS | IP4_OFFSET_MASK)) &&
+		length >= hlen + 2 * sizeof(uint16_t) &&
+		(ip->protocol == IP_PROTO_TCP || ip->protocol == IP_PROTO_UDP)) {
+		l4 = (uint8_t*)ip + hlen;
+		sport = (uint16_t)((l4[0] << 8) | l4[1]);
+		dport = (uint16_t)((l4[2] << 8) | l4[3]);
+	}
+
+	return ipv4_flow_hash(ip->saddr, ip->daddr, ip->protocol, sport, dport);
+}
+
+/**
+ * @brief Redistribute the flow buckets over the active members.
+ * @param bond Bond to rebalance.
+ * @note The bond lock must be held by the caller.
+ *
+ * Only buckets that belong to an inactive member, or to a member that holds more
+ * than its fair share, are moved. All other flows keep using the same member.
+ */
+static void bond_rebalance(struct netdev_bond *bond)
+{
+	int counts[CONFIG_BOND_MAX_MEMBERS];
+	int active, max, idx, best;
+
+	active = 0;
+	for(idx = 0; idx < bond->length; idx++) {
+		counts[idx] = 0;
+		if(bond->members[idx].active)
+			active++;
+	}
+
+	if(!active) {
+		memset(bond->buckets, BOND_NO_MEMBER, sizeof(bond->buckets));
+		return;
+	}
+
+	max = (BOND_BUCKETS + active - 1) / active;
+	for(int i = 0; i < BOND_BUCKETS; i++) {
+		idx = bond->buckets[i];
+
+		if(idx >= bond->length || !bond->members[idx].active || counts[idx] >= max) {
+			bond->buckets[i] = BOND_NO_MEMBER;
+			continue;
+		}
+
+		counts[idx]++;
+	}
+
+	for(int i = 0; i < BOND_BUCKETS; i++) {
+		if(bond->buckets[i] != BOND_NO_MEMBER)
+			continue;
+
+		best = -1;
+		for(idx = 0; idx < bond->length; idx++) {
+			if(!bond->members[idx].active)
+				continue;
+
+			if(best < 0 || counts[idx] < counts[best])
+				best = idx;
+		}
+
+		bond->buckets[i] = (uint8_t)best;
+		counts[best]++;
+	}
+}
+
+static int bond_find_member(struct netdev_bond *bond, struct netdev *member)
+{
+	for(int idx = 0; idx < bond->length; idx++) {
+		if(bond->members[idx].dev == member)
+			return idx;
+	}
+
+	return -1;
+}
+
+/**
+ * @brief Transmit a frame on the bond.
+ * @param dev Bond device.
+ * @param nb Linear frame to transmit.
+ * @return An error code.
+ * @note The bond lock must be held by the caller. The backlog of \p dev holds
+ *       it while writing, so the member state and bucket map are serialised with
+ *       bond_add_member, bond_remove_member and bond_set_member_active.
+ *
+ * The frame is handed to the member that owns its flow bucket through
+ * netdev_xmit, which also accounts for it on the member device.
+ */
+static int bond_write(struct netdev *dev, struct netbuf *nb)
+{
+	struct netdev_bond *bond;
+	struct bond_member *member;
+	uint32_t hash;
+	int rc, idx;
+
+	bond = bond_get(dev);
+	hash = bond_flow_hash(nb);
+
+	/*
+	 * Members that keep failing are disabled, after which the flow
+	 * is retried on the member that took over its bucket.
+	 */
+	for(int attempt = 0; attempt < bond->length; attempt++) {
+		idx = bond->buckets[hash % BOND_BUCKETS];
+		if(unlikely(idx == BOND_NO_MEMBER))
+			break;
+
+		member = &bond->members[idx];
+		rc = netdev_xmit(member->dev, nb);
+
+		if(likely(rc == -EOK)) {
+			member->errors = 0;
+			member->tx_packets++;
+			return -EOK;
+		}
+
+		if(netbuf_test_flag(nb, NBUF_AGAIN))
+			return rc;
+
+		if(++member->errors < CONFIG_BOND_MAX_ERRORS)
+			break;
+
+		member->active = false;
+		bond_rebalance(bond);
+	}
+
+	netbuf_set_flag(nb, NBUF_DROPPED);
+	return -EINVALID;
+}
+
+static int bond_read(struct netdev *dev, int num)
+{
+	UNUSED(dev);
+	UNUSED(num);
+
+	return 0;
+}
+
+static int bond_available(struct netdev *dev)
+{
+	UNUSED(dev);
+	return 0;
+}
+
+/**
+ * @brief Receive handler for member devices.
+ * @param nb Packet buffer received by a member device.
+ *
+ * Move \p nb to the bond and hand it to the receive handler of the bond.
+ */
+static void bond_input(struct netbuf *nb)
+{
+	struct netdev *dev;
+
+	dev = nb->dev->master;
+	if(unlikely(!dev)) {
+		netbuf_set_flag(nb, NBUF_DROPPED);
+		return;
+	}
+
+	netbuf_set_dev(nb, dev);
+	dev->rx(nb);
+
+	if(netbuf_arrived(nb)) {
+		bond_lock(dev);
+		dev->stats.rx_packets++;
+		dev->stats.rx_bytes += nb->size;
+		bond_unlock(dev);
+	}
+}
+
+/**
+ * @brief Create a new bond device.
+ * @param name Device name.
+ * @return The logical device of the bond.
+ */
+struct netdev *bond_create(const char *name)
+{
+	struct netdev_bond *bond;
+	struct netdev *dev;
+	size_t len;
+
+	assert(name);
+
+	bond = z_alloc(sizeof(*bond));
+	assert(bond);
+
+	dev = &bond->dev;
+	len = strlen(name);
+	dev->name = z_alloc(len + 1);
+	memcpy((char*)dev->name, name, len);
+
+	dev->mtu = 0xFFFF;
+	dev->rx = ethernet_input;
+	dev->tx = ethernet_output;
+	dev->classify = ethernet_classify;
+	dev->write = bond_write;
+	dev->read = bond_read;
+	dev->available = bond_available;
+	memset(bond->buckets, BOND_NO_MEMBER, sizeof(bond->buckets));
+
+	netdev_init(dev);
+	return dev;
+}
+
+/**
+ * @brief Add a member to a bond.
+ * @param dev Bond device.
+ * @param member Device to add to \p dev.
+ * @return An error code.
+ *
+ * The receive handler of \p member is replaced, so that all received packets are
+ * handed to \p dev. The first member determines the hardware address of the bond, the
+ * MTU of the bond is the smallest MTU of all members.
+ */
+int bond_add_member(struct netdev *dev, struct netdev *member)
+{
+	struct netdev_bond *bond;
+	struct bond_member *m;
+
+	assert(dev);
+	assert(member);
+
+	bond = bond_get(dev);
+	bond_lock(dev);
+
+	if(bond->length >= CONFIG_BOND_MAX_MEMBERS || member->master) {
+		bond_unlock(dev);
+		return -EINVALID;
+	}
+
+	m = &bond->members[bond->length];
+	m->dev = member;
+	m->active = true;
+	m->errors = 0;
+	m->tx_packets = 0;
+	bond->length++;
+
+	if(!dev->addrlen) {
+		memcpy(dev->hwaddr, member->hwaddr, member->addrlen);
+		dev->addrlen = member->addrlen;
+	}
+
+	if(member->mtu < dev->mtu)
+		dev->mtu = member->mtu;
+
+	bond_lock(member);
+	m->rx = member->rx;
+	member->master = dev;
+	member->rx = bond_input;
+	bond_unlock(member);
+
+	bond_rebalance(bond);
+	bond_unlock(dev);
+
+	return -EOK;
+}
+
+/**
+ * @brief Remove a member from a bond.
+ * @param dev Bond device.
+ * @param member Device to remove from \p dev.
+ * @return An error code.
+ */
+int bond_remove_member(struct netdev *dev, struct netdev *member)
+{
+	struct netdev_bond *bond;
+	int idx;
+
+	assert(dev);
+	assert(member);
+
+	bond = bond_get(dev);
+	bond_lock(dev);
+
+	idx = bond_find_member(bond, member);
+	if(idx < 0) {
+		bond_unlock(dev);
+		return -EINVALID;
+	}
+
+	bond_lock(member);
+	member->rx = bond->members[idx].rx;
+	member->master = NULL;
+	bond_unlock(member);
+
+	/* Keep the bucket map valid by moving the last member into the free slot */
+	bond->length--;
+	if(idx != bond->length) {
+		bond->members[idx] = bond->members[bond->length];
+
+		for(int i = 0; i < BOND_BUCKETS; i++) {
+			if(bond->buckets[i] == idx)
+				bond->buckets[i] = BOND_NO_MEMBER;
+			else if(bond->buckets[i] == bond->length)
+				bond->buckets[i] = (uint8_t)idx;
+		}
+	}
+
+	bond_rebalance(bond);
+	bond_unlock(dev);
+
+	return -EOK;
+}
+
+/**
+ * @brief Enable or disable a bond member.
+ * @param dev Bond device.
+ * @param member Member device.
+ * @param active Indicates whether \p member should be used for transmission.
+ * @return An error code.
+ *
+ * Members are disabled automatically after CONFIG_BOND_MAX_ERRORS consecutive
+ * transmit errors. This function can be used to enable them again once the
+ * link has been restored.
+ */
+int bond_set_member_active(struct netdev *dev, struct netdev *member, bool active)
+{
+	struct netdev_bond *bond;
+	int idx;
+
+	assert(dev);
+
+	bond = bond_get(dev);
+	bond_lock(dev);
+
+	idx = bond_find_member(bond, member);
+	if(idx < 0) {
+		bond_unlock(dev);
+		return -EINVALID;
+	}
+
+	bond->members[idx].active = active;
+	bond->members[idx].errors = 0;
+	bond_rebalance(bond);
+	bond_unlock(dev);
+
+	return -EOK;
+}
+
+/**
+ * @brief Get the number of packets a bond transmitted through a member.
+ * @param dev Bond device.
+ * @param member Member device.
+ * @return The number of packets transmitted through \p member.
+ */
+uint32_t bond_get_member_tx(struct netdev *dev, struct netdev *member)
+{
+	struct netdev_bond *bond;
+	uint32_t num;
+	int idx;
+
+	assert(dev);
+
+	bond = bond_get(dev);
+	bond_lock(dev);
+	idx = bond_find_member(bond, member);
+	num = idx < 0 ? 0 : bond->members[idx].tx_packets;
+	bond_unlock(dev);
+
+	return num;
+}
+
+/**
+ * @brief Destroy a bond device.
+ * @param dev Bond device to destroy.
+ * @note The member devices are released, but not destroyed.
+ */
+void bond_destroy(struct netdev *dev)
+{
+	struct netdev_bond *bond;
+
+	assert(dev);
+
+	bond = bond_get(dev);
+	while(bond->length)
+		bond_remove_member(dev, bond->members[0].dev);
+
+	netdev_destroy(dev);
+	free((void*)dev->name);
+	free(bond);
+}
+
+/** @} */
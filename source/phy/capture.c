@@ -0,0 +1,310 @@
+/*
+ * E/STACK - Packet capture
+ *
+ * Author: Michel Megens
+ * Date: 20/02/2018
+ * Email: dev@bietje.net
+ *
+ * Generic packet capture for network devices. Capturing is disabled by
+ * default. When it is enabled, the backlog processor copies packets into
+ * a lock free ring, which is drained into a pcap file by a writer thread.
+ * The datapath never waits on the writer: if the ring is full, the packet
+ * is simply not captured.
+ */
+
+/**
+ * @addtogroup netdev
+ * @{
+ */
+
+#define _CRT_SECURE_NO_WARNINGS 1
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <estack/estack.h>
+#include <estack/netbuf.h>
+#include <estack/netdev.h>
+#include <estack/filter.h>
+#include <estack/capture.h>
+#include <estack/error.h>
+
+#define CAPTURE_MAGIC 0xA1B2C3D4
+#define CAPTURE_VERSION_MAJOR 2
+#define CAPTURE_VERSION_MINOR 4
+#define CAPTURE_LINKTYPE_ETHERNET 1
+
+/**
+ * @brief Pcap file header.
+ */
+struct capture_file_header {
+	uint32_t magic; //!< Magic number.
+	uint16_t version_major; //!< Major version number.
+	uint16_t version_minor; //!< Minor version number.
+	int32_t thiszone; //!< GMT to local correction.
+	uint32_t sigfigs; //!< Accuracy of timestamps.
+	uint32_t snaplen; //!< Maximum length of captured packets.
+	uint32_t linktype; //!< Data link type.
+};
+
+/**
+ * @brief Pcap record header.
+ */
+struct capture_record_header {
+	uint32_t ts_sec; //!< Timestamp seconds.
+	uint32_t ts_usec; //!< Timestamp microseconds.
+	uint32_t caplen; //!< Number of bytes saved in the file.
+	uint32_t length; //!< Actual length of the packet.
+};
+
+/**
+ * @brief Capture ring slot.
+ */
+struct capture_slot {
+	time_t timestamp; //!< Capture time stamp in microseconds.
+	uint32_t caplen; //!< Number of captured bytes.
+	uint32_t length; //!< Length of the packet.
+};
+
+static inline struct capture_slot *capture_get_slot(struct netdev_capture *cap, uint32_t idx)
+{
+	idx &= cap->slots - 1;
+	return (struct capture_slot*)(cap->ring + idx * cap->slot_size);
+}
+
+/**
+ * @brief Capture a single packet.
+ * @param cap Capture to add \p nb to.
+ * @param nb Linear packet buffer to capture.
+ * @note There can only be a single producer for \p cap, which is ensured by only
+ *       capturing packets with the device lock held.
+ */
+void capture_packet(struct netdev_capture *cap, struct netbuf *nb)
+{
+	struct capture_slot *slot;
+	uint32_t head;
+
+	if(cap->filter && filter_run(cap->filter, nb, NULL) == FILTER_DROP)
+		return;
+
+	if(cap->sample > 1) {
+		if(++cap->counter < cap->sample)
+			return;
+
+		cap->counter = 0;
+	}
+
+	head = cap->head;
+	if(unlikely(head - cap->tail >= cap->slots)) {
+		cap->dropped++;
+		return;
+	}
+
+	/* Make sure the slot has been released by the writer */
+	smp_mb();
+
+	slot = capture_get_slot(cap, head);
+	slot->timestamp = estack_utime();
+	slot->length = (uint32_t)nb->size;
+	slot->caplen = slot->length > cap->snaplen ? cap->snaplen : slot->length;
+	memcpy(slot + 1, nb->datalink.data, slot->caplen);
+
+	smp_wmb();
+	cap->head = head + 1;
+	cap->captured++;
+}
+
+static void capture_drain(struct netdev_capture *cap)
+{
+	struct capture_slot *slot;
+	struct capture_record_header hdr;
+	uint32_t tail;
+
+	tail = cap->tail;
+	while(tail != cap->head) {
+		smp_rmb();
+
+		slot = capture_get_slot(cap, tail);
+		hdr.ts_sec = (uint32_t)(slot->timestamp / 1000000LL);
+		hdr.ts_usec = (uint32_t)(slot->timestamp % 1000000LL);
+		hdr.caplen = slot->caplen;
+		hdr.length = slot->length;
+
+		fwrite(&hdr, sizeof(hdr), 1, cap->file);
+		fwrite(slot + 1, slot->caplen, 1, cap->file);
+
+		tail++;
+		smp_mb();
+		cap->tail = tail;
+	}
+
+	fflush(cap->file);
+}
+
+static void capture_task(void *arg)
+{
+	struct netdev_capture *cap;
+
+	cap = arg;
+	while(cap->running) {
+		capture_drain(cap);
+		estack_sleep(CONFIG_CAPTURE_FLUSH_TMO);
+	}
+
+	capture_drain(cap);
+}
+
+static void capture_free(struct netdev_capture *cap)
+{
+	if(cap->file)
+		fclose(cap->file);
+
+	if(cap->ring)
+		free(cap->ring);
+
+	free(cap);
+}
+
+/**
+ * @brief Start capturing packets on a network device.
+ * @param dev Device to capture packets on.
+ * @param path Path to the output pcap file.
+ * @param snaplen Maximum number of bytes to capture per packet. If set to zero, the
+ *                MTU of \p dev plus CAPTURE_HEADROOM is used.
+ * @param sample Capture one out of every \p sample packets. Zero or one captures all packets.
+ * @param filter Optional filter. Packets that are dropped by \p filter are not captured.
+ * @return An error code.
+ *
+ * Both received and transmitted packets are captured. The caller remains the
+ * owner of \p filter, which should not be freed before the capture is stopped.
+ * Loopback devices do not carry link layer frames and cannot be captured.
+ */
+int netdev_capture_start(struct netdev *dev, const char *path, uint32_t snaplen,
+	uint32_t sample, struct netdev_filter *filter)
+{
+	struct netdev_capture *cap;
+	struct capture_file_header hdr;
+
+	assert(dev);
+	assert(path);
+
+	if(dev->capture)
+		return -EINUSE;
+
+	if(dev->nif.iftype == NIF_TYPE_LOOPBACK)
+		return -EINVALID;
+
+	if(!snaplen)
+		snaplen = dev->mtu + CAPTURE_HEADROOM;
+
+	cap = z_alloc(sizeof(*cap));
+	assert(cap);
+
+	cap->snaplen = snaplen;
+	cap->sample = sample;
+	cap->filter = filter;
+	cap->slots = CONFIG_CAPTURE_SLOTS;
+	cap->slot_size = sizeof(struct capture_slot) + snaplen;
+	cap->slot_size = (cap->slot_size + sizeof(time_t) - 1) & ~(sizeof(time_t) - 1);
+
+	cap->file = fopen(path, "wb");
+	cap->ring = malloc(cap->slots * cap->slot_size);
+
+	if(!cap->file || !cap->ring) {
+		capture_free(cap);
+		return -ENOMEMORY;
+	}
+
+	hdr.magic = CAPTURE_MAGIC;
+	hdr.version_major = CAPTURE_VERSION_MAJOR;
+	hdr.version_minor = CAPTURE_VERSION_MINOR;
+	hdr.thiszone = 0;
+	hdr.sigfigs = 0;
+	hdr.snaplen = snaplen;
+	hdr.linktype = CAPTURE_LINKTYPE_ETHERNET;
+	fwrite(&hdr, sizeof(hdr), 1, cap->file);
+
+	cap->running = true;
+	cap->writer.name = "capture";
+	estack_thread_create(&cap->writer, capture_task, cap);
+
+	estack_mutex_lock(&dev->mtx, 0);
+	if(unlikely(dev->capture)) {
+		estack_mutex_unlock(&dev->mtx);
+		cap->running = false;
+		estack_thread_destroy(&cap->writer);
+		capture_free(cap);
+		return -EINUSE;
+	}
+
+	dev->capture = cap;
+	estack_mutex_unlock(&dev->mtx);
+
+	return -EOK;
+}
+
+/**
+ * @brief Stop capturing packets on a network device.
+ * @param dev Device to stop capturing on.
+ *
+ * All packets that are still on the capture ring are written to the output
+ * file before it is closed.
+ */
+void netdev_capture_stop(struct netdev *dev)
+{
+	struct netdev_capture *cap;
+
+	assert(dev);
+
+	estack_mutex_lock(&dev->mtx, 0);
+	cap = dev->capture;
+	dev->capture = NULL;
+	estack_mutex_unlock(&dev->mtx);
+
+	if(!cap)
+		return;
+
+	cap->running = false;
+	estack_thread_destroy(&cap->writer);
+	capture_free(cap);
+}
+
+/**
+ * @brief Get the number of captured packets.
+ * @param dev Device to get the capture statistics for.
+ * @return The number of packets captured on \p dev.
+ */
+uint32_t netdev_capture_get_captured(struct netdev *dev)
+{
+	uint32_t num;
+
+	assert(dev);
+
+	estack_mutex_lock(&dev->mtx, 0);
+	num = dev->capture ? dev->capture->captured : 0;
+	estack_mutex_unlock(&dev->mtx);
+
+	return num;
+}
+
+/**
+ * @brief Get the number of packets that could not be captured.
+ * @param dev Device to get the capture statistics for.
+ * @return The number of packets that were lost because the capture ring was full.
+ */
+uint32_t netdev_capture_get_dropped(struct netdev *dev)
+{
+	uint32_t num;
+
+	assert(dev);
+
+	estack_mutex_lock(&dev->mtx, 0);
+	num = dev->capture ? dev->capture->dropped : 0;
+	estack_mutex_unlock(&dev->mtx);
+
+	return num;
+}
+
+/** @} */
@@ -0,0 +1,251 @@
+/*
+ * E/STACK - Packet filter
+ *
+ * Author: Michel Megens
+ * Date: 17/02/2018
+ * Email: dev@bietje.net
+ *
+ * Early packet filter for received frames. A filter is a compiled table
+ * of rules that is attached to a network device, and run before any
+ * protocol handler gets to see a received packet.
+ */
+
+/**
+ * @addtogroup netdev
+ * @{
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <estack/estack.h>
+#include <estack/netbuf.h>
+#include <estack/netdev.h>
+#include <estack/ethernet.h>
+#include <estack/ip.h>
+#include <estack/inet.h>
+#include <estack/error.h>
+#include <estack/filter.h>
+
+#define FILTER_MATCH_IP (FILTER_MATCH_PROTOCOL | FILTER_MATCH_SADDR | FILTER_MATCH_DADDR)
+#define FILTER_MATCH_PORTS (FILTER_MATCH_SPORT | FILTER_MATCH_DPORT)
+
+/**
+ * @brief Header fields of a packet that rules are matched against.
+ */
+struct filter_key {
+	uint16_t ethertype; //!< Ethernet type.
+	uint8_t protocol; //!< IPv4 protocol.
+	bool ip, //!< Indicates that the IPv4 fields are valid.
+		ports; //!< Indicates that the port fields are valid.
+	uint32_t saddr, //!< IPv4 source address.
+		daddr; //!< IPv4 destination address.
+	uint16_t sport, //!< Source port.
+		dport; //!< Destination port.
+};
+
+/**
+ * @brief Allocate a new filter.
+ * @param policy Verdict for packets that do not match any rule.
+ * @return The allocated filter.
+ */
+struct netdev_filter *filter_alloc(filter_action_t policy)
+{
+	struct netdev_filter *filter;
+
+	filter = z_alloc(sizeof(*filter));
+	assert(filter);
+	filter->policy = policy;
+
+	return filter;
+}
+
+/**
+ * @brief Free a filter.
+ * @param filter Filter to free.
+ * @note \p filter should not be attached to a device.
+ */
+void filter_free(struct netdev_filter *filter)
+{
+	if(!filter)
+		return;
+
+	if(filter->rules)
+		free(filter->rules);
+
+	free(filter);
+}
+
+/**
+ * @brief Append a rule to a filter.
+ * @param filter Filter to add \p rule to.
+ * @param rule Rule to add.
+ * @return The index of the added rule or an error code.
+ *
+ * The rule is copied into the rule table of \p filter. Prefixes are masked, so
+ * matching only requires a single compare per field.
+ */
+int filter_add_rule(struct netdev_filter *filter, const struct filter_rule *rule)
+{
+	struct filter_rule *r;
+	int size;
+
+	assert(filter);
+	assert(rule);
+
+	if(rule->action == FILTER_REDIRECT && !rule->handler)
+		return -EINVALID;
+
+	if((rule->match & FILTER_MATCH_SPORT) && rule->sport_min > rule->sport_max)
+		return -EINVALID;
+
+	if((rule->match & FILTER_MATCH_DPORT) && rule->dport_min > rule->dport_max)
+		return -EINVALID;
+
+	if(filter->length == filter->size) {
+		size = filter->size ? filter->size * 2 : 4;
+		r = realloc(filter->rules, size * sizeof(*r));
+		if(!r)
+			return -ENOMEMORY;
+
+		filter->rules = r;
+		filter->size = size;
+	}
+
+	r = &filter->rules[filter->length];
+	memcpy(r, rule, sizeof(*r));
+	r->saddr &= r->smask;
+	r->daddr &= r->dmask;
+	r->hits = 0;
+
+	return filter->length++;
+}
+
+static void filter_parse(struct netbuf *nb, struct filter_key *key)
+{
+	struct ethernet_header *eth;
+	struct ipv4_header *ip;
+	uint8_t *l4;
+	size_t length, hlen;
+
+	key->ethertype = 0;
+	key->ip = false;
+	key->ports = false;
+
+	eth = nb->datalink.data;
+	if(unlikely(nb->datalink.size < sizeof(*eth)))
+		return;
+
+	key->ethertype = ntohs(eth->type);
+	if(key->ethertype != ETH_TYPE_IP)
+		return;
+
+	ip = (struct ipv4_header*)(eth + 1);
+	length = nb->datalink.size - sizeof(*eth);
+	if(length < sizeof(*ip))
+		return;
+
+	hlen = (ip->ihl_version & 0xF) * sizeof(uint32_t);
+	if(hlen < sizeof(*ip) || hlen > length)
+		return;
+
+	key->ip = true;
+	key->protocol = ip->protocol;
+	key->saddr = ntohl(ip->saddr);
+	key->daddr = ntohl(ip->daddr);
+
+	if(ntohs(ip->offset) & IP4_OFFSET_MASK)
+		return;
+
+	if(key->protocol != IP_PROTO_TCP && key->protocol != IP_PROTO_UDP)
+		return;
+
+	if(length < hlen + 2 * sizeof(uint16_t))
+		return;
+
+	l4 = (uint8_t*)ip + hlen;
+	key->sport = (uint16_t)((l4[0] << 8) | l4[1]);
+	key->dport = (uint16_t)((l4[2] << 8) | l4[3]);
+	key->ports = true;
+}
+
+static bool filter_match(const struct filter_rule *rule, const struct filter_key *key)
+{
+	uint8_t match;
+
+	match = rule->match;
+	if((match & FILTER_MATCH_ETHERTYPE) && rule->ethertype != key->ethertype)
+		return false;
+
+	if(match & FILTER_MATCH_IP) {
+		if(!key->ip)
+			return false;
+
+		if((match & FILTER_MATCH_PROTOCOL) && rule->protocol != key->protocol)
+			return false;
+
+		if((match & FILTER_MATCH_SADDR) && (key->saddr & rule->smask) != rule->saddr)
+			return false;
+
+		if((match & FILTER_MATCH_DADDR) && (key->daddr & rule->dmask) != rule->daddr)
+			return false;
+	}
+
+	if(match & FILTER_MATCH_PORTS) {
+		if(!key->ports)
+			return false;
+
+		if((match & FILTER_MATCH_SPORT) &&
+			(key->sport < rule->sport_min || key->sport > rule->sport_max))
+			return false;
+
+		if((match & FILTER_MATCH_DPORT) &&
+			(key->dport < rule->dport_min || key->dport > rule->dport_max))
+			return false;
+	}
+
+	return true;
+}
+
+/**
+ * @brief Run a filter on a received frame.
+ * @param filter Filter to run.
+ * @param nb Linear ethernet frame to run \p filter on.
+ * @param handler Output for the redirect handler.
+ * @return The verdict for \p nb.
+ * @note The hit counters of \p filter are updated, so the caller has to ensure
+ *       that \p filter is not run concurrently.
+ *
+ * The headers of \p nb are parsed once, after which each rule is matched against
+ * the parsed header fields. If the verdict is FILTER_REDIRECT, \p handler is set to
+ * the handler of the matching rule.
+ */
+filter_action_t filter_run(struct netdev_filter *filter, struct netbuf *nb, rx_handle *handler)
+{
+	struct filter_key key;
+	struct filter_rule *rule;
+
+	assert(filter);
+	assert(nb);
+
+	filter_parse(nb, &key);
+
+	for(int idx = 0; idx < filter->length; idx++) {
+		rule = &filter->rules[idx];
+
+		if(filter_match(rule, &key)) {
+			rule->hits++;
+
+			if(handler)
+				*handler = rule->handler;
+
+			return rule->action;
+		}
+	}
+
+	filter->hits++;
+	return filter->policy;
+}
+
+/** @} */
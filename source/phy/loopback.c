@@ -0,0 +1,183 @@
+/*
+ * E/STACK - Loopback device
+ *
+ * Author: Michel Megens
+ * Date: 24/02/2018
+ * Email: dev@bietje.net
+ *
+ * The loopback device delivers locally addressed datagrams back to the network
+ * layer. Packets are handed over as they are: no link layer framing, no address
+ * resolution, no linearisation and no checksums.
+ */
+
+/**
+ * @addtogroup netdev
+ * @{
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <estack/estack.h>
+#include <estack/netbuf.h>
+#include <estack/netdev.h>
+#include <estack/ip.h>
+#include <estack/route.h>
+#include <estack/error.h>
+#include <estack/loopback.h>
+
+#define NBUF_ALLOC_MASK (NBAF_DATALINK_MASK | NBAF_NETWORK_MASK | \
+	NBAF_TRANSPORT_MASK | NBAF_APPLICTION_MASK)
+
+static struct netdev *loopback_dev;
+
+/*
+ * Datagrams are looped back by loopback_xmit before they reach the backlog as
+ * transmit packets, so nothing is ever written to the loopback device.
+ */
+static int loopback_write(struct netdev *dev, struct netbuf *nb)
+{
+	UNUSED(dev);
+
+	netbuf_set_flag(nb, NBUF_ARRIVED);
+	return -EOK;
+}
+
+static int loopback_read(struct netdev *dev, int num)
+{
+	UNUSED(dev);
+	UNUSED(num);
+
+	return 0;
+}
+
+static int loopback_available(struct netdev *dev)
+{
+	UNUSED(dev);
+	return 0;
+}
+
+static void loopback_copy_layer(struct netbuf *copy, struct nbdata *nbd, netbuf_type_t type)
+{
+	if(!nbd->size)
+		return;
+
+	netbuf_realloc(copy, type, nbd->size);
+	netbuf_cpy_data(copy, nbd->data, nbd->size, type);
+}
+
+static struct netbuf *loopback_clone(struct netbuf *nb)
+{
+	struct netbuf *copy;
+
+	copy = z_alloc(sizeof(*copy));
+	assert(copy);
+
+	list_head_init(&copy->bl_entry);
+	list_head_init(&copy->entry);
+	copy->refcount = 1;
+
+	loopback_copy_layer(copy, &nb->network, NBAF_NETWORK);
+	loopback_copy_layer(copy, &nb->transport, NBAF_TRANSPORT);
+	loopback_copy_layer(copy, &nb->application, NBAF_APPLICTION);
+	copy->protocol = nb->protocol;
+
+	return copy;
+}
+
+/**
+ * @brief Loop a datagram back to the local host.
+ * @param nb Datagram to deliver.
+ * @return An error code.
+ * @note Ownership of \p nb is taken, unless \p nb has to be kept by the caller
+ *       (i.e. \p NBUF_TX_KEEP or \p NBUF_WAS_RX is set). A copy is delivered in
+ *       that case.
+ *
+ * The network, transport and application layers of \p nb are delivered to the
+ * network layer without being linearised. The loopback device has to be created
+ * before this function is used, \p -EINVALID is returned otherwise.
+ */
+int loopback_xmit(struct netbuf *nb)
+{
+	struct netdev *dev;
+
+	dev = loopback_dev;
+	if(unlikely(!dev))
+		return -EINVALID;
+
+	if(netbuf_test_flag(nb, NBUF_TX_KEEP) || netbuf_test_flag(nb, NBUF_WAS_RX))
+		nb = loopback_clone(nb);
+
+	nb->flags &= NBUF_ALLOC_MASK;
+	netbuf_set_flag(nb, NBUF_RX);
+	netbuf_set_flag(nb, NBUF_LOOPED);
+	netbuf_set_flag(nb, NBUF_NOCSUM);
+	netbuf_set_dev(nb, dev);
+
+	netdev_add_backlog(dev, nb);
+	netdev_wakeup();
+
+	return -EOK;
+}
+
+/**
+ * @brief Create the loopback device.
+ * @param name Device name.
+ * @return The loopback device.
+ *
+ * The device is configured with address 127.0.0.1 and a route to 127.0.0.0/8 is
+ * added. Only a single loopback device can exist.
+ */
+struct netdev *loopback_create(const char *name)
+{
+	struct netdev *dev;
+	uint32_t local, remote, mask;
+	size_t len;
+
+	assert(name);
+	assert(!loopback_dev);
+
+	dev = z_alloc(sizeof(*dev));
+	assert(dev);
+
+	len = strlen(name);
+	dev->name = z_alloc(len + 1);
+	memcpy((char*)dev->name, name, len);
+
+	dev->mtu = 0xFFFF;
+	dev->rx = ipv4_input;
+	dev->write = loopback_write;
+	dev->read = loopback_read;
+	dev->available = loopback_available;
+	netdev_init(dev);
+	dev->features = NETDEV_FEATURE_CSUM;
+
+	local = LOOPBACK_ADDR;
+	remote = 0;
+	mask = LOOPBACK_MASK;
+	ifconfig(dev, (void*)&local, (void*)&remote, (void*)&mask, sizeof(local), NIF_TYPE_LOOPBACK);
+	route4_add(local & mask, mask, 0, dev);
+
+	loopback_dev = dev;
+	return dev;
+}
+
+/**
+ * @brief Destroy the loopback device.
+ * @param dev Loopback device.
+ */
+void loopback_destroy(struct netdev *dev)
+{
+	assert(dev);
+	assert(dev == loopback_dev);
+
+	loopback_dev = NULL;
+	route4_delete(LOOPBACK_ADDR & LOOPBACK_MASK, LOOPBACK_MASK, 0, dev);
+
+	netdev_destroy(dev);
+	free((void*)dev->name);
+	free(dev);
+}
+
+/** @} */
@@ -19,7 +19,7 @@
 
 bool neighbour_output(struct netdev *dev, struct netbuf *nb, void *addr, uint8_t length, resolve_handle handle)
 {
-	struct dst_cache_entry *e;
+	uint8_t hwaddr[MAX_ADDR_LEN];
 
 	assert(dev);
 	assert(nb);
@@ -27,22 +27,16 @@ bool neighbour_output(struct netdev *dev, struct netbuf *nb, void *addr, uint8_t
 	assert(length);
 
 	netbuf_set_dev(nb, dev);
-	e = netdev_find_destination(dev, addr, length);
 
-	if(likely(e)) {
-		estack_mutex_lock(&dev->mtx, 0);
-		if(e->state == DST_RESOLVED) {
-			estack_mutex_unlock(&dev->mtx);
-			dev->tx(nb, e->hwaddr);
-			return true;
-		}
-		estack_mutex_unlock(&dev->mtx);
-
-		/* Entry isn't resolved yet, enqueue it */
-	} else {
-		e = netdev_add_destination_unresolved(dev, addr, length, handle);
+	/*
+	 * The entry might be resolved between the lockless lookup and
+	 * queueing the packet. The packet is sent right away in that case.
+	 */
+	if(likely(netdev_resolve_destination(dev, addr, length, hwaddr)) ||
+		!netdev_dstcache_queue_packet(dev, addr, length, handle, nb, hwaddr)) {
+		dev->tx(nb, hwaddr);
+		return true;
 	}
 
-	netdev_dstcache_add_packet(dev, e, nb);
 	return false;
 }
@@ -28,6 +28,9 @@
 #include <estack/error.h>
 #include <estack/inet.h>
 #include <estack/log.h>
+#include <estack/filter.h>
+#include <estack/capture.h>
+#include <estack/igmp.h>
 
 /**
  * @brief Network device core data.
@@ -39,6 +42,7 @@ struct dev_core {
 	estack_thread_t runner; //!< Processing runner.
 	estack_event_t event; //!< Data event.
 	volatile bool running; //!< Core initialisation indicator.
+	volatile long dst_unresolved; //!< Unresolved destination cache entries on all devices.
 };
 
 static struct dev_core devcore = {
@@ -51,6 +55,29 @@ static uint32_t dst_retry_tmo = 1000000;
 static int dst_retries = 4;
 
 #define DST_CACHE_USEC_AGE (CONFIG_CACHE_AGE * 60ULL * 1000ULL * 1000ULL)
+#define DST_CACHE_USEC_REFRESH (CONFIG_CACHE_REFRESH * 1000ULL * 1000ULL)
+
+static time_t dst_cache_age = DST_CACHE_USEC_AGE;
+static time_t dst_cache_refresh = DST_CACHE_USEC_REFRESH;
+
+/*
+ * Claim one of the CONFIG_DST_UNRESOLVED_MAX unresolved entries that are shared
+ * by all devices. The counter is updated atomically, since every device only
+ * serialises its own destination cache.
+ */
+static inline bool netdev_dst_get_unresolved(void)
+{
+	if(likely(atomic_inc(&devcore.dst_unresolved) <= CONFIG_DST_UNRESOLVED_MAX))
+		return true;
+
+	atomic_dec(&devcore.dst_unresolved);
+	return false;
+}
+
+static inline void netdev_dst_put_unresolved(void)
+{
+	atomic_dec(&devcore.dst_unresolved);
+}
 
 /**
  * @brief Lock the networking core.
@@ -95,7 +122,7 @@ struct netdev *netdev_find(const char *name)
 
 static inline int netdev_backlog_empty(struct netdev *dev)
 {
-	return list_empty(&dev->backlog.head);
+	return dev->backlog.size == 0;
 }
 
 /**
@@ -151,9 +178,112 @@ struct netdev *netdev_remove(const char *name)
 
 static inline void __netdev_add_backlog(struct netdev *dev, struct netbuf *nb)
 {
+	struct netdev_backlog_queue *q;
+
+	q = &dev->backlog.queues[nb->bl_class];
 	netbuf_set_flag(nb, NBUF_BL_QUEUED);
-	list_add_tail(&nb->bl_entry, &dev->backlog.head);
+	list_add_tail(&nb->bl_entry, &q->head);
+	q->size += 1;
 	dev->backlog.size += 1;
+
+	/* Packets queued for transmission don't count against the admission budget */
+	if(netbuf_test_flag(nb, NBUF_RX)) {
+		q->rx_size += 1;
+		dev->backlog.rx_size += 1;
+	}
+}
+
+static inline void netdev_remove_backlog_entry(struct netdev *dev, struct netbuf *nb)
+{
+	struct netdev_backlog_queue *q;
+
+	q = &dev->backlog.queues[nb->bl_class];
+	list_del(&nb->bl_entry);
+	q->size -= 1;
+	dev->backlog.size -= 1;
+
+	if(netbuf_test_flag(nb, NBUF_RX)) {
+		q->rx_size -= 1;
+		dev->backlog.rx_size -= 1;
+	}
+
+	netbuf_clear_flag(nb, NBUF_BL_QUEUED);
+}
+
+static inline void netdev_dropped_stats_inc(struct netdev *dev)
+{
+	struct netdev_stats *stats;
+
+	stats = &dev->stats;
+	stats->dropped++;
+}
+
+/**
+ * @brief Shed a single received packet from a backlog queue.
+ * @param dev Device that owns \p q.
+ * @param q Queue to shed a packet from.
+ * @return True or false based on whether a packet was shed or not.
+ * @note The device lock must be held by the caller.
+ *
+ * The most recently received packet is dropped, older packets are closer to
+ * being processed. Packets that are queued for transmission are never shed.
+ */
+static bool netdev_shed_backlog(struct netdev *dev, struct netdev_backlog_queue *q)
+{
+	struct list_head *entry;
+	struct netbuf *nb;
+
+	list_for_each_prev(entry, &q->head) {
+		nb = list_entry(entry, struct netbuf, bl_entry);
+		if(!netbuf_test_flag(nb, NBUF_RX))
+			continue;
+
+		netdev_remove_backlog_entry(dev, nb);
+		netdev_dropped_stats_inc(dev);
+		q->shed++;
+		netbuf_free(nb);
+		return true;
+	}
+
+	return false;
+}
+
+/**
+ * @brief Admission control for received packets.
+ * @param dev Device to admit \p nb to.
+ * @param nb Received packet buffer.
+ * @return True if \p nb can be queued, false if it should be dropped.
+ * @note The device lock must be held by the caller.
+ *
+ * A packet is refused when its class queue is full. When the backlog as a whole is
+ * over budget, packets of a lower class are shed to make room for \p nb. Only
+ * received packets are counted, packets queued for transmission never take up
+ * the budget.
+ */
+static bool netdev_admit_backlog(struct netdev *dev, struct netbuf *nb)
+{
+	struct netdev_backlog *bl;
+	struct netdev_backlog_queue *q;
+	int cls;
+
+	bl = &dev->backlog;
+	q = &bl->queues[nb->bl_class];
+
+	if(unlikely(q->rx_size >= q->limit)) {
+		q->shed++;
+		return false;
+	}
+
+	if(likely(bl->rx_size < bl->limit))
+		return true;
+
+	for(cls = NETDEV_CLASSES - 1; cls > nb->bl_class; cls--) {
+		if(netdev_shed_backlog(dev, &bl->queues[cls]))
+			return true;
+	}
+
+	q->shed++;
+	return false;
 }
 
 /**
@@ -162,25 +292,29 @@ static inline void __netdev_add_backlog(struct netdev *dev, struct netbuf *nb)
  * @param nb Packet buffer to add.
  *
  * Adds a netbuf to the the backlog and increments the backlog size by one. All
- * packets on the backlog are expected to have a valid output device set.
+ * packets on the backlog are expected to have a valid output device set. The packet
+ * is classified using the classifier of \p dev before it is queued. Received packets
+ * are subject to admission control, and are dropped if the backlog is over budget.
  */
 void netdev_add_backlog(struct netdev *dev, struct netbuf *nb)
 {
 	assert(dev);
 	assert(nb);
 
+	nb->bl_class = dev->classify ? dev->classify(nb) : NETDEV_CLASS_BULK;
 	netdev_lock(dev);
+
+	if(netbuf_test_flag(nb, NBUF_RX) && unlikely(!netdev_admit_backlog(dev, nb))) {
+		netdev_dropped_stats_inc(dev);
+		netdev_unlock(dev);
+		netbuf_free(nb);
+		return;
+	}
+
 	__netdev_add_backlog(dev, nb);
 	netdev_unlock(dev);
 }
 
-static inline void netdev_remove_backlog_entry(struct netdev *dev, struct netbuf *nb)
-{
-	list_del(&nb->bl_entry);
-	dev->backlog.size -= 1;
-	netbuf_clear_flag(nb, NBUF_BL_QUEUED);
-}
-
 /**
  * @brief Remove an entry from the backlog.
  * @param dev Device to remove from.
@@ -233,14 +367,6 @@ static void netdev_tx_stats_inc(struct netdev *dev, struct netbuf *nb)
 	stats->tx_bytes += nb->size;
 }
 
-static inline void netdev_dropped_stats_inc(struct netdev *dev)
-{
-	struct netdev_stats *stats;
-
-	stats = &dev->stats;
-	stats->dropped++;
-}
-
 static struct protocol *netdev_find_protocol(struct netdev *dev, uint16_t proto)
 {
 	struct list_head *entry;
@@ -313,25 +439,361 @@ bool netdev_remove_protocol(struct netdev *dev, uint16_t proto)
 	return false;
 }
 
-static void __netdev_add_dst(struct netdev *dev, const uint8_t *dst, uint8_t daddrlen,
-	const uint8_t *src, uint8_t saddrlen, struct dst_cache_entry *e)
+#define DST_CHAIN_MAX 1024
+
+build_assert(offsetof(struct dst_cache_entry, entry) <= CONFIG_CACHE_LINE_SIZE,
+	"destination cache lookup fields exceed a cache line");
+#define DST_HEAP_SIZE 16
+
+static inline uint32_t netdev_dst_hash(const uint8_t *src, uint8_t length)
 {
-	assert(e);
-	e->state = DST_RESOLVED;
-	e->saddr_length = saddrlen;
-	e->hwaddr_length = daddrlen;
+	uint32_t hash;
 
-	e->saddr = malloc(saddrlen);
-	memcpy(e->saddr, src, saddrlen);
+	/* FNV-1a */
+	hash = 2166136261U;
+	for(int i = 0; i < length; i++) {
+		hash ^= src[i];
+		hash *= 16777619U;
+	}
 
-	e->hwaddr = malloc(daddrlen);
-	memcpy(e->hwaddr, dst, daddrlen);
+	return hash & (CONFIG_DST_HASH_SIZE - 1);
+}
+
+static inline struct dst_cache_bucket *netdev_dst_bucket(struct netdev *dev,
+	const uint8_t *src, uint8_t length)
+{
+	return &dev->dst_table[netdev_dst_hash(src, length)];
+}
+
+static inline void dst_write_begin(struct dst_cache_bucket *bucket)
+{
+	bucket->seq++;
+	smp_wmb();
+}
+
+static inline void dst_write_end(struct dst_cache_bucket *bucket)
+{
+	smp_wmb();
+	bucket->seq++;
+}
+
+/*
+ * Readers never take the device lock. Write sections are short, so a reader
+ * that finds one open spins until the writer is done.
+ */
+static inline uint32_t dst_read_begin(struct dst_cache_bucket *bucket)
+{
+	uint32_t seq;
+
+	while((seq = bucket->seq) & 1)
+		barrier();
+
+	smp_rmb();
+	return seq;
+}
+
+static inline bool dst_read_retry(struct dst_cache_bucket *bucket, uint32_t seq)
+{
+	smp_rmb();
+	return bucket->seq != seq;
+}
+
+static inline bool dst_entry_match(struct dst_cache_entry *e, const uint8_t *src, uint8_t length)
+{
+	return e->saddr_length == length && !memcmp(e->saddr, src, length);
+}
+
+static inline void dst_heap_swap(struct netdev *dev, int a, int b)
+{
+	struct dst_cache_entry *tmp;
+
+	tmp = dev->dst_heap[a];
+	dev->dst_heap[a] = dev->dst_heap[b];
+	dev->dst_heap[b] = tmp;
+
+	dev->dst_heap[a]->heap_idx = a;
+	dev->dst_heap[b]->heap_idx = b;
+}
+
+static void dst_heap_up(struct netdev *dev, int idx)
+{
+	int parent;
+
+	while(idx > 0) {
+		parent = (idx - 1) / 2;
+		if(dev->dst_heap[parent]->expiry <= dev->dst_heap[idx]->expiry)
+			break;
+
+		dst_heap_swap(dev, idx, parent);
+		idx = parent;
+	}
+}
+
+static void dst_heap_down(struct netdev *dev, int idx)
+{
+	int child;
+
+	while((child = 2 * idx + 1) < dev->dst_heap_length) {
+		if(child + 1 < dev->dst_heap_length &&
+			dev->dst_heap[child + 1]->expiry < dev->dst_heap[child]->expiry)
+			child++;
+
+		if(dev->dst_heap[idx]->expiry <= dev->dst_heap[child]->expiry)
+			break;
+
+		dst_heap_swap(dev, idx, child);
+		idx = child;
+	}
+}
+
+/*
+ * Schedule a destination cache entry to be looked at by the cache timers.
+ * The device lock must be held by the caller.
+ */
+static void netdev_dst_schedule(struct netdev *dev, struct dst_cache_entry *e, time_t expiry)
+{
+	int idx;
+
+	e->expiry = expiry;
+	idx = e->heap_idx;
+
+	if(idx < 0) {
+		if(dev->dst_heap_length == dev->dst_heap_size) {
+			dev->dst_heap_size = dev->dst_heap_size ? dev->dst_heap_size * 2 : DST_HEAP_SIZE;
+			dev->dst_heap = realloc(dev->dst_heap, sizeof(*dev->dst_heap) * dev->dst_heap_size);
+			assert(dev->dst_heap);
+		}
+
+		idx = dev->dst_heap_length++;
+		dev->dst_heap[idx] = e;
+		e->heap_idx = idx;
+	}
+
+	dst_heap_up(dev, idx);
+	dst_heap_down(dev, e->heap_idx);
+}
+
+static void netdev_dst_unschedule(struct netdev *dev, struct dst_cache_entry *e)
+{
+	struct dst_cache_entry *moved;
+	int idx, last;
+
+	idx = e->heap_idx;
+	if(idx < 0)
+		return;
+
+	last = --dev->dst_heap_length;
+	if(idx != last) {
+		moved = dev->dst_heap[last];
+		dev->dst_heap[idx] = moved;
+		moved->heap_idx = idx;
+
+		dst_heap_up(dev, idx);
+		dst_heap_down(dev, moved->heap_idx);
+	}
+
+	e->heap_idx = -1;
+}
 
-	list_head_init(&e->entry);
+/*
+ * Look up a destination cache entry.
+ * The device lock must be held by the caller.
+ */
+static struct dst_cache_entry *__netdev_find_dst(struct netdev *dev, const uint8_t *src, uint8_t length)
+{
+	struct dst_cache_bucket *bucket;
+	struct dst_cache_entry *e;
+
+	bucket = netdev_dst_bucket(dev, src, length);
+	for(e = bucket->head; e; e = e->next) {
+		if(dst_entry_match(e, src, length))
+			return e;
+	}
+
+	return NULL;
+}
+
+/*
+ * Allocate a destination cache entry and add it to the cache. Entries
+ * are recycled through the free list of the device, so that lockless
+ * readers never dereference freed memory. The device lock must be held
+ * by the caller.
+ */
+static struct dst_cache_entry *netdev_alloc_dst(struct netdev *dev, const uint8_t *src, uint8_t length)
+{
+	struct dst_cache_bucket *bucket;
+	struct dst_cache_entry *e;
+
+	assert(length <= MAX_LOCAL_ADDRESS_LENGTH);
+
+	e = dev->dst_free;
+	if(e) {
+		dev->dst_free = e->next;
+		memset(e, 0, sizeof(*e));
+	} else {
+		e = z_alloc(sizeof(*e));
+		assert(e);
+	}
+
+	e->saddr_length = length;
+	memcpy(e->saddr, src, length);
+	e->heap_idx = -1;
 	list_head_init(&e->packets);
-	netdev_lock(dev);
+
+	bucket = netdev_dst_bucket(dev, src, length);
+	dst_write_begin(bucket);
+	e->next = bucket->head;
+	bucket->head = e;
+	dst_write_end(bucket);
+
 	list_add(&e->entry, &dev->destinations);
+	return e;
+}
+
+/*
+ * Remove a destination cache entry from the cache and put it on the free list.
+ * The device lock must be held by the caller.
+ */
+static void netdev_release_dst(struct netdev *dev, struct dst_cache_entry *e)
+{
+	struct dst_cache_bucket *bucket;
+	struct dst_cache_entry **pp;
+
+	bucket = netdev_dst_bucket(dev, e->saddr, e->saddr_length);
+	dst_write_begin(bucket);
+	for(pp = (struct dst_cache_entry **)&bucket->head; *pp; pp = &(*pp)->next) {
+		if(*pp == e) {
+			*pp = e->next;
+			break;
+		}
+	}
+	dst_write_end(bucket);
+
+	if(e->state == DST_UNFINISHED)
+		netdev_dst_put_unresolved();
+
+	netdev_dst_unschedule(dev, e);
+	list_del(&e->entry);
+	e->next = dev->dst_free;
+	dev->dst_free = e;
+}
+
+/*
+ * Resolve an entry to a hardware address.
+ * The device lock must be held by the caller.
+ */
+static void netdev_set_dst(struct netdev *dev, struct dst_cache_entry *e,
+	const uint8_t *dst, uint8_t daddrlen)
+{
+	struct dst_cache_bucket *bucket;
+
+	assert(daddrlen <= MAX_ADDR_LEN);
+
+	if(e->state == DST_UNFINISHED)
+		netdev_dst_put_unresolved();
+
+	bucket = netdev_dst_bucket(dev, e->saddr, e->saddr_length);
+	dst_write_begin(bucket);
+	memcpy(e->hwaddr, dst, daddrlen);
+	e->hwaddr_length = daddrlen;
+	e->state = DST_RESOLVED;
+	dst_write_end(bucket);
+}
+
+static void netdev_free_dst_table(struct netdev *dev)
+{
+	struct dst_cache_entry *e;
+
+	while(dev->dst_free) {
+		e = dev->dst_free;
+		dev->dst_free = e->next;
+		free(e);
+	}
+
+	free(dev->dst_table);
+	free(dev->dst_heap);
+	dev->dst_table = NULL;
+	dev->dst_heap = NULL;
+	dev->dst_heap_length = dev->dst_heap_size = 0;
+}
+
+/*
+ * Move the packets that are waiting for an entry to resolve to \p packets.
+ * The device lock must be held by the caller.
+ */
+static void netdev_dst_take_packets(struct dst_cache_entry *e, struct list_head *packets)
+{
+	struct list_head *entry, *tmp;
+
+	list_for_each_safe(entry, tmp, &e->packets) {
+		list_del(entry);
+		list_add_tail(entry, packets);
+	}
+
+	e->pending = 0;
+}
+
+/*
+ * Transmit packets taken from a resolved entry. The device lock should
+ * not be held by the caller.
+ */
+static void netdev_dst_xmit_packets(struct netdev *dev, struct list_head *packets, uint8_t *hwaddr)
+{
+	struct list_head *entry, *tmp;
+	struct netbuf *nb;
+
+	list_for_each_safe(entry, tmp, packets) {
+		nb = list_entry(entry, struct netbuf, bl_entry);
+		list_del(entry);
+		netbuf_set_dev(nb, dev);
+		dev->tx(nb, hwaddr);
+	}
+}
+
+/*
+ * Resolve an entry and schedule it to be refreshed. The entry expires after
+ * \p lifetime microseconds. Packets waiting for the entry are moved to
+ * \p packets. The device lock must be held by the caller.
+ */
+static void netdev_resolve_dst(struct netdev *dev, struct dst_cache_entry *e,
+	const uint8_t *dst, uint8_t daddrlen, time_t lifetime, struct list_head *packets)
+{
+	netdev_set_dst(dev, e, dst, daddrlen);
+	netdev_dst_take_packets(e, packets);
+
+	if(e->flags & DST_PERM_MASK) {
+		netdev_dst_unschedule(dev, e);
+		return;
+	}
+
+	e->used = false;
+	e->timeout = estack_utime() + lifetime;
+	netdev_dst_schedule(dev, e, e->timeout - dst_cache_refresh);
+}
+
+static void __netdev_add_dst(struct netdev *dev, const uint8_t *dst, uint8_t daddrlen,
+	const uint8_t *src, uint8_t saddrlen, uint8_t flags, resolve_handle handle)
+{
+	struct dst_cache_entry *e;
+	struct list_head packets;
+	uint8_t hwaddr[MAX_ADDR_LEN];
+
+	list_head_init(&packets);
+
+	netdev_lock(dev);
+	e = __netdev_find_dst(dev, src, saddrlen);
+	if(!e)
+		e = netdev_alloc_dst(dev, src, saddrlen);
+
+	e->flags |= flags;
+	if(handle)
+		e->translate = handle;
+
+	netdev_resolve_dst(dev, e, dst, daddrlen, dst_cache_age, &packets);
+	memcpy(hwaddr, e->hwaddr, sizeof(hwaddr));
 	netdev_unlock(dev);
+
+	netdev_dst_xmit_packets(dev, &packets, hwaddr);
 }
 
 /**
@@ -341,16 +803,31 @@ static void __netdev_add_dst(struct netdev *dev, const uint8_t *dst, uint8_t dad
  * @param daddrlen Length of \p dst.
  * @param src Network layer address.
  * @param saddrlen Length of \p saddrlen.
+ *
+ * If an entry for \p src already exists, it is updated instead.
  */
 void netdev_add_destination(struct netdev *dev, const uint8_t *dst, uint8_t daddrlen,
 	const uint8_t *src, uint8_t saddrlen)
 {
-	struct dst_cache_entry *e;
+	__netdev_add_dst(dev, dst, daddrlen, src, saddrlen, 0, NULL);
+}
 
-	e = z_alloc(sizeof(*e));
-	assert(e);
-	e->timeout = estack_utime() + DST_CACHE_USEC_AGE;
-	__netdev_add_dst(dev, dst, daddrlen, src, saddrlen, e);
+/**
+ * @brief Add a learned destination cache entry to \p dev.
+ * @param dev Device to add the destination cache entry to.
+ * @param dst Datalink layer address.
+ * @param daddrlen Length of \p dst.
+ * @param src Network layer address.
+ * @param saddrlen Length of \p saddrlen.
+ * @param handle Resolve handle used to refresh the entry.
+ *
+ * Entries learned from incoming traffic are refreshed using \p handle while
+ * they are in use, just like entries that were resolved on request.
+ */
+void netdev_learn_destination(struct netdev *dev, const uint8_t *dst, uint8_t daddrlen,
+	const uint8_t *src, uint8_t saddrlen, resolve_handle handle)
+{
+	__netdev_add_dst(dev, dst, daddrlen, src, saddrlen, 0, handle);
 }
 
 /**
@@ -364,12 +841,85 @@ void netdev_add_destination(struct netdev *dev, const uint8_t *dst, uint8_t dadd
 void netdev_add_destination_perm(struct netdev *dev, const uint8_t *dst, uint8_t addrlen,
 	const uint8_t *src, uint8_t saddrlen)
 {
+	__netdev_add_dst(dev, dst, addrlen, src, saddrlen, DST_PERM_MASK, NULL);
+}
+
+/**
+ * @brief Restore a destination cache entry.
+ * @param dev Device to add the destination cache entry to.
+ * @param dst Datalink layer address.
+ * @param daddrlen Length of \p dst.
+ * @param src Network layer address.
+ * @param saddrlen Length of \p src.
+ * @param lifetime Remaining life time of the entry in microseconds.
+ * @return True if the entry was restored. False if \p dev already has an entry for \p src.
+ *
+ * Existing entries are never overwritten, since they are at least as recent as
+ * the restored one.
+ */
+bool netdev_restore_destination(struct netdev *dev, const uint8_t *dst, uint8_t daddrlen,
+	const uint8_t *src, uint8_t saddrlen, time_t lifetime)
+{
+	struct dst_cache_entry *e;
+	struct list_head packets;
+
+	assert(dev);
+	list_head_init(&packets);
+
+	netdev_lock(dev);
+	if(__netdev_find_dst(dev, src, saddrlen)) {
+		netdev_unlock(dev);
+		return false;
+	}
+
+	e = netdev_alloc_dst(dev, src, saddrlen);
+	netdev_resolve_dst(dev, e, dst, daddrlen, lifetime, &packets);
+	netdev_unlock(dev);
+
+	return true;
+}
+
+/**
+ * @brief Iterate over the destination cache of a device.
+ * @param dev Device to iterate over.
+ * @param handle Handler called for every destination cache entry.
+ * @param arg Argument passed to \p handle.
+ * @note \p handle is called with the device lock held.
+ */
+void netdev_foreach_destination(struct netdev *dev, dst_walk_handle handle, void *arg)
+{
+	struct list_head *entry;
 	struct dst_cache_entry *e;
 
-	e = z_alloc(sizeof(*e));
-	assert(e);
-	e->flags = DST_PERM_MASK;
-	__netdev_add_dst(dev, dst, addrlen, src, saddrlen, e);
+	assert(dev);
+	assert(handle);
+
+	netdev_lock(dev);
+	list_for_each(entry, &dev->destinations) {
+		e = list_entry(entry, struct dst_cache_entry, entry);
+		handle(dev, e, arg);
+	}
+	netdev_unlock(dev);
+}
+
+/*
+ * Create an unresolved entry. A slot must have been claimed with
+ * netdev_dst_get_unresolved, and the device lock must be held by the caller.
+ */
+static struct dst_cache_entry *__netdev_add_dst_unresolved(struct netdev *dev,
+	const uint8_t *src, uint8_t length, resolve_handle handler)
+{
+	struct dst_cache_entry *e;
+
+	e = netdev_alloc_dst(dev, src, length);
+	e->state = DST_UNFINISHED;
+	e->timeout = estack_utime() + dst_resolve_tmo;
+	e->retry = dst_retries;
+	e->translate = handler;
+
+	/* Attempt to resolve the entry on the next poll */
+	netdev_dst_schedule(dev, e, 0);
+	return e;
 }
 
 /**
@@ -378,55 +928,97 @@ void netdev_add_destination_perm(struct netdev *dev, const uint8_t *dst, uint8_t
  * @param src Destination network layer IP address.
  * @param length Length of \p src in bytes.
  * @param handler Handler to retry resolving the entry.
- * @return The created destination cache entry.
+ * @return The created destination cache entry, or the existing entry for \p src.
+ *         \p NULL is returned if the global limit of unresolved entries has been reached.
  */
 struct dst_cache_entry *netdev_add_destination_unresolved(struct netdev *dev,
 	const uint8_t *src, uint8_t length, resolve_handle handler)
 {
 	struct dst_cache_entry *e;
 
-	e = z_alloc(sizeof(*e));
-	assert(e);
-
-	e->state = DST_UNFINISHED;
-	e->saddr_length = length;
+	netdev_lock(dev);
+	e = __netdev_find_dst(dev, src, length);
+	if(!e && netdev_dst_get_unresolved())
+		e = __netdev_add_dst_unresolved(dev, src, length, handler);
+	netdev_unlock(dev);
 
-	e->saddr = malloc(length);
-	memcpy(e->saddr, src, length);
+	return e;
+}
 
-	list_head_init(&e->entry);
-	list_head_init(&e->packets);
+/*
+ * Drop a packet that was waiting for address resolution.
+ * The device lock must be held by the caller.
+ */
+static void netdev_dst_drop_packet(struct netdev *dev, struct netbuf *nb)
+{
+	netdev_dropped_stats_inc(dev);
+	dev->stats.unresolved_dropped++;
+	netbuf_free(nb);
+}
 
-	e->timeout = estack_utime() + dst_resolve_tmo;
-	e->retry = dst_retries;
-	e->translate = handler;
+/*
+ * Add a packet to the queue of an unresolved entry. The oldest packet on the
+ * queue is dropped when the entry has reached its pending limit, so that a
+ * single unresponsive neighbour can't hold on to an unbounded amount of memory.
+ * The device lock must be held by the caller.
+ */
+static void netdev_dst_queue_packet(struct netdev *dev, struct dst_cache_entry *e, struct netbuf *nb)
+{
+	struct netbuf *old;
 
-	netdev_lock(dev);
-	list_add(&e->entry, &dev->destinations);
-	netdev_unlock(dev);
+	if(unlikely(e->pending >= CONFIG_DST_PENDING_MAX)) {
+		old = list_first_entry(&e->packets, struct netbuf, bl_entry);
+		list_del(&old->bl_entry);
+		e->pending--;
+		netdev_dst_drop_packet(dev, old);
+	}
 
-	return e;
+	e->timeout = estack_utime() + dst_resolve_tmo;
+	list_add_tail(&nb->bl_entry, &e->packets);
+	e->pending++;
 }
 
 /**
- * @brief Add a packet buffer to a destination cache entry.
- * @param dev Device to which \p e belongs.
- * @param e Destination cache entry to add \p nb to.
- * @param nb Packet buff to add to \p e.
- * @return True or false based on whether the packet buffer was added or not.
+ * @brief Queue a packet until its destination is resolved.
+ * @param dev Device to queue \p nb on.
+ * @param src Network layer address of the destination.
+ * @param length Length of \p src.
+ * @param handle Handler to resolve the destination with.
+ * @param nb Packet buffer to queue.
+ * @param hwaddr Buffer of at least MAX_ADDR_LEN bytes.
+ * @return True if \p nb was queued or dropped. False if the destination has been resolved
+ *         in the mean time, in which case its hardware address is stored in \p hwaddr.
+ *
+ * An unresolved entry is created if the cache doesn't have an entry for \p src. The
+ * packet is dropped if the global limit of unresolved entries has been reached.
  */
-bool netdev_dstcache_add_packet(struct netdev *dev, struct dst_cache_entry *e, struct netbuf *nb)
+bool netdev_dstcache_queue_packet(struct netdev *dev, const uint8_t *src, uint8_t length,
+	resolve_handle handle, struct netbuf *nb, uint8_t *hwaddr)
 {
-	assert(e);
+	struct dst_cache_entry *e;
+
+	assert(dev);
 	assert(nb);
 
-	if(e->state != DST_UNFINISHED)
+	netdev_lock(dev);
+	e = __netdev_find_dst(dev, src, length);
+
+	if(!e) {
+		if(unlikely(!netdev_dst_get_unresolved())) {
+			netdev_dst_drop_packet(dev, nb);
+			netdev_unlock(dev);
+			return true;
+		}
+
+		e = __netdev_add_dst_unresolved(dev, src, length, handle);
+	} else if(e->state == DST_RESOLVED) {
+		memcpy(hwaddr, e->hwaddr, MAX_ADDR_LEN);
+		e->used = true;
+		netdev_unlock(dev);
 		return false;
+	}
 
-	assert(nb->dev);
-	e->timeout = estack_utime() + dst_resolve_tmo;
-	netdev_lock(dev);
-	list_add(&nb->bl_entry, &e->packets);
+	netdev_dst_queue_packet(dev, e, nb);
 	netdev_unlock(dev);
 
 	return true;
@@ -444,40 +1036,40 @@ bool netdev_dstcache_add_packet(struct netdev *dev, struct dst_cache_entry *e, s
 bool netdev_update_destination(struct netdev *dev, const uint8_t *dst, uint8_t dlength,
 	const uint8_t *src, uint8_t slength)
 {
-	struct list_head *entry;
 	struct dst_cache_entry *e;
+	struct list_head packets;
+	uint8_t hwaddr[MAX_ADDR_LEN];
 
-	netdev_lock(dev);
-	list_for_each(entry, &dev->destinations) {
-		e = list_entry(entry, struct dst_cache_entry, entry);
-		if(e->saddr_length != slength)
-			continue;
-
-		if(!memcmp(e->saddr, src, slength)) {
-			if(dlength != e->hwaddr_length)
-				e->hwaddr = realloc(e->hwaddr, dlength);
+	list_head_init(&packets);
 
-			memcpy(e->hwaddr, dst, dlength);
-			e->state = DST_RESOLVED;
-			e->timeout = estack_utime() + DST_CACHE_USEC_AGE;
-			netdev_unlock(dev);
-			return true;
-		}
+	netdev_lock(dev);
+	e = __netdev_find_dst(dev, src, slength);
+	if(!e) {
+		netdev_unlock(dev);
+		return false;
 	}
+
+	netdev_resolve_dst(dev, e, dst, dlength, dst_cache_age, &packets);
+	memcpy(hwaddr, e->hwaddr, sizeof(hwaddr));
 	netdev_unlock(dev);
 
-	return false;
+	netdev_dst_xmit_packets(dev, &packets, hwaddr);
+	return true;
 }
 
-static inline void netdev_free_dst_entry(struct dst_cache_entry *e)
+static void netdev_drop_dst(struct dst_cache_entry *e)
 {
-	if(e->saddr)
-		free(e->saddr);
+	struct list_head *entry, *tmp;
+	struct netbuf *nb;
 
-	if(e->hwaddr)
-		free(e->hwaddr);
+	list_for_each_safe(entry, tmp, &e->packets) {
+		nb = list_entry(entry, struct netbuf, bl_entry);
+		list_del(entry);
+		netdev_dropped_stats_inc(nb->dev);
+		netbuf_free(nb);
+	}
 
-	free(e);
+	e->pending = 0;
 }
 
 /**
@@ -489,25 +1081,20 @@ static inline void netdev_free_dst_entry(struct dst_cache_entry *e)
  */
 bool netdev_remove_destination(struct netdev *dev, const uint8_t *src, uint8_t length)
 {
-	struct list_head *entry;
 	struct dst_cache_entry *e;
 
 	netdev_lock(dev);
-	list_for_each(entry, &dev->destinations) {
-		e = list_entry(entry, struct dst_cache_entry, entry);
-		if(e->saddr_length != length)
-			continue;
-
-		if(!memcmp(e->saddr, src, length)) {
-			list_del(entry);
-			netdev_free_dst_entry(e);
-			netdev_unlock(dev);
-			return true;
-		}
+	e = __netdev_find_dst(dev, src, length);
+	if(!e) {
+		netdev_unlock(dev);
+		return false;
 	}
 
+	netdev_drop_dst(e);
+	netdev_release_dst(dev, e);
 	netdev_unlock(dev);
-	return false;
+
+	return true;
 }
 
 /**
@@ -516,187 +1103,292 @@ bool netdev_remove_destination(struct netdev *dev, const uint8_t *src, uint8_t l
  * @param src Network layer address.
  * @param length Length of \p saddrlen.
  * @return The destination cache entry or \p NULL.
+ * @note Entries are owned by \p dev. Use netdev_resolve_destination to obtain
+ *       the hardware address of a destination without holding the device lock.
  */
 struct dst_cache_entry *netdev_find_destination(struct netdev *dev, const uint8_t *src, uint8_t length)
 {
-	struct list_head *entry;
 	struct dst_cache_entry *e;
 
 	netdev_lock(dev);
-	list_for_each(entry, &dev->destinations) {
-		e = list_entry(entry, struct dst_cache_entry, entry);
-		if(e->saddr_length != length)
-			continue;
-
-		if(!memcmp(e->saddr, src, length)) {
-			netdev_unlock(dev);
-			return e;
-		}
-	}
-
+	e = __netdev_find_dst(dev, src, length);
 	netdev_unlock(dev);
-	return NULL;
+
+	return e;
 }
 
-static bool netdev_dst_timeout(struct dst_cache_entry *e)
+/**
+ * @brief Resolve a network layer address to a hardware address.
+ * @param dev Device to perform the lookup on.
+ * @param src Network layer address.
+ * @param length Length of \p src.
+ * @param hwaddr Buffer of at least MAX_ADDR_LEN bytes to store the hardware address in.
+ * @return True if \p src was resolved, false otherwise.
+ *
+ * This lookup does not acquire the device lock.
+ */
+bool netdev_resolve_destination(struct netdev *dev, const uint8_t *src, uint8_t length, uint8_t *hwaddr)
 {
-	time_t time;
+	struct dst_cache_bucket *bucket;
+	struct dst_cache_entry *e;
+	uint32_t seq;
+	bool resolved;
+	int steps;
 
-	time = estack_utime();
-	return time > e->timeout;
-}
+	bucket = netdev_dst_bucket(dev, src, length);
 
-static void netdev_drop_dst(struct dst_cache_entry *e)
-{
-	struct list_head *entry, *tmp;
-	struct netbuf *nb;
+	do {
+		seq = dst_read_begin(bucket);
+		resolved = false;
+		steps = 0;
 
-	list_for_each_safe(entry, tmp, &e->packets) {
-		nb = list_entry(entry, struct netbuf, bl_entry);
-		list_del(entry);
-		netdev_dropped_stats_inc(nb->dev);
-		netbuf_free(nb);
-	}
+		/*
+		 * Entries can be moved to another chain while we're walking this one,
+		 * bound the walk. The sequence check catches the move.
+		 */
+		for(e = bucket->head; e && steps < DST_CHAIN_MAX; e = e->next, steps++) {
+			if(!dst_entry_match(e, src, length))
+				continue;
+
+			if(e->state == DST_RESOLVED) {
+				memcpy(hwaddr, e->hwaddr, MAX_ADDR_LEN);
+				e->used = true;
+				resolved = true;
+			}
+
+			break;
+		}
+	} while(dst_read_retry(bucket, seq));
+
+	return resolved;
 }
 
-static inline void netdev_xmit_cache(struct netdev *dev, struct dst_cache_entry *dst)
+/*
+ * Refill the resolution request tokens of a device.
+ * The device lock must be held by the caller.
+ */
+static void netdev_dst_refill_tokens(struct netdev *dev, time_t now)
 {
-	struct list_head *entry, *tmp;
-	struct netbuf *nb;
+	time_t interval, tokens;
 
-	list_for_each_safe(entry, tmp, &dst->packets) {
-		nb = list_entry(entry, struct netbuf, bl_entry);
-		list_del(entry);
-		netdev_unlock(dev);
-		dev->tx(nb, dst->hwaddr);
-		netdev_lock(dev);
+	interval = 1000000 / CONFIG_DST_RESOLVE_RATE;
+	tokens = (now - dev->dst_token_stamp) / interval;
+	if(!tokens)
+		return;
+
+	dev->dst_token_stamp += tokens * interval;
+	tokens += dev->dst_tokens;
+	if(tokens >= CONFIG_DST_RESOLVE_BURST) {
+		dev->dst_tokens = CONFIG_DST_RESOLVE_BURST;
+		dev->dst_token_stamp = now;
+	} else {
+		dev->dst_tokens = (int)tokens;
 	}
 }
 
-static void netdev_age_cache(struct netdev *dev)
-{
-	struct list_head *entry, *tmp;
-	struct dst_cache_entry *dst;
-	time_t now;
+struct dst_resolve_request {
+	resolve_handle translate;
+	uint8_t saddr[MAX_LOCAL_ADDRESS_LENGTH];
+};
 
-	now = estack_utime();
-	list_for_each_safe(entry, tmp, &dev->destinations) {
-		dst = list_entry(entry, struct dst_cache_entry, entry);
+/*
+ * Take a resolution request token and prepare a request for \p e. The entry is
+ * scheduled for its next attempt. The device lock must be held by the caller.
+ */
+static bool netdev_dst_request(struct netdev *dev, struct dst_cache_entry *e, time_t now,
+	struct dst_resolve_request *request)
+{
+	time_t next;
 
-		if(dst->state != DST_RESOLVED || (dst->flags & DST_PERM_MASK))
-			continue;
+	if(dev->dst_tokens <= 0)
+		return false;
 
-		if(unlikely(dst->timeout <= now)) {
-			if(unlikely(!list_empty(&dst->packets)))
-				netdev_xmit_cache(dev, dst);
+	dev->dst_tokens--;
+	e->last_attempt = now;
+	next = now + dst_retry_tmo;
+	netdev_dst_schedule(dev, e, next < e->timeout ? next : e->timeout);
 
-			list_del(entry);
-			netdev_free_dst_entry(dst);
-		}
-	}
+	request->translate = e->translate;
+	memcpy(request->saddr, e->saddr, sizeof(request->saddr));
+	return true;
 }
 
-static void netdev_try_translate_cache(struct netdev *dev)
+/*
+ * Run the destination cache timers of a device. Entries are kept in a min-heap
+ * ordered on the time at which they need attention, so only expired entries are
+ * visited. Expiries are updated lazily: an entry whose time out has been extended
+ * is simply scheduled again. The device lock must be held by the caller.
+ *
+ * Resolved entries that are still in use are refreshed in the background shortly
+ * before they expire. Traffic keeps using the old hardware address until the entry
+ * is updated, so long lived flows don't stall on a new resolution round trip.
+ * Entries that haven't been used, or that don't have a resolve handler, expire.
+ *
+ * Resolution requests are rate limited by a token bucket. The requests that are
+ * due are collected and sent out in a single batch, after which the remaining
+ * entries are left on the heap until the next poll.
+ */
+static void netdev_run_dst_timers(struct netdev *dev)
 {
-	struct list_head *dst, *dsttmp, *entry, *tmp;
 	struct dst_cache_entry *e;
-	struct netbuf *nb;
+	struct dst_resolve_request requests[CONFIG_DST_RESOLVE_BURST];
+	time_t now, next;
+	int num;
+
+	now = estack_utime();
+	netdev_dst_refill_tokens(dev, now);
+	num = 0;
+
+	while(dev->dst_heap_length) {
+		e = dev->dst_heap[0];
+		if(likely(e->expiry > now))
+			break;
 
-	list_for_each_safe(dst, dsttmp, &dev->destinations) {
-		e = list_entry(dst, struct dst_cache_entry, entry);
-
-		if(e->state == DST_UNFINISHED) {
-			/*
-			 * Attempt to clean up any unfinished destination
-			 * cache entries. Unfinished entries are entries that
-			 * have been requested but have not received an ARP / ICMP6
-			 * reply as of yet. Attempt to send out another completion request
-			 * or drop the entry if a timeout has ocurred
-			 */
-			if(netdev_dst_timeout(e) || !e->translate ||
-				e->retry <= 0 || list_empty(&e->packets)) {
+		if(e->state == DST_RESOLVED) {
+			if(e->flags & DST_PERM_MASK) {
+				netdev_dst_unschedule(dev, e);
+			} else if(e->timeout <= now) {
 				netdev_drop_dst(e);
-				list_del(dst);
-				netdev_free_dst_entry(e);
-				continue;
+				netdev_release_dst(dev, e);
+			} else if(e->timeout - dst_cache_refresh > now) {
+				netdev_dst_schedule(dev, e, e->timeout - dst_cache_refresh);
+			} else if(!e->used || !e->translate) {
+				netdev_dst_schedule(dev, e, e->timeout);
+			} else {
+				if(!netdev_dst_request(dev, e, now, &requests[num]))
+					break;
+
+				if(++num == CONFIG_DST_RESOLVE_BURST)
+					break;
 			}
 
-			if(e->last_attempt + dst_retry_tmo < estack_utime()) {
-				netdev_unlock(dev);
-				e->translate(dev, e->saddr);
-				netdev_lock(dev);
-				e->retry--;
-				e->last_attempt = estack_utime();
-			}
 			continue;
 		}
 
 		/*
-		 * Push all packets that are waiting on a (recently)
-		 * completed DST cache entry into the datalink layer. They
-		 * will be processed by netdev_process_backlog in a later call
+		 * Unfinished entries are entries that have been requested but have
+		 * not received an ARP / ICMP6 reply as of yet. Send out another
+		 * completion request, or drop the entry if it has timed out.
 		 */
-		list_for_each_safe(entry, tmp, &e->packets) {
-			nb = list_entry(entry, struct netbuf, bl_entry);
-			list_del(entry);
-			netbuf_set_dev(nb, dev);
+		if(now >= e->timeout || !e->translate || e->retry <= 0 || list_empty(&e->packets)) {
+			netdev_drop_dst(e);
+			netdev_release_dst(dev, e);
+			continue;
+		}
 
-			netdev_unlock(dev);
-			dev->tx(nb, e->hwaddr);
-			netdev_lock(dev);
+		next = e->last_attempt + dst_retry_tmo;
+		if(next > now) {
+			netdev_dst_schedule(dev, e, next < e->timeout ? next : e->timeout);
+			continue;
 		}
+
+		if(!netdev_dst_request(dev, e, now, &requests[num]))
+			break;
+
+		e->retry--;
+		if(++num == CONFIG_DST_RESOLVE_BURST)
+			break;
 	}
+
+	if(!num)
+		return;
+
+	netdev_unlock(dev);
+	for(int idx = 0; idx < num; idx++)
+		requests[idx].translate(dev, requests[idx].saddr);
+	netdev_lock(dev);
 }
 
 static void netdev_prepare_xmit(struct netdev *dev, struct netbuf *nb)
 {
-	size_t offset, tmp;
-	size_t netw, transp, app;
+	struct nbdata *layers[] = { &nb->datalink, &nb->network, &nb->transport, &nb->application };
+	uint8_t *data;
+	size_t offset;
+	int idx;
+
+	UNUSED(dev);
 
 	if(unlikely(netbuf_test_and_set_flag(nb, NBUF_IS_LINEAR)))
 		return;
 
-	tmp = offset = nb->datalink.size;
-	netbuf_realloc(nb, NBAF_DATALINK, nb->size);
-	if(nb->network.data) {
-		netbuf_cpy_data_offset(nb, offset, nb->network.data, nb->network.size, NBAF_DATALINK);
-		offset += nb->network.size;
+	/*
+	 * Build the frame in a new buffer. Layers can point into the current
+	 * datalink buffer, or refer to data that is shared with other buffers.
+	 */
+	data = netbuf_alloc_data(NBAF_DATALINK, nb->size);
+	assert(data);
+
+	offset = 0;
+	for(idx = NBAF_DATALINK; idx <= NBAF_APPLICTION; idx++) {
+		if(!layers[idx]->size)
+			continue;
+
+		memcpy(data + offset, layers[idx]->data, layers[idx]->size);
+		offset += layers[idx]->size;
 	}
 
-	if(nb->transport.data) {
-		netbuf_cpy_data_offset(nb, offset, nb->transport.data, nb->transport.size, NBAF_DATALINK);
-		offset += nb->transport.size;
+	/* Layer allocation flags are numbered after their layer */
+	for(idx = NBAF_DATALINK; idx <= NBAF_APPLICTION; idx++) {
+		if(netbuf_test_and_clear_flag(nb, NBUF_DATALINK_ALLOC + idx))
+			netbuf_free_data(layers[idx]->data, idx);
 	}
 
-	if(nb->application.data) {
-		netbuf_cpy_data_offset(nb, offset, nb->application.data,
-			nb->application.size, NBAF_DATALINK);
+	offset = 0;
+	for(idx = NBAF_DATALINK; idx <= NBAF_APPLICTION; idx++) {
+		if(!layers[idx]->size)
+			continue;
+
+		layers[idx]->data = data + offset;
+		offset += layers[idx]->size;
 	}
 
-	netw = nb->network.size;
-	transp = nb->transport.size;
-	app = nb->application.size;
+	nb->datalink.data = data;
+	netbuf_set_flag(nb, NBUF_DATALINK_ALLOC);
+}
+
+/**
+ * @brief Write a packet to the PHY of a device.
+ * @param dev Device to transmit on.
+ * @param nb Packet buffer to transmit.
+ * @return An error code.
+ * @note The device lock must be held by the caller.
+ */
+static int __netdev_xmit(struct netdev *dev, struct netbuf *nb)
+{
+	int rc;
+
+	netdev_prepare_xmit(dev, nb);
+	rc = dev->write(dev, nb);
 
-	netbuf_free_partial(nb, NBAF_NETWORK);
-	netbuf_free_partial(nb, NBAF_TRANSPORT);
-	netbuf_free_partial(nb, NBAF_APPLICTION);
+	if(likely(rc == -EOK)) {
+		netdev_tx_stats_inc(dev, nb);
 
-	if(netw) {
-		nb->network.data     = (uint8_t*)nb->datalink.data + tmp;
-		nb->network.size     = netw;
+		if(unlikely(dev->capture))
+			capture_packet(dev->capture, nb);
 	}
 
-	if(transp) {
-		nb->transport.data   = (uint8_t*)nb->network.data + nb->network.size;
-		nb->transport.size   = transp;
-	}
+	return rc;
+}
 
-	if(app) {
-		nb->application.data = (uint8_t*)nb->transport.data + nb->transport.size;
-		nb->application.size = app;
-	}
+/**
+ * @brief Transmit a packet on a device, bypassing its backlog.
+ * @param dev Device to transmit on.
+ * @param nb Packet buffer to transmit.
+ * @return An error code.
+ *
+ * The packet is written under the device lock, and accounted for in the
+ * transmit statistics and packet capture of \p dev. Ownership of \p nb
+ * stays with the caller.
+ */
+int netdev_xmit(struct netdev *dev, struct netbuf *nb)
+{
+	int rc;
+
+	netdev_lock(dev);
+	rc = __netdev_xmit(dev, nb);
+	netdev_unlock(dev);
 
-	nb->datalink.size = tmp;
+	return rc;
 }
 
 static inline void netdev_deliver(struct netdev *dev, struct netbuf *nb)
@@ -706,12 +1398,44 @@ static inline void netdev_deliver(struct netdev *dev, struct netbuf *nb)
 	netdev_lock(dev);
 }
 
+/**
+ * @brief Run the receive filter of \p dev on a packet, and deliver it accordingly.
+ * @param dev Device that received \p nb.
+ * @param nb Received packet buffer.
+ * @note The device lock must be held by the caller.
+ */
+static void netdev_filter_deliver(struct netdev *dev, struct netbuf *nb)
+{
+	rx_handle handler;
+
+	handler = NULL;
+	switch(filter_run(dev->filter, nb, &handler)) {
+	case FILTER_DROP:
+		netbuf_set_flag(nb, NBUF_DROPPED);
+		break;
+
+	case FILTER_REDIRECT:
+		if(likely(handler)) {
+			netdev_unlock(dev);
+			handler(nb);
+			netdev_lock(dev);
+			break;
+		}
+
+		/* Fall through */
+	case FILTER_ACCEPT:
+	default:
+		netdev_deliver(dev, nb);
+		break;
+	}
+}
+
 static inline int netbuf_done(struct netbuf *nb)
 {
 	int rc;
 
 	rc = !(nb->flags & ((1 << NBUF_TX_KEEP) | (1 << NBUF_REUSE) | (1 << NBUF_AGAIN)));
-	return netbuf_test_flag(nb, NBUF_ARRIVED) && rc;
+	return (netbuf_test_flag(nb, NBUF_ARRIVED) || netbuf_dropped(nb)) && rc;
 }
 
 static inline int netbuf_test_and_clear_rx(struct netbuf *nb)
@@ -727,56 +1451,71 @@ static inline int netbuf_test_and_clear_rx(struct netbuf *nb)
 static int netdev_process_backlog(struct netdev *dev, int weight)
 {
 	struct netbuf *nb;
-	struct list_head *entry, *tmp;
+	struct netdev_backlog_queue *q;
+	int cls, num;
 
 	netdev_lock(dev);
-	netdev_try_translate_cache(dev);
-	netdev_age_cache(dev);
 
 	if(unlikely(netdev_backlog_empty(dev))) {
 		netdev_unlock(dev);
 		return -EOK;
 	}
 
-	backlog_for_each_safe(&dev->backlog, entry, tmp) {
-		if(weight <= 0)
-			break;
+	for(cls = 0; cls < NETDEV_CLASSES && weight > 0; cls++) {
+		q = &dev->backlog.queues[cls];
 
-		nb = list_entry(entry, struct netbuf, bl_entry);
-		netdev_remove_backlog_entry(dev, nb);
+		/*
+		 * Always take the head of the queue: the lock is dropped while a
+		 * packet is delivered, which allows other packets to be shed or removed
+		 * in the mean time. Limit the number of packets taken to the current
+		 * queue length, so that packets which are queued again are only
+		 * processed once per pass.
+		 */
+		for(num = q->size; num > 0 && weight > 0; num--) {
+			if(unlikely(list_empty(&q->head)))
+				break;
 
-		if(likely(netbuf_test_and_clear_rx(nb))) {
-			netbuf_set_flag(nb, NBUF_IS_LINEAR);
-			netbuf_set_dev(nb, dev);
-			nb->size = netbuf_calc_size(nb);
-			netdev_deliver(dev, nb);
+			nb = list_first_entry(&q->head, struct netbuf, bl_entry);
+			netdev_remove_backlog_entry(dev, nb);
 
-			if(netbuf_dropped(nb))
-				netdev_dropped_stats_inc(dev);
+			if(likely(netbuf_test_and_clear_rx(nb))) {
+				netbuf_set_flag(nb, NBUF_IS_LINEAR);
+				netbuf_set_dev(nb, dev);
+				nb->size = netbuf_calc_size(nb);
+
+				if(unlikely(dev->capture))
+					capture_packet(dev->capture, nb);
+
+				if(unlikely(dev->filter))
+					netdev_filter_deliver(dev, nb);
+				else
+					netdev_deliver(dev, nb);
+
+				if(netbuf_dropped(nb))
+					netdev_dropped_stats_inc(dev);
 			
-			if(netbuf_arrived(nb))
-				netdev_rx_stats_inc(dev, nb);
-		} else {
-			nb->size = netbuf_calc_size(nb);
-			netdev_prepare_xmit(dev, nb);
-
-			if(likely(dev->write(dev, nb) == -EOK)) {
-				netdev_tx_stats_inc(dev, nb);
-			} else if(unlikely(netbuf_test_and_clear_flag(nb, NBUF_AGAIN))) {
-				__netdev_add_backlog(dev, nb);
-				netbuf_clear_flag(nb, NBUF_ARRIVED);
-				continue;
+				if(netbuf_arrived(nb))
+					netdev_rx_stats_inc(dev, nb);
+			} else {
+				nb->size = netbuf_calc_size(nb);
+
+				if(unlikely(__netdev_xmit(dev, nb) != -EOK &&
+						netbuf_test_and_clear_flag(nb, NBUF_AGAIN))) {
+					__netdev_add_backlog(dev, nb);
+					netbuf_clear_flag(nb, NBUF_ARRIVED);
+					continue;
+				}
+
+				if(netbuf_test_flag(nb, NBUF_TX_KEEP))
+					continue;
 			}
 
-			if(netbuf_test_flag(nb, NBUF_TX_KEEP))
-				continue;
+			weight -= nb->size;
+			if(netbuf_done(nb))
+				netbuf_free(nb);
+			else
+				netbuf_clear_flag(nb, NBUF_REUSE);
 		}
-
-		weight -= nb->size;
-		if(netbuf_done(nb))
-			netbuf_free(nb);
-		else
-			netbuf_clear_flag(nb, NBUF_REUSE);
 	}
 
 	netdev_unlock(dev);
@@ -818,9 +1557,16 @@ int netdev_poll(struct netdev *dev)
 	if(available > 0)
 		dev->read(dev, available);
 
+	/*
+	 * A pass always covers at least one MTU sized frame, such as for a
+	 * weight tuned for standard frames on a jumbo frame device.
+	 */
 	weight = dev->processing_weight;
+	if(weight < dev->mtu)
+		weight = dev->mtu;
+
 	netdev_lock(dev);
-	netdev_try_translate_cache(dev);
+	netdev_run_dst_timers(dev);
 	netdev_unlock(dev);
 
 	while(weight > 0 && netdev_backlog_length(dev) != 0) {
@@ -917,6 +1663,7 @@ static void netdev_poll_task(void *arg)
  * @param dev Network device to configure.
  * @param maxrx Maximum number of packets to receive at once.
  * @param maxweight Maximum number of bytes to process in a single pass.
+ * @note A \p maxweight below the MTU of \p dev is raised to the MTU.
  */
 void netdev_config_params(struct netdev *dev, int maxrx, int maxweight)
 {
@@ -928,6 +1675,33 @@ void netdev_config_params(struct netdev *dev, int maxrx, int maxweight)
 	netdev_unlock_core();
 }
 
+/**
+ * @brief Configure the backlog admission limits of a network device.
+ * @param dev Network device to configure.
+ * @param limit Total number of received packets admitted to the backlog.
+ * @param control Maximum number of queued received control packets.
+ * @param latency Maximum number of queued received latency sensitive packets.
+ * @param bulk Maximum number of queued received bulk packets.
+ *
+ * When the number of received packets on the backlog exceeds \p limit, received
+ * packets of the lowest class are shed first to make room for packets of a higher
+ * class. Packets queued for transmission are not limited.
+ */
+void netdev_config_backlog(struct netdev *dev, int limit, int control, int latency, int bulk)
+{
+	struct netdev_backlog *bl;
+
+	assert(dev);
+
+	netdev_lock(dev);
+	bl = &dev->backlog;
+	bl->limit = limit;
+	bl->queues[NETDEV_CLASS_CONTROL].limit = control;
+	bl->queues[NETDEV_CLASS_LATENCY].limit = latency;
+	bl->queues[NETDEV_CLASS_BULK].limit = bulk;
+	netdev_unlock(dev);
+}
+
 static bool __netdev_demux_handle(struct netbuf *nb)
 {
 	struct netdev *dev;
@@ -969,6 +1743,18 @@ void netdev_config_core_params(uint32_t retry_tmo, uint32_t resolv_tmo, int retr
 	dst_retry_tmo = retry_tmo;
 }
 
+/**
+ * @brief Configure the destination cache lifetime.
+ * @param age Lifetime (in us) of a resolved cache entry.
+ * @param refresh Time (in us) before expiry at which used entries are refreshed.
+ * @note The defaults are taken from \p CONFIG_CACHE_AGE and \p CONFIG_CACHE_REFRESH.
+ */
+void netdev_config_cache(time_t age, time_t refresh)
+{
+	dst_cache_age = age;
+	dst_cache_refresh = refresh;
+}
+
 /**
  * @brief Call external handler for the current protocol of \p nb.
  * @param nb Packet buffer to call external handlers for.
@@ -992,6 +1778,42 @@ static inline struct netdev_stats *netdev_get_stats(struct netdev *dev)
 	return &dev->stats;
 }
 
+/**
+ * @brief Get the number of packets dropped while waiting for address resolution.
+ * @param dev Device to get stats for.
+ * @return The number of packets dropped while waiting for address resolution.
+ * @note Packets counted here are included in netdev_get_dropped as well.
+ */
+uint32_t netdev_get_unresolved_dropped(struct netdev *dev)
+{
+	struct netdev_stats *stats;
+	uint32_t dropped;
+
+	assert(dev);
+	netdev_lock(dev);
+	stats = netdev_get_stats(dev);
+	dropped = stats->unresolved_dropped;
+	netdev_unlock(dev);
+
+	return dropped;
+}
+
+/**
+ * @brief Account a packet that was dropped after it has been processed.
+ * @param dev Device that received the packet.
+ *
+ * Upper layers use this for packets that they drop after they have been
+ * accepted, such as datagrams with a bad checksum that are dropped when they
+ * are read from a socket.
+ */
+void netdev_count_dropped(struct netdev *dev)
+{
+	assert(dev);
+	netdev_lock(dev);
+	netdev_dropped_stats_inc(dev);
+	netdev_unlock(dev);
+}
+
 /**
  * @brief Get the number of packets dropped by \p dev.
  * @param dev Device to get stats for.
@@ -1091,6 +1913,75 @@ uint32_t netdev_get_tx_packets(struct netdev *dev)
 	return packets;
 }
 
+/**
+ * @brief Attach a receive filter to a network device.
+ * @param dev Device to attach \p filter to.
+ * @param filter Filter to attach, or \p NULL to detach the current filter.
+ * @return The filter that was previously attached to \p dev.
+ * @note The caller remains the owner of both filters.
+ */
+struct netdev_filter *netdev_attach_filter(struct netdev *dev, struct netdev_filter *filter)
+{
+	struct netdev_filter *old;
+
+	assert(dev);
+
+	netdev_lock(dev);
+	old = dev->filter;
+	dev->filter = filter;
+	netdev_unlock(dev);
+
+	return old;
+}
+
+/**
+ * @brief Get the hit counter of a filter rule.
+ * @param dev Device to get the filter from.
+ * @param rule Rule index. A negative index selects the default policy.
+ * @return The number of packets that hit \p rule.
+ */
+uint32_t netdev_filter_get_hits(struct netdev *dev, int rule)
+{
+	struct netdev_filter *filter;
+	uint32_t hits;
+
+	assert(dev);
+
+	hits = 0;
+	netdev_lock(dev);
+	filter = dev->filter;
+
+	if(filter) {
+		if(rule < 0)
+			hits = filter->hits;
+		else if(rule < filter->length)
+			hits = filter->rules[rule].hits;
+	}
+
+	netdev_unlock(dev);
+	return hits;
+}
+
+/**
+ * @brief Get the number of received packets shed from a backlog class.
+ * @param dev Device to get stats for.
+ * @param cls Backlog class.
+ * @return The number of packets of class \p cls that were shed or refused.
+ */
+uint32_t netdev_get_shed(struct netdev *dev, netdev_class_t cls)
+{
+	uint32_t shed;
+
+	assert(dev);
+	assert(cls < NETDEV_CLASSES);
+
+	netdev_lock(dev);
+	shed = dev->backlog.queues[cls].shed;
+	netdev_unlock(dev);
+
+	return shed;
+}
+
 /**
  * @brief Write device statistics to a file.
  * @param dev Device to get stats from.
@@ -1112,7 +2003,12 @@ void netdev_write_stats(struct netdev *dev, FILE *file)
 	fprintf(file, "\tTransmit: %lu bytes in %lu packets\n", (unsigned long)stats->tx_bytes,
 			(unsigned long)stats->tx_packets);
 	fprintf(file, "\t%lu packets have been dropped\n", (unsigned long)stats->dropped);
+	fprintf(file, "\t%lu packets dropped while resolving\n", (unsigned long)stats->unresolved_dropped);
 	fprintf(file, "\tBacklog size %u\n", (unsigned int)dev->backlog.size);
+	fprintf(file, "\tBacklog shed: %lu control, %lu latency, %lu bulk\n",
+			(unsigned long)dev->backlog.queues[NETDEV_CLASS_CONTROL].shed,
+			(unsigned long)dev->backlog.queues[NETDEV_CLASS_LATENCY].shed,
+			(unsigned long)dev->backlog.queues[NETDEV_CLASS_BULK].shed);
 	netdev_unlock(dev);
 }
 
@@ -1146,6 +2042,18 @@ void netdev_print(struct netdev *dev, FILE *file)
 }
 #endif
 
+#ifndef CONFIG_BACKLOG_CONTROL_SIZE
+#define CONFIG_BACKLOG_CONTROL_SIZE (CONFIG_BACKLOG_SIZE / 4)
+#endif
+
+#ifndef CONFIG_BACKLOG_LATENCY_SIZE
+#define CONFIG_BACKLOG_LATENCY_SIZE (CONFIG_BACKLOG_SIZE / 2)
+#endif
+
+#ifndef CONFIG_BACKLOG_BULK_SIZE
+#define CONFIG_BACKLOG_BULK_SIZE CONFIG_BACKLOG_SIZE
+#endif
+
 #ifndef CONFIG_CORE_EVENT_LENGTH
 #define CONFIG_CORE_EVENT_LENGTH 4
 #endif
@@ -1157,12 +2065,36 @@ void netdev_print(struct netdev *dev, FILE *file)
 void netdev_init(struct netdev *dev)
 {
 	list_head_init(&dev->entry);
-	list_head_init(&dev->backlog.head);
 	list_head_init(&dev->protocols);
 	list_head_init(&dev->destinations);
+	list_head_init(&dev->nif.mcast_groups);
+	dev->nif.mcast_filter = 0ULL;
 	estack_mutex_create(&dev->mtx, 0);
 
+	dev->dst_table = z_alloc(sizeof(*dev->dst_table) * CONFIG_DST_HASH_SIZE);
+	assert(dev->dst_table);
+	dev->dst_free = NULL;
+	dev->dst_heap = NULL;
+	dev->dst_heap_length = dev->dst_heap_size = 0;
+	dev->dst_tokens = CONFIG_DST_RESOLVE_BURST;
+	dev->dst_token_stamp = estack_utime();
+
+	for(int cls = 0; cls < NETDEV_CLASSES; cls++) {
+		list_head_init(&dev->backlog.queues[cls].head);
+		dev->backlog.queues[cls].size = 0;
+		dev->backlog.queues[cls].rx_size = 0;
+		dev->backlog.queues[cls].shed = 0;
+	}
+
+	dev->filter = NULL;
+	dev->capture = NULL;
+	dev->master = NULL;
 	dev->backlog.size = 0;
+	dev->backlog.rx_size = 0;
+	dev->backlog.limit = CONFIG_BACKLOG_SIZE;
+	dev->backlog.queues[NETDEV_CLASS_CONTROL].limit = CONFIG_BACKLOG_CONTROL_SIZE;
+	dev->backlog.queues[NETDEV_CLASS_LATENCY].limit = CONFIG_BACKLOG_LATENCY_SIZE;
+	dev->backlog.queues[NETDEV_CLASS_BULK].limit = CONFIG_BACKLOG_BULK_SIZE;
 	dev->processing_weight = 15000;
 	dev->rx_max = 10;
 
@@ -1187,6 +2119,8 @@ void netdev_destroy(struct netdev *dev)
 
 	assert(dev);
 
+	netdev_capture_stop(dev);
+	igmp_flush(dev);
 	netdev_lock_core();
 	netdev_lock(dev);
 
@@ -1194,13 +2128,21 @@ void netdev_destroy(struct netdev *dev)
 		e = list_entry(entry, struct dst_cache_entry, entry);
 		list_del(entry);
 		netdev_drop_dst(e);
-		netdev_free_dst_entry(e);
+
+		if(e->state == DST_UNFINISHED)
+			netdev_dst_put_unresolved();
+
+		free(e);
 	}
 
-	backlog_for_each_safe(&dev->backlog, entry, tmp) {
-		nb = list_entry(entry, struct netbuf, bl_entry);
-		list_del(entry);
-		netbuf_free(nb);
+	netdev_free_dst_table(dev);
+
+	for(int cls = 0; cls < NETDEV_CLASSES; cls++) {
+		backlog_for_each_safe(&dev->backlog.queues[cls], entry, tmp) {
+			nb = list_entry(entry, struct netbuf, bl_entry);
+			list_del(entry);
+			netbuf_free(nb);
+		}
 	}
 
 	list_for_each_safe(entry, tmp, &dev->protocols) {
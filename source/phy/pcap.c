@@ -24,6 +24,7 @@
 #include <estack/netbuf.h>
 #include <estack/netdev.h>
 #include <estack/ethernet.h>
+#include <estack/ip.h>
 #include <estack/error.h>
 #include <estack/prototype.h>
 
@@ -178,9 +179,13 @@ static int pcapdev_read(struct netdev *dev, int num)
 	}
 
 	while(priv->nread > 0 && (rv = pcap_next_ex(cap, &hdr, &data)) >= 0 && num > 0) {
-		length = hdr->len;
+		/* Only the captured part of the frame is available */
+		length = hdr->caplen;
 		nb = netbuf_alloc(NBAF_DATALINK, length);
-		netbuf_cpy_data(nb, data, length, NBAF_DATALINK);
+
+		/* Record the sum of the frame, so that upper layers don't read it again */
+		nb->csum = ip_checksum_partial_copy(0, nb->datalink.data, data, (int)length);
+		netbuf_set_flag(nb, NBUF_CSUM_COMPLETE);
 		netbuf_set_flag(nb, NBUF_RX);
 		nb->protocol = PROTO_ETHERNET;
 		nb->size = length;
@@ -197,7 +202,7 @@ static int pcapdev_read(struct netdev *dev, int num)
 		pcap_dump((u_char*)priv->dumper, hdr, data);
 
 		priv->nread--;
-		priv->available -= length;
+		priv->available -= hdr->len;
 	}
 
 	pcapdev_unlock(dev);
@@ -336,6 +341,7 @@ struct netdev *pcapdev_create(const char **srcs, int length, const char *dstfile
 
 	dev->rx = ethernet_input;
 	dev->tx = ethernet_output;
+	dev->classify = ethernet_classify;
 	pcapdev_init(dev, "dbg0", hwaddr, mtu);
 
 	pcapdev_lock(dev);
@@ -8,6 +8,7 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 
 #include <estack/estack.h>
 #include <estack/list.h>
@@ -17,163 +18,898 @@
 #include <estack/route.h>
 #include <estack/in.h>
 
-static struct iproute_head ip4_head = {
-	.head = STATIC_INIT_LIST_HEAD(ip4_head.head),
-	.version = 4,
+#define ROUTE4_PREFIXES 33
+#define ROUTE4_DEPTH_MAX ROUTE4_PREFIXES
+#define ROUTE4_NO_NEXTHOP 0xFF
+
+/*
+ * Node of the path compressed binary trie. A node covers the prefix
+ * key / plen, and only exists if it holds a route or if it has two children.
+ */
+struct route4_node {
+	uint32_t key; //!< Prefix, masked to \p plen bits.
+	uint8_t plen; //!< Prefix length.
+	struct route4_node *volatile child[2]; //!< Children, selected on the bit following the prefix.
+	struct iproute4_entry *volatile route; //!< Route for exactly this prefix.
+};
+
+/*
+ * IPv4 routing table. Routes are stored in a path compressed trie for longest
+ * prefix matching, and on a list per prefix length for iteration.
+ *
+ * Lookups don't take the lock. Writers hold the lock and make the sequence
+ * counter odd while they modify the trie, readers retry their lookup when the
+ * counter changed. Nodes and routes that are removed are kept on free lists
+ * until the table is destroyed, so a reader racing with a writer never touches
+ * freed memory. For the same reason, next hop groups stay attached to their
+ * route entry once allocated.
+ *
+ * Broadcast and multicast datagrams are sent on the device of the oldest
+ * route, which is tracked in \p first.
+ */
+struct route4_table {
+	struct route4_node *volatile root;
+	struct iproute4_entry *volatile first;
+	volatile uint32_t seq;
+	uint32_t stamp;
+	estack_mutex_t lock;
+
+	struct list_head prefixes[ROUTE4_PREFIXES];
+	struct list_head free_routes;
+	struct route4_node *free_nodes;
 };
 
-static inline struct iproute_head *route4_get_head(void)
+static struct route4_table ip4_table;
+
+static inline uint32_t route4_mask(uint8_t plen)
+{
+	return plen ? 0xFFFFFFFFU << (32 - plen) : 0;
+}
+
+static inline int route4_bit(uint32_t key, uint8_t pos)
+{
+	return (key >> (31 - pos)) & 1;
+}
+
+static int route4_prefix_length(uint32_t mask)
+{
+	int plen;
+
+	for(plen = 0; plen < 32 && (mask & (0x80000000U >> plen)); plen++);
+
+	/* Only contiguous masks are supported */
+	return mask == route4_mask(plen) ? plen : -1;
+}
+
+static uint8_t route4_common(uint32_t a, uint32_t b, uint8_t max)
+{
+	uint8_t bits;
+
+	for(bits = 0; bits < max && route4_bit(a, bits) == route4_bit(b, bits); bits++);
+	return bits;
+}
+
+static inline void route4_write_begin(void)
+{
+	ip4_table.seq++;
+	smp_wmb();
+}
+
+static inline void route4_write_end(void)
+{
+	smp_wmb();
+	ip4_table.seq++;
+}
+
+/*
+ * Lookups never take the table lock. A lookup that finds a write section open
+ * spins until the writer is done, and is retried if it raced with one.
+ */
+static inline uint32_t route4_read_begin(void)
+{
+	uint32_t seq;
+
+	while((seq = ip4_table.seq) & 1)
+		barrier();
+
+	smp_rmb();
+	return seq;
+}
+
+static inline bool route4_read_retry(uint32_t seq)
+{
+	smp_rmb();
+	return ip4_table.seq != seq;
+}
+
+static struct route4_node *route4_alloc_node(uint32_t key, uint8_t plen, struct iproute4_entry *route)
+{
+	struct route4_node *node;
+
+	node = ip4_table.free_nodes;
+	if(node) {
+		ip4_table.free_nodes = node->child[0];
+	} else {
+		node = malloc(sizeof(*node));
+		assert(node);
+	}
+
+	node->key = key;
+	node->plen = plen;
+	node->child[0] = node->child[1] = NULL;
+	node->route = route;
+	return node;
+}
+
+static void route4_release_node(struct route4_node *node)
 {
-	return &ip4_head;
+	node->route = NULL;
+	node->child[1] = NULL;
+	node->child[0] = ip4_table.free_nodes;
+	ip4_table.free_nodes = node;
 }
 
-static struct iproute4_entry *__route4_search(uint32_t addr)
+/*
+ * Insert a route into the trie.
+ * The table lock must be held and a write section must be open.
+ */
+static void __route4_insert(struct iproute4_entry *route, uint8_t plen)
+{
+	struct route4_node *volatile *pp;
+	struct route4_node *node, *parent, *leaf;
+	uint32_t key;
+	uint8_t common;
+
+	key = route->ip;
+	pp = &ip4_table.root;
+
+	while((node = *pp) != NULL) {
+		common = route4_common(key, node->key, plen < node->plen ? plen : node->plen);
+
+		if(common < node->plen) {
+			/* The new prefix diverges from, or is a prefix of, this node */
+			if(common == plen) {
+				leaf = route4_alloc_node(key, plen, route);
+				leaf->child[route4_bit(node->key, plen)] = node;
+				smp_wmb();
+				*pp = leaf;
+				return;
+			}
+
+			parent = route4_alloc_node(key & route4_mask(common), common, NULL);
+			leaf = route4_alloc_node(key, plen, route);
+			parent->child[route4_bit(key, common)] = leaf;
+			parent->child[route4_bit(node->key, common)] = node;
+			smp_wmb();
+			*pp = parent;
+			return;
+		}
+
+		if(node->plen == plen) {
+			node->route = route;
+			return;
+		}
+
+		pp = &node->child[route4_bit(key, node->plen)];
+	}
+
+	node = route4_alloc_node(key, plen, route);
+	smp_wmb();
+	*pp = node;
+}
+
+/*
+ * Remove the route for key / plen from the trie. Nodes that no longer hold
+ * a route are merged with their parent. The table lock must be held and a
+ * write section must be open.
+ */
+static void __route4_remove(uint32_t key, uint8_t plen)
+{
+	struct route4_node *volatile *path[ROUTE4_DEPTH_MAX];
+	struct route4_node *volatile *pp;
+	struct route4_node *node, *child;
+	int depth;
+
+	depth = 0;
+	pp = &ip4_table.root;
+
+	while((node = *pp) != NULL) {
+		if(node->plen > plen || (key & route4_mask(node->plen)) != node->key)
+			return;
+
+		path[depth++] = pp;
+		if(node->plen == plen)
+			break;
+
+		pp = &node->child[route4_bit(key, node->plen)];
+	}
+
+	if(!node)
+		return;
+
+	node->route = NULL;
+
+	while(depth > 0) {
+		pp = path[--depth];
+		node = *pp;
+
+		if(node->route || (node->child[0] && node->child[1]))
+			break;
+
+		child = node->child[0] ? node->child[0] : node->child[1];
+		*pp = child;
+		route4_release_node(node);
+	}
+}
+
+static void route4_release_trie(struct route4_node *node)
+{
+	if(!node)
+		return;
+
+	route4_release_trie(node->child[0]);
+	route4_release_trie(node->child[1]);
+	route4_release_node(node);
+}
+
+static struct iproute4_entry *__route4_search(uint32_t addr, uint8_t plen)
 {
 	struct list_head *entry;
 	struct iproute4_entry *e;
 
-	list_for_each(entry, &ip4_head.head) {
+	list_for_each(entry, &ip4_table.prefixes[plen]) {
 		e = container_of(entry, struct iproute4_entry, entry);
 
-		if ((addr & e->mask) == e->ip)
+		if(e->ip == addr)
 			return e;
 	}
 
 	return NULL;
 }
 
-/* IPv4 routing */
-bool route4_add(uint32_t addr, uint32_t mask, uint32_t gw, struct netdev *dev)
+static struct iproute4_entry *__route4_search_trie(uint32_t addr, uint8_t plen)
 {
-	struct iproute4_entry *entry;
+	struct route4_node *node;
 
-	assert(dev);
+	node = ip4_table.root;
+	while(node && node->plen <= plen && (addr & route4_mask(node->plen)) == node->key) {
+		if(node->plen == plen)
+			return node->route;
 
-	estack_mutex_lock(&ip4_head.lock, 0);
-	entry = __route4_search(addr);
-	if(entry) {
-		estack_mutex_unlock(&ip4_head.lock);
-		return false;
+		node = node->child[route4_bit(addr, node->plen)];
 	}
 
-	entry = z_alloc(sizeof(*entry));
-	assert(entry);
+	return NULL;
+}
+
+/**
+ * @brief Start a batch of route table updates.
+ *
+ * Updates made between route4_batch_begin and route4_batch_commit become
+ * visible to lookups at once. Lookups that race with the batch spin until it
+ * has been committed.
+ */
+void route4_batch_begin(void)
+{
+	estack_mutex_lock(&ip4_table.lock, 0);
+	route4_write_begin();
+}
+
+/**
+ * @brief Commit a batch of route table updates.
+ */
+void route4_batch_commit(void)
+{
+	route4_write_end();
+	estack_mutex_unlock(&ip4_table.lock);
+}
+
+static struct iproute4_entry *__route4_add(uint32_t addr, uint32_t mask, uint8_t plen,
+	uint32_t gw, struct netdev *dev, uint8_t weight)
+{
+	struct iproute4_entry *entry;
+
+	if(!list_empty(&ip4_table.free_routes)) {
+		entry = list_first_entry(&ip4_table.free_routes, struct iproute4_entry, entry);
+		list_del(&entry->entry);
+	} else {
+		entry = z_alloc(sizeof(*entry));
+		assert(entry);
+	}
 
 	entry->dev = dev;
 	entry->gateway = gw;
+	entry->weight = weight ? weight : 1;
 	entry->ip = addr;
 	entry->mask = mask;
-	list_head_init(&entry->entry);
 
-	list_add_tail(&entry->entry, &ip4_head.head);
-	estack_mutex_unlock(&ip4_head.lock);
+	/* Groups of recycled entries are kept, see struct route4_table */
+	if(entry->group)
+		entry->group->length = 0;
+
+	entry->stamp = ip4_table.stamp++;
+	if(!ip4_table.first)
+		ip4_table.first = entry;
+
+	list_add_tail(&entry->entry, &ip4_table.prefixes[plen]);
+	__route4_insert(entry, plen);
+	return entry;
+}
+
+/*
+ * Find the oldest route, after the current oldest route was removed.
+ * The table lock must be held by the caller.
+ */
+static struct iproute4_entry *route4_find_first(void)
+{
+	struct list_head *entry;
+	struct iproute4_entry *e, *first;
+
+	first = NULL;
+	for(int plen = 0; plen < ROUTE4_PREFIXES; plen++) {
+		list_for_each(entry, &ip4_table.prefixes[plen]) {
+			e = list_entry(entry, struct iproute4_entry, entry);
+			if(!first || (int32_t)(e->stamp - first->stamp) < 0)
+				first = e;
+		}
+	}
+
+	return first;
+}
+
+/*
+ * Redistribute the flow buckets of a group over its next hops, according to their
+ * weights. Only buckets that belong to a removed next hop, or to a next hop that
+ * holds more than its share, are moved. All other flows keep their next hop.
+ */
+static void route4_rebalance(struct route4_group *group)
+{
+	int counts[CONFIG_ROUTE4_NEXTHOPS];
+	int max[CONFIG_ROUTE4_NEXTHOPS];
+	int total, idx, best;
+
+	total = 0;
+	for(idx = 0; idx < group->length; idx++) {
+		counts[idx] = 0;
+		total += group->nexthops[idx].weight;
+	}
+
+	for(idx = 0; idx < group->length; idx++)
+		max[idx] = (ROUTE4_BUCKETS * group->nexthops[idx].weight + total - 1) / total;
+
+	for(int i = 0; i < ROUTE4_BUCKETS; i++) {
+		idx = group->buckets[i];
+
+		if(idx >= group->length || counts[idx] >= max[idx]) {
+			group->buckets[i] = ROUTE4_NO_NEXTHOP;
+			continue;
+		}
+
+		counts[idx]++;
+	}
+
+	for(int i = 0; i < ROUTE4_BUCKETS; i++) {
+		if(group->buckets[i] != ROUTE4_NO_NEXTHOP)
+			continue;
+
+		/* Pick the next hop that is furthest below its share */
+		best = 0;
+		for(idx = 1; idx < group->length; idx++) {
+			if(counts[idx] * group->nexthops[best].weight < counts[best] * group->nexthops[idx].weight)
+				best = idx;
+		}
+
+		group->buckets[i] = (uint8_t)best;
+		counts[best]++;
+	}
+}
+
+static int route4_find_nexthop(struct route4_group *group, uint32_t gw, struct netdev *dev)
+{
+	for(int idx = 0; idx < group->length; idx++) {
+		if(group->nexthops[idx].gateway == gw && group->nexthops[idx].dev == dev)
+			return idx;
+	}
+
+	return -1;
+}
+
+/*
+ * Make sure \p entry has a group that holds at least its first next hop.
+ */
+static struct route4_group *route4_get_group(struct iproute4_entry *entry)
+{
+	struct route4_group *group;
+
+	group = entry->group;
+	if(!group) {
+		group = z_alloc(sizeof(*group));
+		assert(group);
+	}
+
+	if(!group->length) {
+		group->nexthops[0].gateway = entry->gateway;
+		group->nexthops[0].dev = entry->dev;
+		group->nexthops[0].weight = entry->weight;
+		group->length = 1;
+		memset(group->buckets, 0, sizeof(group->buckets));
+	}
+
+	smp_wmb();
+	entry->group = group;
+	return group;
+}
+
+/**
+ * @brief Add a route as part of a batch.
+ * @param addr Route address.
+ * @param mask Route mask. Must be a contiguous mask.
+ * @param gw Gateway address, or 0 for a directly connected network.
+ * @param dev Output device.
+ * @return True if the route was added.
+ * @see route4_batch_begin
+ */
+bool route4_batch_add(uint32_t addr, uint32_t mask, uint32_t gw, struct netdev *dev)
+{
+	int plen;
+
+	assert(dev);
+
+	plen = route4_prefix_length(mask);
+	if(plen < 0)
+		return false;
+
+	addr &= mask;
+	if(__route4_search_trie(addr, (uint8_t)plen))
+		return false;
+
+	__route4_add(addr, mask, (uint8_t)plen, gw, dev, 1);
 	return true;
 }
 
-void route4_clear(void)
+/**
+ * @brief Add a next hop to a route as part of a batch.
+ * @param addr Route address.
+ * @param mask Route mask. Must be a contiguous mask.
+ * @param gw Gateway address, or 0 for a directly connected network.
+ * @param dev Output device.
+ * @param weight Relative weight of the next hop.
+ * @return True if the next hop was added.
+ * @see route4_batch_begin
+ *
+ * The route is created if it doesn't exist yet. Flows are spread over the next
+ * hops of a route in proportion to their weight.
+ */
+bool route4_batch_add_nexthop(uint32_t addr, uint32_t mask, uint32_t gw,
+	struct netdev *dev, uint8_t weight)
 {
-	struct list_head *entry, *tmp;
-	struct iproute4_entry *e;
-	struct iproute_head *head;
+	struct iproute4_entry *entry;
+	struct route4_group *group;
+	struct route4_nexthop *nh;
+	int plen;
 
-	head = route4_get_head();
-	estack_mutex_lock(&ip4_head.lock, 0);
-	list_for_each_safe(entry, tmp, &head->head) {
-		e = list_entry(entry, struct iproute4_entry, entry);
-		list_del(entry);
-		free(e);
+	assert(dev);
+
+	plen = route4_prefix_length(mask);
+	if(plen < 0)
+		return false;
+
+	addr &= mask;
+	entry = __route4_search_trie(addr, (uint8_t)plen);
+	if(!entry) {
+		__route4_add(addr, mask, (uint8_t)plen, gw, dev, weight);
+		return true;
 	}
-	estack_mutex_unlock(&ip4_head.lock);
+
+	group = route4_get_group(entry);
+	if(group->length >= CONFIG_ROUTE4_NEXTHOPS || route4_find_nexthop(group, gw, dev) >= 0)
+		return false;
+
+	nh = &group->nexthops[group->length];
+	nh->gateway = gw;
+	nh->dev = dev;
+	nh->weight = weight ? weight : 1;
+	group->length++;
+
+	route4_rebalance(group);
+	return true;
 }
 
-bool route4_delete(uint32_t ip, uint32_t mask, uint32_t gate, struct netdev *dev)
+/**
+ * @brief Delete a route as part of a batch.
+ * @param ip Route address.
+ * @param mask Route mask.
+ * @param gate Gateway address.
+ * @param dev Output device.
+ * @return True if the route was deleted.
+ * @see route4_batch_begin
+ *
+ * Only the next hop \p gate / \p dev is removed from a multipath route. The
+ * route itself is removed with its last next hop.
+ */
+bool route4_batch_delete(uint32_t ip, uint32_t mask, uint32_t gate, struct netdev *dev)
 {
 	struct iproute4_entry *entry;
-	struct list_head *e, *tmp;
-	struct iproute_head *head;
-	bool rv = false;
-
-	head = route4_get_head();
-	estack_mutex_lock(&ip4_head.lock, 0);
-	list_for_each_safe(e, tmp, &head->head) {
-		entry = list_entry(e, struct iproute4_entry, entry);
-
-		if(entry->ip == ip && entry->mask == mask &&
-				entry->gateway == gate && entry->dev == dev) {
-			list_del(e);
-			free(entry);
-			estack_mutex_unlock(&ip4_head.lock);
-			rv = true;
+	struct route4_group *group;
+	int plen, idx, last;
+
+	plen = route4_prefix_length(mask);
+	if(plen < 0)
+		return false;
+
+	ip &= mask;
+	entry = __route4_search(ip, (uint8_t)plen);
+	if(!entry)
+		return false;
+
+	group = entry->group;
+	if(group && group->length > 1) {
+		idx = route4_find_nexthop(group, gate, dev);
+		if(idx < 0)
+			return false;
+
+		/* Move the last next hop into the hole, and remap its buckets */
+		last = --group->length;
+		group->nexthops[idx] = group->nexthops[last];
+		for(int i = 0; i < ROUTE4_BUCKETS; i++) {
+			if(group->buckets[i] == idx)
+				group->buckets[i] = ROUTE4_NO_NEXTHOP;
+			else if(group->buckets[i] == last)
+				group->buckets[i] = (uint8_t)idx;
 		}
+
+		route4_rebalance(group);
+		entry->gateway = group->nexthops[0].gateway;
+		entry->dev = group->nexthops[0].dev;
+		entry->weight = group->nexthops[0].weight;
+		return true;
 	}
 
-	estack_mutex_unlock(&ip4_head.lock);
+	if(entry->gateway != gate || entry->dev != dev)
+		return false;
+
+	__route4_remove(ip, (uint8_t)plen);
+	list_del(&entry->entry);
+	list_add(&entry->entry, &ip4_table.free_routes);
+
+	if(ip4_table.first == entry)
+		ip4_table.first = route4_find_first();
+
+	return true;
+}
+
+/* IPv4 routing */
+bool route4_add(uint32_t addr, uint32_t mask, uint32_t gw, struct netdev *dev)
+{
+	bool rv;
+
+	route4_batch_begin();
+	rv = route4_batch_add(addr, mask, gw, dev);
+	route4_batch_commit();
+
 	return rv;
 }
 
-#define LOOKUP_MAX_LEVEL 4
-static struct iproute4_entry *__route4_lookup(uint32_t ip, uint32_t *gw, uint8_t level)
+/**
+ * @brief Add a next hop to a route.
+ * @param addr Route address.
+ * @param mask Route mask. Must be a contiguous mask.
+ * @param gw Gateway address, or 0 for a directly connected network.
+ * @param dev Output device.
+ * @param weight Relative weight of the next hop.
+ * @return True if the next hop was added.
+ * @see route4_batch_add_nexthop
+ */
+bool route4_add_nexthop(uint32_t addr, uint32_t mask, uint32_t gw, struct netdev *dev, uint8_t weight)
 {
-	struct iproute4_entry *entry;
-	struct list_head *e;
-	volatile struct iproute_head *head;
+	bool rv;
 
-	entry = NULL;
+	route4_batch_begin();
+	rv = route4_batch_add_nexthop(addr, mask, gw, dev, weight);
+	route4_batch_commit();
 
-	if(level >= LOOKUP_MAX_LEVEL)
-		return entry;
+	return rv;
+}
 
-	head = route4_get_head();
+/*
+ * Call \p handle for every next hop of every IPv4 route, most specific routes
+ * first. The route table is locked while \p handle is called.
+ */
+void route4_foreach(route4_walk_handle handle, void *arg)
+{
+	struct list_head *entry;
+	struct iproute4_entry *e;
+	struct route4_nexthop nh;
 
-	if(!level)
-		estack_mutex_lock(&ip4_head.lock, 0);
-	list_for_each(e, &head->head) {
-		entry = list_entry(e, struct iproute4_entry, entry);
+	assert(handle);
 
-		if((ip & entry->mask) == entry->ip) {
-			if(gw && entry->gateway)
-				*gw = entry->gateway;
+	estack_mutex_lock(&ip4_table.lock, 0);
+	for(int plen = ROUTE4_PREFIXES - 1; plen >= 0; plen--) {
+		list_for_each(entry, &ip4_table.prefixes[plen]) {
+			e = list_entry(entry, struct iproute4_entry, entry);
 
-			if(!entry->dev)
-				entry = __route4_lookup(ip, gw, level + 1);
+			if(e->group && e->group->length > 1) {
+				for(int idx = 0; idx < e->group->length; idx++)
+					handle(e, &e->group->nexthops[idx], arg);
 
-			break;
+				continue;
+			}
+
+			nh.gateway = e->gateway;
+			nh.dev = e->dev;
+			nh.weight = e->weight;
+			handle(e, &nh, arg);
 		}
 	}
+	estack_mutex_unlock(&ip4_table.lock);
+}
 
-	if(!level)
-		estack_mutex_unlock(&ip4_head.lock);
+void route4_clear(void)
+{
+	struct list_head *entry, *tmp;
 
-	return entry;
+	route4_batch_begin();
+	route4_release_trie(ip4_table.root);
+	ip4_table.root = NULL;
+	ip4_table.first = NULL;
+
+	for(int plen = 0; plen < ROUTE4_PREFIXES; plen++) {
+		list_for_each_safe(entry, tmp, &ip4_table.prefixes[plen]) {
+			list_del(entry);
+			list_add(entry, &ip4_table.free_routes);
+		}
+	}
+	route4_batch_commit();
+}
+
+bool route4_delete(uint32_t ip, uint32_t mask, uint32_t gate, struct netdev *dev)
+{
+	bool rv;
+
+	route4_batch_begin();
+	rv = route4_batch_delete(ip, mask, gate, dev);
+	route4_batch_commit();
+
+	return rv;
 }
 
+/*
+ * Longest prefix match. The walk is bounded, since a racing writer may
+ * recycle nodes under our feet. The sequence check catches that. The next
+ * hop of a multipath route is selected on \p hash. If \p out is set, only
+ * next hops on \p out are considered.
+ */
+static struct netdev *__route4_lookup(uint32_t ip, uint32_t hash, struct netdev *out,
+	uint32_t *gw, bool *multipath)
+{
+	struct route4_node *node;
+	struct iproute4_entry *best;
+	struct route4_group *group;
+	struct netdev *dev;
+	uint32_t seq, gateway;
+	int steps;
+	uint8_t idx;
+	bool mp;
+
+	do {
+		seq = route4_read_begin();
+		best = NULL;
+		dev = NULL;
+		gateway = 0;
+		mp = false;
+
+		node = ip4_table.root;
+		for(steps = 0; node && steps < ROUTE4_DEPTH_MAX; steps++) {
+			if((ip & route4_mask(node->plen)) != node->key)
+				break;
+
+			if(node->route)
+				best = node->route;
+
+			if(node->plen >= 32)
+				break;
+
+			node = node->child[route4_bit(ip, node->plen)];
+		}
+
+		if(best) {
+			dev = best->dev;
+			gateway = best->gateway;
+			group = best->group;
+
+			if(group && group->length > 1) {
+				idx = group->buckets[hash % ROUTE4_BUCKETS];
+				mp = true;
+
+				if(likely(idx < group->length)) {
+					dev = group->nexthops[idx].dev;
+					gateway = group->nexthops[idx].gateway;
+				}
+
+				for(idx = 0; out && dev != out && idx < group->length; idx++) {
+					dev = group->nexthops[idx].dev;
+					gateway = group->nexthops[idx].gateway;
+				}
+			}
+
+			if(out && dev != out) {
+				dev = NULL;
+				gateway = 0;
+			}
+		}
+	} while(route4_read_retry(seq));
+
+	if(gw && gateway)
+		*gw = gateway;
+
+	if(multipath)
+		*multipath = mp;
+
+	return dev;
+}
+
+/**
+ * @brief Look up the output device of an IPv4 destination.
+ * @param ip Destination address.
+ * @param gw Gateway output, set to 0 if the destination is directly connected.
+ * @return The output device, or \p NULL if there is no route to \p ip.
+ *
+ * Broadcast and multicast destinations are sent on the device of the oldest
+ * route in the table.
+ */
 struct netdev *route4_lookup(uint32_t ip, uint32_t *gw)
 {
 	struct iproute4_entry *entry;
+	struct netdev *dev;
+	uint32_t seq;
 
 	if (gw)
 		*gw = 0;
 
 	if ((ip == INADDR_BCAST) || IS_MULTICAST(ip)) {
-		if (list_empty(&ip4_head.head))
-			return NULL;
+		do {
+			seq = route4_read_begin();
+			entry = ip4_table.first;
+			dev = entry ? entry->dev : NULL;
+		} while(route4_read_retry(seq));
 
-		estack_mutex_lock(&ip4_head.lock, 0);
-		entry = list_first_entry(&ip4_head.head, struct iproute4_entry, entry);		
-		estack_mutex_unlock(&ip4_head.lock);
-	} else {
-		entry = __route4_lookup(ip, gw, 0);
+		return dev;
 	}
 
-	return entry ? entry->dev : NULL;
+	return __route4_lookup(ip, 0, NULL, gw, NULL);
+}
+
+/**
+ * @brief Look up the route for a flow.
+ * @param ip Destination address.
+ * @param hash Flow hash.
+ * @param gw Gateway output, set to 0 if the destination is directly connected.
+ * @return The output device, or \p NULL if there is no route to \p ip.
+ *
+ * Packets of a flow should all use the same \p hash, so that they are sent to
+ * the same next hop of a multipath route.
+ */
+struct netdev *route4_lookup_flow(uint32_t ip, uint32_t hash, uint32_t *gw)
+{
+	if(gw)
+		*gw = 0;
+
+	if(unlikely(ip == INADDR_BCAST || IS_MULTICAST(ip)))
+		return route4_lookup(ip, gw);
+
+	return __route4_lookup(ip, hash, NULL, gw, NULL);
+}
+
+/**
+ * @brief Look up the next hop for a flow on a given device.
+ * @param ip Destination address.
+ * @param hash Flow hash.
+ * @param dev Output device.
+ * @param gw Gateway output, set to 0 if the destination is directly connected.
+ * @return \p dev if the route to \p ip has a next hop on \p dev, \p NULL otherwise.
+ *
+ * Used when the caller already picked the output device. The next hop selected
+ * by \p hash is used if it is on \p dev, the first next hop on \p dev otherwise.
+ */
+struct netdev *route4_lookup_dev(uint32_t ip, uint32_t hash, struct netdev *dev, uint32_t *gw)
+{
+	assert(dev);
+
+	if(gw)
+		*gw = 0;
+
+	return __route4_lookup(ip, hash, dev, gw, NULL);
+}
+
+/**
+ * @brief Look up the route for a flow through a lookup cache.
+ * @param cache Lookup cache.
+ * @param ip Destination address.
+ * @param hash Flow hash.
+ * @param gw Gateway output, set to 0 if the destination is directly connected.
+ * @return The output device, or \p NULL if there is no route to \p ip.
+ *
+ * The cache holds the result of the last lookup. It is reused as long as the
+ * route table isn't modified, so that consecutive packets to the same
+ * destination share a single lookup. The caller serializes access to \p cache.
+ */
+struct netdev *route4_lookup_cached(struct netif_route_cache *cache, uint32_t ip,
+	uint32_t hash, uint32_t *gw)
+{
+	struct netdev *dev;
+	uint32_t seq, gateway;
+	bool multipath;
+
+	assert(cache);
+
+	if(unlikely(ip == INADDR_BCAST || IS_MULTICAST(ip)))
+		return route4_lookup(ip, gw);
+
+	seq = ip4_table.seq;
+	if(likely(cache->dev && cache->seq == seq && cache->daddr == ip &&
+		(!cache->multipath || cache->hash == hash))) {
+		if(gw)
+			*gw = cache->gateway;
+
+		return cache->dev;
+	}
+
+	/*
+	 * A modification of the route table during the lookup leaves the
+	 * entry behind with an outdated revision.
+	 */
+	seq = route4_read_begin();
+	gateway = 0;
+	dev = __route4_lookup(ip, hash, NULL, &gateway, &multipath);
+
+	cache->daddr = ip;
+	cache->hash = hash;
+	cache->gateway = gateway;
+	cache->seq = seq;
+	cache->multipath = multipath;
+	cache->dev = dev;
+
+	if(gw)
+		*gw = gateway;
+
+	return dev;
 }
 
 void route4_init(void)
 {
-	estack_mutex_create(&ip4_head.lock, 0);
+	estack_mutex_create(&ip4_table.lock, 0);
+
+	ip4_table.root = NULL;
+	ip4_table.first = NULL;
+	ip4_table.seq = 0;
+	ip4_table.stamp = 0;
+	ip4_table.free_nodes = NULL;
+	list_head_init(&ip4_table.free_routes);
+
+	for(int plen = 0; plen < ROUTE4_PREFIXES; plen++)
+		list_head_init(&ip4_table.prefixes[plen]);
 }
 
 void route4_destroy(void)
 {
-	estack_mutex_destroy(&ip4_head.lock);
+	struct list_head *entry, *tmp;
+	struct iproute4_entry *e;
+	struct route4_node *node;
+
+	route4_clear();
+
+	list_for_each_safe(entry, tmp, &ip4_table.free_routes) {
+		list_del(entry);
+		e = list_entry(entry, struct iproute4_entry, entry);
+		free(e->group);
+		free(e);
+	}
+
+	while(ip4_table.free_nodes) {
+		node = ip4_table.free_nodes;
+		ip4_table.free_nodes = node->child[0];
+		free(node);
+	}
+
+	estack_mutex_destroy(&ip4_table.lock);
 }
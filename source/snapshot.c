@@ -0,0 +1,338 @@
+/*
+ * E/STACK - Warm start snapshots
+ *
+ * Author: Michel Megens
+ * Date: 24/02/2018
+ * Email: dev@bietje.net
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <estack/estack.h>
+#include <estack/error.h>
+#include <estack/log.h>
+#include <estack/netdev.h>
+#include <estack/route.h>
+#include <estack/snapshot.h>
+
+/*
+ * Records that have been loaded but have not been applied to a device yet.
+ * Destination cache lifetimes are converted to absolute expiry times on load.
+ */
+struct snapshot_pending {
+	struct snapshot_record *records;
+	bool *applied;
+	uint32_t length;
+	estack_mutex_t lock;
+};
+
+static struct snapshot_pending pending;
+
+struct snapshot_writer {
+	FILE *file;
+	time_t now;
+	uint32_t length;
+	int error;
+};
+
+/*
+ * Records are matched to devices on their name. Devices without a name can't
+ * be matched and are skipped. A name that doesn't fit a record is an error.
+ */
+static bool snapshot_set_name(struct snapshot_writer *writer, struct snapshot_record *record,
+	struct netdev *dev)
+{
+	size_t len;
+
+	if(!dev->name)
+		return false;
+
+	len = strlen(dev->name);
+	if(len >= SNAPSHOT_NAME_LENGTH) {
+		print_dbg("Snapshot: device name %s is too long, skipping its records\n", dev->name);
+		writer->error = -ETOOLARGE;
+		return false;
+	}
+
+	memcpy(record->name, dev->name, len);
+	return true;
+}
+
+static void snapshot_write_dst(struct netdev *dev, struct dst_cache_entry *e, void *arg)
+{
+	struct snapshot_writer *writer;
+	struct snapshot_record record;
+
+	writer = arg;
+
+	/*
+	 * Permanent entries are configured by the application, unresolved entries
+	 * have nothing worth restoring.
+	 */
+	if(e->state != DST_RESOLVED || (e->flags & DST_PERM_MASK) || e->timeout <= writer->now)
+		return;
+
+	memset(&record, 0, sizeof(record));
+	if(!snapshot_set_name(writer, &record, dev))
+		return;
+
+	record.type = SNAPSHOT_DST;
+	record.saddr_length = e->saddr_length;
+	record.hwaddr_length = e->hwaddr_length;
+	record.lifetime = e->timeout - writer->now;
+	memcpy(record.dst.saddr, e->saddr, e->saddr_length);
+	memcpy(record.dst.hwaddr, e->hwaddr, e->hwaddr_length);
+
+	if(fwrite(&record, sizeof(record), 1, writer->file) == 1)
+		writer->length++;
+}
+
+static void snapshot_write_route4(struct iproute4_entry *e, struct route4_nexthop *nh, void *arg)
+{
+	struct snapshot_writer *writer;
+	struct snapshot_record record;
+
+	writer = arg;
+	memset(&record, 0, sizeof(record));
+	if(!snapshot_set_name(writer, &record, nh->dev))
+		return;
+
+	/* Multipath routes are stored as one record per next hop */
+	record.type = SNAPSHOT_ROUTE4;
+	record.weight = nh->weight;
+	record.route4.ip = e->ip;
+	record.route4.mask = e->mask;
+	record.route4.gateway = nh->gateway;
+
+	if(fwrite(&record, sizeof(record), 1, writer->file) == 1)
+		writer->length++;
+}
+
+/**
+ * @brief Write a snapshot of the stack state to a file.
+ * @param path File to write the snapshot to.
+ * @return An error code. \p -ETOOLARGE is returned if the records of a device
+ *         were left out, because its name doesn't fit SNAPSHOT_NAME_LENGTH.
+ *
+ * The snapshot contains the resolved, non-permanent destination cache entries
+ * of all devices and the IPv4 route table. Entries are stored with their
+ * remaining life time, so that stale entries are discarded on restore. Records
+ * of devices without a name are left out.
+ */
+int estack_snapshot_save(const char *path)
+{
+	struct snapshot_writer writer;
+	struct snapshot_header hdr;
+	struct list_head *entry;
+	struct netdev *dev;
+
+	assert(path);
+
+	writer.file = fopen(path, "wb");
+	if(!writer.file)
+		return -EINVALID;
+
+	writer.now = estack_utime();
+	writer.length = 0;
+	writer.error = -EOK;
+
+	memset(&hdr, 0, sizeof(hdr));
+	fwrite(&hdr, sizeof(hdr), 1, writer.file);
+
+	list_for_each(entry, netdev_get_devices()) {
+		dev = list_entry(entry, struct netdev, entry);
+		netdev_foreach_destination(dev, snapshot_write_dst, &writer);
+	}
+
+	route4_foreach(snapshot_write_route4, &writer);
+
+	/* The header is written last, a partially written snapshot is never valid */
+	hdr.magic = SNAPSHOT_MAGIC;
+	hdr.version = SNAPSHOT_VERSION;
+	hdr.length = writer.length;
+	hdr.stamp = writer.now;
+
+	fseek(writer.file, 0, SEEK_SET);
+	if(fwrite(&hdr, sizeof(hdr), 1, writer.file) != 1) {
+		fclose(writer.file);
+		return -EINVALID;
+	}
+
+	if(fclose(writer.file))
+		return -EINVALID;
+
+	return writer.error;
+}
+
+static inline bool snapshot_match(uint32_t idx, struct netdev *dev, snapshot_type_t type)
+{
+	return !pending.applied[idx] && pending.records[idx].type == type &&
+		!strcmp(pending.records[idx].name, dev->name);
+}
+
+static void __snapshot_apply(struct netdev *dev)
+{
+	struct snapshot_record *record;
+	time_t now;
+	bool batch;
+
+	now = estack_utime();
+	for(uint32_t idx = 0; idx < pending.length; idx++) {
+		if(!snapshot_match(idx, dev, SNAPSHOT_DST))
+			continue;
+
+		record = &pending.records[idx];
+		pending.applied[idx] = true;
+
+		if((time_t)record->lifetime > now)
+			netdev_restore_destination(dev, record->dst.hwaddr, record->hwaddr_length,
+				record->dst.saddr, record->saddr_length, record->lifetime - now);
+	}
+
+	/* Routes are loaded in a single batch */
+	batch = false;
+	for(uint32_t idx = 0; idx < pending.length; idx++) {
+		if(!snapshot_match(idx, dev, SNAPSHOT_ROUTE4))
+			continue;
+
+		if(!batch) {
+			route4_batch_begin();
+			batch = true;
+		}
+
+		record = &pending.records[idx];
+		pending.applied[idx] = true;
+		route4_batch_add_nexthop(record->route4.ip, record->route4.mask, record->route4.gateway,
+			dev, record->weight);
+	}
+
+	if(batch)
+		route4_batch_commit();
+}
+
+/**
+ * @brief Apply a loaded snapshot to a device.
+ * @param dev Device to apply the snapshot to.
+ *
+ * Records are matched to devices on the device name. Each record is applied
+ * once. This function is called when a device interface is configured, so
+ * devices created after the snapshot was loaded pick up their state as well.
+ */
+void estack_snapshot_apply(struct netdev *dev)
+{
+	assert(dev);
+
+	if(!dev->name)
+		return;
+
+	estack_mutex_lock(&pending.lock, 0);
+	__snapshot_apply(dev);
+	estack_mutex_unlock(&pending.lock);
+}
+
+static void snapshot_clear(void)
+{
+	free(pending.records);
+	free(pending.applied);
+	pending.records = NULL;
+	pending.applied = NULL;
+	pending.length = 0;
+}
+
+/**
+ * @brief Load a snapshot file.
+ * @param path Snapshot file to load.
+ * @return An error code.
+ *
+ * The snapshot is read in a single bulk read. Destination cache entries that
+ * expired while the stack was down are discarded. Records are applied to
+ * existing devices right away, the remaining records are applied when their
+ * device is configured.
+ */
+int estack_snapshot_load(const char *path)
+{
+	struct snapshot_header hdr;
+	struct snapshot_record *record;
+	struct netdev *dev;
+	FILE *file;
+	time_t now;
+
+	assert(path);
+
+	file = fopen(path, "rb");
+	if(!file)
+		return -EINVALID;
+
+	if(fread(&hdr, sizeof(hdr), 1, file) != 1 || hdr.magic != SNAPSHOT_MAGIC ||
+		hdr.version != SNAPSHOT_VERSION) {
+		fclose(file);
+		return -EINVALID;
+	}
+
+	estack_mutex_lock(&pending.lock, 0);
+	snapshot_clear();
+
+	if(hdr.length) {
+		pending.records = malloc(sizeof(*pending.records) * hdr.length);
+		pending.applied = z_alloc(sizeof(*pending.applied) * hdr.length);
+
+		if(!pending.records || !pending.applied ||
+			fread(pending.records, sizeof(*pending.records), hdr.length, file) != hdr.length) {
+			snapshot_clear();
+			estack_mutex_unlock(&pending.lock);
+			fclose(file);
+			return -EINVALID;
+		}
+
+		pending.length = hdr.length;
+	}
+
+	fclose(file);
+	now = estack_utime();
+
+	for(uint32_t idx = 0; idx < pending.length; idx++) {
+		record = &pending.records[idx];
+		record->name[SNAPSHOT_NAME_LENGTH - 1] = '\0';
+
+		if(record->type != SNAPSHOT_DST)
+			continue;
+
+		/*
+		 * Discard entries that expired while the stack was down. The age of
+		 * the snapshot can't be determined if the clock went backwards.
+		 */
+		if(record->saddr_length > MAX_LOCAL_ADDRESS_LENGTH || record->hwaddr_length > MAX_ADDR_LEN ||
+			now < (time_t)hdr.stamp || (time_t)(hdr.stamp + record->lifetime) <= now) {
+			pending.applied[idx] = true;
+			continue;
+		}
+
+		record->lifetime += hdr.stamp;
+	}
+
+	for(uint32_t idx = 0; idx < pending.length; idx++) {
+		if(pending.applied[idx])
+			continue;
+
+		dev = netdev_find(pending.records[idx].name);
+		if(dev)
+			__snapshot_apply(dev);
+	}
+
+	estack_mutex_unlock(&pending.lock);
+	return -EOK;
+}
+
+void snapshot_init(void)
+{
+	estack_mutex_create(&pending.lock, 0);
+}
+
+void snapshot_destroy(void)
+{
+	snapshot_clear();
+	estack_mutex_destroy(&pending.lock);
+}
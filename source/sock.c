@@ -68,6 +68,43 @@ struct socket *socket_find(ip_addr_t *addr, uint16_t port)
 	return NULL;
 }
 
+/**
+ * @brief Deliver a multicast datagram to all sockets bound to its group and port.
+ * @param nb Datagram to deliver.
+ * @param group Destination group of \p nb.
+ * @param port Destination port of \p nb.
+ * @return The number of sockets \p nb was delivered to.
+ *
+ * Sockets are bound to either the group address or to the any address. Every
+ * socket refers to the data of \p nb, rather than receiving its own copy.
+ */
+int socket_deliver_multicast(struct netbuf *nb, ip_addr_t *group, uint16_t port)
+{
+	struct socket *matches[MAX_SOCKETS];
+	struct socket *sock, tmp;
+	int num;
+
+	tmp.local = *group;
+	tmp.lport = port;
+	num = 0;
+
+	socket_pool_lock();
+	for(int idx = 0; idx < MAX_SOCKETS; idx++) {
+		sock = sockets.sockets[idx];
+		if(!sock || !(sock->flags & SO_DGRAM))
+			continue;
+
+		if(socket_cmp(sock, &tmp))
+			matches[num++] = sock;
+	}
+	socket_pool_unlock();
+
+	for(int idx = 0; idx < num; idx++)
+		matches[idx]->rcv_event(matches[idx], nb);
+
+	return num;
+}
+
 struct socket *socket_find_by_addr(const struct sockaddr *s, socklen_t length)
 {
 	ip_addr_t *addr;
@@ -20,39 +20,38 @@
 #include <estack/netbuf.h>
 #include <estack/error.h>
 
+/*
+ * The receive buffer refers to the application data of nb, rather than
+ * copying it. A reference to nb is held until the data has been read.
+ */
 int socket_datagram_receive_event(struct socket *sock, struct netbuf *nb)
 {
 	size_t length;
 	struct sock_rcv_buffer *buf;
 
-	buf = malloc(sizeof(*buf));
-	buf->index = 0;
-	list_head_init(&buf->entry);
-	length = nb->application.size;
-	buf->data = malloc(length);
+	if(!ip_is_ipv4(nb)) {
+		print_dbg("IPv6 isn't supported yet!\n");
+		return -EINVALID;
+	}
 
-	if(!buf->data) {
-		free(buf);
+	buf = malloc(sizeof(*buf));
+	if(!buf)
 		return -ENOMEMORY;
-	}
 
+	length = nb->application.size;
+	list_head_init(&buf->entry);
+	buf->index = 0;
 	buf->length = length;
-
-	estack_mutex_lock(&sock->mtx, 0);
-	memcpy(buf->data, nb->application.data, length);
+	buf->nb = netbuf_get(nb);
+	buf->data = nb->application.data;
 	buf->port = udp_get_remote_port(nb);
+	buf->addr.addr.in4_addr.s_addr = ipv4_get_remote_address(nb);
+	buf->addr.type = IPADDR_TYPE_V4;
+	buf->csum_pending = netbuf_test_and_clear_flag(nb, NBUF_CSUM_PENDING);
+	buf->csum = nb->csum;
 
-	if(ip_is_ipv4(nb)) {
-		buf->addr.addr.in4_addr.s_addr = ipv4_get_remote_address(nb);
-		buf->addr.type = IPADDR_TYPE_V4;
-	} else {
-		print_dbg("IPv6 isn't supported yet!\n");
-		free(buf->data);
-		free(buf);
-		return -EINVALID;
-	}
-
-	list_add(&buf->entry, &sock->lh);
+	estack_mutex_lock(&sock->mtx, 0);
+	list_add_tail(&buf->entry, &sock->lh);
 	netbuf_set_flag(nb, NBUF_ARRIVED);
 
 	if(sock->readsize != 0)
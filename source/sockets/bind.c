@@ -17,7 +17,7 @@
 
 int estack_bind(int fd, const struct sockaddr *addr, socklen_t length)
 {
-	struct socket *sock;
+	struct socket *sock, *other;
 	const struct sockaddr_in6 *sin6;
 	const struct sockaddr_in *sin;
 
@@ -25,7 +25,9 @@ int estack_bind(int fd, const struct sockaddr *addr, socklen_t length)
 	if(!sock)
 		return -ENOSOCK;
 
-	if(socket_find_by_addr(addr, length))
+	/* Addresses can be shared if all sockets bound to it allow reuse */
+	other = socket_find_by_addr(addr, length);
+	if(other && (other == sock || !(other->flags & sock->flags & SO_REUSE)))
 		return -EINUSE;
 
 	if(addr->sa_family == AF_INET) {
@@ -40,22 +40,28 @@ static int datagram_connect_ipv4(struct socket *sock, const struct sockaddr *add
 static int stream_connect_ipv4(struct socket *sock, const struct sockaddr *addr, socklen_t len)
 {
 	struct sockaddr_in *in;
+	uint32_t hash;
 
 	in = (struct sockaddr_in*)addr;
 	print_dbg("Stream connect: 0x%x\n", ntohl(in->sin_addr.s_addr));
-	sock->dev = route4_lookup(ntohl(in->sin_addr.s_addr), 0);
-	if(!sock->dev)
-		return -EINVALID;
 
-	sock->rport = in->sin_port;
-	sock->addr.addr.in4_addr.s_addr = in->sin_addr.s_addr;
-	sock->addr.type = IPADDR_TYPE_V4;
 #ifdef HAVE_DEBUG
 	if(!sock->lport)
 		sock->lport = htons(eph_port_alloc());
 #else
 	sock->lport = htons(eph_port_alloc());
 #endif
+
+	/* Pick the same next hop as the segments of the connection, see tcp_output */
+	hash = ipv4_flow_hash(0, ntohl(in->sin_addr.s_addr), IP_PROTO_TCP,
+		ntohs(sock->lport), ntohs(in->sin_port));
+	sock->dev = route4_lookup_flow(ntohl(in->sin_addr.s_addr), hash, 0);
+	if(!sock->dev)
+		return -EINVALID;
+
+	sock->rport = in->sin_port;
+	sock->addr.addr.in4_addr.s_addr = in->sin_addr.s_addr;
+	sock->addr.type = IPADDR_TYPE_V4;
 	sock->local.addr.in4_addr.s_addr = INADDR_ANY;
 
 	sock->flags |= SO_CONNECTED;
@@ -14,6 +14,42 @@
 
 #include <estack/error.h>
 #include <estack/socket.h>
+#include <estack/netdev.h>
+#include <estack/ip.h>
+
+static void datagram_release(struct sock_rcv_buffer *buffer)
+{
+	netbuf_free(buffer->nb);
+	list_del(&buffer->entry);
+	free(buffer);
+}
+
+/*
+ * Copy data out of a receive buffer. If the checksum of the datagram is still
+ * pending, it is verified while the data is copied when the datagram is read
+ * in one go.
+ */
+static bool datagram_copy(struct sock_rcv_buffer *buffer, void *buf, size_t num)
+{
+	uint8_t *data;
+	uint16_t csum;
+
+	data = ((uint8_t*)buffer->data) + buffer->index;
+	if(!buffer->csum_pending) {
+		memcpy(buf, data, num);
+		return true;
+	}
+
+	if(num == buffer->length) {
+		csum = ip_checksum_partial_copy(buffer->csum, buf, data, (int)num);
+	} else {
+		csum = ip_checksum_partial(buffer->csum, buffer->data, (int)buffer->length);
+		memcpy(buf, data, num);
+	}
+
+	buffer->csum_pending = false;
+	return (uint16_t)~csum == 0;
+}
 
 static ssize_t datagram_recvfrom(struct socket *sock, void *buf, size_t length,
                                    int flags, struct sockaddr *addr, socklen_t len)
@@ -32,18 +68,29 @@ static ssize_t datagram_recvfrom(struct socket *sock, void *buf, size_t length,
 	} 
  
 	sock->readsize = length;
-	if(likely(list_empty(&sock->lh))) {
-		estack_mutex_unlock(&sock->mtx);
-		estack_event_wait(&sock->read_event, FOREVER);
-		estack_mutex_lock(&sock->mtx, 0);
-	}
 
-	buffer = list_first_entry(&sock->lh, struct sock_rcv_buffer, entry);
-	num = buffer->length - buffer->index;
-	if(num > length)
-		num = length;
+	do {
+		if(likely(list_empty(&sock->lh))) {
+			estack_mutex_unlock(&sock->mtx);
+			estack_event_wait(&sock->read_event, FOREVER);
+			estack_mutex_lock(&sock->mtx, 0);
+		}
+
+		buffer = list_first_entry(&sock->lh, struct sock_rcv_buffer, entry);
+		num = buffer->length - buffer->index;
+		if(num > length)
+			num = length;
+
+		if(datagram_copy(buffer, buf, num))
+			break;
+
+		print_dbg("Dropping UDP packet with bogus checksum\n");
+		if(buffer->nb->dev)
+			netdev_count_dropped(buffer->nb->dev);
+
+		datagram_release(buffer);
+	} while(true);
 
-	memcpy(buf, ((uint8_t*)buffer->data) + buffer->index, num);
 	buffer->index += num;
 
 	if(len) {
@@ -59,11 +106,8 @@ static ssize_t datagram_recvfrom(struct socket *sock, void *buf, size_t length,
 	}
 
 	/* Release the buffer if its fully used up */
-	if(buffer->index >= buffer->length) {
-		free(buffer->data);
-		list_del(&buffer->entry);
-		free(buffer);
-	}
+	if(buffer->index >= buffer->length)
+		datagram_release(buffer);
 
 	sock->readsize = 0;
 	estack_mutex_unlock(&sock->mtx);
@@ -17,6 +17,7 @@
 #include <estack/in6.h>
 #include <estack/socket.h>
 #include <estack/udp.h>
+#include <estack/ip.h>
 
 ssize_t estack_sendto(int fd, const void *msg, size_t length, int flags,
 	const struct sockaddr *daddr, socklen_t len)
@@ -42,9 +43,6 @@ ssize_t estack_sendto(int fd, const void *msg, size_t length, int flags,
 		return -EINVALID;
 	}
 
-	nb = netbuf_alloc(NBAF_APPLICTION, length);
-	netbuf_cpy_data(nb, msg, length, NBAF_APPLICTION);
-
 	if(sock->flags & SO_CONNECTED) {
 		memcpy(&remote, &sock->addr, sizeof(remote));
 		rport = sock->rport;
@@ -65,11 +63,28 @@ ssize_t estack_sendto(int fd, const void *msg, size_t length, int flags,
 		}
 	}
 
-	if(sock->flags & SO_DGRAM || sock->flags & SO_UDP) {
-		udp_output(nb, &remote, rport, sock->lport);
-		rv = length;
+	if(!(sock->flags & SO_DGRAM || sock->flags & SO_UDP)) {
+		estack_mutex_unlock(&sock->mtx);
+		return rv;
+	}
+
+	/* Datagrams that may not be fragmented are refused instead of silently dropped */
+	if(sock->flags & SO_DONTFRAG && !udp_fits_pmtu(&remote, rport, sock->lport, length)) {
+		estack_mutex_unlock(&sock->mtx);
+		return -ETOOLARGE;
 	}
 
+	/* Sum the data while it is copied, the transport layer reuses the sum */
+	nb = netbuf_alloc(NBAF_APPLICTION, length);
+	nb->csum = ip_checksum_partial_copy(0, nb->application.data, msg, (int)length);
+	netbuf_set_flag(nb, NBUF_CSUM_PARTIAL);
+
+	if(sock->flags & SO_DONTFRAG)
+		netbuf_set_flag(nb, NBUF_DONTFRAG);
+
+	udp_output(nb, &remote, rport, sock->lport);
+	rv = length;
+
 	estack_mutex_unlock(&sock->mtx);
 	return rv;
 }
@@ -14,6 +14,7 @@
 #include <estack/error.h>
 #include <estack/socket.h>
 #include <estack/tcp.h>
+#include <estack/igmp.h>
 
 #define SOCK_EVENT_LENGTH MAX_SOCKETS
 
@@ -25,6 +26,7 @@ void socket_init(struct socket *sock)
 	estack_mutex_create(&sock->mtx, 0);
 	estack_event_create(&sock->read_event, SOCK_EVENT_LENGTH);
 	list_head_init(&sock->lh);
+	list_head_init(&sock->mcast);
 	sock->err = -EOK;
 }
 
@@ -41,7 +43,26 @@ static struct socket *socket_alloc(void)
 
 void socket_destroy(struct socket *sock)
 {
+	struct list_head *entry, *tmp;
+	struct sock_rcv_buffer *buf;
+	struct sock_mcast *mc;
+
 	estack_mutex_lock(&sock->mtx, 0);
+
+	list_for_each_safe(entry, tmp, &sock->lh) {
+		buf = list_entry(entry, struct sock_rcv_buffer, entry);
+		list_del(entry);
+		netbuf_free(buf->nb);
+		free(buf);
+	}
+
+	list_for_each_safe(entry, tmp, &sock->mcast) {
+		mc = list_entry(entry, struct sock_mcast, entry);
+		list_del(entry);
+		igmp_leave(mc->dev, mc->group);
+		free(mc);
+	}
+
 	estack_event_destroy(&sock->read_event);
 	estack_mutex_unlock(&sock->mtx);
 	estack_mutex_destroy(&sock->mtx);
@@ -0,0 +1,191 @@
+/*
+ * E/STACK - Socket options
+ *
+ * Author: Michel Megens
+ * Date:   24/02/2018
+ * Email:  dev@bietje.net
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <estack.h>
+
+#include <estack/error.h>
+#include <estack/inet.h>
+#include <estack/in.h>
+#include <estack/ip.h>
+#include <estack/igmp.h>
+#include <estack/route.h>
+#include <estack/netdev.h>
+#include <estack/socket.h>
+
+static struct netdev *sockopt_find_dev(uint32_t local, uint32_t group)
+{
+	struct list_head *entry;
+	struct netdev *dev;
+
+	/* Use the interface the group is routed to by default */
+	if(local == INADDR_ANY)
+		return route4_lookup(group, NULL);
+
+	list_for_each(entry, netdev_get_devices()) {
+		dev = list_entry(entry, struct netdev, entry);
+		if(ipv4_ptoi(dev->nif.local_ip) == local)
+			return dev;
+	}
+
+	return NULL;
+}
+
+static struct sock_mcast *sockopt_find_membership(struct socket *sock, uint32_t group,
+	struct netdev *dev)
+{
+	struct list_head *entry;
+	struct sock_mcast *mc;
+
+	list_for_each(entry, &sock->mcast) {
+		mc = list_entry(entry, struct sock_mcast, entry);
+		if(mc->group == group && mc->dev == dev)
+			return mc;
+	}
+
+	return NULL;
+}
+
+static int sockopt_add_membership(struct socket *sock, uint32_t group, struct netdev *dev)
+{
+	struct sock_mcast *mc;
+	int rc;
+
+	if(sockopt_find_membership(sock, group, dev))
+		return -EINUSE;
+
+	mc = z_alloc(sizeof(*mc));
+	if(!mc)
+		return -ENOMEMORY;
+
+	rc = igmp_join(dev, group);
+	if(rc != -EOK) {
+		free(mc);
+		return rc;
+	}
+
+	mc->group = group;
+	mc->dev = dev;
+	list_add(&mc->entry, &sock->mcast);
+	return -EOK;
+}
+
+static int sockopt_drop_membership(struct socket *sock, uint32_t group, struct netdev *dev)
+{
+	struct sock_mcast *mc;
+
+	mc = sockopt_find_membership(sock, group, dev);
+	if(!mc)
+		return -EINVALID;
+
+	list_del(&mc->entry);
+	free(mc);
+	return igmp_leave(dev, group);
+}
+
+static int sockopt_set_flag(struct socket *sock, uint32_t flag, const void *optval, socklen_t length)
+{
+	const int *value;
+
+	if(length < sizeof(*value))
+		return -EINVALID;
+
+	value = optval;
+	estack_mutex_lock(&sock->mtx, 0);
+	if(*value)
+		sock->flags |= flag;
+	else
+		sock->flags &= ~flag;
+	estack_mutex_unlock(&sock->mtx);
+
+	return -EOK;
+}
+
+static int sockopt_ip(struct socket *sock, int optname, const void *optval, socklen_t length)
+{
+	const struct ip_mreq *mreq;
+	struct netdev *dev;
+	uint32_t group;
+	int rc;
+
+	if(optname == IP_DONTFRAG)
+		return sockopt_set_flag(sock, SO_DONTFRAG, optval, length);
+
+	if(optname != IP_ADD_MEMBERSHIP && optname != IP_DROP_MEMBERSHIP)
+		return -ENOTSUPPORTED;
+
+	if(length < sizeof(*mreq) || !(sock->flags & SO_DGRAM))
+		return -EINVALID;
+
+	mreq = optval;
+	group = ntohl(mreq->imr_multiaddr.s_addr);
+	if(!IS_MULTICAST(group))
+		return -EINVALID;
+
+	dev = sockopt_find_dev(ntohl(mreq->imr_interface.s_addr), group);
+	if(!dev)
+		return -EINVALID;
+
+	estack_mutex_lock(&sock->mtx, 0);
+	if(optname == IP_ADD_MEMBERSHIP)
+		rc = sockopt_add_membership(sock, group, dev);
+	else
+		rc = sockopt_drop_membership(sock, group, dev);
+	estack_mutex_unlock(&sock->mtx);
+
+	return rc;
+}
+
+static int sockopt_socket(struct socket *sock, int optname, const void *optval, socklen_t length)
+{
+	if(optname != SO_REUSEADDR)
+		return -ENOTSUPPORTED;
+
+	return sockopt_set_flag(sock, SO_REUSE, optval, length);
+}
+
+/**
+ * @brief Set a socket option.
+ * @param fd Socket descriptor.
+ * @param level Protocol level of \p optname.
+ * @param optname Option to set.
+ * @param optval Option value.
+ * @param length Length of \p optval.
+ * @return An error code.
+ *
+ * Supported options are \p SO_REUSEADDR at level \p SOL_SOCKET and
+ * \p IP_ADD_MEMBERSHIP, \p IP_DROP_MEMBERSHIP and \p IP_DONTFRAG at level
+ * \p IPPROTO_IP. Memberships are dropped when the socket is closed. Datagrams
+ * sent on a socket with \p IP_DONTFRAG set are dropped instead of fragmented
+ * if they exceed the path MTU.
+ */
+int estack_setsockopt(int fd, int level, int optname, const void *optval, socklen_t length)
+{
+	struct socket *sock;
+
+	sock = socket_get(fd);
+	if(!sock)
+		return -ENOSOCK;
+
+	if(!optval)
+		return -EINVALID;
+
+	switch(level) {
+	case SOL_SOCKET:
+		return sockopt_socket(sock, optname, optval, length);
+
+	case IPPROTO_IP:
+		return sockopt_ip(sock, optname, optval, length);
+
+	default:
+		return -ENOTSUPPORTED;
+	}
+}
@@ -16,13 +16,24 @@
 
 static int tcp_input_verify(struct netbuf *nb, struct tcp_hdr *hdr)
 {
-	struct ipv4_header *ip4hdr;
-	uint16_t csum;
+	uint16_t csum, length;
+
+	if(netbuf_test_flag(nb, NBUF_LOOPED))
+		return -EOK;
 
 	if(ip_is_ipv4(nb)) {
-		ip4hdr = nb->network.data;
-		csum = ipv4_inet_csum(nb->transport.data, (uint16_t) nb->transport.size,
-			ipv4_get_saddr(ip4hdr), ipv4_get_daddr(ip4hdr), IP_PROTO_TCP);
+		/* The header and data of a received segment are contiguous */
+		length = (uint16_t)(nb->transport.size + nb->application.size);
+
+		if(netbuf_test_and_clear_flag(nb, NBUF_CSUM_COMPLETE)) {
+			/* The sum of the segment is known already */
+			csum = (uint16_t)ipv4_pseudo_partial_csum(htonl(nb->meta.saddr), htonl(nb->meta.daddr),
+				IP_PROTO_TCP, htons(length));
+			csum = (uint16_t)~ip_checksum_add(csum, nb->csum);
+		} else {
+			csum = ipv4_inet_csum(nb->transport.data, length, nb->meta.saddr,
+				nb->meta.daddr, IP_PROTO_TCP);
+		}
 
 		if(csum) {
 			print_dbg("Dropping TCP segment with bogus checksum: %x\n", hdr->checksum);
@@ -57,19 +68,16 @@ void tcp_input(struct netbuf *nb)
 		return;
 	}
 
-	hdr->sport = ntohs(hdr->sport);
+	nb->meta.sport = ntohs(hdr->sport);
+	nb->meta.dport = ntohs(hdr->dport);
+
 	sock = NULL;
 	if(ip_is_ipv4(nb)) {
 		addr.type = IPADDR_TYPE_V4;
-		addr.addr.in4_addr.s_addr = htonl(ipv4_get_daddr(nb->network.data));
+		addr.addr.in4_addr.s_addr = htonl(nb->meta.daddr);
 		sock = socket_find(&addr, hdr->dport);
 	}
 
-	hdr->dport = ntohs(hdr->dport);
-	hdr->seq_no = ntohl(hdr->seq_no);
-	hdr->window = ntohs(hdr->window);
-	hdr->ack_no = ntohl(hdr->ack_no);
-
 	if(sock) {
 		print_dbg("TCP segment arrived!\n");
 		tcp_process(sock, nb);
@@ -46,6 +46,7 @@ int tcp_output(struct netbuf *nb, struct tcp_pcb *pcb, uint32_t seq)
 	hdr->checksum = 0;
 	hdr->urg_ptr = 0;
 	nb->protocol = IP_PROTO_TCP;
+	netbuf_set_flag(nb, NBUF_DONTFRAG);
 
 	sock = &pcb->sock;
 	dev = sock->dev;
@@ -56,11 +57,14 @@ int tcp_output(struct netbuf *nb, struct tcp_pcb *pcb, uint32_t seq)
 		dst = sock->addr.addr.in4_addr.s_addr;
 		saddr = ipv4_ptoi(nif->local_ip);
 		dev = sock->dev;
+		nb->hash = ipv4_flow_hash(0, ntohl(dst), IP_PROTO_TCP, ntohs(sock->lport), ntohs(sock->rport));
 
-		csum = (uint16_t)ipv4_pseudo_partial_csum(htonl(saddr), dst, IP_PROTO_TCP,
-			htons((uint16_t)(nb->transport.size + nb->application.size)));
-		csum = ip_checksum_partial(csum, hdr, nb->transport.size);
-		hdr->checksum = ip_checksum(csum, nb->application.data, nb->application.size);
+		if(!(dev->features & NETDEV_FEATURE_CSUM)) {
+			csum = (uint16_t)ipv4_pseudo_partial_csum(htonl(saddr), dst, IP_PROTO_TCP,
+				htons((uint16_t)(nb->transport.size + nb->application.size)));
+			csum = ip_checksum_partial(csum, hdr, nb->transport.size);
+			hdr->checksum = ip_checksum(csum, nb->application.data, nb->application.size);
+		}
 		ipv4_output(nb, ntohl(sock->addr.addr.in4_addr.s_addr));
 	} else {
 		print_dbg("TCP over IPv6 is not yet supported!\n");
@@ -15,6 +15,7 @@
 #include <estack/socket.h>
 #include <estack/error.h>
 #include <estack/tcp.h>
+#include <estack/ip.h>
 #include <estack/route.h>
 
 static void tcp_send_fin(struct tcp_pcb *pcb);
@@ -34,6 +35,39 @@ static inline void tcp_pcb_unlock(struct tcp_pcb *pcb)
 	estack_mutex_unlock(&pcb->sock.mtx);
 }
 
+/* Largest segment that fits in a datagram of \p mtu bytes */
+static inline uint16_t tcp_mtu_to_mss(uint16_t mtu)
+{
+	size_t mss;
+
+	mss = mtu - sizeof(struct ipv4_header) - TCP_HDR_LENGTH;
+	return (uint16_t)(mss > TCP_MAX_MSS ? TCP_MAX_MSS : mss);
+}
+
+/* Largest segment that fits in the path MTU to the remote end of \p pcb */
+static inline uint16_t tcp_path_mss(struct tcp_pcb *pcb)
+{
+	uint16_t mtu;
+
+	mtu = ipv4_pmtu_lookup(pcb->sock.dev, ntohl(pcb->sock.addr.addr.in4_addr.s_addr));
+	return tcp_mtu_to_mss(mtu);
+}
+
+/*
+ * The receive window has to hold a few full sized segments, otherwise the
+ * remote end can't make use of a jumbo MSS.
+ */
+static inline uint16_t tcp_rcv_window(uint16_t mss)
+{
+	uint32_t window;
+
+	window = (uint32_t)mss * TCP_WINDOW_SEGMENTS;
+	if(window < TCP_WINSIZE)
+		return TCP_WINSIZE;
+
+	return (uint16_t)(window > TCP_MAX_WINDOW_SIZE ? TCP_MAX_WINDOW_SIZE : window);
+}
+
 struct socket *tcp_socket_alloc(void)
 {
 	struct tcp_pcb *pcb;
@@ -304,9 +338,18 @@ int tcp_connect(struct socket *sock)
 		return -EINVALID;
 	}
 
-	pcb->mss = TCP_MSS;
-	pcb->rcv_window = TCP_WINSIZE;
-	pcb->rcv_window_announce = TCP_WINSIZE;
+	/*
+	 * Announce the largest segment the interface can receive. Segments sent
+	 * are limited to the path MTU, and to the default MSS until the remote
+	 * end announces its own.
+	 */
+	pcb->mss = tcp_mtu_to_mss(dev->mtu);
+	pcb->smss = tcp_path_mss(pcb);
+	if(pcb->smss > TCP_MSS)
+		pcb->smss = TCP_MSS;
+
+	pcb->rcv_window = tcp_rcv_window(pcb->mss);
+	pcb->rcv_window_announce = pcb->rcv_window;
 
 	pcb->snd_next = 0;
 	pcb->snd_window = 0;
@@ -346,8 +389,11 @@ static void tcp_parse_options(struct tcp_pcb *pcb, struct tcp_hdr *hdr)
 			opt_mss = (struct tcp_options_mss*)data;
 			mss = ntohs(opt_mss->mss);
 
-			if(mss > TCP_MSS && mss < TCP_MAX_MSS)
-				pcb->smss = mss;
+			if(mss) {
+				pcb->smss = tcp_path_mss(pcb);
+				if(mss < pcb->smss)
+					pcb->smss = mss;
+			}
 
 			data += sizeof(struct tcp_options_mss);
 			optlen -= sizeof(struct tcp_options_mss);
@@ -440,13 +486,15 @@ static void tcp_syn_sent(struct tcp_pcb *pcb, struct netbuf *nb)
 {
 	struct tcp_hdr *hdr;
 	uint16_t flags;
+	uint32_t ack;
 
 	hdr = nb->transport.data;
 	flags = tcp_hdr_get_flags(hdr);
+	ack = tcp_hdr_get_ack(hdr);
 
 	if(flags & TCP_ACK) {
 		/* Validate packet */
-		if(hdr->ack_no <= pcb->iss || hdr->ack_no > pcb->snd_next) {
+		if(ack <= pcb->iss || ack > pcb->snd_next) {
 			if(flags & TCP_RST)
 				tcp_reset(pcb);
 
@@ -454,7 +502,7 @@ static void tcp_syn_sent(struct tcp_pcb *pcb, struct netbuf *nb)
 			return;
 		}
 
-		if(hdr->ack_no < pcb->snd_unack || hdr->ack_no > pcb->snd_next) {
+		if(ack < pcb->snd_unack || ack > pcb->snd_next) {
 			netbuf_set_flag(nb, NBUF_DROPPED);
 			return;
 		}
@@ -466,9 +514,9 @@ static void tcp_syn_sent(struct tcp_pcb *pcb, struct netbuf *nb)
 		return;
 	}
 
-	pcb->rcv_next = hdr->seq_no + 1;
+	pcb->rcv_next = tcp_hdr_get_seq(hdr) + 1;
 	if(flags & TCP_ACK) {
-		pcb->snd_unack = hdr->ack_no;
+		pcb->snd_unack = ack;
 		tcp_clear_rto(pcb);
 	}
 
@@ -517,7 +565,7 @@ void tcp_process(struct socket *sock , struct netbuf *nb)
 
 	/* Check syn */
 
-	expected = hdr->seq_no == pcb->rcv_next;
+	expected = tcp_hdr_get_seq(hdr) == pcb->rcv_next;
 	/* Process data */
 
 	/* In sequence FIN */
@@ -533,6 +581,41 @@ void tcp_process(struct socket *sock , struct netbuf *nb)
 	tcp_pcb_unlock(pcb);
 }
 
+/**
+ * @brief Handle a path MTU decrease for a connection.
+ * @param saddr Local address.
+ * @param sport Local port.
+ * @param daddr Remote address.
+ * @param dport Remote port.
+ * @param mtu New path MTU.
+ *
+ * All addresses and ports are in network byte order, as quoted by the
+ * ICMP fragmentation needed message.
+ */
+void tcp_pmtu_update(uint32_t saddr, uint16_t sport, uint32_t daddr, uint16_t dport, uint16_t mtu)
+{
+	struct socket *sock;
+	struct tcp_pcb *pcb;
+	ip_addr_t addr;
+	uint16_t mss;
+
+	addr.type = IPADDR_TYPE_V4;
+	addr.addr.in4_addr.s_addr = saddr;
+	sock = socket_find(&addr, sport);
+
+	if(!sock || !(sock->flags & SO_TCP) || sock->addr.addr.in4_addr.s_addr != daddr ||
+		sock->rport != dport)
+		return;
+
+	pcb = tcp_sock_to_pcb(sock);
+	mss = tcp_mtu_to_mss(mtu);
+
+	tcp_pcb_lock(pcb);
+	if(mss < pcb->smss)
+		pcb->smss = mss;
+	tcp_pcb_unlock(pcb);
+}
+
 static void tcp_send_fin(struct tcp_pcb *pcb)
 {
 	struct netbuf *nb;
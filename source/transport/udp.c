@@ -22,66 +22,111 @@
 
 static void udp_port_unreachable(struct netbuf *nb)
 {
-	struct udp_header *udp;
-
-	udp = nb->transport.data;
 	print_dbg("UDP socked unreachable ([local - remote]): [%u - %u]\n",
-	            udp->dport, udp->sport);
+	            nb->meta.dport, nb->meta.sport);
 	netbuf_set_flag(nb, NBUF_REUSE);
-	udp->sport = htons(udp->sport);
-	udp->dport = htons(udp->dport);
-	udp->length = htons(udp->length);
 	icmp_response(nb, ICMP_UNREACH, ICMP_UNREACH_PORT, 0);
 }
 
+static bool udp_csum_valid(struct netbuf *nb)
+{
+	uint16_t csum;
+
+	if(!netbuf_test_and_clear_flag(nb, NBUF_CSUM_PENDING))
+		return true;
+
+	csum = ip_checksum(nb->csum, nb->application.data, (int)nb->application.size);
+	if(csum) {
+		print_dbg("Dropping UDP packet with bogus checksum: %x\n", csum);
+		netbuf_set_flag(nb, NBUF_DROPPED);
+		return false;
+	}
+
+	return true;
+}
+
 void udp_input(struct netbuf *nb)
 {
 	struct udp_header *hdr;
-	uint16_t length;
 	uint16_t csum;
 	ip_addr_t addr;
 	struct socket *sock;
+	bool looped, complete;
 
 	hdr = nb->transport.data;
-	if(nb->transport.size <= sizeof(*hdr)) {
+	looped = netbuf_test_flag(nb, NBUF_LOOPED);
+	if(nb->transport.size < sizeof(*hdr) || (!looped && nb->transport.size == sizeof(*hdr))) {
 		netbuf_set_flag(nb, NBUF_DROPPED);
 		return;
 	}
 
-	length = ntohs(hdr->length);
-	if(hdr->csum) {
+	nb->meta.sport = ntohs(hdr->sport);
+	nb->meta.dport = ntohs(hdr->dport);
+
+	if(!looped) {
+		nb->application.size = nb->transport.size - sizeof(*hdr);
+		nb->application.data = (void*) (hdr + 1);
+	}
+
+	complete = netbuf_test_and_clear_flag(nb, NBUF_CSUM_COMPLETE);
+
+	if(hdr->csum && !looped) {
 		if(hdr->csum == 0xFFFF)
 			hdr->csum = 0x0;
 		
 		if(ip_is_ipv4(nb)) {
-			csum = ipv4_inet_csum(nb->transport.data, (uint16_t)nb->transport.size,
-								ipv4_get_saddr(nb->network.data),
-								ipv4_get_daddr(nb->network.data), IP_PROTO_UDP);
-			
-			if(csum) {
-				print_dbg("Dropping UDP packet with bogus checksum: %x\n", csum);
-				netbuf_set_flag(nb, NBUF_DROPPED);
-				return;
+			csum = (uint16_t)ipv4_pseudo_partial_csum(htonl(nb->meta.saddr), htonl(nb->meta.daddr),
+				IP_PROTO_UDP, htons((uint16_t)nb->transport.size));
+
+			if(complete) {
+				/* The sum of the datagram is known already */
+				csum = (uint16_t)~ip_checksum_add(csum, nb->csum);
+				if(csum) {
+					print_dbg("Dropping UDP packet with bogus checksum: %x\n", csum);
+					netbuf_set_flag(nb, NBUF_DROPPED);
+					return;
+				}
+			} else {
+				/*
+				 * Only the headers are summed here. The data is summed when it
+				 * is needed, which for datagram sockets is while it is copied
+				 * to the application.
+				 */
+				nb->csum = ip_checksum_partial(csum, hdr, sizeof(*hdr));
+				netbuf_set_flag(nb, NBUF_CSUM_PENDING);
 			}
 		}
 	}
 
-	hdr->length = length;
-	hdr->sport = ntohs(hdr->sport);
-
-	nb->application.size = nb->transport.size - sizeof(*hdr);
 	if(!nb->application.size) {
-		netbuf_set_flag(nb, NBUF_ARRIVED);
+		if(udp_csum_valid(nb))
+			netbuf_set_flag(nb, NBUF_ARRIVED);
 		return;
 	}
 
-	nb->application.data = (void*) (hdr + 1);
 	/* Find the right socket and dump data into the socket */
 	if(ip_is_ipv4(nb)) {
 		addr.type = 4;
-		addr.addr.in4_addr.s_addr = htonl(ipv4_get_daddr(nb->network.data));
+		addr.addr.in4_addr.s_addr = htonl(nb->meta.daddr);
+
+		if(netbuf_test_flag(nb, NBUF_MULTICAST)) {
+			if(!udp_csum_valid(nb))
+				return;
+
+			/* Datagrams for groups without subscribers are dropped silently */
+			if(socket_deliver_multicast(nb, &addr, hdr->dport))
+				netbuf_set_flag(nb, NBUF_ARRIVED);
+			else
+				netbuf_set_flag(nb, NBUF_DROPPED);
+
+			return;
+		}
+
 		sock = socket_find(&addr, hdr->dport);
-		hdr->dport = ntohs(hdr->dport);
+
+		/* Datagram sockets verify the checksum when the data is read */
+		if(!(sock && (sock->flags & SO_DGRAM)) && !udp_csum_valid(nb))
+			return;
 
 		if(sock) {
 			sock->rcv_event(sock, nb);
@@ -94,10 +139,34 @@ void udp_input(struct netbuf *nb)
 
 uint16_t udp_get_remote_port(struct netbuf *nb)
 {
-	struct udp_header *hdr;
+	return nb->meta.sport;
+}
 
-	hdr = nb->transport.data;
-	return hdr->sport;
+/**
+ * @brief Check if a datagram can be sent without fragmenting it.
+ * @param daddr Destination address.
+ * @param rport Remote port.
+ * @param lport Local port.
+ * @param length Length of the datagram payload.
+ * @return True if the datagram fits in the path MTU to \p daddr.
+ *
+ * The output device is looked up the same way \p udp_output does.
+ */
+bool udp_fits_pmtu(ip_addr_t *daddr, uint16_t rport, uint16_t lport, size_t length)
+{
+	struct netdev *dev;
+	uint32_t dst, hash;
+
+	assert(daddr);
+
+	if(daddr->type != IPADDR_TYPE_V4)
+		return true;
+
+	dst = ntohl(daddr->addr.in4_addr.s_addr);
+	hash = ipv4_flow_hash(0, dst, IP_PROTO_UDP, ntohs(lport), ntohs(rport));
+	dev = route4_lookup_flow(dst, hash, NULL);
+
+	return ipv4_fits_pmtu(dev, dst, sizeof(struct udp_header) + length);
 }
 
 /**
@@ -127,7 +196,8 @@ void udp_output(struct netbuf *nb, ip_addr_t *daddr, uint16_t rport, uint16_t lp
 
 	if(daddr->type == IPADDR_TYPE_V4) {
 		dst = daddr->addr.in4_addr.s_addr;
-		dev = route4_lookup(dst, &saddr);
+		nb->hash = ipv4_flow_hash(0, ntohl(dst), IP_PROTO_UDP, ntohs(lport), ntohs(rport));
+		dev = route4_lookup_flow(ntohl(dst), nb->hash, NULL);
 		if(dev) {
 			nif = &dev->nif;
 			saddr = ipv4_ptoi(nif->local_ip);
@@ -138,9 +208,17 @@ void udp_output(struct netbuf *nb, ip_addr_t *daddr, uint16_t rport, uint16_t lp
 		netbuf_set_dev(nb, dev);
 		hdr->csum = 0;
 		hdr->length = htons(hdr->length);
-		chksum = ipv4_pseudo_partial_csum(htonl(saddr), dst, IP_PROTO_UDP, hdr->length);
-		chksum = ip_checksum_partial((uint16_t)chksum, hdr, sizeof(*hdr));
-		hdr->csum = ip_checksum((uint16_t)chksum, nb->application.data, nb->application.size);
+
+		if(!dev || !(dev->features & NETDEV_FEATURE_CSUM)) {
+			chksum = ipv4_pseudo_partial_csum(htonl(saddr), dst, IP_PROTO_UDP, hdr->length);
+			chksum = ip_checksum_partial((uint16_t)chksum, hdr, sizeof(*hdr));
+
+			if(netbuf_test_flag(nb, NBUF_CSUM_PARTIAL))
+				hdr->csum = (uint16_t)~ip_checksum_add((uint16_t)chksum, nb->csum);
+			else
+				hdr->csum = ip_checksum((uint16_t)chksum, nb->application.data,
+					(int)nb->application.size);
+		}
 
 		ipv4_output(nb, ntohl(dst));
 	}
@@ -0,0 +1,124 @@
+/*
+ * ARP cache refresh unit test
+ *
+ * Author: Michel Megens
+ * Date:   24/02/2018
+ * Email:  dev@bietje.net
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <estack.h>
+
+#include <estack/netdev.h>
+#include <estack/netbuf.h>
+#include <estack/ethernet.h>
+#include <estack/pcapdev.h>
+#include <estack/inet.h>
+#include <estack/arp.h>
+#include <estack/ip.h>
+#include <estack/test.h>
+
+#include "frame.h"
+
+#define HW_ADDR {0x48, 0x5D, 0x60, 0xBF, 0x51, 0xA9}
+static const uint8_t hw_old[] = {0x00, 0x00, 0x5e, 0x00, 0x01, 0x31};
+static const uint8_t hw_new[] = {0x00, 0x00, 0x5e, 0x00, 0x01, 0x32};
+static const uint8_t hwbcast[] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+
+#define LOCAL_ADDR "145.49.33.186"
+#define REMOTE_ADDR "145.49.33.1"
+
+#define TEST_CACHE_AGE    1500000
+#define TEST_CACHE_REFRESH 1000000
+
+static bool test_resolve(struct netdev *dev, uint8_t *hw)
+{
+	uint32_t addr;
+
+	addr = ipv4_atoi(REMOTE_ADDR);
+	return netdev_resolve_destination(dev, (uint8_t*)&addr, IPV4_ADDR_SIZE, hw);
+}
+
+static void test_wait_tx(struct netdev *dev, uint32_t packets)
+{
+	for(int i = 0; i < 100 && netdev_get_tx_packets(dev) < packets; i++)
+		estack_sleep(10);
+
+	assert(netdev_get_tx_packets(dev) == packets);
+}
+
+static void test_refresh(struct netdev *dev)
+{
+	struct netbuf *nb;
+	uint8_t hw[MAX_ADDR_LEN];
+	uint32_t tx;
+	time_t learned;
+
+	tx = netdev_get_tx_packets(dev);
+
+	/* Learn the peer from its request, and answer it */
+	nb = test_alloc_arp(hwbcast, hw_old, ARP_OP_REQUEST, ipv4_atoi(REMOTE_ADDR), ipv4_atoi(LOCAL_ADDR));
+	learned = estack_utime();
+	netdev_add_backlog(dev, nb);
+	netdev_wakeup();
+	test_wait_tx(dev, tx + 1);
+
+	/* Use the entry, so that it is refreshed before it expires */
+	assert(test_resolve(dev, hw));
+	assert(!memcmp(hw, hw_old, ETHERNET_MAC_LENGTH));
+
+	for(int i = 0; i < 150 && netdev_get_tx_packets(dev) < tx + 2; i++)
+		estack_sleep(10);
+
+	assert(netdev_get_tx_packets(dev) == tx + 2);
+	assert(estack_utime() - learned < TEST_CACHE_AGE);
+
+	/* The old address is used until the peer answers */
+	assert(test_resolve(dev, hw));
+	assert(!memcmp(hw, hw_old, ETHERNET_MAC_LENGTH));
+
+	nb = test_alloc_arp(dev->hwaddr, hw_new, ARP_OP_REPLY, ipv4_atoi(REMOTE_ADDR), ipv4_atoi(LOCAL_ADDR));
+	netdev_add_backlog(dev, nb);
+	netdev_wakeup();
+
+	for(int i = 0; i < 100; i++) {
+		if(test_resolve(dev, hw) && !memcmp(hw, hw_new, ETHERNET_MAC_LENGTH))
+			break;
+
+		estack_sleep(10);
+	}
+
+	assert(!memcmp(hw, hw_new, ETHERNET_MAC_LENGTH));
+
+	/* The reply extended the lifetime of the entry */
+	estack_sleep((TEST_CACHE_AGE - (estack_utime() - learned)) / 1000 + 100);
+	assert(test_resolve(dev, hw));
+}
+
+int main(int argc, char **argv)
+{
+	struct netdev *dev;
+	const uint8_t hwaddr[] = HW_ADDR;
+
+	UNUSED(argc);
+	UNUSED(argv);
+
+	estack_init(NULL);
+	netdev_config_cache(TEST_CACHE_AGE, TEST_CACHE_REFRESH);
+
+	dev = pcapdev_create(NULL, 0, "arp-refresh-output.pcap", hwaddr, 1500);
+	pcapdev_create_link_ip4(dev, ipv4_atoi(LOCAL_ADDR), 0, 0xFFFFC000);
+
+	test_refresh(dev);
+
+	netdev_print(dev, stdout);
+	pcapdev_destroy(dev);
+	estack_destroy();
+
+	wait_close();
+	return 0;
+}
@@ -0,0 +1,97 @@
+/*
+ * E/STACK - Unit test frame builders
+ *
+ * Author: Michel Megens
+ * Date:   24/02/2018
+ * Email:  dev@bietje.net
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <estack.h>
+
+#include <estack/netbuf.h>
+#include <estack/ethernet.h>
+#include <estack/inet.h>
+#include <estack/ip.h>
+#include <estack/arp.h>
+#include <estack/prototype.h>
+
+#include "frame.h"
+
+#define ARP_HWTYPE_ETHERNET 1
+
+static struct netbuf *test_alloc_ethernet(const uint8_t *dmac, const uint8_t *smac, uint16_t type,
+	size_t length)
+{
+	struct netbuf *nb;
+	struct ethernet_header *eth;
+	size_t size;
+
+	size = sizeof(*eth) + length;
+	nb = netbuf_alloc(NBAF_DATALINK, size);
+	memset(nb->datalink.data, 0, size);
+	eth = nb->datalink.data;
+
+	memcpy(eth->dest_mac, dmac, ETHERNET_MAC_LENGTH);
+	memcpy(eth->src_mac, smac, ETHERNET_MAC_LENGTH);
+	eth->type = htons(type);
+
+	netbuf_set_flag(nb, NBUF_RX);
+	nb->protocol = PROTO_ETHERNET;
+	nb->size = size;
+	return nb;
+}
+
+void test_ipv4_update_csum(struct ipv4_header *hdr)
+{
+	hdr->chksum = 0;
+	hdr->chksum = ip_checksum(0, hdr, (hdr->ihl_version & 0xF) * sizeof(uint32_t));
+}
+
+struct netbuf *test_alloc_frame(const uint8_t *dmac, const uint8_t *smac, uint32_t saddr,
+	uint32_t daddr, uint8_t proto, size_t length, void **data)
+{
+	struct netbuf *nb;
+	struct ipv4_header *hdr;
+
+	nb = test_alloc_ethernet(dmac, smac, ETH_TYPE_IP, sizeof(*hdr) + length);
+	hdr = (void*)((struct ethernet_header*)nb->datalink.data + 1);
+
+	hdr->ihl_version = 0x45;
+	hdr->length = htons((uint16_t)(sizeof(*hdr) + length));
+	hdr->ttl = IPV4_TTL;
+	hdr->protocol = proto;
+	hdr->saddr = htonl(saddr);
+	hdr->daddr = htonl(daddr);
+	test_ipv4_update_csum(hdr);
+
+	if(data)
+		*data = hdr + 1;
+
+	return nb;
+}
+
+struct netbuf *test_alloc_arp(const uint8_t *dmac, const uint8_t *smac, uint16_t op,
+	uint32_t saddr, uint32_t daddr)
+{
+	struct netbuf *nb;
+	struct arp_header *hdr;
+	struct arp_ipv4_header *ip4hdr;
+
+	nb = test_alloc_ethernet(dmac, smac, ETH_TYPE_ARP, sizeof(*hdr) + sizeof(*ip4hdr));
+	hdr = (void*)((struct ethernet_header*)nb->datalink.data + 1);
+	ip4hdr = (void*)(hdr + 1);
+
+	hdr->hwtype = htons(ARP_HWTYPE_ETHERNET);
+	hdr->protocol = htons(ETH_TYPE_IP);
+	hdr->hwsize = ETHERNET_MAC_LENGTH;
+	hdr->protosize = sizeof(uint32_t);
+	hdr->opcode = htons(op);
+
+	memcpy(ip4hdr->hw_src_addr, smac, ETHERNET_MAC_LENGTH);
+	ip4hdr->ip_src_addr = htonl(saddr);
+	ip4hdr->ip_target_addr = htonl(daddr);
+	return nb;
+}
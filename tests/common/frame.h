@@ -0,0 +1,37 @@
+/*
+ * E/STACK - Unit test frame builders
+ *
+ * Author: Michel Megens
+ * Date:   24/02/2018
+ * Email:  dev@bietje.net
+ */
+
+#ifndef __TEST_FRAME_H__
+#define __TEST_FRAME_H__
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <estack/estack.h>
+#include <estack/netbuf.h>
+#include <estack/ip.h>
+
+CDECL
+/*
+ * Build a received ethernet frame carrying an IPv4 datagram of \p length payload
+ * bytes. Addresses are in host byte order, the payload is zeroed and returned
+ * through \p data. The header checksum is valid, fields that are changed after
+ * allocation require test_ipv4_update_csum to be called.
+ */
+extern struct netbuf *test_alloc_frame(const uint8_t *dmac, const uint8_t *smac, uint32_t saddr,
+	uint32_t daddr, uint8_t proto, size_t length, void **data);
+extern void test_ipv4_update_csum(struct ipv4_header *hdr);
+/*
+ * Build a received ethernet frame carrying an ARP message for IPv4. The target
+ * hardware address is left zero.
+ */
+extern struct netbuf *test_alloc_arp(const uint8_t *dmac, const uint8_t *smac, uint16_t op,
+	uint32_t saddr, uint32_t daddr);
+CDECL_END
+
+#endif /* !__TEST_FRAME_H__ */
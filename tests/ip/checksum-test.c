@@ -0,0 +1,220 @@
+/*
+ * E/STACK - Internet checksum test
+ *
+ * Author: Michel Megens
+ * Date:   24/02/2018
+ * Email:  dev@bietje.net
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <estack.h>
+
+#include <estack/ip.h>
+#include <estack/inet.h>
+#include <estack/test.h>
+
+#define TEST_BUFFER_SIZE 0x10000
+#define TEST_ITERATIONS 20000
+#define BENCH_ROUNDS 2000
+
+static uint8_t buffer[TEST_BUFFER_SIZE + 8];
+static uint8_t copy[TEST_BUFFER_SIZE + 8];
+
+/* Reference implementation: add the buffer one 16-bit word at a time */
+static uint16_t test_csum_reference(uint16_t start, const uint8_t *buf, int len)
+{
+	uint32_t sum;
+	uint16_t word;
+
+	sum = start;
+	while(len > 1) {
+		memcpy(&word, buf, sizeof(word));
+		sum += word;
+		buf += 2;
+		len -= 2;
+	}
+
+	if(len) {
+		word = 0;
+		memcpy(&word, buf, 1);
+		sum += word;
+	}
+
+	sum = (sum >> 16) + (sum & 0xFFFF);
+	sum = (sum >> 16) + (sum & 0xFFFF);
+	return (uint16_t)sum;
+}
+
+static void test_fill(uint8_t value)
+{
+	for(int idx = 0; idx < (int)sizeof(buffer); idx++)
+		buffer[idx] = value ? value : (uint8_t)rand();
+}
+
+static void test_compare(uint16_t start, int offset, int len)
+{
+	uint16_t expected, actual;
+
+	expected = test_csum_reference(start, buffer + offset, len);
+	actual = ip_checksum_partial(start, buffer + offset, len);
+
+	if(expected != actual) {
+		fprintf(stderr, "Checksum mismatch: start %#x, offset %i, length %i: %#x != %#x\n",
+			start, offset, len, expected, actual);
+		exit(1);
+	}
+
+	/* Copy to a differently aligned destination */
+	memset(copy, 0, sizeof(copy));
+	actual = ip_checksum_partial_copy(start, copy + (offset ^ 5), buffer + offset, len);
+
+	if(expected != actual || memcmp(copy + (offset ^ 5), buffer + offset, len)) {
+		fprintf(stderr, "Checksum copy mismatch: start %#x, offset %i, length %i: %#x != %#x\n",
+			start, offset, len, expected, actual);
+		exit(1);
+	}
+}
+
+static void test_fuzz(void)
+{
+	int len, offset;
+	uint16_t start;
+
+	test_fill(0);
+
+	for(int idx = 0; idx < TEST_ITERATIONS; idx++) {
+		offset = rand() % 8;
+		start = (uint16_t)rand();
+
+		/* Favour packet sized buffers */
+		if(idx & 1)
+			len = rand() % 1600;
+		else
+			len = rand() % TEST_BUFFER_SIZE;
+
+		test_compare(start, offset, len);
+	}
+
+	/* Sums that overflow a lot and sums that end up at zero */
+	test_fill(0xFF);
+	for(int len = 0; len < 1024; len++)
+		test_compare(0xFFFF, len & 7, len);
+	test_compare(0xFFFF, 1, TEST_BUFFER_SIZE - 1);
+	test_compare(0, 0, TEST_BUFFER_SIZE);
+
+	memset(buffer, 0, sizeof(buffer));
+	test_compare(0, 3, 1500);
+	test_compare(0, 0, TEST_BUFFER_SIZE);
+}
+
+/* Sums of data split at an even offset can be added and subtracted */
+static void test_combine(void)
+{
+	uint16_t whole, head, tail;
+	int len, split;
+
+	test_fill(0);
+
+	for(int idx = 0; idx < 1000; idx++) {
+		len = rand() % 4096;
+		split = (rand() % (len + 1)) & ~1;
+
+		whole = ip_checksum_partial(0, buffer, len);
+		head = ip_checksum_partial(0, buffer, split);
+		tail = ip_checksum_partial(0, buffer + split, len - split);
+
+		assert(ip_checksum_add(head, tail) % 0xFFFF == whole % 0xFFFF);
+		assert(ip_checksum_sub(whole, head) % 0xFFFF == tail % 0xFFFF);
+	}
+}
+
+static void test_inet_csum(void)
+{
+	uint32_t saddr, daddr, partial;
+	uint16_t csum, reference;
+	struct ipv4_header hdr;
+
+	test_fill(0);
+	saddr = ipv4_atoi("145.49.12.1");
+	daddr = ipv4_atoi("145.49.12.2");
+
+	/* A buffer with a valid checksum sums to zero, including odd lengths */
+	for(uint16_t len = 8; len < 2048; len += 7) {
+		memset(buffer + 6, 0, 2);
+		csum = ipv4_inet_csum(buffer, len, saddr, daddr, IP_PROTO_UDP);
+		memcpy(buffer + 6, &csum, sizeof(csum));
+
+		partial = ipv4_pseudo_partial_csum(htonl(saddr), htonl(daddr), IP_PROTO_UDP, htons(len));
+		reference = test_csum_reference((uint16_t)partial, buffer, len);
+		assert((uint16_t)~reference == 0);
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.ihl_version = 0x45;
+	hdr.length = htons(sizeof(hdr));
+	hdr.ttl = 64;
+	hdr.saddr = htonl(saddr);
+	hdr.daddr = htonl(daddr);
+	hdr.chksum = ip_checksum(0, &hdr, sizeof(hdr));
+	assert(ip_checksum(0, &hdr, sizeof(hdr)) == 0);
+}
+
+static void test_bench(int len)
+{
+	volatile uint16_t sink;
+	time_t start, reference, actual;
+
+	sink = 0;
+	start = estack_utime();
+	for(int idx = 0; idx < BENCH_ROUNDS; idx++)
+		sink += test_csum_reference(0, buffer, len);
+	reference = estack_utime() - start;
+
+	start = estack_utime();
+	for(int idx = 0; idx < BENCH_ROUNDS; idx++)
+		sink += ip_checksum_partial(0, buffer, len);
+	actual = estack_utime() - start;
+
+	printf("Checksum of %i bytes: reference %lu us, ip_checksum_partial %lu us\n", len,
+		(unsigned long)reference, (unsigned long)actual);
+
+	start = estack_utime();
+	for(int idx = 0; idx < BENCH_ROUNDS; idx++) {
+		memcpy(copy, buffer, len);
+		sink += ip_checksum_partial(0, copy, len);
+	}
+	reference = estack_utime() - start;
+
+	start = estack_utime();
+	for(int idx = 0; idx < BENCH_ROUNDS; idx++)
+		sink += ip_checksum_partial_copy(0, copy, buffer, len);
+	actual = estack_utime() - start;
+
+	UNUSED(sink);
+	printf("Copy and checksum of %i bytes: separate %lu us, ip_checksum_partial_copy %lu us\n", len,
+		(unsigned long)reference, (unsigned long)actual);
+}
+
+int main(int argc, char **argv)
+{
+	UNUSED(argc);
+	UNUSED(argv);
+
+	srand(0x5EED);
+	test_fuzz();
+	test_combine();
+	test_inet_csum();
+
+	test_fill(0);
+	test_bench(64);
+	test_bench(1500);
+	test_bench(9000);
+	test_bench(TEST_BUFFER_SIZE);
+
+	wait_close();
+	return 0;
+}
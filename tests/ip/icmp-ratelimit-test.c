@@ -0,0 +1,143 @@
+/*
+ * E/STACK - ICMP rate limit test
+ *
+ * Author: Michel Megens
+ * Date:   24/02/2018
+ * Email:  dev@bietje.net
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <assert.h>
+#include <estack.h>
+
+#include <estack/error.h>
+#include <estack/inet.h>
+#include <estack/test.h>
+#include <estack/ethernet.h>
+#include <estack/pcapdev.h>
+#include <estack/route.h>
+#include <estack/ip.h>
+#include <estack/udp.h>
+#include <estack/icmp.h>
+#include <estack/prototype.h>
+
+#include "frame.h"
+
+#define HW_ADDR {0x48, 0x5D, 0x60, 0xBF, 0x51, 0xA9}
+#define HW_ADDR1 {0x00, 0x00, 0x5e, 0x00, 0x01, 0x31}
+static const uint8_t hw1[] = HW_ADDR1;
+
+#define LOCAL_ADDR "145.49.33.186"
+#define REMOTE_ADDR "145.49.33.1"
+#define OTHER_ADDR "145.49.33.2"
+
+#define TEST_REQUESTS 15
+#define TEST_ECHO_BURST 3
+
+static void test_inject_datagram(struct netdev *dev, uint32_t saddr)
+{
+	struct netbuf *nb;
+	struct udp_header *udp;
+	void *data;
+
+	nb = test_alloc_frame(dev->hwaddr, hw1, saddr, ipv4_atoi(LOCAL_ADDR), IP_PROTO_UDP, sizeof(*udp) + 4, &data);
+	udp = data;
+	udp->sport = htons(5000);
+	udp->dport = htons(5001);
+	udp->length = htons(sizeof(*udp) + 4);
+
+	netdev_add_backlog(dev, nb);
+}
+
+static void test_inject_echo(struct netdev *dev, uint32_t saddr)
+{
+	struct netbuf *nb;
+	struct icmp_header *icmp;
+	void *data;
+
+	nb = test_alloc_frame(dev->hwaddr, hw1, saddr, ipv4_atoi(LOCAL_ADDR), IP_PROTO_ICMP, sizeof(*icmp) + 8, &data);
+	icmp = data;
+	icmp->type = ICMP_ECHO;
+	icmp->spec = htonl(0x12340001);
+	icmp->csum = ip_checksum(0, icmp, sizeof(*icmp) + 8);
+
+	netdev_add_backlog(dev, nb);
+}
+
+static void test_wait_tx(struct netdev *dev, uint32_t packets)
+{
+	for(int i = 0; i < 100 && netdev_get_tx_packets(dev) < packets; i++)
+		estack_sleep(10);
+
+	/* Give suppressed messages a chance to show up */
+	estack_sleep(50);
+	assert(netdev_get_tx_packets(dev) == packets);
+}
+
+int main(int argc, char **argv)
+{
+	struct netdev *dev;
+	const uint8_t hwaddr[] = HW_ADDR;
+	uint32_t remote, other, tx;
+
+	UNUSED(argc);
+	UNUSED(argv);
+
+	estack_init(NULL);
+
+	dev = pcapdev_create(NULL, 0, "icmp-ratelimit-output.pcap", hwaddr, 1500);
+	netdev_config_params(dev, 30, 15000);
+	pcapdev_create_link_ip4(dev, ipv4_atoi(LOCAL_ADDR), 0, 0xFFFFC000);
+	route4_add(ipv4_atoi("145.49.0.0"), ipv4_atoi("255.255.192.0"), 0, dev);
+
+	remote = ipv4_atoi(REMOTE_ADDR);
+	other = ipv4_atoi(OTHER_ADDR);
+	netdev_add_destination(dev, hw1, ETHERNET_MAC_LENGTH, (void*)&remote, 4);
+	netdev_add_destination(dev, hw1, ETHERNET_MAC_LENGTH, (void*)&other, 4);
+
+	assert(icmp_ratelimit_set(ICMP_TYPE_MAX + 1, 1, 1) == -EINVALID);
+	assert(icmp_ratelimit_set(ICMP_REPLY, 1, 0) == -EINVALID);
+
+	/* Port unreachables to a single destination are limited to its burst */
+	for(int idx = 0; idx < TEST_REQUESTS; idx++)
+		test_inject_datagram(dev, remote);
+
+	netdev_wakeup();
+	test_wait_tx(dev, CONFIG_ICMP_DEST_BURST);
+	assert(icmp_get_suppressed(ICMP_UNREACH) == TEST_REQUESTS - CONFIG_ICMP_DEST_BURST);
+
+	/* Other destinations have a bucket of their own */
+	tx = netdev_get_tx_packets(dev);
+	test_inject_datagram(dev, other);
+	netdev_wakeup();
+	test_wait_tx(dev, tx + 1);
+
+	/* Echo replies are unlimited, unless a limit is configured */
+	tx = netdev_get_tx_packets(dev);
+	for(int idx = 0; idx < TEST_REQUESTS; idx++)
+		test_inject_echo(dev, remote);
+
+	netdev_wakeup();
+	test_wait_tx(dev, tx + TEST_REQUESTS);
+	assert(icmp_get_suppressed(ICMP_REPLY) == 0);
+
+	assert(icmp_ratelimit_set(ICMP_REPLY, 1, TEST_ECHO_BURST) == -EOK);
+	tx = netdev_get_tx_packets(dev);
+	for(int idx = 0; idx < TEST_REQUESTS; idx++)
+		test_inject_echo(dev, remote);
+
+	netdev_wakeup();
+	test_wait_tx(dev, tx + TEST_ECHO_BURST);
+	assert(icmp_get_suppressed(ICMP_REPLY) == TEST_REQUESTS - TEST_ECHO_BURST);
+
+	netdev_print(dev, stdout);
+	route4_clear();
+	pcapdev_destroy(dev);
+	estack_destroy();
+
+	wait_close();
+	return 0;
+}
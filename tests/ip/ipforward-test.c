@@ -25,6 +25,10 @@
 #include <estack/test.h>
 #include <estack/route.h>
 #include <estack/inet.h>
+#include <estack/udp.h>
+#include <estack/prototype.h>
+
+#include "frame.h"
 
 #ifdef WIN32
 #include <Windows.h>
@@ -84,6 +88,53 @@ static struct netdev *setup_dev(const char **input, const char *output, const ui
 	return dev;
 }
 
+static void test_inject_datagram(struct netdev *dev, uint8_t ttl)
+{
+	struct netbuf *nb;
+	struct ipv4_header *hdr;
+	struct udp_header *udp;
+	void *data;
+
+	nb = test_alloc_frame(dev->hwaddr, hw1, ipv4_atoi("8.8.8.8"), ipv4_atoi("80.114.190.10"),
+		IP_PROTO_UDP, sizeof(*udp) + 16, &data);
+	udp = data;
+	hdr = (struct ipv4_header*)data - 1;
+
+	hdr->id = htons(0x4321);
+	hdr->ttl = ttl;
+	test_ipv4_update_csum(hdr);
+
+	udp->sport = htons(5000);
+	udp->dport = htons(5001);
+	udp->length = htons((uint16_t)(sizeof(*udp) + 16));
+
+	netdev_add_backlog(dev, nb);
+}
+
+static void test_ttl(struct netdev *dev1, struct netdev *dev2)
+{
+	uint32_t tx1, tx2;
+
+	tx1 = netdev_get_tx_packets(dev1);
+	tx2 = netdev_get_tx_packets(dev2);
+
+	/* Expires in transit, a time exceeded message is sent back */
+	test_inject_datagram(dev1, 1);
+	netdev_wakeup();
+	estack_sleep(500);
+
+	assert(netdev_get_tx_packets(dev1) == tx1 + 1);
+	assert(netdev_get_tx_packets(dev2) == tx2);
+
+	test_inject_datagram(dev1, 2);
+	test_inject_datagram(dev1, 2);
+	netdev_wakeup();
+	estack_sleep(500);
+
+	assert(netdev_get_tx_packets(dev1) == tx1 + 1);
+	assert(netdev_get_tx_packets(dev2) == tx2 + 2);
+}
+
 int main(int argc, char **argv)
 {
 	char *input;
@@ -125,6 +176,8 @@ int main(int argc, char **argv)
 	assert(netdev_get_tx_bytes(dev2) == 3410);
 	assert(netdev_get_tx_bytes(dev1) == 0);
 
+	test_ttl(dev1, dev2);
+
 	route4_clear();
 	pcapdev_destroy(dev1);
 	pcapdev_destroy(dev2);
@@ -27,6 +27,10 @@
 #include <estack/inet.h>
 #include <estack/addr.h>
 #include <estack/udp.h>
+#include <estack/icmp.h>
+#include <estack/prototype.h>
+
+#include "frame.h"
 
 #ifdef WIN32
 #include <Windows.h>
@@ -76,6 +80,30 @@ static void test_ipout(struct netdev *ndev, uint32_t addr)
 	udp_output(nb, &dst, htons(2100), htons(48720));
 }
 
+static void test_fragment_sizes(struct netdev *ndev, uint32_t addr)
+{
+	struct netbuf *nb;
+	ip_addr_t dst;
+	uint32_t packets, bytes;
+	size_t length;
+
+	packets = netdev_get_tx_packets(ndev);
+	bytes = netdev_get_tx_bytes(ndev);
+
+	/* The payload exactly fills two fragments */
+	length = 2 * (ndev->mtu - sizeof(struct ipv4_header)) - sizeof(struct udp_header);
+	nb = netbuf_alloc(NBAF_APPLICTION, length);
+	memset(nb->application.data, 0xAD, length);
+
+	dst.type = IPADDR_TYPE_V4;
+	dst.addr.in4_addr.s_addr = addr;
+	udp_output(nb, &dst, htons(2100), htons(48720));
+
+	estack_sleep(500);
+	assert(netdev_get_tx_packets(ndev) == packets + 2);
+	assert(netdev_get_tx_bytes(ndev) == bytes + 2 * (sizeof(struct ethernet_header) + ndev->mtu));
+}
+
 static void test_setup_routes(struct netdev *dev)
 {
 	uint32_t addr, mask, gw;
@@ -87,6 +115,177 @@ static void test_setup_routes(struct netdev *dev)
 	route4_add(0, 0, gw, dev);
 }
 
+#define FRAG_SIZE 24
+
+static void test_inject_fragment(struct netdev *dev, uint16_t id, int idx, bool more)
+{
+	struct netbuf *nb;
+	struct ipv4_header *hdr;
+	struct icmp_header *icmp;
+	uint8_t *data;
+
+	nb = test_alloc_frame(dev->hwaddr, hw1, ipv4_atoi("80.114.190.254"), ipv4_atoi("80.114.190.241"),
+		IP_PROTO_ICMP, FRAG_SIZE, (void**)&data);
+	hdr = (struct ipv4_header*)data - 1;
+	hdr->id = htons(id);
+	hdr->offset = htons((uint16_t)(idx * FRAG_SIZE / 8) | (more ? 0x2000 : 0));
+	test_ipv4_update_csum(hdr);
+
+	memset(data, idx, FRAG_SIZE);
+	if(!idx) {
+		icmp = (void*)data;
+		icmp->type = ICMP_ECHO;
+		icmp->code = 0;
+		icmp->csum = 0;
+	}
+
+	netdev_add_backlog(dev, nb);
+}
+
+static void test_reassembly(struct netdev *dev)
+{
+	uint32_t tx, dropped;
+
+	tx = netdev_get_tx_packets(dev);
+	dropped = netdev_get_dropped(dev);
+
+	/* Out of order, with a duplicate fragment */
+	test_inject_fragment(dev, 0x1234, 2, false);
+	test_inject_fragment(dev, 0x1234, 0, true);
+	test_inject_fragment(dev, 0x1234, 0, true);
+	test_inject_fragment(dev, 0x1234, 1, true);
+
+	/* Incomplete datagram */
+	test_inject_fragment(dev, 0x1235, 0, true);
+	test_inject_fragment(dev, 0x1235, 2, false);
+
+	netdev_wakeup();
+	estack_sleep(500);
+
+	/* Only the complete datagram is answered */
+	assert(netdev_get_tx_packets(dev) == tx + 1);
+	assert(netdev_get_dropped(dev) == dropped + 1);
+}
+
+static void test_inject_needfrag(struct netdev *dev, uint32_t daddr, uint16_t length, uint16_t mtu)
+{
+	struct netbuf *nb;
+	struct ipv4_header *quoted;
+	struct icmp_header *icmp;
+	void *data;
+
+	nb = test_alloc_frame(dev->hwaddr, hw1, ipv4_atoi("80.114.190.254"), ipv4_atoi("80.114.190.241"),
+		IP_PROTO_ICMP, sizeof(*icmp) + sizeof(*quoted) + sizeof(struct udp_header), &data);
+	icmp = data;
+	quoted = (void*)(icmp + 1);
+
+	icmp->type = ICMP_UNREACH;
+	icmp->code = ICMP_UNREACH_NEEDFRAG;
+	icmp->spec = htonl(mtu);
+
+	/* The header of the datagram that was too big */
+	quoted->ihl_version = 0x45;
+	quoted->length = htons(length);
+	quoted->offset = htons(IP4_DONT_FRAGMENT);
+	quoted->ttl = IPV4_TTL;
+	quoted->protocol = IP_PROTO_UDP;
+	quoted->saddr = htonl(ipv4_atoi("80.114.190.241"));
+	quoted->daddr = htonl(daddr);
+
+	netdev_add_backlog(dev, nb);
+}
+
+static void test_pmtu(struct netdev *dev)
+{
+	struct netbuf *nb;
+	ip_addr_t dst;
+	uint32_t daddr, other, packets, bytes;
+
+	daddr = ipv4_atoi("8.8.8.8");
+	assert(ipv4_pmtu_lookup(dev, daddr) == dev->mtu);
+	assert(ipv4_pmtu_plateau(1500) == 1492);
+	assert(ipv4_pmtu_plateau(IPV4_MIN_MTU) == IPV4_MIN_MTU);
+
+	test_inject_needfrag(dev, daddr, 1500, 1000);
+	netdev_wakeup();
+	estack_sleep(500);
+	assert(ipv4_pmtu_lookup(dev, daddr) == 1000);
+
+	/* Estimates are never raised */
+	assert(!ipv4_pmtu_update(daddr, 1200));
+	assert(ipv4_pmtu_lookup(dev, daddr) == 1000);
+
+	/* Looking up a destination that shares the slot leaves the estimate alone */
+	other = daddr + 1;
+	while(ipv4_flow_hash(0, other, 0, 0, 0) % CONFIG_PMTU_ENTRIES !=
+		ipv4_flow_hash(0, daddr, 0, 0, 0) % CONFIG_PMTU_ENTRIES)
+		other++;
+
+	assert(ipv4_pmtu_lookup(dev, other) == dev->mtu);
+	assert(ipv4_pmtu_lookup(dev, daddr) == 1000);
+
+	packets = netdev_get_tx_packets(dev);
+	bytes = netdev_get_tx_bytes(dev);
+
+	dst.type = IPADDR_TYPE_V4;
+	dst.addr.in4_addr.s_addr = htonl(daddr);
+
+	/* Fragmented to the path MTU */
+	nb = netbuf_alloc(NBAF_APPLICTION, 1400);
+	memset(nb->application.data, 0xAD, 1400);
+	udp_output(nb, &dst, htons(2100), htons(48720));
+
+	/* Too big and not allowed to fragment */
+	nb = netbuf_alloc(NBAF_APPLICTION, 1400);
+	memset(nb->application.data, 0xAD, 1400);
+	netbuf_set_flag(nb, NBUF_DONTFRAG);
+	udp_output(nb, &dst, htons(2100), htons(48720));
+
+	estack_sleep(500);
+	assert(netdev_get_tx_packets(dev) == packets + 2);
+	assert(netdev_get_tx_bytes(dev) == bytes + 2 * (sizeof(struct ethernet_header) + sizeof(struct ipv4_header)) +
+		1400 + sizeof(struct udp_header));
+}
+
+static void test_jumbo(void)
+{
+	struct netdev *dev;
+	struct netbuf *nb;
+	ip_addr_t dst;
+	uint32_t addr;
+	const uint8_t hwaddr[] = HW_ADDR;
+
+	dev = pcapdev_create(NULL, 0, "ipfrag-jumbo-output.pcap", hwaddr, 9000);
+	netdev_config_params(dev, 30, 15000);
+	pcapdev_set_name(dev, "dbg1");
+	pcapdev_create_link_ip4(dev, ipv4_atoi("10.1.0.1"), 0, ipv4_atoi("255.255.255.0"));
+	route4_add(ipv4_atoi("10.1.0.0"), ipv4_atoi("255.255.255.0"), 0, dev);
+
+	addr = ipv4_atoi("10.1.0.2");
+	netdev_add_destination(dev, hw1, ETHERNET_MAC_LENGTH, (void*)&addr, 4);
+	assert(ipv4_pmtu_lookup(dev, addr) == 9000);
+
+	dst.type = IPADDR_TYPE_V4;
+	dst.addr.in4_addr.s_addr = htonl(addr);
+
+	/* Fills a jumbo frame exactly */
+	nb = netbuf_alloc(NBAF_APPLICTION, 9000 - sizeof(struct ipv4_header) - sizeof(struct udp_header));
+	memset(nb->application.data, 0xAD, nb->application.size);
+	udp_output(nb, &dst, htons(2100), htons(48720));
+
+	/* One byte too many */
+	nb = netbuf_alloc(NBAF_APPLICTION, 9000 - sizeof(struct ipv4_header) - sizeof(struct udp_header) + 1);
+	memset(nb->application.data, 0xAD, nb->application.size);
+	udp_output(nb, &dst, htons(2100), htons(48720));
+
+	estack_sleep(500);
+	assert(netdev_get_tx_packets(dev) == 3);
+	assert(netdev_get_tx_bytes(dev) == 3 * (sizeof(struct ethernet_header) + sizeof(struct ipv4_header)) +
+		2 * (9000 - sizeof(struct ipv4_header)) + 1);
+
+	pcapdev_destroy(dev);
+}
+
 int main(int argc, char **argv)
 {
 	char *input;
@@ -118,6 +317,11 @@ int main(int argc, char **argv)
 	assert(netdev_get_rx_bytes(dev) == 3410);
 	assert(netdev_get_tx_bytes(dev) == 3580);
 
+	test_reassembly(dev);
+	test_fragment_sizes(dev, addr);
+	test_pmtu(dev);
+	test_jumbo();
+
 	route4_clear();
 	pcapdev_destroy(dev);
 	estack_destroy();
@@ -23,6 +23,7 @@
 #include <estack/arp.h>
 #include <estack/test.h>
 #include <estack/route.h>
+#include <estack/in.h>
 
 #ifdef WIN32
 #include <Windows.h>
@@ -49,10 +50,161 @@ static const uint8_t hw1[] = HW_ADDR1;
 
 #define HW_ADDR {0x48, 0x5D, 0x60, 0xBF, 0x51, 0xA9}
 
+static void test_longest_prefix(struct netdev *dev)
+{
+	uint32_t gw, addr;
+	struct netdev *lookup;
+
+	/* More specific routes win, regardless of the order in which they are added */
+	assert(route4_add(ipv4_atoi("10.1.0.0"), ipv4_atoi("255.255.0.0"), ipv4_atoi("145.49.6.1"), dev));
+	assert(route4_add(ipv4_atoi("10.1.2.0"), ipv4_atoi("255.255.255.0"), ipv4_atoi("145.49.6.2"), dev));
+	assert(route4_add(ipv4_atoi("10.0.0.0"), ipv4_atoi("255.0.0.0"), ipv4_atoi("145.49.6.3"), dev));
+	assert(!route4_add(ipv4_atoi("10.1.2.0"), ipv4_atoi("255.255.255.0"), 0, dev));
+	assert(!route4_add(ipv4_atoi("10.2.0.0"), ipv4_atoi("255.0.255.0"), 0, dev));
+
+	lookup = route4_lookup(ipv4_atoi("10.1.2.3"), &gw);
+	assert(lookup == dev && gw == ipv4_atoi("145.49.6.2"));
+	lookup = route4_lookup(ipv4_atoi("10.1.3.3"), &gw);
+	assert(lookup == dev && gw == ipv4_atoi("145.49.6.1"));
+	lookup = route4_lookup(ipv4_atoi("10.3.3.3"), &gw);
+	assert(lookup == dev && gw == ipv4_atoi("145.49.6.3"));
+
+	/* Deleting a route falls back to the next most specific one */
+	assert(route4_delete(ipv4_atoi("10.1.2.0"), ipv4_atoi("255.255.255.0"), ipv4_atoi("145.49.6.2"), dev));
+	assert(!route4_delete(ipv4_atoi("10.1.2.0"), ipv4_atoi("255.255.255.0"), ipv4_atoi("145.49.6.2"), dev));
+	lookup = route4_lookup(ipv4_atoi("10.1.2.3"), &gw);
+	assert(lookup == dev && gw == ipv4_atoi("145.49.6.1"));
+
+	/* Load a large table in a single batch */
+	route4_batch_begin();
+	for(addr = 0; addr < 0x10000; addr++)
+		assert(route4_batch_add(0x64000000 | (addr << 8), 0xFFFFFF00, addr, dev));
+	route4_batch_commit();
+
+	for(addr = 0; addr < 0x10000; addr += 97) {
+		lookup = route4_lookup(0x64000000 | (addr << 8) | 0x42, &gw);
+		assert(lookup == dev && gw == addr);
+	}
+
+	route4_batch_begin();
+	for(addr = 0; addr < 0x10000; addr++)
+		assert(route4_batch_delete(0x64000000 | (addr << 8), 0xFFFFFF00, addr, dev));
+	route4_batch_commit();
+
+	assert(route4_delete(ipv4_atoi("10.1.0.0"), ipv4_atoi("255.255.0.0"), ipv4_atoi("145.49.6.1"), dev));
+	assert(route4_delete(ipv4_atoi("10.0.0.0"), ipv4_atoi("255.0.0.0"), ipv4_atoi("145.49.6.3"), dev));
+}
+
+static void test_multipath(struct netdev *dev)
+{
+	uint32_t gws[ROUTE4_BUCKETS], gw, a, b, c, addr, mask;
+	int na, nb, nc;
+
+	addr = ipv4_atoi("20.0.0.0");
+	mask = ipv4_atoi("255.0.0.0");
+	a = ipv4_atoi("145.49.6.1");
+	b = ipv4_atoi("145.49.6.2");
+	c = ipv4_atoi("145.49.6.3");
+
+	assert(route4_add_nexthop(addr, mask, a, dev, 1));
+	assert(route4_add_nexthop(addr, mask, b, dev, 1));
+	assert(!route4_add_nexthop(addr, mask, b, dev, 1));
+
+	/* Flows stick to a single next hop and are spread evenly */
+	na = nb = 0;
+	for(int i = 0; i < ROUTE4_BUCKETS; i++) {
+		assert(route4_lookup_flow(ipv4_atoi("20.1.2.3"), i, &gws[i]) == dev);
+		assert(route4_lookup_flow(ipv4_atoi("20.3.2.1"), i + ROUTE4_BUCKETS, &gw) == dev);
+		assert(gw == gws[i]);
+
+		na += gws[i] == a;
+		nb += gws[i] == b;
+	}
+	assert(na == ROUTE4_BUCKETS / 2 && nb == ROUTE4_BUCKETS / 2);
+
+	/* Adding a next hop only moves flows towards the new next hop */
+	assert(route4_add_nexthop(addr, mask, c, dev, 2));
+	na = nb = nc = 0;
+	for(int i = 0; i < ROUTE4_BUCKETS; i++) {
+		route4_lookup_flow(ipv4_atoi("20.1.2.3"), i, &gw);
+		assert(gw == gws[i] || gw == c);
+
+		gws[i] = gw;
+		na += gw == a;
+		nb += gw == b;
+		nc += gw == c;
+	}
+	assert(na == ROUTE4_BUCKETS / 4 && nb == ROUTE4_BUCKETS / 4 && nc == ROUTE4_BUCKETS / 2);
+
+	/* Removing a next hop only moves the flows of that next hop */
+	assert(route4_delete(addr, mask, a, dev));
+	for(int i = 0; i < ROUTE4_BUCKETS; i++) {
+		route4_lookup_flow(ipv4_atoi("20.1.2.3"), i, &gw);
+		assert(gw != a);
+		assert(gws[i] == a || gw == gws[i]);
+	}
+
+	assert(route4_delete(addr, mask, b, dev));
+	assert(route4_delete(addr, mask, c, dev));
+
+	/* Flows fall back to the default route */
+	assert(route4_lookup_flow(ipv4_atoi("20.1.2.3"), 0, &gw) == dev);
+	assert(gw == ipv4_atoi("145.49.6.254"));
+}
+
+static void test_nexthop_dev(struct netdev *dev, struct netdev *other)
+{
+	uint32_t gw, a, b, addr, mask;
+
+	addr = ipv4_atoi("30.0.0.0");
+	mask = ipv4_atoi("255.0.0.0");
+	a = ipv4_atoi("145.49.6.1");
+	b = ipv4_atoi("145.49.6.2");
+
+	assert(route4_add_nexthop(addr, mask, a, dev, 1));
+	assert(route4_add_nexthop(addr, mask, b, other, 1));
+
+	/* A device picked by the caller only gets gateways of its own next hops */
+	for(int i = 0; i < ROUTE4_BUCKETS; i++) {
+		assert(route4_lookup_dev(ipv4_atoi("30.1.2.3"), i, dev, &gw) == dev);
+		assert(gw == a);
+		assert(route4_lookup_dev(ipv4_atoi("30.1.2.3"), i, other, &gw) == other);
+		assert(gw == b);
+	}
+
+	assert(route4_delete(addr, mask, b, other));
+	assert(!route4_lookup_dev(ipv4_atoi("30.1.2.3"), 0, other, &gw));
+	assert(gw == 0);
+	assert(route4_delete(addr, mask, a, dev));
+}
+
+static void test_broadcast(struct netdev *dev, struct netdev *other)
+{
+	uint32_t gw, mcast;
+
+	mcast = ipv4_atoi("224.0.0.1");
+	route4_clear();
+	assert(!route4_lookup(INADDR_BCAST, &gw));
+
+	/* Broadcast and multicast use the device of the oldest route */
+	assert(route4_add(ipv4_atoi("40.0.0.0"), ipv4_atoi("255.0.0.0"), 0, other));
+	assert(route4_add(ipv4_atoi("40.1.0.0"), ipv4_atoi("255.255.0.0"), 0, dev));
+	assert(route4_lookup(INADDR_BCAST, &gw) == other);
+	assert(gw == 0);
+	assert(route4_lookup(mcast, &gw) == other);
+
+	assert(route4_delete(ipv4_atoi("40.0.0.0"), ipv4_atoi("255.0.0.0"), 0, other));
+	assert(route4_lookup(INADDR_BCAST, &gw) == dev);
+	assert(route4_lookup(mcast, &gw) == dev);
+
+	route4_clear();
+	assert(!route4_lookup(mcast, &gw));
+}
+
 int main(int argc, char **argv)
 {
 	char *input;
-	struct netdev *dev;
+	struct netdev *dev, *other;
 	const uint8_t hwaddr[] = HW_ADDR;
 	uint32_t addr, mask, gw, gwlookup;
 	struct netdev *lookup;
@@ -80,6 +232,12 @@ int main(int argc, char **argv)
 	route4_add(0, 0, gw, dev);
 
 	lookup = route4_lookup(ipv4_atoi("8.8.8.8"), &gwlookup);
+	test_longest_prefix(dev);
+	test_multipath(dev);
+
+	other = pcapdev_create(NULL, 0, "ip-output-other.pcap", hw1, 1500);
+	test_nexthop_dev(dev, other);
+	assert(route4_lookup(ipv4_atoi("100.0.1.1"), NULL) == dev);
 	pcapdev_start(dev);
 
 	estack_sleep(1000);
@@ -87,7 +245,8 @@ int main(int argc, char **argv)
 	assert(lookup);
 	netdev_print(dev, stdout);
 
-	route4_clear();
+	test_broadcast(dev, other);
+	pcapdev_destroy(other);
 	pcapdev_destroy(dev);
 	estack_destroy();
 
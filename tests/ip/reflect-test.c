@@ -0,0 +1,297 @@
+/*
+ * In place reply unit test
+ *
+ * Author: Michel Megens
+ * Date:   24/02/2018
+ * Email:  dev@bietje.net
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <estack.h>
+
+#include <estack/netdev.h>
+#include <estack/netbuf.h>
+#include <estack/ethernet.h>
+#include <estack/pcapdev.h>
+#include <estack/loopback.h>
+#include <estack/route.h>
+#include <estack/inet.h>
+#include <estack/arp.h>
+#include <estack/ip.h>
+#include <estack/icmp.h>
+#include <estack/test.h>
+
+#include "frame.h"
+
+#define HW_ADDR {0x48, 0x5D, 0x60, 0xBF, 0x51, 0xA9}
+#define HW_ADDR1 {0x00, 0x00, 0x5e, 0x00, 0x01, 0x31}
+static const uint8_t hwaddr[] = HW_ADDR;
+static const uint8_t hw1[] = HW_ADDR1;
+static const uint8_t hwbcast[] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+
+#define LOCAL_ADDR "145.49.33.186"
+#define REMOTE_ADDR "145.49.33.1"
+
+#define TEST_ID 0xBEEF
+#define TEST_SPEC 0x12340001
+#define TEST_DATA 32
+#define TEST_FILL 0xA5
+#define TEST_TTL 0xFF
+#define TEST_FRAME_MAX 1600
+
+/*
+ * Transmitted frames are copied behind CONFIG_NET_IP_ALIGN bytes, so that the
+ * headers can be inspected in place.
+ */
+static union {
+	uint32_t align;
+	uint8_t data[CONFIG_NET_IP_ALIGN + TEST_FRAME_MAX];
+} frame;
+
+static volatile size_t frame_length;
+static volatile int frames;
+static int(*test_write)(struct netdev *dev, struct netbuf *nb);
+
+static int test_capture(struct netdev *dev, struct netbuf *nb)
+{
+	assert(nb->size <= TEST_FRAME_MAX);
+	memcpy(frame.data + CONFIG_NET_IP_ALIGN, nb->datalink.data, nb->size);
+	frame_length = nb->size;
+	frames++;
+
+	return test_write(dev, nb);
+}
+
+static void test_wait_frames(int num)
+{
+	for(int i = 0; i < 100 && frames < num; i++)
+		estack_sleep(10);
+
+	assert(frames == num);
+}
+
+static void test_fill_echo(struct icmp_header *icmp, size_t length)
+{
+	icmp->type = ICMP_ECHO;
+	icmp->code = 0;
+	icmp->spec = htonl(TEST_SPEC);
+	memset(icmp + 1, TEST_FILL, length);
+
+	icmp->csum = 0;
+	icmp->csum = ip_checksum(0, icmp, (int)(sizeof(*icmp) + length));
+}
+
+/* Inject an echo request, with \p options bytes of IP options (NOPs) */
+static void test_inject_echo(struct netdev *dev, size_t options)
+{
+	struct netbuf *nb;
+	struct ipv4_header *ip;
+	void *data;
+
+	nb = test_alloc_frame(dev->hwaddr, hw1, ipv4_atoi(REMOTE_ADDR), ipv4_atoi(LOCAL_ADDR),
+		IP_PROTO_ICMP, options + sizeof(struct icmp_header) + TEST_DATA, &data);
+
+	ip = (struct ipv4_header*)data - 1;
+	ip->id = htons(TEST_ID);
+	ip->ihl_version = (uint8_t)(0x45 + options / sizeof(uint32_t));
+	memset(data, 1, options);
+	test_ipv4_update_csum(ip);
+
+	test_fill_echo((void*)((uint8_t*)data + options), TEST_DATA);
+	netdev_add_backlog(dev, nb);
+	netdev_wakeup();
+}
+
+/* Inject an echo request in two fragments */
+static void test_inject_fragments(struct netdev *dev)
+{
+	struct netbuf *nb;
+	struct ipv4_header *ip;
+	uint8_t echo[sizeof(struct icmp_header) + TEST_DATA];
+	size_t first;
+	void *data;
+
+	test_fill_echo((void*)echo, TEST_DATA);
+	first = sizeof(struct icmp_header) + TEST_DATA / 2;
+
+	nb = test_alloc_frame(dev->hwaddr, hw1, ipv4_atoi(REMOTE_ADDR), ipv4_atoi(LOCAL_ADDR),
+		IP_PROTO_ICMP, first, &data);
+	ip = (struct ipv4_header*)data - 1;
+	ip->id = htons(TEST_ID);
+	ip->offset = htons(IP4_MORE_FRAGMENTS);
+	test_ipv4_update_csum(ip);
+	memcpy(data, echo, first);
+	netdev_add_backlog(dev, nb);
+
+	nb = test_alloc_frame(dev->hwaddr, hw1, ipv4_atoi(REMOTE_ADDR), ipv4_atoi(LOCAL_ADDR),
+		IP_PROTO_ICMP, sizeof(echo) - first, &data);
+	ip = (struct ipv4_header*)data - 1;
+	ip->id = htons(TEST_ID);
+	ip->offset = htons((uint16_t)(first / 8));
+	test_ipv4_update_csum(ip);
+	memcpy(data, echo + first, sizeof(echo) - first);
+	netdev_add_backlog(dev, nb);
+
+	netdev_wakeup();
+}
+
+/*
+ * Check the last transmitted frame for an echo reply. Replies made in place
+ * keep the identification of the request, the regular output path assigns a
+ * new one.
+ */
+static void test_check_reply(bool inplace)
+{
+	struct ethernet_header *eth;
+	struct ipv4_header *ip;
+	struct icmp_header *icmp;
+	uint8_t *data;
+	size_t length;
+
+	eth = (void*)(frame.data + CONFIG_NET_IP_ALIGN);
+	ip = (void*)(eth + 1);
+	icmp = (void*)(ip + 1);
+	length = sizeof(*icmp) + TEST_DATA;
+
+	assert(frame_length == sizeof(*eth) + sizeof(*ip) + length);
+	assert(!memcmp(eth->dest_mac, hw1, ETHERNET_MAC_LENGTH));
+	assert(!memcmp(eth->src_mac, hwaddr, ETHERNET_MAC_LENGTH));
+
+	assert(ip->ihl_version == 0x45);
+	assert(ntohs(ip->length) == sizeof(*ip) + length);
+	assert(ntohl(ip->saddr) == ipv4_atoi(LOCAL_ADDR));
+	assert(ntohl(ip->daddr) == ipv4_atoi(REMOTE_ADDR));
+	assert(ip->ttl == TEST_TTL);
+	assert(ip->protocol == IP_PROTO_ICMP);
+	assert(ip_checksum(0, ip, sizeof(*ip)) == 0);
+	assert((ntohs(ip->id) == TEST_ID) == inplace);
+
+	assert(icmp->type == ICMP_REPLY);
+	assert(icmp->code == 0);
+	assert(ntohl(icmp->spec) == TEST_SPEC);
+	assert(ip_checksum(0, icmp, (int)length) == 0);
+
+	data = (uint8_t*)(icmp + 1);
+	for(int idx = 0; idx < TEST_DATA; idx++)
+		assert(data[idx] == TEST_FILL);
+}
+
+static void test_arp(struct netdev *dev)
+{
+	struct ethernet_header *eth;
+	struct arp_header *hdr;
+	struct arp_ipv4_header *ip4hdr;
+	struct netbuf *nb;
+	int num;
+
+	num = frames;
+	nb = test_alloc_arp(hwbcast, hw1, ARP_OP_REQUEST, ipv4_atoi(REMOTE_ADDR), ipv4_atoi(LOCAL_ADDR));
+	netdev_add_backlog(dev, nb);
+	netdev_wakeup();
+	test_wait_frames(num + 1);
+
+	eth = (void*)(frame.data + CONFIG_NET_IP_ALIGN);
+	hdr = (void*)(eth + 1);
+	ip4hdr = (void*)(hdr + 1);
+
+	assert(frame_length == sizeof(*eth) + sizeof(*hdr) + sizeof(*ip4hdr));
+	assert(!memcmp(eth->dest_mac, hw1, ETHERNET_MAC_LENGTH));
+	assert(!memcmp(eth->src_mac, hwaddr, ETHERNET_MAC_LENGTH));
+	assert(ntohs(eth->type) == ETH_TYPE_ARP);
+
+	assert(ntohs(hdr->opcode) == ARP_OP_REPLY);
+	assert(!memcmp(ip4hdr->hw_src_addr, hwaddr, ETHERNET_MAC_LENGTH));
+	assert(!memcmp(ip4hdr->hw_target_addr, hw1, ETHERNET_MAC_LENGTH));
+	assert(ntohl(ip4hdr->ip_src_addr) == ipv4_atoi(LOCAL_ADDR));
+	assert(ntohl(ip4hdr->ip_target_addr) == ipv4_atoi(REMOTE_ADDR));
+}
+
+static void test_echo(struct netdev *dev)
+{
+	int num;
+
+	num = frames;
+	test_inject_echo(dev, 0);
+	test_wait_frames(num + 1);
+	test_check_reply(true);
+
+	/* Requests with IP options and reassembled requests take the regular path */
+	test_inject_echo(dev, 4);
+	test_wait_frames(num + 2);
+	test_check_reply(false);
+
+	test_inject_fragments(dev);
+	test_wait_frames(num + 3);
+	test_check_reply(false);
+}
+
+/* A looped request is answered through the loopback device */
+static void test_looped(struct netdev *lo)
+{
+	struct netbuf *nb;
+	struct icmp_header *icmp;
+	uint32_t rx;
+	int num;
+
+	num = frames;
+	rx = netdev_get_rx_packets(lo);
+
+	nb = netbuf_alloc(NBAF_APPLICTION, TEST_DATA);
+	memset(nb->application.data, TEST_FILL, TEST_DATA);
+	nb = netbuf_realloc(nb, NBAF_TRANSPORT, sizeof(*icmp));
+	memset(nb->transport.data, 0, sizeof(*icmp));
+	icmp = nb->transport.data;
+	icmp->spec = htonl(TEST_SPEC);
+	netbuf_set_dev(nb, lo);
+	icmp_output(ICMP_ECHO, ipv4_atoi("127.0.0.1"), nb);
+
+	/* Both the request and the reply are received */
+	for(int i = 0; i < 100 && netdev_get_rx_packets(lo) < rx + 2; i++)
+		estack_sleep(10);
+
+	assert(netdev_get_rx_packets(lo) == rx + 2);
+	assert(frames == num);
+}
+
+int main(int argc, char **argv)
+{
+	struct netdev *dev, *lo;
+	uint32_t remote;
+
+	UNUSED(argc);
+	UNUSED(argv);
+
+	estack_init(NULL);
+
+	dev = pcapdev_create(NULL, 0, "reflect-output.pcap", hwaddr, 1500);
+	netdev_config_params(dev, 30, 15000);
+	pcapdev_create_link_ip4(dev, ipv4_atoi(LOCAL_ADDR), 0, 0xFFFFC000);
+	route4_add(ipv4_atoi("145.49.0.0"), ipv4_atoi("255.255.192.0"), 0, dev);
+	lo = loopback_create("lo");
+
+	/* Replies on the regular path are sent without resolving the peer */
+	remote = ipv4_atoi(REMOTE_ADDR);
+	netdev_add_destination_perm(dev, hw1, ETHERNET_MAC_LENGTH, (uint8_t*)&remote, IPV4_ADDR_SIZE);
+
+	test_write = dev->write;
+	dev->write = test_capture;
+
+	test_arp(dev);
+	test_echo(dev);
+	test_looped(lo);
+
+	dev->write = test_write;
+	netdev_print(dev, stdout);
+	netdev_print(lo, stdout);
+	route4_clear();
+	loopback_destroy(lo);
+	pcapdev_destroy(dev);
+	estack_destroy();
+
+	wait_close();
+	return 0;
+}
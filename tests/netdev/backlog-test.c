@@ -0,0 +1,246 @@
+/*
+ * Network device backlog admission unit test
+ *
+ * Author: Michel Megens
+ * Date:   24/02/2018
+ * Email:  dev@bietje.net
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <estack.h>
+
+#include <estack/netdev.h>
+#include <estack/netbuf.h>
+#include <estack/ethernet.h>
+#include <estack/pcapdev.h>
+#include <estack/inet.h>
+#include <estack/arp.h>
+#include <estack/ip.h>
+#include <estack/udp.h>
+#include <estack/tcp.h>
+#include <estack/prototype.h>
+#include <estack/test.h>
+
+#include "frame.h"
+
+#define HW_ADDR {0x48, 0x5D, 0x60, 0xBF, 0x51, 0xA9}
+#define HW_ADDR1 {0x00, 0x00, 0x5e, 0x00, 0x01, 0x31}
+static const uint8_t hw1[] = HW_ADDR1;
+static const uint8_t hwbcast[] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+
+#define LOCAL_ADDR "145.49.33.186"
+#define REMOTE_ADDR "145.49.33.1"
+#define OTHER_ADDR "145.49.33.2"
+
+#define TEST_BUDGET 8
+#define TEST_LATENCY_LIMIT 2
+
+static volatile int delivered[NETDEV_CLASSES];
+
+/* Called for every frame that made it past the backlog */
+static void test_deliver(struct netbuf *nb)
+{
+	delivered[ethernet_classify(nb)]++;
+}
+
+static int test_delivered(void)
+{
+	return delivered[NETDEV_CLASS_CONTROL] + delivered[NETDEV_CLASS_LATENCY] +
+		delivered[NETDEV_CLASS_BULK];
+}
+
+static void test_wait_delivered(int num)
+{
+	for(int i = 0; i < 100 && test_delivered() < num; i++)
+		estack_sleep(10);
+
+	/* Give frames that should have been shed a chance to show up */
+	estack_sleep(50);
+	assert(test_delivered() == num);
+}
+
+/* Bulk datagrams aren't addressed to us, and are dropped after delivery */
+static void test_inject_bulk(struct netdev *dev)
+{
+	struct netbuf *nb;
+	struct udp_header *udp;
+	void *data;
+
+	nb = test_alloc_frame(dev->hwaddr, hw1, ipv4_atoi(REMOTE_ADDR), ipv4_atoi(OTHER_ADDR),
+		IP_PROTO_UDP, sizeof(*udp) + 64, &data);
+	udp = data;
+	udp->sport = htons(5000);
+	udp->dport = htons(5001);
+	udp->length = htons(sizeof(*udp) + 64);
+
+	netdev_add_backlog(dev, nb);
+}
+
+/* Segments carry a bogus checksum, so that they are dropped after delivery */
+static void test_inject_segment(struct netdev *dev, uint16_t flags)
+{
+	struct netbuf *nb;
+	struct tcp_hdr *tcp;
+	void *data;
+
+	nb = test_alloc_frame(dev->hwaddr, hw1, ipv4_atoi(REMOTE_ADDR), ipv4_atoi(LOCAL_ADDR),
+		IP_PROTO_TCP, sizeof(*tcp), &data);
+	tcp = data;
+	tcp->sport = htons(5000);
+	tcp->dport = htons(5001);
+	tcp_hdr_set_hlen(tcp, sizeof(*tcp) / sizeof(uint32_t));
+	tcp_hdr_set_flags(tcp, flags);
+
+	netdev_add_backlog(dev, nb);
+}
+
+static void test_inject_arp(struct netdev *dev)
+{
+	struct netbuf *nb;
+
+	nb = test_alloc_arp(hwbcast, hw1, ARP_OP_REQUEST, ipv4_atoi(REMOTE_ADDR), ipv4_atoi(LOCAL_ADDR));
+	netdev_add_backlog(dev, nb);
+}
+
+static void test_shed(struct netdev *dev)
+{
+	uint32_t tx;
+
+	tx = netdev_get_tx_packets(dev);
+
+	/* Fill the budget with bulk traffic, then add control and latency traffic */
+	for(int idx = 0; idx < TEST_BUDGET; idx++)
+		test_inject_bulk(dev);
+
+	test_inject_arp(dev);
+	test_inject_arp(dev);
+	test_inject_segment(dev, TCP_SYN);
+	test_inject_segment(dev, TCP_SYN);
+	test_inject_segment(dev, TCP_ACK);
+	test_inject_segment(dev, TCP_ACK);
+
+	netdev_wakeup();
+	test_wait_delivered(TEST_BUDGET);
+
+	/* Bulk frames made room for all others */
+	assert(delivered[NETDEV_CLASS_CONTROL] == 4);
+	assert(delivered[NETDEV_CLASS_LATENCY] == 2);
+	assert(delivered[NETDEV_CLASS_BULK] == TEST_BUDGET - 6);
+
+	assert(netdev_get_shed(dev, NETDEV_CLASS_CONTROL) == 0);
+	assert(netdev_get_shed(dev, NETDEV_CLASS_LATENCY) == 0);
+	assert(netdev_get_shed(dev, NETDEV_CLASS_BULK) == 6);
+
+	/* Both ARP requests are answered */
+	for(int i = 0; i < 100 && netdev_get_tx_packets(dev) < tx + 2; i++)
+		estack_sleep(10);
+	assert(netdev_get_tx_packets(dev) == tx + 2);
+}
+
+/* Queue a frame for transmission, without waking up the stack */
+static void test_queue_transmit(struct netdev *dev)
+{
+	struct netbuf *nb;
+
+	nb = test_alloc_frame(hw1, dev->hwaddr, ipv4_atoi(LOCAL_ADDR), ipv4_atoi(REMOTE_ADDR),
+		IP_PROTO_UDP, sizeof(struct udp_header) + 64, NULL);
+	netbuf_clear_flag(nb, NBUF_RX);
+	netbuf_set_dev(nb, dev);
+	netdev_add_backlog(dev, nb);
+}
+
+static void test_transmit(struct netdev *dev)
+{
+	uint32_t tx;
+
+	tx = netdev_get_tx_packets(dev);
+
+	/* Queued transmissions leave the budget to received packets */
+	for(int idx = 0; idx < TEST_BUDGET; idx++)
+		test_queue_transmit(dev);
+	for(int idx = 0; idx < TEST_BUDGET; idx++)
+		test_inject_bulk(dev);
+
+	netdev_wakeup();
+	test_wait_delivered(TEST_BUDGET);
+	assert(netdev_get_shed(dev, NETDEV_CLASS_BULK) == 0);
+
+	for(int i = 0; i < 100 && netdev_get_tx_packets(dev) < tx + TEST_BUDGET; i++)
+		estack_sleep(10);
+	assert(netdev_get_tx_packets(dev) == tx + TEST_BUDGET);
+
+	memset((void*)delivered, 0, sizeof(delivered));
+}
+
+static void test_refuse(struct netdev *dev)
+{
+	memset((void*)delivered, 0, sizeof(delivered));
+
+	/* A full budget of control frames leaves nothing to shed for bulk frames */
+	for(int idx = 0; idx < TEST_BUDGET; idx++)
+		test_inject_segment(dev, TCP_SYN);
+	test_inject_bulk(dev);
+
+	netdev_wakeup();
+	test_wait_delivered(TEST_BUDGET);
+	assert(delivered[NETDEV_CLASS_CONTROL] == TEST_BUDGET);
+	assert(netdev_get_shed(dev, NETDEV_CLASS_BULK) == 7);
+
+	/* Class queues are limited on their own */
+	memset((void*)delivered, 0, sizeof(delivered));
+	netdev_config_backlog(dev, TEST_BUDGET, TEST_BUDGET, TEST_LATENCY_LIMIT, TEST_BUDGET);
+
+	for(int idx = 0; idx < TEST_LATENCY_LIMIT + 1; idx++)
+		test_inject_segment(dev, TCP_ACK);
+	test_inject_bulk(dev);
+
+	netdev_wakeup();
+	test_wait_delivered(TEST_LATENCY_LIMIT + 1);
+	assert(delivered[NETDEV_CLASS_LATENCY] == TEST_LATENCY_LIMIT);
+	assert(delivered[NETDEV_CLASS_BULK] == 1);
+
+	assert(netdev_get_shed(dev, NETDEV_CLASS_CONTROL) == 0);
+	assert(netdev_get_shed(dev, NETDEV_CLASS_LATENCY) == 1);
+	assert(netdev_get_shed(dev, NETDEV_CLASS_BULK) == 7);
+}
+
+int main(int argc, char **argv)
+{
+	struct netdev *dev;
+	const uint8_t hwaddr[] = HW_ADDR;
+	uint32_t dropped;
+
+	UNUSED(argc);
+	UNUSED(argv);
+
+	estack_init(NULL);
+
+	dev = pcapdev_create(NULL, 0, "backlog-output.pcap", hwaddr, 1500);
+	netdev_config_params(dev, 30, 15000);
+	netdev_config_backlog(dev, TEST_BUDGET, TEST_BUDGET, TEST_BUDGET, TEST_BUDGET);
+	pcapdev_create_link_ip4(dev, ipv4_atoi(LOCAL_ADDR), 0, 0xFFFFC000);
+	assert(netdev_add_protocol(dev, PROTO_ETHERNET, test_deliver));
+
+	test_transmit(dev);
+
+	dropped = netdev_get_dropped(dev);
+	test_shed(dev);
+	test_refuse(dev);
+
+	/*
+	 * Shed frames are accounted as dropped, next to the delivered frames that
+	 * are dropped by the stack. Only the ARP requests are accepted.
+	 */
+	assert(netdev_get_dropped(dev) - dropped == 8 + (TEST_BUDGET * 2 + TEST_LATENCY_LIMIT + 1 - 2));
+
+	netdev_print(dev, stdout);
+	pcapdev_destroy(dev);
+	estack_destroy();
+
+	wait_close();
+	return 0;
+}
@@ -0,0 +1,191 @@
+/*
+ * Network device bond unit test
+ *
+ * Author: Michel Megens
+ * Date:   24/02/2018
+ * Email:  dev@bietje.net
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <assert.h>
+#include <estack.h>
+
+#include <estack/netdev.h>
+#include <estack/netbuf.h>
+#include <estack/ethernet.h>
+#include <estack/pcapdev.h>
+#include <estack/bond.h>
+#include <estack/error.h>
+#include <estack/inet.h>
+#include <estack/route.h>
+#include <estack/udp.h>
+#include <estack/test.h>
+
+static int err_exit(int code, const char *fmt, ...)
+{
+	va_list va;
+
+	va_start(va, fmt);
+	vfprintf(stderr, fmt, va);
+	va_end(va);
+
+	wait_close();
+	exit(code);
+}
+
+#define HW_ADDR {0x48, 0x5D, 0x60, 0xBF, 0x51, 0xA9}
+#define HW_ADDR1 {0x00, 0x1A, 0xA0, 0x0F, 0x51, 0x37}
+#define HW_ADDR2 {0x48, 0x5D, 0x60, 0xBF, 0x51, 0xAA}
+
+#define TEST_FLOWS 32
+#define TEST_REMOTE "145.49.33.1"
+
+static void test_send_flows(int flows)
+{
+	struct netbuf *nb;
+	ip_addr_t dst;
+
+	dst.type = IPADDR_TYPE_V4;
+	dst.addr.in4_addr.s_addr = htonl(ipv4_atoi(TEST_REMOTE));
+
+	/* Every source port is a flow of its own */
+	for(int idx = 0; idx < flows; idx++) {
+		nb = netbuf_alloc(NBAF_APPLICTION, 16);
+		memset(nb->application.data, 0xAD, 16);
+		udp_output(nb, &dst, htons(5000), htons((uint16_t)(10000 + idx)));
+	}
+
+	estack_sleep(300);
+}
+
+static void test_spread(struct netdev *bond, struct netdev *m0, struct netdev *m1)
+{
+	uint32_t tx0, tx1, dev0, dev1;
+
+	assert(bond_set_member_active(bond, m1, true) == -EOK);
+	tx0 = bond_get_member_tx(bond, m0);
+	tx1 = bond_get_member_tx(bond, m1);
+	dev0 = netdev_get_tx_packets(m0);
+	dev1 = netdev_get_tx_packets(m1);
+
+	/* Flows are spread over all active members */
+	test_send_flows(TEST_FLOWS);
+	assert(bond_get_member_tx(bond, m0) > tx0);
+	assert(bond_get_member_tx(bond, m1) > tx1);
+	assert(bond_get_member_tx(bond, m0) - tx0 + bond_get_member_tx(bond, m1) - tx1 == TEST_FLOWS);
+	assert(netdev_get_tx_packets(bond) == tx0 + tx1 + TEST_FLOWS);
+
+	/* Members account for the frames they transmit on behalf of the bond */
+	assert(netdev_get_tx_packets(m0) - dev0 == bond_get_member_tx(bond, m0) - tx0);
+	assert(netdev_get_tx_packets(m1) - dev1 == bond_get_member_tx(bond, m1) - tx1);
+}
+
+static int test_write_error(struct netdev *dev, struct netbuf *nb)
+{
+	UNUSED(dev);
+	UNUSED(nb);
+
+	return -EINVALID;
+}
+
+static void test_failover(struct netdev *bond, struct netdev *m0, struct netdev *m1)
+{
+	uint32_t tx0, tx1;
+	int(*write)(struct netdev *dev, struct netbuf *nb);
+
+	tx0 = bond_get_member_tx(bond, m0);
+	tx1 = bond_get_member_tx(bond, m1);
+
+	write = m1->write;
+	m1->write = test_write_error;
+
+	/*
+	 * Frames for the failing member are dropped until it has failed
+	 * CONFIG_BOND_MAX_ERRORS times, after which its flows move to m0.
+	 */
+	test_send_flows(TEST_FLOWS);
+	assert(bond_get_member_tx(bond, m1) == tx1);
+	assert(bond_get_member_tx(bond, m0) == tx0 + TEST_FLOWS - (CONFIG_BOND_MAX_ERRORS - 1));
+
+	/* The member stays disabled */
+	test_send_flows(TEST_FLOWS);
+	assert(bond_get_member_tx(bond, m1) == tx1);
+	assert(bond_get_member_tx(bond, m0) == tx0 + 2 * TEST_FLOWS - (CONFIG_BOND_MAX_ERRORS - 1));
+
+	m1->write = write;
+}
+
+int main(int argc, char **argv)
+{
+	char *input;
+	struct netdev *bond, *m0, *m1;
+	const uint8_t hwaddr[] = HW_ADDR;
+	const uint8_t hw1[] = HW_ADDR1;
+	const uint8_t hw2[] = HW_ADDR2;
+	uint8_t local[4], remote[4], mask[4];
+	uint32_t addr;
+
+	if (argc < 2) {
+		err_exit(-EXIT_FAILURE, "Usage: %s <input-file>\n", argv[0]);
+	} else {
+		input = argv[1];
+	}
+
+	estack_init(NULL);
+
+	m0 = pcapdev_create((const char**)&input, 1, "bond-m0-output.pcap", hwaddr, 1500);
+	m1 = pcapdev_create(NULL, 0, "bond-m1-output.pcap", hw2, 1500);
+	netdev_config_params(m0, 30, 15000);
+	netdev_config_params(m1, 30, 15000);
+
+	bond = bond_create("bond0");
+	netdev_config_params(bond, 30, 15000);
+	assert(bond_add_member(bond, m0) == -EOK);
+	assert(bond_add_member(bond, m1) == -EOK);
+	assert(bond_add_member(bond, m1) == -EINVALID);
+	assert(!memcmp(bond->hwaddr, hwaddr, ETHERNET_MAC_LENGTH));
+
+	addr = ipv4_atoi("145.49.33.186");
+	memcpy(local, &addr, sizeof(local));
+	addr = 0xFFFFC000;
+	memcpy(mask, &addr, sizeof(mask));
+	memset(remote, 0, sizeof(remote));
+	ifconfig(bond, local, remote, mask, 4, NIF_TYPE_ETHER);
+
+	addr = ipv4_atoi("145.49.63.254");
+	netdev_add_destination(bond, hw1, ETHERNET_MAC_LENGTH, (void*)&addr, 4);
+	route4_add(ipv4_atoi("145.49.0.0"), ipv4_atoi("255.255.192.0"), 0, bond);
+	route4_add(0, 0, addr, bond);
+
+	/* All flows should fail over to the remaining member */
+	assert(bond_set_member_active(bond, m1, false) == -EOK);
+	pcapdev_start(m0);
+
+	estack_sleep(300);
+	netdev_print(bond, stdout);
+
+	assert(netdev_get_rx_packets(bond) == 4);
+	assert(bond_get_member_tx(bond, m0) == 4);
+	assert(bond_get_member_tx(bond, m1) == 0);
+	assert(netdev_get_tx_packets(m1) == 0);
+
+	addr = ipv4_atoi(TEST_REMOTE);
+	netdev_add_destination(bond, hw1, ETHERNET_MAC_LENGTH, (void*)&addr, 4);
+	test_spread(bond, m0, m1);
+	test_failover(bond, m0, m1);
+
+	route4_clear();
+	bond_destroy(bond);
+	assert(m0->master == NULL);
+
+	pcapdev_destroy(m0);
+	pcapdev_destroy(m1);
+	estack_destroy();
+
+	wait_close();
+	return 0;
+}
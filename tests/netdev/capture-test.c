@@ -0,0 +1,107 @@
+/*
+ * Network device capture unit test
+ *
+ * Author: Michel Megens
+ * Date:   20/02/2018
+ * Email:  dev@bietje.net
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <assert.h>
+#include <estack.h>
+
+#include <estack/netdev.h>
+#include <estack/netbuf.h>
+#include <estack/ethernet.h>
+#include <estack/pcapdev.h>
+#include <estack/capture.h>
+#include <estack/error.h>
+#include <estack/inet.h>
+#include <estack/route.h>
+#include <estack/test.h>
+
+static int err_exit(int code, const char *fmt, ...)
+{
+	va_list va;
+
+	va_start(va, fmt);
+	vfprintf(stderr, fmt, va);
+	va_end(va);
+
+	wait_close();
+	exit(code);
+}
+
+#define HW_ADDR1 {0xf0, 0xf7, 0x55, 0xbd, 0xbe, 0x40}
+#define HW_ADDR {0x48, 0x5D, 0x60, 0xBF, 0x51, 0xA9}
+
+#define CAPTURE_FILE "capture-output.pcap"
+#define PCAP_FILE_HDR_SIZE 24
+#define PCAP_REC_HDR_SIZE 16
+
+static long test_file_size(const char *path)
+{
+	FILE *file;
+	long size;
+
+	file = fopen(path, "rb");
+	assert(file);
+	fseek(file, 0, SEEK_END);
+	size = ftell(file);
+	fclose(file);
+
+	return size;
+}
+
+int main(int argc, char **argv)
+{
+	char *input;
+	struct netdev *dev;
+	const uint8_t hwaddr[] = HW_ADDR;
+	const uint8_t hw1[] = HW_ADDR1;
+	uint32_t addr;
+	long expected;
+
+	if (argc < 2) {
+		err_exit(-EXIT_FAILURE, "Usage: %s <input-file>\n", argv[0]);
+	} else {
+		input = argv[1];
+	}
+
+	estack_init(NULL);
+
+	dev = pcapdev_create((const char**)&input, 1, "capture-dev-output.pcap", hwaddr, 1500);
+	netdev_config_params(dev, 30, 15000);
+	pcapdev_create_link_ip4(dev, ipv4_atoi("145.49.33.186"), 0, 0xFFFFC000);
+
+	addr = ipv4_atoi("145.49.63.254");
+	netdev_add_destination(dev, hw1, ETHERNET_MAC_LENGTH, (void*)&addr, 4);
+	route4_add(ipv4_atoi("145.49.0.0"), ipv4_atoi("255.255.192.0"), 0, dev);
+	route4_add(0, 0, addr, dev);
+
+	assert(netdev_capture_start(dev, CAPTURE_FILE, 0, 1, NULL) == -EOK);
+	assert(netdev_capture_start(dev, CAPTURE_FILE, 0, 1, NULL) == -EINUSE);
+	pcapdev_start(dev);
+
+	estack_sleep(300);
+	netdev_print(dev, stdout);
+
+	assert(netdev_capture_get_dropped(dev) == 0);
+	assert(netdev_capture_get_captured(dev) == 8);
+	netdev_capture_stop(dev);
+
+	expected = PCAP_FILE_HDR_SIZE + 8 * PCAP_REC_HDR_SIZE;
+	expected += netdev_get_rx_bytes(dev) + netdev_get_tx_bytes(dev);
+	assert(test_file_size(CAPTURE_FILE) == expected);
+
+	route4_clear();
+	pcapdev_destroy(dev);
+	estack_destroy();
+
+	wait_close();
+	return 0;
+}
@@ -0,0 +1,119 @@
+/*
+ * Network device filter unit test
+ *
+ * Author: Michel Megens
+ * Date:   17/02/2018
+ * Email:  dev@bietje.net
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <assert.h>
+#include <estack.h>
+
+#include <estack/netdev.h>
+#include <estack/netbuf.h>
+#include <estack/ethernet.h>
+#include <estack/pcapdev.h>
+#include <estack/filter.h>
+#include <estack/inet.h>
+#include <estack/ip.h>
+#include <estack/route.h>
+#include <estack/test.h>
+
+static int err_exit(int code, const char *fmt, ...)
+{
+	va_list va;
+
+	va_start(va, fmt);
+	vfprintf(stderr, fmt, va);
+	va_end(va);
+
+	wait_close();
+	exit(code);
+}
+
+#define HW_ADDR {0x48, 0x5D, 0x60, 0xBF, 0x51, 0xA9}
+
+static volatile int redirected;
+
+static void filter_handler(struct netbuf *nb)
+{
+	redirected++;
+	netbuf_set_flag(nb, NBUF_ARRIVED);
+}
+
+static struct netdev_filter *test_setup_filter(void)
+{
+	struct netdev_filter *filter;
+	struct filter_rule rule;
+
+	filter = filter_alloc(FILTER_ACCEPT);
+
+	memset(&rule, 0, sizeof(rule));
+	rule.match = FILTER_MATCH_PROTOCOL | FILTER_MATCH_DPORT;
+	rule.protocol = IP_PROTO_UDP;
+	rule.dport_min = rule.dport_max = 53;
+	rule.action = FILTER_DROP;
+	assert(filter_add_rule(filter, &rule) == 0);
+
+	memset(&rule, 0, sizeof(rule));
+	rule.match = FILTER_MATCH_ETHERTYPE | FILTER_MATCH_PROTOCOL | FILTER_MATCH_DADDR;
+	rule.ethertype = ETH_TYPE_IP;
+	rule.protocol = IP_PROTO_ICMP;
+	rule.daddr = ipv4_atoi("145.49.0.0");
+	rule.dmask = ipv4_atoi("255.255.0.0");
+	rule.action = FILTER_REDIRECT;
+	rule.handler = filter_handler;
+	assert(filter_add_rule(filter, &rule) == 1);
+
+	rule.handler = NULL;
+	assert(filter_add_rule(filter, &rule) < 0);
+
+	return filter;
+}
+
+int main(int argc, char **argv)
+{
+	char *input;
+	struct netdev *dev;
+	struct netdev_filter *filter;
+	const uint8_t hwaddr[] = HW_ADDR;
+
+	if (argc < 2) {
+		err_exit(-EXIT_FAILURE, "Usage: %s <input-file>\n", argv[0]);
+	} else {
+		input = argv[1];
+	}
+
+	estack_init(NULL);
+
+	dev = pcapdev_create((const char**)&input, 1, "filter-output.pcap", hwaddr, 1500);
+	netdev_config_params(dev, 30, 15000);
+	pcapdev_create_link_ip4(dev, ipv4_atoi("145.49.33.186"), 0, 0xFFFFC000);
+
+	filter = test_setup_filter();
+	assert(netdev_attach_filter(dev, filter) == NULL);
+	pcapdev_start(dev);
+
+	estack_sleep(300);
+	netdev_print(dev, stdout);
+
+	assert(redirected == 4);
+	assert(netdev_filter_get_hits(dev, 0) == 0);
+	assert(netdev_filter_get_hits(dev, 1) == 4);
+	assert(netdev_filter_get_hits(dev, -1) == 0);
+	assert(netdev_get_tx_packets(dev) == 0);
+
+	assert(netdev_attach_filter(dev, NULL) == filter);
+	filter_free(filter);
+
+	pcapdev_destroy(dev);
+	estack_destroy();
+
+	wait_close();
+	return 0;
+}
@@ -11,6 +11,7 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdarg.h>
+#include <assert.h>
 #include <estack.h>
 
 #include <estack/netdev.h>
@@ -167,6 +168,121 @@ static void test_dst_cache(void)
 	assert(!entry);
 }
 
+static void test_dst_cache_update(void)
+{
+	uint8_t hwaddr[MAX_ADDR_LEN];
+
+	assert(netdev_resolve_destination(dev, (void*)&addr1, 4, hwaddr));
+	assert(!memcmp(hwaddr, hw1, ETHERNET_MAC_LENGTH));
+	assert(!netdev_resolve_destination(dev, (void*)&addr4, 4, hwaddr));
+
+	/* Adding an existing destination updates it */
+	netdev_add_destination(dev, hw2, ETHERNET_MAC_LENGTH, (void*)&addr1, 4);
+	assert(netdev_resolve_destination(dev, (void*)&addr1, 4, hwaddr));
+	assert(!memcmp(hwaddr, hw2, ETHERNET_MAC_LENGTH));
+
+	netdev_add_destination(dev, hw1, ETHERNET_MAC_LENGTH, (void*)&addr4, 4);
+	assert(netdev_remove_destination(dev, (void*)&addr4, 4));
+	assert(!netdev_remove_destination(dev, (void*)&addr4, 4));
+	assert(!netdev_find_destination(dev, (void*)&addr4, 4));
+
+	netdev_add_destination(dev, hw1, ETHERNET_MAC_LENGTH, (void*)&addr1, 4);
+}
+
+static volatile int received, misaligned;
+
+/* Network headers of received frames are stored on a 4 byte boundary */
+static void test_rx_alignment(struct netbuf *nb)
+{
+	if((uintptr_t)nb->network.data & 3)
+		misaligned++;
+
+	received++;
+}
+
+static void nop_resolve(struct netdev *dev, uint8_t *addr)
+{
+	UNUSED(dev);
+	UNUSED(addr);
+}
+
+static void test_pending_limit(void)
+{
+	struct netbuf *nb;
+	uint8_t hwaddr[MAX_ADDR_LEN];
+	uint32_t dropped;
+
+	dropped = netdev_get_dropped(dev);
+
+	for(int idx = 0; idx < CONFIG_DST_PENDING_MAX + 2; idx++) {
+		nb = netbuf_alloc(NBAF_NETWORK, sizeof(struct iphdr));
+		netbuf_set_dev(nb, dev);
+		assert(netdev_dstcache_queue_packet(dev, (void*)&addr4, 4, nop_resolve, nb, hwaddr));
+	}
+
+	/* The oldest packets are dropped once the limit has been reached */
+	assert(netdev_get_unresolved_dropped(dev) == 2);
+	assert(netdev_remove_destination(dev, (void*)&addr4, 4));
+	assert(netdev_get_dropped(dev) == dropped + CONFIG_DST_PENDING_MAX + 2);
+}
+
+/*
+ * Queue a packet for an unresolved destination. Entries without packets are
+ * dropped on the next poll, so every entry gets one.
+ */
+static bool test_queue_unresolved(struct netdev *target, uint32_t *addr)
+{
+	struct netbuf *nb;
+	uint8_t hwaddr[MAX_ADDR_LEN];
+	uint32_t dropped;
+
+	dropped = netdev_get_unresolved_dropped(target);
+	nb = netbuf_alloc(NBAF_NETWORK, sizeof(struct iphdr));
+	netbuf_set_dev(nb, target);
+	assert(netdev_dstcache_queue_packet(target, (void*)addr, 4, nop_resolve, nb, hwaddr));
+
+	return netdev_get_unresolved_dropped(target) == dropped;
+}
+
+static void test_unresolved_limit(void)
+{
+	struct netdev *other, *target;
+	uint32_t addrs[CONFIG_DST_UNRESOLVED_MAX + 1];
+	int idx, num;
+
+	other = pcapdev_create(NULL, 0, "netdev-other-output.pcap", hw1, 1500);
+
+	for(idx = 0; idx <= CONFIG_DST_UNRESOLVED_MAX; idx++)
+		addrs[idx] = htonl(ipv4_atoi("10.0.0.1") + (uint32_t)idx);
+
+	/* Spread entries over both devices until the shared limit is hit */
+	for(num = 0; num <= CONFIG_DST_UNRESOLVED_MAX; num++) {
+		target = num & 1 ? other : dev;
+		if(!test_queue_unresolved(target, &addrs[num]))
+			break;
+	}
+
+	assert(num > 1 && num <= CONFIG_DST_UNRESOLVED_MAX);
+	assert(!test_queue_unresolved(dev, &addrs[num]));
+	assert(!test_queue_unresolved(other, &addrs[num]));
+
+	/* Entries released on one device can be used by another */
+	assert(netdev_remove_destination(other, (void*)&addrs[1], 4));
+	assert(test_queue_unresolved(dev, &addrs[num]));
+	assert(!test_queue_unresolved(dev, &addrs[1]));
+
+	/* Destroying a device releases its unresolved entries */
+	pcapdev_destroy(other);
+	assert(test_queue_unresolved(dev, &addrs[1]));
+
+	for(idx = 0; idx <= num; idx++) {
+		if(idx & 1 && idx != 1)
+			continue;
+
+		assert(netdev_remove_destination(dev, (void*)&addrs[idx], 4));
+	}
+}
+
 int main(int argc, char **argv)
 {
 	const uint8_t hwaddr[] = HW_ADDR;
@@ -183,10 +299,13 @@ int main(int argc, char **argv)
 	dev = pcapdev_create((const char**)&input, 1, "netdev-output.pcap", hwaddr, 1500);
 	netdev_config_params(dev, 30, 15000);
 	pcapdev_create_link_ip4(dev, 0x9131060C, 0, 0xFFFFC000);
+	assert(netdev_add_protocol(dev, PROTO_ETHERNET, test_rx_alignment));
 	pcapdev_start(dev);
 
 	setup_dst_cache();
 	test_dst_cache();
+	test_dst_cache_update();
+	test_pending_limit();
 
 	ip1 = ipv4_atoi("145.49.6.14");
 	ip2 = ipv4_atoi("145.49.6.13");
@@ -198,8 +317,11 @@ int main(int argc, char **argv)
 	netdev_print(dev, stdout);
 
 	assert(netdev_get_rx_packets(dev) == 1);
+	assert(received == 1 && misaligned == 0);
 	assert(netdev_get_tx_packets(dev) == 9);
-	assert(netdev_get_dropped(dev) == 1);
+	assert(netdev_get_dropped(dev) == CONFIG_DST_PENDING_MAX + 3);
+
+	test_unresolved_limit();
 	pcapdev_destroy(dev);
 	estack_destroy();
 	wait_close();
@@ -0,0 +1,130 @@
+/*
+ * Warm start snapshot unit test
+ *
+ * Author: Michel Megens
+ * Date:   24/02/2018
+ * Email:  dev@bietje.net
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <estack.h>
+
+#include <estack/netdev.h>
+#include <estack/ethernet.h>
+#include <estack/pcapdev.h>
+#include <estack/snapshot.h>
+#include <estack/error.h>
+#include <estack/inet.h>
+#include <estack/route.h>
+#include <estack/test.h>
+
+#define HW_ADDR {0x48, 0x5D, 0x60, 0xBF, 0x51, 0xA9}
+#define HW_ADDR1 {0xF4, 0x6D, 0x04, 0x18, 0xD6, 0x5B}
+#define HW_ADDR2 {0xF4, 0x6D, 0x04, 0x22, 0xD6, 0x5B}
+
+#define SNAPSHOT_FILE "snapshot-test.bin"
+#define DEV_NAME "snap0"
+
+static const uint8_t hw1[] = HW_ADDR1;
+static const uint8_t hw2[] = HW_ADDR2;
+
+static struct netdev *create_dev(void)
+{
+	struct netdev *dev;
+	const uint8_t hwaddr[] = HW_ADDR;
+
+	dev = pcapdev_create(NULL, 0, "snapshot-output.pcap", hwaddr, 1500);
+	pcapdev_set_name(dev, DEV_NAME);
+	return dev;
+}
+
+static void test_save(uint32_t addr1, uint32_t addr2)
+{
+	struct netdev *dev;
+
+	dev = create_dev();
+	pcapdev_create_link_ip4(dev, ipv4_atoi("145.49.6.12"), 0, ipv4_atoi("255.255.192.0"));
+
+	netdev_add_destination(dev, hw1, ETHERNET_MAC_LENGTH, (void*)&addr1, 4);
+	netdev_add_destination_perm(dev, hw2, ETHERNET_MAC_LENGTH, (void*)&addr2, 4);
+	route4_add(ipv4_atoi("145.49.0.0"), ipv4_atoi("255.255.192.0"), 0, dev);
+	route4_add(0, 0, ipv4_atoi("145.49.63.254"), dev);
+
+	assert(estack_snapshot_save(SNAPSHOT_FILE) == -EOK);
+
+	route4_clear();
+	pcapdev_destroy(dev);
+}
+
+static void test_restore(uint32_t addr1, uint32_t addr2)
+{
+	struct netdev *dev;
+	struct dst_cache_entry *e;
+	uint32_t gw;
+
+	assert(estack_snapshot_load("does-not-exist.bin") == -EINVALID);
+	assert(estack_snapshot_load(SNAPSHOT_FILE) == -EOK);
+
+	/* The snapshot is applied once the interface is configured */
+	dev = create_dev();
+	assert(!netdev_find_destination(dev, (void*)&addr1, 4));
+	assert(!route4_lookup(ipv4_atoi("145.49.6.13"), &gw));
+
+	pcapdev_create_link_ip4(dev, ipv4_atoi("145.49.6.12"), 0, ipv4_atoi("255.255.192.0"));
+
+	e = netdev_find_destination(dev, (void*)&addr1, 4);
+	assert(e);
+	assert(e->state == DST_RESOLVED);
+	assert(!memcmp(e->hwaddr, hw1, ETHERNET_MAC_LENGTH));
+
+	/* Permanent entries are configured by the application */
+	assert(!netdev_find_destination(dev, (void*)&addr2, 4));
+
+	assert(route4_lookup(ipv4_atoi("145.49.6.13"), &gw) == dev);
+	assert(gw == 0);
+	assert(route4_lookup(ipv4_atoi("8.8.8.8"), &gw) == dev);
+	assert(gw == ipv4_atoi("145.49.63.254"));
+
+	route4_clear();
+	pcapdev_destroy(dev);
+}
+
+static void test_long_name(uint32_t addr1)
+{
+	struct netdev *dev;
+
+	dev = create_dev();
+	pcapdev_set_name(dev, "snapshot-long-name0");
+	netdev_add_destination(dev, hw1, ETHERNET_MAC_LENGTH, (void*)&addr1, 4);
+
+	/* Records of a device whose name doesn't fit are reported, not dropped silently */
+	assert(estack_snapshot_save(SNAPSHOT_FILE) == -ETOOLARGE);
+	pcapdev_destroy(dev);
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t addr1, addr2;
+
+	UNUSED(argc);
+	UNUSED(argv);
+
+	estack_init(NULL);
+
+	addr1 = ipv4_atoi("145.49.6.13");
+	addr2 = ipv4_atoi("145.49.6.14");
+
+	test_save(addr1, addr2);
+	test_restore(addr1, addr2);
+	test_long_name(addr1);
+
+	remove(SNAPSHOT_FILE);
+	estack_destroy();
+
+	wait_close();
+	return -EXIT_SUCCESS;
+}
@@ -0,0 +1,176 @@
+/**
+ * E/STACK - Datagram checksum test
+ *
+ * Author: Michel Megens
+ * Email:  dev@bietje.net
+ * Date:   24/02/2018
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <estack.h>
+
+#include <estack/error.h>
+#include <estack/inet.h>
+#include <estack/test.h>
+#include <estack/ethernet.h>
+#include <estack/pcapdev.h>
+#include <estack/socket.h>
+#include <estack/in.h>
+#include <estack/ip.h>
+#include <estack/udp.h>
+
+#include "frame.h"
+
+#define HW_ADDR {0x48, 0x5D, 0x60, 0xBF, 0x51, 0xA9}
+#define HW_ADDR1 {0x00, 0x00, 0x5e, 0x00, 0x01, 0x31}
+static const uint8_t hw1[] = HW_ADDR1;
+
+#define LOCAL_ADDR "145.49.33.186"
+#define REMOTE_ADDR "145.49.33.1"
+#define TEST_PORT 5000
+#define TEST_LENGTH 64
+#define TEST_PART 16
+
+/* Inject a datagram filled with \p fill. Its data is corrupted after the checksum is set if \p corrupt is set. */
+static void test_inject(struct netdev *dev, uint8_t fill, bool corrupt)
+{
+	struct netbuf *nb;
+	struct udp_header *udp;
+	uint32_t saddr, daddr, csum;
+	uint8_t *payload;
+	void *data;
+
+	saddr = ipv4_atoi(REMOTE_ADDR);
+	daddr = ipv4_atoi(LOCAL_ADDR);
+	nb = test_alloc_frame(dev->hwaddr, hw1, saddr, daddr, IP_PROTO_UDP,
+		sizeof(*udp) + TEST_LENGTH, &data);
+
+	udp = data;
+	udp->sport = htons(TEST_PORT);
+	udp->dport = htons(TEST_PORT);
+	udp->length = htons(sizeof(*udp) + TEST_LENGTH);
+	payload = (uint8_t*)(udp + 1);
+	memset(payload, fill, TEST_LENGTH);
+
+	csum = ipv4_pseudo_partial_csum(htonl(saddr), htonl(daddr), IP_PROTO_UDP, udp->length);
+	udp->csum = ip_checksum((uint16_t)csum, udp, sizeof(*udp) + TEST_LENGTH);
+	if(!udp->csum)
+		udp->csum = 0xFFFF;
+
+	if(corrupt)
+		payload[TEST_LENGTH / 2] ^= 0x1;
+
+	netdev_add_backlog(dev, nb);
+}
+
+static void test_wait_rx(struct netdev *dev, uint32_t packets)
+{
+	for(int i = 0; i < 100 && netdev_get_rx_packets(dev) < packets; i++)
+		estack_sleep(10);
+
+	assert(netdev_get_rx_packets(dev) == packets);
+}
+
+static void test_check(const uint8_t *buf, size_t length, uint8_t fill)
+{
+	for(size_t idx = 0; idx < length; idx++)
+		assert(buf[idx] == fill);
+}
+
+static ssize_t test_recv(int fd, void *buf, size_t length)
+{
+	struct sockaddr_in other;
+	ssize_t num;
+
+	num = estack_recvfrom(fd, buf, length, 0, (struct sockaddr*)&other, sizeof(other));
+	assert(ntohs(other.sin_port) == TEST_PORT);
+	assert(ntohl(other.sin_addr.s_addr) == ipv4_atoi(REMOTE_ADDR));
+	return num;
+}
+
+static void test_skip(struct netdev *dev, int fd)
+{
+	uint8_t buf[TEST_LENGTH];
+	uint32_t dropped, rx;
+	ssize_t num;
+
+	dropped = netdev_get_dropped(dev);
+	rx = netdev_get_rx_packets(dev);
+
+	test_inject(dev, 'A', true);
+	test_inject(dev, 'B', false);
+	netdev_wakeup();
+	test_wait_rx(dev, rx + 2);
+
+	/* The corrupted datagram is skipped */
+	num = test_recv(fd, buf, sizeof(buf));
+	assert(num == TEST_LENGTH);
+	test_check(buf, TEST_LENGTH, 'B');
+	assert(netdev_get_dropped(dev) == dropped + 1);
+}
+
+static void test_partial(struct netdev *dev, int fd)
+{
+	uint8_t buf[TEST_LENGTH];
+	uint32_t dropped, rx;
+	ssize_t num;
+
+	dropped = netdev_get_dropped(dev);
+	rx = netdev_get_rx_packets(dev);
+
+	test_inject(dev, 'C', true);
+	test_inject(dev, 'D', false);
+	netdev_wakeup();
+	test_wait_rx(dev, rx + 2);
+
+	/* Datagrams are verified as a whole, even when only a part is read */
+	num = test_recv(fd, buf, TEST_PART);
+	assert(num == TEST_PART);
+	test_check(buf, TEST_PART, 'D');
+	assert(netdev_get_dropped(dev) == dropped + 1);
+
+	num = test_recv(fd, buf + TEST_PART, sizeof(buf) - TEST_PART);
+	assert(num == TEST_LENGTH - TEST_PART);
+	test_check(buf, TEST_LENGTH, 'D');
+	assert(netdev_get_dropped(dev) == dropped + 1);
+}
+
+int main(int argc, char **argv)
+{
+	struct sockaddr_in addr;
+	struct netdev *dev;
+	const uint8_t hwaddr[] = HW_ADDR;
+	int fd;
+
+	UNUSED(argc);
+	UNUSED(argv);
+
+	estack_init(NULL);
+
+	dev = pcapdev_create(NULL, 0, "datagram-output.pcap", hwaddr, 1500);
+	netdev_config_params(dev, 30, 15000);
+	pcapdev_create_link_ip4(dev, ipv4_atoi(LOCAL_ADDR), 0, 0xFFFFC000);
+
+	fd = estack_socket(PF_INET, SOCK_DGRAM, 0);
+	assert(fd >= 0);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(TEST_PORT);
+	addr.sin_addr.s_addr = INADDR_ANY;
+	assert(estack_bind(fd, (struct sockaddr*) &addr, sizeof(addr)) == -EOK);
+
+	test_skip(dev, fd);
+	test_partial(dev, fd);
+
+	estack_close(fd);
+	netdev_print(dev, stdout);
+	pcapdev_destroy(dev);
+	estack_destroy();
+
+	wait_close();
+	return 0;
+}
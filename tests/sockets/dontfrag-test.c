@@ -0,0 +1,154 @@
+/**
+ * E/STACK - Don't fragment socket option test
+ *
+ * Author: Michel Megens
+ * Email:  dev@bietje.net
+ * Date:   24/02/2018
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <estack.h>
+
+#include <estack/error.h>
+#include <estack/inet.h>
+#include <estack/test.h>
+#include <estack/ethernet.h>
+#include <estack/pcapdev.h>
+#include <estack/socket.h>
+#include <estack/route.h>
+#include <estack/in.h>
+#include <estack/ip.h>
+#include <estack/udp.h>
+
+#define HW_ADDR {0x48, 0x5D, 0x60, 0xBF, 0x51, 0xA9}
+#define HW_ADDR1 {0x00, 0x00, 0x5e, 0x00, 0x01, 0x31}
+static const uint8_t hw1[] = HW_ADDR1;
+
+#define LOCAL_ADDR "145.49.33.186"
+#define REMOTE_ADDR "145.49.33.1"
+#define TEST_PORT 5000
+#define TEST_MTU 1500
+
+static uint8_t payload[TEST_MTU + 500];
+
+static volatile int frames;
+static volatile int dontfrag;
+static int(*test_write)(struct netdev *dev, struct netbuf *nb);
+
+/* Record the don't fragment bit of every transmitted datagram */
+static int test_capture(struct netdev *dev, struct netbuf *nb)
+{
+	struct ipv4_header *hdr;
+
+	hdr = nb->network.data;
+	if(ntohs(hdr->offset) & IP4_DONT_FRAGMENT)
+		dontfrag++;
+
+	frames++;
+	return test_write(dev, nb);
+}
+
+static void test_wait_frames(int num)
+{
+	for(int i = 0; i < 100 && frames < num; i++)
+		estack_sleep(10);
+
+	assert(frames == num);
+}
+
+static ssize_t test_sendto(int fd, size_t length)
+{
+	struct sockaddr_in addr;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(TEST_PORT);
+	addr.sin_addr.s_addr = htonl(ipv4_atoi(REMOTE_ADDR));
+
+	return estack_sendto(fd, payload, length, 0, (struct sockaddr*)&addr, sizeof(addr));
+}
+
+static void test_send(int fd, size_t length)
+{
+	assert(test_sendto(fd, length) == (ssize_t)length);
+}
+
+static void test_dontfrag(int fd)
+{
+	int value;
+
+	value = 1;
+	assert(estack_setsockopt(fd, IPPROTO_IP, IP_DONTFRAG, &value, 1) == -EINVALID);
+	assert(estack_setsockopt(fd, IPPROTO_IP, IP_DONTFRAG, &value, sizeof(value)) == -EOK);
+
+	test_send(fd, 64);
+	test_wait_frames(1);
+	assert(dontfrag == 1);
+
+	/* Datagrams that exceed the MTU are refused instead of fragmented */
+	assert(test_sendto(fd, sizeof(payload)) == -ETOOLARGE);
+	assert(test_sendto(fd, TEST_MTU - sizeof(struct ipv4_header) - sizeof(struct udp_header) + 1) ==
+		-ETOOLARGE);
+	test_send(fd, TEST_MTU - sizeof(struct ipv4_header) - sizeof(struct udp_header));
+	test_send(fd, 64);
+	test_wait_frames(3);
+	assert(dontfrag == 3);
+
+	/* Fragmentation is allowed again once the option is cleared */
+	value = 0;
+	assert(estack_setsockopt(fd, IPPROTO_IP, IP_DONTFRAG, &value, sizeof(value)) == -EOK);
+
+	test_send(fd, 64);
+	test_send(fd, sizeof(payload));
+	test_wait_frames(6);
+	assert(dontfrag == 3);
+}
+
+int main(int argc, char **argv)
+{
+	struct sockaddr_in addr;
+	struct netdev *dev;
+	const uint8_t hwaddr[] = HW_ADDR;
+	uint32_t remote;
+	int fd;
+
+	UNUSED(argc);
+	UNUSED(argv);
+
+	estack_init(NULL);
+
+	dev = pcapdev_create(NULL, 0, "dontfrag-output.pcap", hwaddr, TEST_MTU);
+	netdev_config_params(dev, 30, 15000);
+	pcapdev_create_link_ip4(dev, ipv4_atoi(LOCAL_ADDR), 0, 0xFFFFC000);
+	route4_add(ipv4_atoi("145.49.0.0"), ipv4_atoi("255.255.192.0"), 0, dev);
+
+	remote = ipv4_atoi(REMOTE_ADDR);
+	netdev_add_destination_perm(dev, hw1, ETHERNET_MAC_LENGTH, (uint8_t*)&remote, IPV4_ADDR_SIZE);
+
+	test_write = dev->write;
+	dev->write = test_capture;
+
+	fd = estack_socket(PF_INET, SOCK_DGRAM, 0);
+	assert(fd >= 0);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(TEST_PORT);
+	addr.sin_addr.s_addr = INADDR_ANY;
+	assert(estack_bind(fd, (struct sockaddr*) &addr, sizeof(addr)) == -EOK);
+
+	test_dontfrag(fd);
+	estack_close(fd);
+
+	dev->write = test_write;
+	netdev_print(dev, stdout);
+	route4_clear();
+	pcapdev_destroy(dev);
+	estack_destroy();
+
+	wait_close();
+	return 0;
+}
@@ -0,0 +1,105 @@
+/**
+ * E/STACK - Loopback test
+ *
+ * Author: Michel Megens
+ * Email:  dev@bietje.net
+ * Date:   24/02/2018
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <assert.h>
+#include <estack.h>
+
+#include <estack/error.h>
+#include <estack/inet.h>
+#include <estack/test.h>
+#include <estack/ethernet.h>
+#include <estack/pcapdev.h>
+#include <estack/loopback.h>
+#include <estack/socket.h>
+#include <estack/route.h>
+#include <estack/in.h>
+
+#define HW_ADDR {0x48, 0x5D, 0x60, 0xBF, 0x51, 0xA9}
+#define TEST_PORT 1275
+
+static const char msg[] = "Hello, loopback!";
+
+static void test_send_receive(int fd, char *ip)
+{
+	char buf[sizeof(msg)];
+	struct sockaddr_in addr, other;
+	ssize_t num;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(TEST_PORT);
+	addr.sin_addr.s_addr = htonl(ipv4_atoi(ip));
+
+	num = estack_sendto(fd, msg, sizeof(msg), 0, (struct sockaddr*)&addr, sizeof(addr));
+	assert(num == sizeof(msg));
+
+	memset(buf, 0, sizeof(buf));
+	num = estack_recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr*)&other, sizeof(other));
+	assert(num == sizeof(msg));
+	assert(!memcmp(buf, msg, sizeof(msg)));
+	assert(ntohs(other.sin_port) == TEST_PORT);
+}
+
+/*
+ * The loopback device counts a packet once it has been delivered to the socket,
+ * which may be after the receiver has returned from estack_recvfrom.
+ */
+static void test_wait_rx(struct netdev *dev, uint32_t packets)
+{
+	for(int i = 0; i < 100 && netdev_get_rx_packets(dev) != packets; i++)
+		estack_sleep(10);
+
+	assert(netdev_get_rx_packets(dev) == packets);
+}
+
+int main(int argc, char **argv)
+{
+	int fd;
+	struct sockaddr_in addr;
+	struct netdev *dev, *lo;
+	const uint8_t hwaddr[] = HW_ADDR;
+
+	UNUSED(argc);
+	UNUSED(argv);
+
+	estack_init(NULL);
+
+	lo = loopback_create("lo");
+	dev = pcapdev_create(NULL, 0, "loopback-output.pcap", hwaddr, 1500);
+	netdev_config_params(dev, 30, 15000);
+	pcapdev_create_link_ip4(dev, ipv4_atoi("145.49.33.186"), 0, 0xFFFFC000);
+	route4_add(ipv4_atoi("145.49.0.0"), ipv4_atoi("255.255.192.0"), 0, dev);
+
+	fd = estack_socket(PF_INET, SOCK_DGRAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(TEST_PORT);
+	addr.sin_addr.s_addr = INADDR_ANY;
+	assert(estack_bind(fd, (struct sockaddr*) &addr, sizeof(addr)) == -EOK);
+
+	test_send_receive(fd, "127.0.0.1");
+	test_send_receive(fd, "145.49.33.186");
+	estack_close(fd);
+
+	test_wait_rx(lo, 2);
+	netdev_print(lo, stdout);
+	assert(netdev_get_tx_packets(dev) == 0);
+	assert(netdev_get_rx_packets(dev) == 0);
+
+	route4_clear();
+	loopback_destroy(lo);
+	pcapdev_destroy(dev);
+	estack_destroy();
+
+	wait_close();
+	return 0;
+}
@@ -0,0 +1,200 @@
+/**
+ * E/STACK - Multicast socket test
+ *
+ * Author: Michel Megens
+ * Email:  dev@bietje.net
+ * Date:   24/02/2018
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <assert.h>
+#include <estack.h>
+
+#include <estack/error.h>
+#include <estack/inet.h>
+#include <estack/test.h>
+#include <estack/ethernet.h>
+#include <estack/pcapdev.h>
+#include <estack/socket.h>
+#include <estack/route.h>
+#include <estack/in.h>
+#include <estack/ip.h>
+#include <estack/udp.h>
+#include <estack/igmp.h>
+#include <estack/translate.h>
+#include <estack/prototype.h>
+
+#include "frame.h"
+
+#define HW_ADDR {0x48, 0x5D, 0x60, 0xBF, 0x51, 0xA9}
+#define HW_ADDR1 {0x00, 0x00, 0x5e, 0x00, 0x01, 0x31}
+static const uint8_t hw1[] = HW_ADDR1;
+
+#define TEST_PORT 5000
+#define TEST_GROUP "239.1.2.3"
+#define TEST_SOCKETS 4
+
+static const char msg[] = "Hello, multicast!";
+
+static struct netbuf *test_alloc_group_frame(uint32_t group, uint8_t proto, size_t length, void **data)
+{
+	struct netbuf *nb;
+	struct ipv4_header *hdr;
+	uint8_t mac[ETHERNET_MAC_LENGTH];
+
+	translate_ipv4_multicast_to_mac(group, mac);
+	nb = test_alloc_frame(mac, hw1, ipv4_atoi("145.49.33.1"), group, proto, length, data);
+
+	hdr = (struct ipv4_header*)*data - 1;
+	hdr->ttl = 1;
+	test_ipv4_update_csum(hdr);
+	return nb;
+}
+
+static void test_inject_datagram(struct netdev *dev, uint32_t group)
+{
+	struct netbuf *nb;
+	struct udp_header *udp;
+	void *data;
+
+	nb = test_alloc_group_frame(group, IP_PROTO_UDP, sizeof(*udp) + sizeof(msg), &data);
+	udp = data;
+	udp->sport = htons(TEST_PORT);
+	udp->dport = htons(TEST_PORT);
+	udp->length = htons(sizeof(*udp) + sizeof(msg));
+	memcpy(udp + 1, msg, sizeof(msg));
+
+	netdev_add_backlog(dev, nb);
+}
+
+static void test_inject_query(struct netdev *dev)
+{
+	struct netbuf *nb;
+	struct igmp_header *igmp;
+	void *data;
+
+	nb = test_alloc_group_frame(IGMP_ALL_HOSTS, IP_PROTO_IGMP, sizeof(*igmp), &data);
+	igmp = data;
+	igmp->type = IGMP_QUERY;
+	igmp->max_resp = 100;
+	igmp->csum = ip_checksum(0, igmp, sizeof(*igmp));
+
+	netdev_add_backlog(dev, nb);
+}
+
+static int test_socket(void)
+{
+	struct sockaddr_in addr;
+	struct ip_mreq mreq;
+	int fd, one;
+
+	fd = estack_socket(PF_INET, SOCK_DGRAM, 0);
+	assert(fd >= 0);
+
+	one = 1;
+	assert(estack_setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -EOK);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(TEST_PORT);
+	addr.sin_addr.s_addr = INADDR_ANY;
+	assert(estack_bind(fd, (struct sockaddr*) &addr, sizeof(addr)) == -EOK);
+
+	mreq.imr_multiaddr.s_addr = htonl(ipv4_atoi(TEST_GROUP));
+	mreq.imr_interface.s_addr = INADDR_ANY;
+	assert(estack_setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) == -EOK);
+	assert(estack_setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) == -EINUSE);
+
+	return fd;
+}
+
+static void test_wait_tx(struct netdev *dev, uint32_t packets)
+{
+	for(int i = 0; i < 100 && netdev_get_tx_packets(dev) != packets; i++)
+		estack_sleep(10);
+
+	assert(netdev_get_tx_packets(dev) == packets);
+}
+
+int main(int argc, char **argv)
+{
+	int fds[TEST_SOCKETS], fd;
+	struct sockaddr_in addr, other;
+	struct netdev *dev;
+	const uint8_t hwaddr[] = HW_ADDR;
+	char buf[sizeof(msg)];
+	uint32_t dropped;
+	ssize_t num;
+
+	UNUSED(argc);
+	UNUSED(argv);
+
+	estack_init(NULL);
+
+	dev = pcapdev_create(NULL, 0, "multicast-output.pcap", hwaddr, 1500);
+	netdev_config_params(dev, 30, 15000);
+	pcapdev_create_link_ip4(dev, ipv4_atoi("145.49.33.186"), 0, 0xFFFFC000);
+	route4_add(ipv4_atoi("145.49.0.0"), ipv4_atoi("255.255.192.0"), 0, dev);
+
+	for(int idx = 0; idx < TEST_SOCKETS; idx++)
+		fds[idx] = test_socket();
+
+	/* The address is shared by sockets that allow reuse only */
+	fd = estack_socket(PF_INET, SOCK_DGRAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(TEST_PORT);
+	assert(estack_bind(fd, (struct sockaddr*) &addr, sizeof(addr)) == -EINUSE);
+	estack_close(fd);
+
+	/* The group is reported once */
+	assert(igmp_is_member(dev, ipv4_atoi(TEST_GROUP)));
+	assert(igmp_is_member(dev, IGMP_ALL_HOSTS));
+	assert(!igmp_is_member(dev, ipv4_atoi("239.1.2.4")));
+	test_wait_tx(dev, 1);
+
+	dropped = netdev_get_dropped(dev);
+	test_inject_datagram(dev, ipv4_atoi(TEST_GROUP));
+	test_inject_datagram(dev, ipv4_atoi("239.1.2.4"));
+	test_inject_query(dev);
+	netdev_wakeup();
+	test_wait_tx(dev, 2);
+	assert(netdev_get_dropped(dev) == dropped + 1);
+
+	/* Every subscriber receives the datagram */
+	for(int idx = 0; idx < TEST_SOCKETS; idx++) {
+		memset(buf, 0, sizeof(buf));
+		num = estack_recvfrom(fds[idx], buf, sizeof(buf), 0, (struct sockaddr*)&other, sizeof(other));
+		assert(num == sizeof(msg));
+		assert(!memcmp(buf, msg, sizeof(msg)));
+		assert(ntohs(other.sin_port) == TEST_PORT);
+		assert(ntohl(other.sin_addr.s_addr) == ipv4_atoi("145.49.33.1"));
+	}
+
+	/* The group is left when the last member is closed */
+	for(int idx = 0; idx < TEST_SOCKETS; idx++)
+		estack_close(fds[idx]);
+
+	test_wait_tx(dev, 3);
+	assert(!igmp_is_member(dev, ipv4_atoi(TEST_GROUP)));
+
+	/* Groups that were left are reused when joining again */
+	assert(igmp_join(dev, ipv4_atoi("239.1.2.4")) == -EOK);
+	assert(igmp_is_member(dev, ipv4_atoi("239.1.2.4")));
+	assert(!igmp_is_member(dev, ipv4_atoi(TEST_GROUP)));
+	test_wait_tx(dev, 4);
+	assert(igmp_leave(dev, ipv4_atoi("239.1.2.4")) == -EOK);
+	assert(!igmp_is_member(dev, ipv4_atoi("239.1.2.4")));
+	test_wait_tx(dev, 5);
+
+	netdev_print(dev, stdout);
+	route4_clear();
+	pcapdev_destroy(dev);
+	estack_destroy();
+
+	wait_close();
+	return 0;
+}